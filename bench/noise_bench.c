@@ -0,0 +1,120 @@
+/*
+    Gaussian noise benchmark, run by `make noise-bench`.
+
+    Adds noise of the same sigma to a frame of pixels, first the way src/image_processing_demo.c
+    does it, one box_muller_transform() per pixel (two rand() calls, a log, a sqrt, a cos and a
+    sin in double precision, and the sine thrown away), then with noise_add() on every kernel
+    this build and CPU have (see src/image-noise.h). Each case runs a few times and the fastest
+    run is reported in pixels per second, along with its speedup over the per-pixel transform.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../src/image-processing.h"
+#include "../src/image-noise.h"
+
+#define DEFAULT_SIDE 2048   // pixels of a side of the square 8 bit frame
+#define DEFAULT_REPEATS 5   // runs of every case, the fastest one is reported
+#define SIGMA 50.0f         // as in the demo
+#define LEVEL 30            // the dark sky the noise is added to
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The demo's noise loop, clamped where the demo lets the byte wrap
+static void box_muller_noise(uint8_t *pixels, size_t len, float sigma)
+{
+    Box_Muller_Output output;
+
+    for (size_t i = 0; i < len; i++) {
+        box_muller_transform(&output);
+        double v = pixels[i] + output.z1 * sigma;
+        pixels[i] = v < 0 ? 0 : v > 255 ? 255 : (uint8_t)(v + 0.5);
+    }
+}
+
+// Seconds of the fastest of repeats runs, kernel -1 for the per-pixel transform
+static double time_case(int kernel, uint8_t *pixels, size_t len, int repeats)
+{
+    Noise_Rng rng;
+    double best = 0;
+
+    noise_seed(&rng, 1);
+    if (kernel >= 0) {
+        noise_use_kernel(&rng, (Noise_Kernel)kernel);
+    }
+    for (int run = 0; run < repeats; run++) {
+        memset(pixels, LEVEL, len);
+        double start = now_seconds();
+        if (kernel >= 0) {
+            noise_add(&rng, pixels, len, SIGMA);
+        } else {
+            box_muller_noise(pixels, len, SIGMA);
+        }
+        double seconds = now_seconds() - start;
+        if (run == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s side] [-n runs]\n", prog);
+    fprintf(stderr, "  -s  side of the square frame in pixels, %d by default\n", DEFAULT_SIDE);
+    fprintf(stderr, "  -n  runs of every case, the fastest is reported, %d by default\n", DEFAULT_REPEATS);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t side = DEFAULT_SIDE;
+    int repeats = DEFAULT_REPEATS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+        switch (opt) {
+        case 's':
+            side = atoi(optarg) > 0 ? atoi(optarg) : DEFAULT_SIDE;
+            break;
+        case 'n':
+            repeats = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    size_t len = side * side;
+    uint8_t *pixels = malloc(len);
+    if (pixels == NULL) {
+        fprintf(stderr, "Unable to allocate a %zux%zu frame\n", side, side);
+        return 1;
+    }
+
+    srand(1);
+    double baseline = time_case(-1, pixels, len, repeats);
+    printf("%zux%zu frame, sigma %.0f, fastest of %d runs\n", side, side, SIGMA, repeats);
+    printf("%-16s %10.1f Mpixels/s %8.2f ms\n", "box_muller", len / baseline / 1e6, baseline * 1e3);
+
+    Noise_Rng rng;
+    noise_seed(&rng, 1);
+    for (int kernel = NOISE_KERNEL_SCALAR; kernel <= NOISE_KERNEL_AVX2; kernel++) {
+        if (noise_use_kernel(&rng, (Noise_Kernel)kernel) == -1) {
+            printf("%-16s not available\n", noise_kernel_name((Noise_Kernel)kernel));
+            continue;
+        }
+        double seconds = time_case(kernel, pixels, len, repeats);
+        printf("%-16s %10.1f Mpixels/s %8.2f ms %6.1fx\n", noise_kernel_name((Noise_Kernel)kernel),
+               len / seconds / 1e6, seconds * 1e3, baseline / seconds);
+    }
+    free(pixels);
+    return 0;
+}
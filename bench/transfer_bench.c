@@ -0,0 +1,590 @@
+/*
+    End-to-end transfer benchmark, run by `make bench`.
+
+    Every case forks a satellite (tftp_send_mapped_file, as build/satellite does), a ground
+    station (tftp_retrieve_file into the resumable image) and, for an emulated link profile,
+    a link emulator between them, then checks that the image arrived intact. The sweep covers
+    file size, block size, window size and link profile, and each case is written to the
+    output as one line of JSON, so two runs can be diffed or compared with -b.
+
+    Reported per case:
+      - MB/s and blocks/s, from the RRQ until the last block is in the image, so the ground
+        station's dally after its final ACK is left out
+      - system calls per block on either end: the executable is linked with --wrap for every
+        call the transfer code makes (see BENCH_WRAPS in the Makefile), and each wrapper counts
+      - p50/p99 block latency: from the first time the satellite sent a block until the ground
+        station's sink had it, retransmissions and emulated delay included
+      - peak RSS of either end
+*/
+#define _GNU_SOURCE // ppoll, sendmmsg, recvmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "../src/tftp.h"
+#include "../src/tftp-io.h"
+#include "../src/link-emu.h"
+#define TEST_SOCKET_TIMEOUT_S 10 // cases on emulated links take longer
+#include "../tests/tftp_test_fixture.h"
+
+#define SATELLITE_SOCKET_PATH "temp/server-socket"
+#define GROUND_STATION_SOCKET_PATH "temp/client-socket"
+#define LINK_SOCKET_PATH "temp/link-socket"
+#define RELAY_SOCKET_PATH "temp/link-relay-socket"
+#define SOURCE_FILE_PATH "images/source.bmp"
+
+#define MAX_BENCH_BLOCKS 65535 // cases stay below the block number rollover
+#define DEFAULT_REPEATS 5      // runs of every case, the fastest one is reported
+#define DEFAULT_THRESHOLD 20   // percent of MB/s a case may lose against the baseline
+#define MIN_COMPARED_SECONDS 0.01 // faster cases are all scheduling noise, they aren't compared
+
+enum bench_role {
+    ROLE_HARNESS,
+    ROLE_GROUND_STATION,
+    ROLE_SATELLITE,
+    ROLE_LINK,
+    ROLE_COUNT
+};
+
+// Filled in by the processes of a case, mapped before they are forked
+struct bench_shared {
+    uint64_t syscalls[ROLE_COUNT];
+    double seconds;
+    uint64_t send_us[MAX_BENCH_BLOCKS + 1]; // first time block n went out, 0 = not yet
+    uint64_t recv_us[MAX_BENCH_BLOCKS + 1]; // when block n was in the sink
+};
+
+static enum bench_role role = ROLE_HARNESS;
+static struct bench_shared *shared;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void count_syscall(void)
+{
+    if (shared != NULL) {
+        shared->syscalls[role]++;
+    }
+}
+
+/*
+    The wrappers --wrap points the transfer code at. Each counts one system call and makes it,
+    __wrap_sendmmsg also notes when a DATA block first went out.
+*/
+int __real_sendmmsg(int sfd, struct mmsghdr *msgs, unsigned int vlen, int flags);
+int __wrap_sendmmsg(int sfd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+    count_syscall();
+    int sent = __real_sendmmsg(sfd, msgs, vlen, flags);
+
+    if (role == ROLE_SATELLITE && shared != NULL) {
+        uint64_t now = now_us();
+        for (int i = 0; i < sent; i++) {
+            const uint8_t *hdr = msgs[i].msg_hdr.msg_iov[0].iov_base;
+            if (msgs[i].msg_hdr.msg_iov[0].iov_len >= DATA_HDR_LEN && ((hdr[0] << 8) | hdr[1]) == TFTP_DATA) {
+                uint16_t block = (hdr[2] << 8) | hdr[3];
+                if (shared->send_us[block] == 0) {
+                    shared->send_us[block] = now;
+                }
+            }
+        }
+    }
+    return sent;
+}
+
+#define WRAP(ret, name, params, args) \
+    ret __real_##name params; \
+    ret __wrap_##name params { count_syscall(); return __real_##name args; }
+
+WRAP(int, recvmmsg, (int sfd, struct mmsghdr *msgs, unsigned int vlen, int flags, struct timespec *timeout),
+     (sfd, msgs, vlen, flags, timeout))
+WRAP(ssize_t, sendto, (int sfd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len),
+     (sfd, buf, len, flags, addr, addr_len))
+WRAP(ssize_t, recvfrom, (int sfd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len),
+     (sfd, buf, len, flags, addr, addr_len))
+WRAP(int, poll, (struct pollfd *fds, nfds_t nfds, int timeout), (fds, nfds, timeout))
+WRAP(int, ppoll, (struct pollfd *fds, nfds_t nfds, const struct timespec *timeout, const sigset_t *mask),
+     (fds, nfds, timeout, mask))
+WRAP(ssize_t, read, (int fd, void *buf, size_t len), (fd, buf, len))
+WRAP(ssize_t, write, (int fd, const void *buf, size_t len), (fd, buf, len))
+WRAP(ssize_t, pread, (int fd, void *buf, size_t len, off_t offset), (fd, buf, len, offset))
+WRAP(ssize_t, pwritev, (int fd, const struct iovec *iovs, int iov_count, off_t offset), (fd, iovs, iov_count, offset))
+WRAP(int, madvise, (void *addr, size_t len, int advice), (addr, len, advice))
+WRAP(int, msync, (void *addr, size_t len, int flags), (addr, len, flags))
+WRAP(int, fdatasync, (int fd), (fd))
+WRAP(int, posix_fallocate, (int fd, off_t offset, off_t len), (fd, offset, len))
+WRAP(int, ftruncate, (int fd, off_t len), (fd, len))
+WRAP(void *, mmap, (void *addr, size_t len, int prot, int flags, int fd, off_t offset), (addr, len, prot, flags, fd, offset))
+WRAP(int, munmap, (void *addr, size_t len), (addr, len))
+WRAP(int, open, (const char *path, int flags, mode_t mode), (path, flags, mode))
+WRAP(int, close, (int fd), (fd))
+WRAP(int, fstat, (int fd, struct stat *st), (fd, st))
+WRAP(int, epoll_wait, (int epfd, struct epoll_event *events, int max_events, int timeout),
+     (epfd, events, max_events, timeout))
+WRAP(int, unlink, (const char *path), (path))
+WRAP(int, getsockopt, (int sfd, int level, int name, void *value, socklen_t *len), (sfd, level, name, value, len))
+// io_uring_enter and the futex calls, every argument is passed on in its register
+WRAP(long, syscall, (long number, long a, long b, long c, long d, long e, long f), (number, a, b, c, d, e, f))
+
+struct bench_link {
+    const char *name;
+    int emulated;
+    struct link_profile profile;
+};
+
+static const struct bench_link links[] = {
+    { "local", 0, { 0 } },
+    // A low earth orbit pass: 10 ms each way and a 100 Mbit/s downlink
+    { "leo", 1, { .delay_ms = 10, .jitter_ms = 2, .rate_bps = 100000000 } },
+    // The same pass through fades, losing datagrams in bursts
+    { "leo-fading", 1, { .delay_ms = 10, .jitter_ms = 2, .rate_bps = 100000000, .loss = 0.001,
+                         .ge_enter_bad = 0.005, .ge_leave_bad = 0.2, .ge_bad_loss = 0.3 } },
+};
+
+struct bench_case {
+    const struct bench_link *link;
+    size_t file_size;
+    uint16_t blksize;
+    uint16_t windowsize;
+};
+
+struct bench_result {
+    char name[96];
+    int ok;
+    size_t file_size;
+    double seconds;
+    uint32_t blocks;
+    uint64_t syscalls[ROLE_COUNT];
+    size_t latency_count; // 0 on the io_uring backend, its sends don't go through sendmmsg
+    uint64_t p50_us;
+    uint64_t p99_us;
+    long rss_kb[ROLE_COUNT];
+};
+
+// The image sink of the ground station, noting when every block is in
+struct timed_sink {
+    struct tftp_sink inner;
+    uint64_t file_size;
+    size_t blksize;
+    uint32_t delivered;
+    uint64_t done_us; // when the whole file was in, 0 until then
+};
+
+static int timed_write(void *ctx, uint64_t offset, struct iovec *iovs, int iov_count)
+{
+    struct timed_sink *t = ctx;
+    return t->inner.write(t->inner.ctx, offset, iovs, iov_count);
+}
+
+static uint8_t *timed_map(void *ctx, uint64_t size)
+{
+    struct timed_sink *t = ctx;
+    return t->inner.map(t->inner.ctx, size);
+}
+
+static void timed_progress(void *ctx, uint64_t length)
+{
+    struct timed_sink *t = ctx;
+    uint64_t now = now_us();
+
+    // The last block is the short one, empty if the file ends on a block boundary
+    uint32_t complete = length / t->blksize;
+    if (length == t->file_size) {
+        complete = t->file_size / t->blksize + 1;
+        t->done_us = now;
+    }
+    while (t->delivered < complete && t->delivered < MAX_BENCH_BLOCKS) {
+        shared->recv_us[++t->delivered] = now;
+    }
+    t->inner.progress(t->inner.ctx, length);
+}
+
+static int timed_close(void *ctx, int complete)
+{
+    struct timed_sink *t = ctx;
+    return t->inner.close(t->inner.ctx, complete);
+}
+
+static void run_ground_station(int sfd, const struct bench_case *c)
+{
+    struct tftp_options opts = { .windowsize = c->windowsize, .blksize = c->blksize };
+    struct tftp_image image;
+    struct timed_sink timed = { .file_size = c->file_size, .blksize = c->blksize };
+
+    if (tftp_image_open(&image, RECEIVED_IMAGE_PATH, &opts, "[GROUND STATION]") == -1) {
+        _exit(1);
+    }
+    tftp_image_sink(&timed.inner, &image);
+    struct tftp_sink sink = {
+        .write = timed_write,
+        .map = timed_map,
+        .progress = timed_progress,
+        .close = timed_close,
+        .fd = timed.inner.fd,
+        .ctx = &timed
+    };
+
+    struct sockaddr_un dest_addr;
+    memset(&dest_addr, 0, sizeof(struct sockaddr_un));
+    dest_addr.sun_family = AF_UNIX;
+    strncpy(dest_addr.sun_path, c->link->emulated ? LINK_SOCKET_PATH : SATELLITE_SOCKET_PATH,
+            sizeof(dest_addr.sun_path) - 1);
+
+    uint64_t start = now_us();
+    int result = tftp_retrieve_file(sfd, dest_addr, &sink, &opts, "[GROUND STATION]");
+    shared->seconds = ((timed.done_us ? timed.done_us : now_us()) - start) / 1e6;
+    _exit(result == 0 ? 0 : 1);
+}
+
+// Waits for a process of the case, returns its peak RSS in KiB, -1 if it failed
+static long reap(pid_t pid)
+{
+    struct rusage usage;
+    int status;
+
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Whether the received image is the source file, byte for byte
+static int image_matches(size_t len)
+{
+    int src = open(SOURCE_FILE_PATH, O_RDONLY);
+    int dst = open(RECEIVED_IMAGE_PATH, O_RDONLY);
+    struct stat st;
+    int matches = src >= 0 && dst >= 0 && fstat(dst, &st) == 0 && (size_t)st.st_size == len;
+
+    static uint8_t a[65536], b[65536];
+    for (size_t pos = 0; matches && pos < len; pos += sizeof(a)) {
+        size_t chunk = len - pos < sizeof(a) ? len - pos : sizeof(a);
+        matches = pread(src, a, chunk, pos) == (ssize_t)chunk && pread(dst, b, chunk, pos) == (ssize_t)chunk &&
+                  memcmp(a, b, chunk) == 0;
+    }
+    if (src >= 0) {
+        close(src);
+    }
+    if (dst >= 0) {
+        close(dst);
+    }
+    return matches;
+}
+
+static int run_case(const struct bench_case *c, struct bench_result *r)
+{
+    memset(r, 0, sizeof(struct bench_result));
+    snprintf(r->name, sizeof(r->name), "%s/%zu/%u/%u", c->link->name, c->file_size, c->blksize, c->windowsize);
+    r->file_size = c->file_size;
+    r->blocks = c->file_size / c->blksize + 1;
+    fprintf(stderr, "[BENCH] %s\n", r->name);
+
+    memset(shared, 0, sizeof(struct bench_shared));
+    unlink(RECEIVED_IMAGE_PATH);
+    unlink(RECEIVED_IMAGE_PATH CHECKPOINT_SUFFIX);
+
+    // Every socket is bound before anyone sends to it
+    struct link_emulator emulator;
+    if (c->link->emulated && link_emulator_open(&emulator, LINK_SOCKET_PATH, RELAY_SOCKET_PATH, SATELLITE_SOCKET_PATH,
+                                                &c->link->profile, &c->link->profile, 1) == -1) {
+        return -1;
+    }
+    int satellite_fd = open_socket(SATELLITE_SOCKET_PATH);
+    int ground_fd = open_socket(GROUND_STATION_SOCKET_PATH);
+    if (satellite_fd < 0 || ground_fd < 0) {
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t satellite = fork();
+    if (satellite == 0) {
+        role = ROLE_SATELLITE;
+        _exit(tftp_send_mapped_file(satellite_fd, SOURCE_FILE_PATH, "[SATELLITE]") == 0 ? 0 : 1);
+    }
+    pid_t link = -1;
+    if (c->link->emulated) {
+        link = fork();
+        if (link == 0) {
+            static volatile sig_atomic_t stop = 0;
+            role = ROLE_LINK;
+            _exit(link_emulator_run(&emulator, &stop) == 0 ? 0 : 1);
+        }
+        close(emulator.ground_fd);
+        close(emulator.satellite_fd);
+    }
+    pid_t ground = fork();
+    if (ground == 0) {
+        role = ROLE_GROUND_STATION;
+        run_ground_station(ground_fd, c);
+    }
+    close(satellite_fd);
+    close(ground_fd);
+
+    r->rss_kb[ROLE_GROUND_STATION] = ground > 0 ? reap(ground) : -1;
+    r->rss_kb[ROLE_SATELLITE] = satellite > 0 ? reap(satellite) : -1;
+    if (link > 0) {
+        kill(link, SIGTERM);
+        waitpid(link, NULL, 0);
+    }
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+    unlink(LINK_SOCKET_PATH);
+    unlink(RELAY_SOCKET_PATH);
+
+    r->ok = r->rss_kb[ROLE_GROUND_STATION] >= 0 && r->rss_kb[ROLE_SATELLITE] >= 0 && image_matches(c->file_size);
+    r->seconds = shared->seconds > 0 ? shared->seconds : 1e-6;
+    memcpy(r->syscalls, shared->syscalls, sizeof(r->syscalls));
+
+    // Latency of every block both ends saw
+    uint64_t *latencies = malloc(r->blocks * sizeof(uint64_t));
+    size_t count = 0;
+    for (uint32_t block = 1; latencies != NULL && block <= r->blocks; block++) {
+        if (shared->send_us[block] != 0 && shared->recv_us[block] >= shared->send_us[block]) {
+            latencies[count++] = shared->recv_us[block] - shared->send_us[block];
+        }
+    }
+    r->latency_count = count;
+    if (count > 0) {
+        qsort(latencies, count, sizeof(uint64_t), compare_u64);
+        r->p50_us = latencies[(count - 1) / 2];
+        r->p99_us = latencies[(count - 1) * 99 / 100];
+    }
+    free(latencies);
+
+    if (!r->ok) {
+        fprintf(stderr, "[BENCH] %s failed\n", r->name);
+    }
+    return r->ok ? 0 : -1;
+}
+
+static void write_result(FILE *out, const struct bench_result *r, const struct bench_case *c, int last)
+{
+    char latency[64] = "null";
+    if (r->latency_count > 0) {
+        snprintf(latency, sizeof(latency), "{\"p50\": %llu, \"p99\": %llu}",
+                 (unsigned long long)r->p50_us, (unsigned long long)r->p99_us);
+    }
+
+    fprintf(out, "    {\"name\": \"%s\", \"link\": \"%s\", \"file_size\": %zu, \"blksize\": %u, \"windowsize\": %u, "
+            "\"ok\": %s, \"seconds\": %.6f, \"mb_per_s\": %.3f, \"blocks_per_s\": %.1f, "
+            "\"syscalls_per_block\": {\"satellite\": %.3f, \"ground_station\": %.3f}, \"latency_us\": %s, "
+            "\"peak_rss_kb\": {\"satellite\": %ld, \"ground_station\": %ld}}%s\n",
+            r->name, c->link->name, c->file_size, c->blksize, c->windowsize, r->ok ? "true" : "false",
+            r->seconds, c->file_size / r->seconds / 1e6, r->blocks / r->seconds,
+            (double)r->syscalls[ROLE_SATELLITE] / r->blocks, (double)r->syscalls[ROLE_GROUND_STATION] / r->blocks,
+            latency, r->rss_kb[ROLE_SATELLITE], r->rss_kb[ROLE_GROUND_STATION], last ? "" : ",");
+}
+
+/*
+    Compares every case with the same case in a baseline written by an earlier run.
+    Returns the number of cases that got slower by more than threshold percent.
+*/
+static int compare_baseline(const char *path, const struct bench_result *results, size_t count, int threshold)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("unable to open baseline");
+        return -1;
+    }
+
+    int regressions = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char name[96];
+        double baseline_seconds, baseline_mb_per_s;
+        const char *seconds = strstr(line, "\"seconds\": ");
+        const char *mb = strstr(line, "\"mb_per_s\": ");
+        if (sscanf(line, " {\"name\": \"%95[^\"]\"", name) != 1 || seconds == NULL || mb == NULL ||
+            sscanf(seconds, "\"seconds\": %lf", &baseline_seconds) != 1 ||
+            sscanf(mb, "\"mb_per_s\": %lf", &baseline_mb_per_s) != 1 || baseline_seconds < MIN_COMPARED_SECONDS) {
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (strcmp(results[i].name, name) != 0) {
+                continue;
+            }
+            double mb_per_s = results[i].ok ? results[i].file_size / results[i].seconds / 1e6 : 0;
+            if (mb_per_s < baseline_mb_per_s * (100 - threshold) / 100) {
+                fprintf(stderr, "[BENCH] Regression: %s %.3f MB/s, was %.3f MB/s\n", name, mb_per_s, baseline_mb_per_s);
+                regressions++;
+            }
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-o results.json] [-b baseline.json [-t percent]] [-n runs] [-q]\n", prog);
+    fprintf(stderr, "  -o  where the results go, stdout by default\n");
+    fprintf(stderr, "  -b  fail if a case is more than -t percent (%d) slower than in this earlier run\n",
+            DEFAULT_THRESHOLD);
+    fprintf(stderr, "  -n  runs of every case, the fastest is reported, %d by default\n", DEFAULT_REPEATS);
+    fprintf(stderr, "  -q  a quick sweep of a few cases\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out_path = NULL, *baseline_path = NULL;
+    int threshold = DEFAULT_THRESHOLD, repeats = DEFAULT_REPEATS, quick = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:b:t:n:q")) != -1) {
+        switch (opt) {
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 't':
+            threshold = atoi(optarg);
+            break;
+        case 'n':
+            repeats = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'q':
+            quick = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // Opened before moving to the scratch directory, the paths are relative to where make runs
+    FILE *out = out_path != NULL ? fopen(out_path, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    char baseline[PATH_MAX];
+    if (out == NULL || (baseline_path != NULL && realpath(baseline_path, baseline) == NULL)) {
+        perror("unable to open output");
+        return 1;
+    }
+
+    // The transfers log every block, which would cost more than they do
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    char scratch_dir[] = "/tmp/transfer-bench-XXXXXX";
+    if (enter_scratch_dir(scratch_dir, "temp", "images", "received-images", NULL) == -1) {
+        return 1;
+    }
+
+    shared = mmap(NULL, sizeof(struct bench_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("unable to map shared results");
+        return 1;
+    }
+
+    size_t sizes[] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    uint16_t blksizes[] = { DEFAULT_BLKSIZE, 1428, 8192, MAX_BLKSIZE };
+    uint16_t windowsizes[] = { 1, 8, MAX_WINDOWSIZE };
+
+    // Every combination over the local sockets, the ones that move data fast over the emulated link
+    struct bench_case cases[128];
+    size_t case_count = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(blksizes) / sizeof(blksizes[0]); j++) {
+            for (size_t k = 0; k < sizeof(windowsizes) / sizeof(windowsizes[0]); k++) {
+                if (quick && (sizes[i] != 1024 * 1024 || blksizes[j] == 1428 || blksizes[j] == MAX_BLKSIZE ||
+                              windowsizes[k] == 8)) {
+                    continue;
+                }
+                cases[case_count++] = (struct bench_case) { &links[0], sizes[i], blksizes[j], windowsizes[k] };
+            }
+        }
+    }
+    for (size_t l = 1; l < sizeof(links) / sizeof(links[0]); l++) {
+        for (size_t j = 1; j <= 2; j++) {
+            for (size_t k = 1; k <= 2; k++) {
+                if (quick && (l > 1 || j > 1 || k > 1)) {
+                    continue;
+                }
+                cases[case_count++] = (struct bench_case) { &links[l], 1024 * 1024, blksizes[j], windowsizes[k] };
+            }
+        }
+    }
+
+    struct bench_result results[128];
+    int failed = 0;
+    fprintf(out, "{\n  \"benchmark\": \"transfer\",\n  \"results\": [\n");
+    for (size_t i = 0; i < case_count; i++) {
+        const struct bench_case *c = &cases[i];
+
+        // The satellite sends the source from a file, so neither end inherits it in memory
+        int fd = open(SOURCE_FILE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        for (size_t pos = 0; fd >= 0 && pos < c->file_size; pos += 4096) {
+            uint8_t chunk[4096];
+            for (size_t b = 0; b < sizeof(chunk); b++) {
+                chunk[b] = ((pos + b) * 7 + (pos + b) / 512) % 251;
+            }
+            size_t len = c->file_size - pos < sizeof(chunk) ? c->file_size - pos : sizeof(chunk);
+            if (write(fd, chunk, len) != (ssize_t)len) {
+                break;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        // The fastest of a few runs, a run that got descheduled says nothing about the code
+        struct bench_result run;
+        for (int n = 0; n < repeats; n++) {
+            if (run_case(c, &run) == -1) {
+                results[i] = run;
+                failed = 1;
+                break;
+            }
+            if (n == 0 || run.seconds < results[i].seconds) {
+                results[i] = run;
+            }
+        }
+        write_result(out, &results[i], c, i == case_count - 1);
+        fflush(out);
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+
+    unlink(SOURCE_FILE_PATH);
+    unlink(RECEIVED_IMAGE_PATH);
+    unlink(RECEIVED_IMAGE_PATH CHECKPOINT_SUFFIX);
+    leave_scratch_dir(scratch_dir, "images", "received-images", "temp", NULL);
+
+    if (baseline_path != NULL) {
+        int regressions = compare_baseline(baseline, results, case_count, threshold);
+        failed |= regressions != 0;
+        if (regressions >= 0) {
+            fprintf(stderr, "[BENCH] %d cases slower than the baseline by more than %d%%\n", regressions, threshold);
+        }
+    }
+    return failed;
+}
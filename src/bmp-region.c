@@ -0,0 +1,130 @@
+/*
+    Regions of a BMP read out of it, see bmp-region.h.
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "bmp-region.h"
+#include "tftp-session.h"
+
+// Bytes [from, from + len) of row row of the region's BMP, in its file order
+static void region_row(const Bmp_Region *r, uint32_t row, size_t from, uint8_t *buf, size_t len)
+{
+    int channels = r->header.bit_depth / 8;
+    uint32_t image_rows = bmp_rows(&r->header);
+
+    // Rows of a bottom-up BMP count from its bottom, the region from the top of the image
+    uint32_t top_row = r->header.heigth > 0 ? r->rows - 1 - row : row;
+    uint32_t image_top_row = r->region.y + top_row * r->region.step;
+    uint32_t image_row = r->header.heigth > 0 ? image_rows - 1 - image_top_row : image_top_row;
+    const uint8_t *src = r->bmp + r->header.data_offset + image_row * bmp_row_size(&r->header) +
+                         (size_t)r->region.x * channels;
+
+    size_t pixel_bytes = (size_t)r->width * channels;
+    size_t copied = 0;
+    if (from < pixel_bytes) {
+        copied = pixel_bytes - from < len ? pixel_bytes - from : len;
+        if (r->region.step == 1) {
+            memcpy(buf, src + from, copied);
+        } else {
+            for (size_t i = 0; i < copied; i++) {
+                size_t byte = from + i;
+                buf[i] = src[(byte / channels) * r->region.step * channels + byte % channels];
+            }
+        }
+    }
+    memset(buf + copied, 0, len - copied);
+}
+
+static ssize_t region_read(void *ctx, uint64_t offset, uint8_t *buf, size_t len)
+{
+    const Bmp_Region *r = ctx;
+    uint32_t data_offset = r->header.data_offset;
+
+    if (offset >= r->source.size) {
+        return 0;
+    }
+    if (len > r->source.size - offset) {
+        len = r->source.size - offset;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        uint64_t at = offset + done;
+        size_t n;
+        if (at < BMP_HEADER_LEN) {
+            n = BMP_HEADER_LEN - at < len - done ? BMP_HEADER_LEN - at : len - done;
+            memcpy(buf + done, r->region_header + at, n);
+        } else if (at < data_offset) {
+            // The palette, and whatever else sits before the pixels, as it is in the image
+            n = data_offset - at < len - done ? data_offset - at : len - done;
+            memcpy(buf + done, r->bmp + at, n);
+        } else {
+            uint64_t pos = at - data_offset;
+            size_t from = pos % r->row_size;
+            n = r->row_size - from < len - done ? r->row_size - from : len - done;
+            region_row(r, pos / r->row_size, from, buf + done, n);
+        }
+        done += n;
+    }
+    return done;
+}
+
+/*
+    Points ctx, a Bmp_Region, at the region of the BMP in bmp, clipped to the image, and
+    returns its source. region is set to what is left of it after clipping. Returns NULL if
+    bmp is not a BMP or region starts outside of it.
+*/
+const struct tftp_source *bmp_region_source(void *ctx, const uint8_t *bmp, uint64_t len, struct tftp_region *region)
+{
+    Bmp_Region *r = ctx;
+    Bmp_Header *header = &r->header;
+
+    if (bmp_parse_header(bmp, len, header) == -1 || header->data_offset > len ||
+        bmp_row_size(header) * bmp_rows(header) > len - header->data_offset) {
+        fprintf(stderr, "Not an uncompressed 8 or 24 bit BMP, sending all of it\n");
+        return NULL;
+    }
+    uint32_t image_width = header->width, image_rows = bmp_rows(header);
+    if (region->width == 0 || region->height == 0 || region->step == 0 || region->x >= image_width ||
+        region->y >= image_rows) {
+        fprintf(stderr, "Region %ux%u at %u,%u is outside of the %ux%u image, sending all of it\n", region->width,
+                region->height, region->x, region->y, image_width, image_rows);
+        return NULL;
+    }
+    if (region->width > image_width - region->x) {
+        region->width = image_width - region->x;
+    }
+    if (region->height > image_rows - region->y) {
+        region->height = image_rows - region->y;
+    }
+
+    r->bmp = bmp;
+    r->region = *region;
+    r->width = (region->width - 1) / region->step + 1;
+    r->rows = (region->height - 1) / region->step + 1;
+    r->row_size = ((size_t)r->width * header->bit_depth + 31) / 32 * 4;
+
+    // The header of the image, with the region's size
+    uint64_t data_size = (uint64_t)r->row_size * r->rows;
+    memcpy(r->region_header, bmp, BMP_HEADER_LEN);
+    write_le32(r->region_header + 2, header->data_offset + data_size);
+    write_le32(r->region_header + 18, r->width);
+    write_le32(r->region_header + 22, header->heigth > 0 ? (int32_t)r->rows : -(int32_t)r->rows);
+    write_le32(r->region_header + 34, data_size);
+
+    r->source = (struct tftp_source){
+        .read = region_read,
+        .data = NULL,
+        .size = header->data_offset + data_size,
+        .ctx = r,
+    };
+    return &r->source;
+}
+
+// A cropper for a sender session that cuts regions into region
+void bmp_region_cropper(struct tftp_cropper *cropper, Bmp_Region *region)
+{
+    cropper->crop = bmp_region_source;
+    cropper->ctx = region;
+}
@@ -0,0 +1,35 @@
+#ifndef BMP_REGION_H
+#define BMP_REGION_H
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image-processing.h"
+#include "tftp.h"
+#include "tftp-io.h"
+
+/*
+    A region of a BMP as a BMP of its own, read straight out of the image as a transfer gets
+    there, so the crop is never held in memory.
+
+    The region is a rectangle of the image counted from its top left corner, of which every
+    step-th pixel of every step-th row is kept. Its BMP keeps the palette and the row order of
+    the image, with the width, height and sizes of the header set to the region's, and rows
+    padded to 4 bytes again.
+*/
+
+typedef struct {
+    struct tftp_source source;
+    const uint8_t *bmp;
+    Bmp_Header header;                // of the image
+    uint8_t region_header[BMP_HEADER_LEN];
+    struct tftp_region region;
+    uint32_t width;                   // pixels in a row of the region's BMP
+    uint32_t rows;
+    size_t row_size;                  // of the region's BMP, padding included
+} Bmp_Region;
+
+// Public interface
+const struct tftp_source *bmp_region_source(void *ctx, const uint8_t *bmp, uint64_t len, struct tftp_region *region);
+void bmp_region_cropper(struct tftp_cropper *cropper, Bmp_Region *region);
+
+#endif
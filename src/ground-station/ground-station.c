@@ -10,6 +10,8 @@
 #include <sys/socket.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -18,9 +20,21 @@
 #include <string.h>
 
 #include "../tftp.h"
+#include "../tftp-shm.h"
+#include "../tftp-metrics.h"
+#include "../tftp-trace.h"
+#include "../tftp-io.h"
+#include "../star-codec.h"
+#include "../progressive.h"
 
 #define SATELLITE_SOCKET_PATH "temp/server-socket"
 #define GROUND_STATION_SOCKET_PATH "temp/client-socket"
+#define METRICS_PATH "temp/ground-station-metrics"
+#define ENCODED_IMAGE_PATH "received-images/test.star" // what a satellite started with -e sends
+#define STAR_LIST_PATH "received-images/test.stars"    // and one started with -c
+#define CATALOG_PATH "received-images/stars.csv"        // the star list, for people and spreadsheets
+#define PROGRESSIVE_PATH "received-images/test.prog"   // what a satellite started with -i sends
+#define REGION_PATH "received-images/region.bmp"       // a region asked for with -R
 
 #define DATA "Hello, world!\n"
 
@@ -32,9 +46,280 @@ void exit_error(char *s) {
 	exit(1);
 }
 
+// Writes what the trace rings still hold on any exit
+static void stop_trace(void) {
+	tftp_trace_stop();
+}
+
+void usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-w windowsize] [-b blksize] [-s none|msync|fdatasync] [-m] [-p] [-a satellite_socket]\n", prog);
+	fprintf(stderr, "          [-T trace_file] [-z level] [-e | -c | -i | -R x,y,width,height[,step]]\n");
+	fprintf(stderr, "  -s  how the complete image is flushed to disk, none by default\n");
+	fprintf(stderr, "  -m  receive over the satellite's shared memory link instead of the socket\n");
+	fprintf(stderr, "  -p  write the image on a thread of its own, so a slow disk doesn't delay the ACKs\n");
+	fprintf(stderr, "  -a  send to this socket instead of %s, such as a link emulator's\n", SATELLITE_SOCKET_PATH);
+	fprintf(stderr, "  -T  trace every packet, timeout and retransmission to trace_file, see build/trace-decoder\n");
+	fprintf(stderr, "  -z  ask for the image deflated at this zlib level, %d (fast) to %d (smallest)\n",
+		TFTP_COMPRESS_FAST, TFTP_COMPRESS_BEST);
+	fprintf(stderr, "  -e  receive the stars of the image from a satellite started with -e, and rebuild it\n");
+	fprintf(stderr, "  -c  receive the star list from a satellite started with -c, and write it to %s\n", CATALOG_PATH);
+	fprintf(stderr, "  -i  receive the image coarse to fine from a satellite started with -i, a pass cut short still\n");
+	fprintf(stderr, "      gives a whole preview and the next pass goes on from there\n");
+	fprintf(stderr, "  -R  receive only this rectangle of the image, counted from its top left corner, into %s.\n",
+		REGION_PATH);
+	fprintf(stderr, "      With a step, only every step-th pixel of every step-th row\n");
+	exit(1);
+}
+
+// Reads the whole received file at path into a newly allocated *buf, returns 0 on success, -1 on failure
+int read_received(const char *path, uint8_t **buf, size_t *len) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror("unable to open received file");
+		return -1;
+	}
+
+	*buf = malloc(st.st_size ? st.st_size : 1);
+	*len = st.st_size;
+	int result = *buf != NULL && read(fd, *buf, st.st_size) == st.st_size ? 0 : -1;
+	if (result == -1) {
+		perror("unable to read received file");
+		free(*buf);
+	}
+	close(fd);
+	return result;
+}
+
+// Rebuilds the image from its encoding at ENCODED_IMAGE_PATH, returns 0 on success, -1 on failure
+int decode_image(void) {
+	uint8_t *encoded;
+	size_t encoded_len;
+	if (read_received(ENCODED_IMAGE_PATH, &encoded, &encoded_len) == -1) {
+		return -1;
+	}
+
+	uint8_t *bmp = NULL;
+	size_t bmp_len;
+	int result = -1;
+	if (star_decode(encoded, encoded_len, &bmp, &bmp_len) == 0) {
+		FILE *fp = fopen(RECEIVED_IMAGE_PATH, "wb");
+		if (fp != NULL && fwrite(bmp, bmp_len, 1, fp) == 1 && fclose(fp) == 0) {
+			printf("Rebuilt %zu bytes of image from %zu\n", bmp_len, encoded_len);
+			result = 0;
+		} else {
+			perror("unable to write image");
+		}
+	}
+	free(encoded);
+	free(bmp);
+	return result;
+}
+
+// Writes the star list at STAR_LIST_PATH out as CSV to CATALOG_PATH, returns 0 on success, -1 on failure
+int write_catalog(void) {
+	uint8_t *list;
+	size_t list_len;
+	if (read_received(STAR_LIST_PATH, &list, &list_len) == -1) {
+		return -1;
+	}
+
+	Star *stars = NULL;
+	size_t count;
+	uint32_t width, height;
+	int result = -1;
+	if (star_list_decode(list, list_len, &stars, &count, &width, &height) == 0) {
+		FILE *fp = fopen(CATALOG_PATH, "w");
+		if (fp != NULL) {
+			fprintf(fp, "x,y,flux,pixels,peak\n");
+			for (size_t i = 0; i < count; i++) {
+				fprintf(fp, "%.3f,%.3f,%.0f,%u,%u\n", stars[i].x, stars[i].y, stars[i].flux, stars[i].pixels,
+					stars[i].peak);
+			}
+		}
+		if (fp != NULL && fclose(fp) == 0) {
+			printf("%zu stars of a %ux%u frame written to %s\n", count, width, height, CATALOG_PATH);
+			result = 0;
+		} else {
+			perror("unable to write star catalog");
+		}
+	}
+	free(list);
+	free(stars);
+	return result;
+}
+
+// Rebuilds the image from the first received bytes of its progressive stream, returns 0 on success, -1 on failure
+int preview_image(uint64_t received) {
+	uint8_t *stream;
+	size_t stream_len;
+	if (read_received(PROGRESSIVE_PATH, &stream, &stream_len) == -1) {
+		return -1;
+	}
+
+	// A preallocated stream is longer than what arrived
+	uint8_t *bmp = NULL;
+	size_t bmp_len;
+	double complete;
+	int result = -1;
+	if (progressive_decode(stream, received < stream_len ? received : stream_len, &bmp, &bmp_len, &complete) == 0) {
+		FILE *fp = fopen(RECEIVED_IMAGE_PATH, "wb");
+		if (fp != NULL && fwrite(bmp, bmp_len, 1, fp) == 1 && fclose(fp) == 0) {
+			printf("Rebuilt %zu bytes of image from %.1f%% of its pixels\n", bmp_len, complete * 100);
+			result = 0;
+		} else {
+			perror("unable to write image");
+		}
+	}
+	free(stream);
+	free(bmp);
+	return result;
+}
+
+// Tells what the satellite made of the region that was asked for
+void print_region(const struct tftp_region *granted) {
+	if (granted->width) {
+		printf("Received the region %ux%u at %u,%u, every %u pixels, into %s\n", granted->width, granted->height,
+			granted->x, granted->y, granted->step, REGION_PATH);
+	} else {
+		printf("Received the whole image into %s, the satellite doesn't send regions of it\n", REGION_PATH);
+	}
+}
+
+// Turns what was received into what it stands for, returns 0 on success, -1 on failure
+int finish_object(int encoded, int catalog) {
+	if (encoded) {
+		return decode_image();
+	}
+	return catalog ? write_catalog() : 0;
+}
+
 int main(int argc, char *argv[]) {
    	int sfd;
 	struct sockaddr_un satellite_addr, ground_station_addr;
+	struct tftp_options opts = { .windowsize = 0, .blksize = 0, .sync = TFTP_SYNC_NONE };
+	int shm_mode = 0, encoded = 0, catalog = 0, interlaced = 0;
+	struct tftp_region granted;
+	const char *satellite_path = SATELLITE_SOCKET_PATH;
+	const char *trace_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:b:s:mpa:T:z:eciR:")) != -1) {
+		switch (opt) {
+		case 'w':
+			opts.windowsize = atoi(optarg);
+			if (opts.windowsize < 1 || opts.windowsize > MAX_WINDOWSIZE) {
+				usage(argv[0]);
+			}
+			break;
+		case 'b':
+			if (atoi(optarg) < MIN_BLKSIZE || atoi(optarg) > MAX_BLKSIZE) {
+				usage(argv[0]);
+			}
+			opts.blksize = atoi(optarg);
+			break;
+		case 's':
+			if (strcmp(optarg, "none") == 0) {
+				opts.sync = TFTP_SYNC_NONE;
+			} else if (strcmp(optarg, "msync") == 0) {
+				opts.sync = TFTP_SYNC_MSYNC;
+			} else if (strcmp(optarg, "fdatasync") == 0) {
+				opts.sync = TFTP_SYNC_FDATASYNC;
+			} else {
+				usage(argv[0]);
+			}
+			break;
+		case 'm':
+			shm_mode = 1;
+			break;
+		case 'p':
+			opts.pipelined = 1;
+			break;
+		case 'a':
+			satellite_path = optarg;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'z':
+			opts.compress = atoi(optarg);
+			if (opts.compress < TFTP_COMPRESS_FAST || opts.compress > TFTP_COMPRESS_BEST) {
+				usage(argv[0]);
+			}
+			break;
+		case 'e':
+			encoded = 1;
+			break;
+		case 'c':
+			catalog = 1;
+			break;
+		case 'i':
+			interlaced = 1;
+			break;
+		case 'R':
+			if (tftp_parse_region(optarg, &opts.region) == -1) {
+				usage(argv[0]);
+			}
+			opts.granted = &granted;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (encoded + catalog + interlaced + (opts.region.width > 0) > 1) {
+		usage(argv[0]);
+	}
+
+	if (trace_path != NULL) {
+		if (tftp_trace_start(trace_path) == -1) {
+			exit(1);
+		}
+		atexit(stop_trace);
+	}
+
+	// `kill -USR1` writes the metrics of the running transfer to METRICS_PATH
+	if (tftp_metrics_dump_on_signal(METRICS_PATH) == -1) {
+		exit(1);
+	}
+
+	// The encoding, the star list and a region are small and only useful whole, so they are not resumed and go to files of their own
+	struct tftp_sink *sink = NULL;
+	struct tftp_sink object_sink;
+	if (encoded || catalog || opts.region.width) {
+		const char *path = encoded ? ENCODED_IMAGE_PATH : catalog ? STAR_LIST_PATH : REGION_PATH;
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			exit_error("unable to open received file");
+		}
+		tftp_fd_sink(&object_sink, fd);
+		sink = &object_sink;
+	}
+
+	// The progressive stream is resumed like the image, it is useful at any length
+	struct tftp_image progressive;
+	if (interlaced) {
+		if (tftp_image_open(&progressive, PROGRESSIVE_PATH, &opts, "[GROUND STATION]") == -1) {
+			exit(1);
+		}
+		tftp_image_sink(&object_sink, &progressive);
+		sink = &object_sink;
+	}
+
+	if (shm_mode) {
+		struct tftp_shm_link link;
+		if (tftp_shm_attach(&link, SHM_LINK_NAME) == -1) {
+			exit(1);
+		}
+		int result = tftp_shm_retrieve_file(&link, sink, &opts, "[GROUND STATION]");
+		tftp_shm_close(&link);
+		if (interlaced && preview_image(progressive.length) == -1) {
+			result = -1;
+		}
+		if (result == 0 && opts.region.width) {
+			print_region(&granted);
+		}
+		exit(result == 0 && finish_object(encoded, catalog) == 0 ? 0 : 1);
+	}
 
 	/* Create socket. It is automatically marked as "active" and can be used to connect to a
 	    "passive" socket
@@ -50,8 +335,8 @@ int main(int argc, char *argv[]) {
 	}
 
 	// Construct ground station address
-	ground_station_addr.sun_family = AF_UNIX;
 	memset(&ground_station_addr, 0, sizeof(struct sockaddr_un));
+	ground_station_addr.sun_family = AF_UNIX;
 	strncpy(ground_station_addr.sun_path, GROUND_STATION_SOCKET_PATH, sizeof(ground_station_addr.sun_path) -1);
 
 
@@ -62,9 +347,17 @@ int main(int argc, char *argv[]) {
 	// Construct server address (no need to bind)
 	memset(&satellite_addr, 0, sizeof(struct sockaddr_un));
 	satellite_addr.sun_family = AF_UNIX;
-	strncpy(satellite_addr.sun_path, SATELLITE_SOCKET_PATH, sizeof(satellite_addr.sun_path) -1 );
+	strncpy(satellite_addr.sun_path, satellite_path, sizeof(satellite_addr.sun_path) -1 );
 
-	tftp_retrieve_file(sfd, satellite_addr, NULL, 1, "[GROUND STATION]");
+	if (tftp_retrieve_file(sfd, satellite_addr, sink, &opts, "[GROUND STATION]") == 0) {
+		finish_object(encoded, catalog);
+		if (opts.region.width) {
+			print_region(&granted);
+		}
+	}
+	if (interlaced) {
+		preview_image(progressive.length);
+	}
 
 	close(sfd);
 	unlink(GROUND_STATION_SOCKET_PATH);
@@ -0,0 +1,617 @@
+/*
+    Gaussian noise in blocks of lanes, see image-noise.h.
+
+    Each kernel turns two steps of the generators into a block of normal numbers with the same
+    operations in the same order, rounded to single precision after each one, and never fused.
+    Adding noise to a pixel is float(pixel) + sigma * z, clamped to [0, 255] and rounded to the
+    nearest integer, ties to even as the SSE conversion does.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define NOISE_HAVE_AVX2 // compiled for this target only, picked if the CPU has it
+#endif
+
+#include "image-processing.h"
+#include "image-noise.h"
+
+#define UNIFORM_SCALE 0x1p-24f // the top 24 bits of a step are the mantissa of a uniform number
+
+// logf of Cephes, for x in (0, 1]
+#define LOG_SQRTHF 0.707106781186547524f
+#define LOG_P0 7.0376836292e-2f
+#define LOG_P1 -1.1514610310e-1f
+#define LOG_P2 1.1676998740e-1f
+#define LOG_P3 -1.2420140846e-1f
+#define LOG_P4 1.4249322787e-1f
+#define LOG_P5 -1.6668057665e-1f
+#define LOG_P6 2.0000714765e-1f
+#define LOG_P7 -2.4999993993e-1f
+#define LOG_P8 3.3333331174e-1f
+#define LOG_Q1 -2.12194440e-4f
+#define LOG_Q2 0.693359375f
+
+// sinf and cosf of Cephes, for x in [-pi/4, pi/4]
+#define PI_OVER_2 1.57079632679489661923f
+#define SIN_P0 -1.9515295891e-4f
+#define SIN_P1 8.3321608736e-3f
+#define SIN_P2 -1.6666654611e-1f
+#define COS_P0 2.443315711809948e-5f
+#define COS_P1 -1.388731625493765e-3f
+#define COS_P2 4.166664568298827e-2f
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static uint32_t float_bits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static float bits_float(uint32_t u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// One step of the generator of a lane
+static uint32_t scalar_next(uint32_t s[4][NOISE_LANES], int lane)
+{
+    uint32_t result = s[0][lane] + s[3][lane];
+    uint32_t t = s[1][lane] << 9;
+
+    s[2][lane] ^= s[0][lane];
+    s[3][lane] ^= s[1][lane];
+    s[1][lane] ^= s[2][lane];
+    s[0][lane] ^= s[3][lane];
+    s[2][lane] ^= t;
+    s[3][lane] = (s[3][lane] << 11) | (s[3][lane] >> 21);
+    return result;
+}
+
+// The pair of normal numbers of two steps a and b of a lane
+static void scalar_gaussian(uint32_t a, uint32_t b, float *z_cos, float *z_sin)
+{
+    float u1 = (float)((a >> 8) + 1) * UNIFORM_SCALE; // (0, 1], never the log of 0
+    float u2 = (float)(b >> 8) * UNIFORM_SCALE;       // [0, 1)
+
+    // ln u1, from u1 = m * 2^e with m in [sqrt(1/2), sqrt(2))
+    uint32_t bits = float_bits(u1);
+    float e = (float)((int)((bits >> 23) & 0xff) - 126);
+    float m = bits_float((bits & 0x007fffff) | 0x3f000000);
+    int below = m < LOG_SQRTHF;
+    e = e - (below ? 1.0f : 0.0f);
+    float x = m - 1.0f;
+    x = x + (below ? m : 0.0f);
+    float z = x * x;
+    float y = LOG_P0;
+    y = y * x + LOG_P1;
+    y = y * x + LOG_P2;
+    y = y * x + LOG_P3;
+    y = y * x + LOG_P4;
+    y = y * x + LOG_P5;
+    y = y * x + LOG_P6;
+    y = y * x + LOG_P7;
+    y = y * x + LOG_P8;
+    y = y * x;
+    y = y * z;
+    y = y + e * LOG_Q1;
+    y = y - z * 0.5f;
+    x = x + y;
+    x = x + e * LOG_Q2;
+
+    float r = -2.0f * x;
+    r = r > 0.0f ? r : 0.0f;
+    r = sqrtf(r);
+
+    // 2 pi u2 = q pi/2 + x with x in [-pi/4, pi/4]
+    float t = u2 * 4.0f;
+    int32_t q = (int32_t)lrintf(t);
+    x = (t - (float)q) * PI_OVER_2;
+    z = x * x;
+    float s = SIN_P0;
+    s = s * z + SIN_P1;
+    s = s * z + SIN_P2;
+    s = s * z;
+    s = s * x;
+    s = s + x;
+    float c = COS_P0;
+    c = c * z + COS_P1;
+    c = c * z + COS_P2;
+    c = c * z;
+    c = c * z;
+    c = c - z * 0.5f;
+    c = c + 1.0f;
+
+    float cos_q = (q & 1) ? s : c;
+    float sin_q = (q & 1) ? c : s;
+    cos_q = bits_float(float_bits(cos_q) ^ (((uint32_t)q + 1) << 30 & 0x80000000u));
+    sin_q = bits_float(float_bits(sin_q) ^ ((uint32_t)q << 30 & 0x80000000u));
+    *z_cos = r * cos_q;
+    *z_sin = r * sin_q;
+}
+
+static void scalar_block(uint32_t s[4][NOISE_LANES], float *out)
+{
+    uint32_t a[NOISE_LANES], b[NOISE_LANES];
+
+    for (int lane = 0; lane < NOISE_LANES; lane++) {
+        a[lane] = scalar_next(s, lane);
+    }
+    for (int lane = 0; lane < NOISE_LANES; lane++) {
+        b[lane] = scalar_next(s, lane);
+    }
+    for (int lane = 0; lane < NOISE_LANES; lane++) {
+        scalar_gaussian(a[lane], b[lane], &out[lane], &out[NOISE_LANES + lane]);
+    }
+}
+
+static uint8_t noisy_pixel(uint8_t pixel, float sigma, float z)
+{
+    float v = (float)pixel + sigma * z;
+    v = v > 0.0f ? v : 0.0f;
+    v = v < 255.0f ? v : 255.0f;
+    return (uint8_t)lrintf(v);
+}
+
+static void scalar_add(uint32_t s[4][NOISE_LANES], uint8_t *pixels, size_t blocks, float sigma)
+{
+    float z[NOISE_BLOCK];
+
+    for (size_t i = 0; i < blocks; i++, pixels += NOISE_BLOCK) {
+        scalar_block(s, z);
+        for (int j = 0; j < NOISE_BLOCK; j++) {
+            pixels[j] = noisy_pixel(pixels[j], sigma, z[j]);
+        }
+    }
+}
+
+#ifdef __SSE2__
+// One step of the generators of 4 lanes from lane, as scalar_next()
+static __m128i sse2_next(uint32_t s[4][NOISE_LANES], int lane)
+{
+    __m128i s0 = _mm_loadu_si128((__m128i *)&s[0][lane]);
+    __m128i s1 = _mm_loadu_si128((__m128i *)&s[1][lane]);
+    __m128i s2 = _mm_loadu_si128((__m128i *)&s[2][lane]);
+    __m128i s3 = _mm_loadu_si128((__m128i *)&s[3][lane]);
+    __m128i result = _mm_add_epi32(s0, s3);
+    __m128i t = _mm_slli_epi32(s1, 9);
+
+    s2 = _mm_xor_si128(s2, s0);
+    s3 = _mm_xor_si128(s3, s1);
+    s1 = _mm_xor_si128(s1, s2);
+    s0 = _mm_xor_si128(s0, s3);
+    s2 = _mm_xor_si128(s2, t);
+    s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+    _mm_storeu_si128((__m128i *)&s[0][lane], s0);
+    _mm_storeu_si128((__m128i *)&s[1][lane], s1);
+    _mm_storeu_si128((__m128i *)&s[2][lane], s2);
+    _mm_storeu_si128((__m128i *)&s[3][lane], s3);
+    return result;
+}
+
+static __m128 sse2_select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// The pairs of normal numbers of 4 lanes, as scalar_gaussian()
+static void sse2_gaussian(__m128i a, __m128i b, __m128 *z_cos, __m128 *z_sin)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    __m128 u1 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_srli_epi32(a, 8), _mm_set1_epi32(1))),
+                           _mm_set1_ps(UNIFORM_SCALE));
+    __m128 u2 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(b, 8)), _mm_set1_ps(UNIFORM_SCALE));
+
+    __m128i bits = _mm_castps_si128(u1);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xff)),
+                                             _mm_set1_epi32(126)));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                                             _mm_set1_epi32(0x3f000000)));
+    __m128 below = _mm_cmplt_ps(m, _mm_set1_ps(LOG_SQRTHF));
+    e = _mm_sub_ps(e, _mm_and_ps(below, one));
+    __m128 x = _mm_sub_ps(m, one);
+    x = _mm_add_ps(x, _mm_and_ps(below, m));
+    __m128 z = _mm_mul_ps(x, x);
+    __m128 y = _mm_set1_ps(LOG_P0);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(LOG_P1));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(LOG_P2));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(LOG_P3));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(LOG_P4));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(LOG_P5));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(LOG_P6));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(LOG_P7));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(LOG_P8));
+    y = _mm_mul_ps(y, x);
+    y = _mm_mul_ps(y, z);
+    y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(LOG_Q1)));
+    y = _mm_sub_ps(y, _mm_mul_ps(z, half));
+    x = _mm_add_ps(x, y);
+    x = _mm_add_ps(x, _mm_mul_ps(e, _mm_set1_ps(LOG_Q2)));
+
+    __m128 r = _mm_mul_ps(_mm_set1_ps(-2.0f), x);
+    r = _mm_max_ps(r, _mm_setzero_ps());
+    r = _mm_sqrt_ps(r);
+
+    __m128 t = _mm_mul_ps(u2, _mm_set1_ps(4.0f));
+    __m128i q = _mm_cvtps_epi32(t);
+    x = _mm_mul_ps(_mm_sub_ps(t, _mm_cvtepi32_ps(q)), _mm_set1_ps(PI_OVER_2));
+    z = _mm_mul_ps(x, x);
+    __m128 s = _mm_set1_ps(SIN_P0);
+    s = _mm_add_ps(_mm_mul_ps(s, z), _mm_set1_ps(SIN_P1));
+    s = _mm_add_ps(_mm_mul_ps(s, z), _mm_set1_ps(SIN_P2));
+    s = _mm_mul_ps(s, z);
+    s = _mm_mul_ps(s, x);
+    s = _mm_add_ps(s, x);
+    __m128 c = _mm_set1_ps(COS_P0);
+    c = _mm_add_ps(_mm_mul_ps(c, z), _mm_set1_ps(COS_P1));
+    c = _mm_add_ps(_mm_mul_ps(c, z), _mm_set1_ps(COS_P2));
+    c = _mm_mul_ps(c, z);
+    c = _mm_mul_ps(c, z);
+    c = _mm_sub_ps(c, _mm_mul_ps(z, half));
+    c = _mm_add_ps(c, one);
+
+    __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+    __m128 cos_q = sse2_select(swap, s, c);
+    __m128 sin_q = sse2_select(swap, c, s);
+    __m128i sign = _mm_set1_epi32((int)0x80000000u);
+    cos_q = _mm_xor_ps(cos_q, _mm_castsi128_ps(_mm_and_si128(_mm_slli_epi32(_mm_add_epi32(q, _mm_set1_epi32(1)), 30),
+                                                             sign)));
+    sin_q = _mm_xor_ps(sin_q, _mm_castsi128_ps(_mm_and_si128(_mm_slli_epi32(q, 30), sign)));
+    *z_cos = _mm_mul_ps(r, cos_q);
+    *z_sin = _mm_mul_ps(r, sin_q);
+}
+
+// A block as 4 vectors: the cosines of lanes 0-3 and 4-7, then their sines
+static void sse2_block(uint32_t s[4][NOISE_LANES], __m128 z[4])
+{
+    __m128i a0 = sse2_next(s, 0), a1 = sse2_next(s, 4);
+    __m128i b0 = sse2_next(s, 0), b1 = sse2_next(s, 4);
+
+    sse2_gaussian(a0, b0, &z[0], &z[2]);
+    sse2_gaussian(a1, b1, &z[1], &z[3]);
+}
+
+static void sse2_fill(uint32_t s[4][NOISE_LANES], float *out, size_t blocks)
+{
+    __m128 z[4];
+
+    for (size_t i = 0; i < blocks; i++, out += NOISE_BLOCK) {
+        sse2_block(s, z);
+        for (int j = 0; j < 4; j++) {
+            _mm_storeu_ps(out + 4 * j, z[j]);
+        }
+    }
+}
+
+// 4 pixels as floats, with their noise, clamped and rounded back to integers
+static __m128i sse2_noisy(__m128i pixels, __m128 sigma, __m128 z)
+{
+    __m128 v = _mm_add_ps(_mm_cvtepi32_ps(pixels), _mm_mul_ps(sigma, z));
+    v = _mm_max_ps(v, _mm_setzero_ps());
+    v = _mm_min_ps(v, _mm_set1_ps(255.0f));
+    return _mm_cvtps_epi32(v);
+}
+
+static void sse2_add(uint32_t s[4][NOISE_LANES], uint8_t *pixels, size_t blocks, float sigma)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128 sigmas = _mm_set1_ps(sigma);
+    __m128 z[4];
+
+    for (size_t i = 0; i < blocks; i++, pixels += NOISE_BLOCK) {
+        sse2_block(s, z);
+        __m128i bytes = _mm_loadu_si128((__m128i *)pixels);
+        __m128i lo = _mm_unpacklo_epi8(bytes, zero), hi = _mm_unpackhi_epi8(bytes, zero);
+        __m128i p0 = sse2_noisy(_mm_unpacklo_epi16(lo, zero), sigmas, z[0]);
+        __m128i p1 = sse2_noisy(_mm_unpackhi_epi16(lo, zero), sigmas, z[1]);
+        __m128i p2 = sse2_noisy(_mm_unpacklo_epi16(hi, zero), sigmas, z[2]);
+        __m128i p3 = sse2_noisy(_mm_unpackhi_epi16(hi, zero), sigmas, z[3]);
+        bytes = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+        _mm_storeu_si128((__m128i *)pixels, bytes);
+    }
+}
+#endif
+
+#ifdef NOISE_HAVE_AVX2
+#define AVX2 __attribute__((target("avx2")))
+
+// One step of the generators of all lanes, as scalar_next()
+AVX2 static __m256i avx2_next(uint32_t s[4][NOISE_LANES])
+{
+    __m256i s0 = _mm256_loadu_si256((__m256i *)s[0]);
+    __m256i s1 = _mm256_loadu_si256((__m256i *)s[1]);
+    __m256i s2 = _mm256_loadu_si256((__m256i *)s[2]);
+    __m256i s3 = _mm256_loadu_si256((__m256i *)s[3]);
+    __m256i result = _mm256_add_epi32(s0, s3);
+    __m256i t = _mm256_slli_epi32(s1, 9);
+
+    s2 = _mm256_xor_si256(s2, s0);
+    s3 = _mm256_xor_si256(s3, s1);
+    s1 = _mm256_xor_si256(s1, s2);
+    s0 = _mm256_xor_si256(s0, s3);
+    s2 = _mm256_xor_si256(s2, t);
+    s3 = _mm256_or_si256(_mm256_slli_epi32(s3, 11), _mm256_srli_epi32(s3, 21));
+    _mm256_storeu_si256((__m256i *)s[0], s0);
+    _mm256_storeu_si256((__m256i *)s[1], s1);
+    _mm256_storeu_si256((__m256i *)s[2], s2);
+    _mm256_storeu_si256((__m256i *)s[3], s3);
+    return result;
+}
+
+// A block as 2 vectors: the cosines of all lanes, then their sines, as scalar_gaussian()
+AVX2 static void avx2_block(uint32_t s[4][NOISE_LANES], __m256 z[2])
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    __m256i a = avx2_next(s);
+    __m256i b = avx2_next(s);
+    __m256 u1 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_srli_epi32(a, 8), _mm256_set1_epi32(1))),
+                              _mm256_set1_ps(UNIFORM_SCALE));
+    __m256 u2 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(b, 8)), _mm256_set1_ps(UNIFORM_SCALE));
+
+    __m256i bits = _mm256_castps_si256(u1);
+    __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(bits, 23),
+                                                                    _mm256_set1_epi32(0xff)),
+                                                   _mm256_set1_epi32(126)));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+                                                   _mm256_set1_epi32(0x3f000000)));
+    __m256 below = _mm256_cmp_ps(m, _mm256_set1_ps(LOG_SQRTHF), _CMP_LT_OQ);
+    e = _mm256_sub_ps(e, _mm256_and_ps(below, one));
+    __m256 x = _mm256_sub_ps(m, one);
+    x = _mm256_add_ps(x, _mm256_and_ps(below, m));
+    __m256 z2 = _mm256_mul_ps(x, x);
+    __m256 y = _mm256_set1_ps(LOG_P0);
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(LOG_P1));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(LOG_P2));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(LOG_P3));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(LOG_P4));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(LOG_P5));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(LOG_P6));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(LOG_P7));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(LOG_P8));
+    y = _mm256_mul_ps(y, x);
+    y = _mm256_mul_ps(y, z2);
+    y = _mm256_add_ps(y, _mm256_mul_ps(e, _mm256_set1_ps(LOG_Q1)));
+    y = _mm256_sub_ps(y, _mm256_mul_ps(z2, half));
+    x = _mm256_add_ps(x, y);
+    x = _mm256_add_ps(x, _mm256_mul_ps(e, _mm256_set1_ps(LOG_Q2)));
+
+    __m256 r = _mm256_mul_ps(_mm256_set1_ps(-2.0f), x);
+    r = _mm256_max_ps(r, _mm256_setzero_ps());
+    r = _mm256_sqrt_ps(r);
+
+    __m256 t = _mm256_mul_ps(u2, _mm256_set1_ps(4.0f));
+    __m256i q = _mm256_cvtps_epi32(t);
+    x = _mm256_mul_ps(_mm256_sub_ps(t, _mm256_cvtepi32_ps(q)), _mm256_set1_ps(PI_OVER_2));
+    z2 = _mm256_mul_ps(x, x);
+    __m256 sn = _mm256_set1_ps(SIN_P0);
+    sn = _mm256_add_ps(_mm256_mul_ps(sn, z2), _mm256_set1_ps(SIN_P1));
+    sn = _mm256_add_ps(_mm256_mul_ps(sn, z2), _mm256_set1_ps(SIN_P2));
+    sn = _mm256_mul_ps(sn, z2);
+    sn = _mm256_mul_ps(sn, x);
+    sn = _mm256_add_ps(sn, x);
+    __m256 c = _mm256_set1_ps(COS_P0);
+    c = _mm256_add_ps(_mm256_mul_ps(c, z2), _mm256_set1_ps(COS_P1));
+    c = _mm256_add_ps(_mm256_mul_ps(c, z2), _mm256_set1_ps(COS_P2));
+    c = _mm256_mul_ps(c, z2);
+    c = _mm256_mul_ps(c, z2);
+    c = _mm256_sub_ps(c, _mm256_mul_ps(z2, half));
+    c = _mm256_add_ps(c, one);
+
+    __m256 swap = _mm256_castsi256_ps(_mm256_slli_epi32(q, 31));
+    __m256 cos_q = _mm256_blendv_ps(c, sn, swap);
+    __m256 sin_q = _mm256_blendv_ps(sn, c, swap);
+    __m256i sign = _mm256_set1_epi32((int)0x80000000u);
+    cos_q = _mm256_xor_ps(cos_q, _mm256_castsi256_ps(_mm256_and_si256(
+                                     _mm256_slli_epi32(_mm256_add_epi32(q, _mm256_set1_epi32(1)), 30), sign)));
+    sin_q = _mm256_xor_ps(sin_q, _mm256_castsi256_ps(_mm256_and_si256(_mm256_slli_epi32(q, 30), sign)));
+    z[0] = _mm256_mul_ps(r, cos_q);
+    z[1] = _mm256_mul_ps(r, sin_q);
+}
+
+AVX2 static void avx2_fill(uint32_t s[4][NOISE_LANES], float *out, size_t blocks)
+{
+    __m256 z[2];
+
+    for (size_t i = 0; i < blocks; i++, out += NOISE_BLOCK) {
+        avx2_block(s, z);
+        _mm256_storeu_ps(out, z[0]);
+        _mm256_storeu_ps(out + NOISE_LANES, z[1]);
+    }
+}
+
+// 8 pixels as floats, with their noise, clamped and rounded back to integers
+AVX2 static __m256i avx2_noisy(__m128i pixels, __m256 sigma, __m256 z)
+{
+    __m256 v = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(pixels)), _mm256_mul_ps(sigma, z));
+    v = _mm256_max_ps(v, _mm256_setzero_ps());
+    v = _mm256_min_ps(v, _mm256_set1_ps(255.0f));
+    return _mm256_cvtps_epi32(v);
+}
+
+AVX2 static void avx2_add(uint32_t s[4][NOISE_LANES], uint8_t *pixels, size_t blocks, float sigma)
+{
+    __m256 sigmas = _mm256_set1_ps(sigma);
+    __m256 z[2];
+
+    for (size_t i = 0; i < blocks; i++, pixels += NOISE_BLOCK) {
+        avx2_block(s, z);
+        __m128i bytes = _mm_loadu_si128((__m128i *)pixels);
+        __m256i p0 = avx2_noisy(bytes, sigmas, z[0]);
+        __m256i p1 = avx2_noisy(_mm_srli_si128(bytes, 8), sigmas, z[1]);
+        // Packing works within 128 bit halves, the words of p0 and p1 come out interleaved
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(p0, p1), 0xd8);
+        __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+        _mm_storeu_si128((__m128i *)pixels, packed);
+    }
+}
+#endif
+
+// Seeds every lane from seed, and picks the fastest kernel the CPU has
+void noise_seed(Noise_Rng *rng, uint64_t seed)
+{
+    uint64_t x = seed;
+
+    for (int lane = 0; lane < NOISE_LANES; lane++) {
+        uint64_t a = splitmix64(&x), b = splitmix64(&x);
+        rng->s[0][lane] = a;
+        rng->s[1][lane] = a >> 32;
+        rng->s[2][lane] = b;
+        rng->s[3][lane] = b >> 32;
+        if ((a | b) == 0) {
+            rng->s[0][lane] = 1; // the one state xoshiro never leaves
+        }
+    }
+
+    rng->kernel = NOISE_KERNEL_SCALAR;
+    if (noise_use_kernel(rng, NOISE_KERNEL_AVX2) == -1) {
+        noise_use_kernel(rng, NOISE_KERNEL_SSE2);
+    }
+}
+
+// Makes rng use kernel from now on, returns 0 on success, -1 if this build or CPU lacks it
+int noise_use_kernel(Noise_Rng *rng, Noise_Kernel kernel)
+{
+    switch (kernel) {
+    case NOISE_KERNEL_SCALAR:
+        break;
+    case NOISE_KERNEL_SSE2:
+#ifdef __SSE2__
+        break;
+#else
+        return -1;
+#endif
+    case NOISE_KERNEL_AVX2:
+#ifdef NOISE_HAVE_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            break;
+        }
+#endif
+        return -1;
+    default:
+        return -1;
+    }
+    rng->kernel = kernel;
+    return 0;
+}
+
+const char *noise_kernel_name(Noise_Kernel kernel)
+{
+    switch (kernel) {
+    case NOISE_KERNEL_SCALAR:
+        return "scalar";
+    case NOISE_KERNEL_SSE2:
+        return "SSE2";
+    case NOISE_KERNEL_AVX2:
+        return "AVX2";
+    }
+    return "unknown";
+}
+
+// Whole blocks of normal numbers into out
+static void fill_blocks(Noise_Rng *rng, float *out, size_t blocks)
+{
+    switch (rng->kernel) {
+#ifdef NOISE_HAVE_AVX2
+    case NOISE_KERNEL_AVX2:
+        avx2_fill(rng->s, out, blocks);
+        return;
+#endif
+#ifdef __SSE2__
+    case NOISE_KERNEL_SSE2:
+        sse2_fill(rng->s, out, blocks);
+        return;
+#endif
+    default:
+        for (size_t i = 0; i < blocks; i++) {
+            scalar_block(rng->s, out + i * NOISE_BLOCK);
+        }
+    }
+}
+
+// Fills out with count numbers of the standard normal distribution
+void noise_gaussian(Noise_Rng *rng, float *out, size_t count)
+{
+    size_t blocks = count / NOISE_BLOCK;
+    fill_blocks(rng, out, blocks);
+
+    size_t rest = count % NOISE_BLOCK;
+    if (rest > 0) {
+        float z[NOISE_BLOCK];
+        fill_blocks(rng, z, 1);
+        memcpy(out + blocks * NOISE_BLOCK, z, rest * sizeof(float));
+    }
+}
+
+// Adds normal noise of standard deviation sigma to every byte of pixels, saturating at 0 and 255
+void noise_add(Noise_Rng *rng, uint8_t *pixels, size_t len, float sigma)
+{
+    size_t blocks = len / NOISE_BLOCK;
+    switch (rng->kernel) {
+#ifdef NOISE_HAVE_AVX2
+    case NOISE_KERNEL_AVX2:
+        avx2_add(rng->s, pixels, blocks, sigma);
+        break;
+#endif
+#ifdef __SSE2__
+    case NOISE_KERNEL_SSE2:
+        sse2_add(rng->s, pixels, blocks, sigma);
+        break;
+#endif
+    default:
+        scalar_add(rng->s, pixels, blocks, sigma);
+    }
+
+    size_t rest = len % NOISE_BLOCK;
+    if (rest > 0) {
+        float z[NOISE_BLOCK];
+        fill_blocks(rng, z, 1);
+        pixels += blocks * NOISE_BLOCK;
+        for (size_t i = 0; i < rest; i++) {
+            pixels[i] = noisy_pixel(pixels[i], sigma, z[i]);
+        }
+    }
+}
+
+/*
+    Adds normal noise of standard deviation sigma to every channel of every pixel of an 8 or
+    24 bit BMP, leaving its header, palette and row padding alone.
+    Returns 0 on success, -1 if bmp is not such a BMP.
+*/
+int bmp_add_noise(Noise_Rng *rng, uint8_t *bmp, size_t bmp_len, float sigma)
+{
+    Bmp_Header header;
+
+    if (bmp_parse_header(bmp, bmp_len, &header) == -1 || header.data_offset > bmp_len ||
+        bmp_row_size(&header) * bmp_rows(&header) > bmp_len - header.data_offset) {
+        fprintf(stderr, "Not an uncompressed 8 or 24 bit BMP\n");
+        return -1;
+    }
+
+    size_t row_size = bmp_row_size(&header);
+    size_t pixel_bytes = (size_t)header.width * (header.bit_depth / 8);
+    uint8_t *row = bmp + header.data_offset;
+    if (pixel_bytes == row_size) {
+        noise_add(rng, row, row_size * bmp_rows(&header), sigma);
+        return 0;
+    }
+    for (uint32_t y = 0; y < bmp_rows(&header); y++, row += row_size) {
+        noise_add(rng, row, pixel_bytes, sigma);
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef IMAGE_NOISE_H
+#define IMAGE_NOISE_H
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    Gaussian noise for images, generated a block of lanes at a time.
+
+    Every lane runs its own xoshiro128+ generator, seeded from one 64 bit seed through
+    splitmix64. A step of all lanes gives one uniform number per lane, and two steps give two
+    normal numbers per lane through Box-Muller: sqrt(-2 ln u1) times both the cosine and the
+    sine of 2 pi u2. The logarithm, sine and cosine are single precision polynomials (as in
+    Cephes), so the same code runs in AVX2, in SSE2 and one lane at a time, and all three give
+    the same numbers bit for bit. The fastest kernel the CPU has is picked when seeding.
+
+    Numbers come out in blocks of NOISE_BLOCK, the cosines of every lane and then the sines. A
+    call that stops within a block drops the rest of it, so a seed gives the same noise for the
+    same sequence of calls, whatever the kernel.
+*/
+
+#define NOISE_LANES 8
+#define NOISE_BLOCK (2 * NOISE_LANES) // normal numbers from two steps of every lane
+
+typedef enum {
+    NOISE_KERNEL_SCALAR,
+    NOISE_KERNEL_SSE2,
+    NOISE_KERNEL_AVX2
+} Noise_Kernel;
+
+typedef struct {
+    uint32_t s[4][NOISE_LANES]; // xoshiro128+ state, word by word so a word of every lane is one vector
+    Noise_Kernel kernel;
+} Noise_Rng;
+
+// Public interface
+void noise_seed(Noise_Rng *rng, uint64_t seed);
+int noise_use_kernel(Noise_Rng *rng, Noise_Kernel kernel);
+const char *noise_kernel_name(Noise_Kernel kernel);
+void noise_gaussian(Noise_Rng *rng, float *out, size_t count);
+void noise_add(Noise_Rng *rng, uint8_t *pixels, size_t len, float sigma);
+int bmp_add_noise(Noise_Rng *rng, uint8_t *bmp, size_t bmp_len, float sigma);
+
+#endif
@@ -5,12 +5,87 @@
 #include <math.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "image-processing.h"
 
 // there is strict typing for BMP headers, this is to make sure there is no padding
 #pragma pack(1)
 
+uint16_t read_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void write_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+void write_le32(uint8_t *p, uint32_t v)
+{
+    write_le16(p, v);
+    write_le16(p + 2, v >> 16);
+}
+
+/*
+    Reads the headers at the start of the BMP in buf, field by field since the file is little
+    endian and Bmp_Header is not laid out like it. Only uncompressed 8 and 24 bit images are
+    accepted, the pixel array itself is not checked against len.
+    Returns 0 on success, -1 if buf is not such a BMP.
+*/
+int bmp_parse_header(const uint8_t *buf, size_t len, Bmp_Header *header)
+{
+    if (len < BMP_HEADER_LEN) {
+        return -1;
+    }
+
+    header->signature = read_le16(buf);
+    header->file_size = read_le32(buf + 2);
+    header->reserved1 = read_le16(buf + 6);
+    header->reserved2 = read_le16(buf + 8);
+    header->data_offset = read_le32(buf + 10);
+    header->info_header_size = read_le32(buf + 14);
+    header->width = read_le32(buf + 18);
+    header->heigth = read_le32(buf + 22);
+    header->planes = read_le16(buf + 26);
+    header->bit_depth = read_le16(buf + 28);
+    header->compression_type = read_le32(buf + 30);
+    header->data_size = read_le32(buf + 34);
+    header->horizontal_resolution = read_le32(buf + 38);
+    header->vertical_resolution = read_le32(buf + 42);
+    header->number_of_colors = read_le32(buf + 46);
+    header->number_of_important_colors = read_le32(buf + 50);
+
+    if ((uint16_t)header->signature != BMP_SIGNATURE || header->info_header_size < 40 || header->planes != 1 ||
+        (header->bit_depth != 8 && header->bit_depth != 24) || header->compression_type != 0 ||
+        header->width <= 0 || header->width > 0x7FFFFF || header->heigth == 0 || header->heigth == INT32_MIN ||
+        header->data_offset < BMP_HEADER_LEN) {
+        return -1;
+    }
+    return 0;
+}
+
+// Bytes of a row of pixels in the file, padded to a multiple of 4
+size_t bmp_row_size(const Bmp_Header *header)
+{
+    return ((size_t)header->width * header->bit_depth + 31) / 32 * 4;
+}
+
+// Rows of pixels, stored bottom-up for a positive height and top-down for a negative one
+uint32_t bmp_rows(const Bmp_Header *header)
+{
+    return header->heigth < 0 ? -(int64_t)header->heigth : header->heigth;
+}
+
 /*
     Input: 2 random numbers from a uniform distribution
     Output 2 numbers from normal (gaussian) distribution
@@ -24,3 +99,314 @@ void box_muller_transform(Box_Muller_Output *output)
     output->z1 = (sqrt(-2 * log(u1)))*(cos(2*M_PI*u2));
     output->z2 = (sqrt(-2 * log(u1)))*(sin(2*M_PI*u2));
 }
+
+#define SKY_SAMPLE_STEP 8 // the background is estimated from every 8th row
+#define NO_BLOB UINT32_MAX
+
+// Pixels above the threshold next to each other in a row, [start, end)
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    uint32_t blob;
+} Run;
+
+// Pixels above the threshold connected to each other, with their moments so far
+typedef struct {
+    uint32_t parent; // blob it was merged into, itself for a whole one
+    uint32_t pixels;
+    uint8_t peak;
+    uint64_t sum;    // of the pixels above the background
+    uint64_t sum_x;  // the same, weighted by column
+    uint64_t sum_y;  // and by row, in file order
+} Blob;
+
+// Luminance of a row of 24 bit BGR pixels
+static void row_luminance(const uint8_t *row, uint32_t width, uint8_t *gray)
+{
+    for (uint32_t x = 0; x < width; x++) {
+        gray[x] = (row[x * 3] + 2 * row[x * 3 + 1] + row[x * 3 + 2] + 2) >> 2;
+    }
+}
+
+// The sample at or below which half of the histogram's count lies
+static int histogram_median(const uint32_t *histogram, uint64_t count)
+{
+    uint64_t seen = 0;
+    for (int value = 0; value < 256; value++) {
+        seen += histogram[value];
+        if (seen * 2 >= count) {
+            return value;
+        }
+    }
+    return 255;
+}
+
+/*
+    Background and threshold of the whole frame: the median of a sample of rows, and their
+    median absolute deviation scaled to a gaussian sigma. gray holds a row for color frames.
+*/
+static void sky_levels(const uint8_t *pixels, size_t row_size, uint32_t width, uint32_t rows, int channels,
+                       double sigmas, uint8_t *gray, uint8_t *background, int *threshold)
+{
+    uint32_t histogram[256] = { 0 }, deviations[256] = { 0 };
+    uint64_t count = 0;
+
+    for (uint32_t y = 0; y < rows; y += SKY_SAMPLE_STEP) {
+        const uint8_t *row = pixels + y * row_size;
+        if (channels == 3) {
+            row_luminance(row, width, gray);
+            row = gray;
+        }
+        for (uint32_t x = 0; x < width; x++) {
+            histogram[row[x]]++;
+        }
+        count += width;
+    }
+    int median = histogram_median(histogram, count);
+    for (int value = 0; value < 256; value++) {
+        deviations[abs(value - median)] += histogram[value];
+    }
+
+    // A sensor whose noise stays within one level still has a quantization step of noise
+    double sigma = 1.4826 * histogram_median(deviations, count);
+    double level = median + sigmas * (sigma < 1 ? 1 : sigma);
+    *background = median;
+    *threshold = level > 255 ? 255 : (int)level;
+}
+
+/*
+    Bit i is set for each of the 16 pixels from row[i] that is above threshold. With SSE2 this
+    is one comparison for all 16, and the dark sky goes by 16 pixels at a time.
+*/
+static uint32_t above_mask(const uint8_t *row, uint8_t threshold)
+{
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((const __m128i *)row);
+    __m128i above = _mm_set1_epi8((char)(threshold + 1));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, above), v));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < 16; i++) {
+        mask |= (uint32_t)(row[i] > threshold) << i;
+    }
+    return mask;
+#endif
+}
+
+// Finds the runs of pixels above threshold in a row, returns how many there are
+static uint32_t row_runs(const uint8_t *row, uint32_t width, uint8_t threshold, Run *runs)
+{
+    uint32_t count = 0, start = 0;
+    int open = 0;
+
+    for (uint32_t x = 0; x < width; x += 16) {
+        uint32_t mask = 0;
+        if (x + 16 <= width) {
+            mask = above_mask(row + x, threshold);
+        } else {
+            for (uint32_t i = 0; x + i < width; i++) {
+                mask |= (uint32_t)(row[x + i] > threshold) << i;
+            }
+        }
+
+        // Every set bit after a clear one starts a run, and the other way round ends it
+        uint32_t from = 0;
+        for (;;) {
+            uint32_t edges = (open ? ~mask : mask) & (0xFFFFu << from) & 0xFFFF;
+            if (edges == 0) {
+                break;
+            }
+            from = __builtin_ctz(edges);
+            if (open) {
+                runs[count++] = (Run){ .start = start, .end = x + from, .blob = NO_BLOB };
+            } else {
+                start = x + from;
+            }
+            open = !open;
+        }
+    }
+    if (open) {
+        runs[count++] = (Run){ .start = start, .end = width, .blob = NO_BLOB };
+    }
+    return count;
+}
+
+static uint32_t blob_root(Blob *blobs, uint32_t i)
+{
+    while (blobs[i].parent != i) {
+        blobs[i].parent = blobs[blobs[i].parent].parent;
+        i = blobs[i].parent;
+    }
+    return i;
+}
+
+// Merges the blobs of a and b into the older one, returns it
+static uint32_t blob_merge(Blob *blobs, uint32_t a, uint32_t b)
+{
+    a = blob_root(blobs, a);
+    b = blob_root(blobs, b);
+    if (a == b) {
+        return a;
+    }
+    if (b < a) {
+        uint32_t older = b;
+        b = a;
+        a = older;
+    }
+    blobs[b].parent = a;
+    blobs[a].pixels += blobs[b].pixels;
+    blobs[a].sum += blobs[b].sum;
+    blobs[a].sum_x += blobs[b].sum_x;
+    blobs[a].sum_y += blobs[b].sum_y;
+    if (blobs[b].peak > blobs[a].peak) {
+        blobs[a].peak = blobs[b].peak;
+    }
+    return a;
+}
+
+static int brighter_first(const void *a, const void *b)
+{
+    float fa = ((const Star *)a)->flux, fb = ((const Star *)b)->flux;
+    return (fa < fb) - (fa > fb);
+}
+
+/*
+    Finds the stars in the BMP in bmp, into a newly allocated *stars of *count, the brightest
+    first. The background and noise are estimated from a sample of rows up front, then the
+    pixel array is read once, row after row: the pixels above the threshold are found as runs,
+    the runs touching one in the row before (8-connected) join its blob, and each blob sums
+    its pixels above the background weighted by their place. The centroid is then the first
+    moment over the sum, to a fraction of a pixel. Only two rows of runs are kept at a time.
+    Returns 0 on success, -1 on failure.
+*/
+int detect_stars(const uint8_t *bmp, size_t bmp_len, const Star_Detect_Options *opts, Star **stars, size_t *count)
+{
+    Bmp_Header header;
+    if (bmp_parse_header(bmp, bmp_len, &header) == -1 || header.data_offset > bmp_len ||
+        bmp_row_size(&header) * bmp_rows(&header) > bmp_len - header.data_offset) {
+        fprintf(stderr, "Not an uncompressed 8 or 24 bit BMP\n");
+        return -1;
+    }
+
+    double sigmas = opts != NULL && opts->sigmas > 0 ? opts->sigmas : STAR_DETECT_SIGMAS;
+    uint32_t min_pixels = opts != NULL && opts->min_pixels > 0 ? opts->min_pixels : STAR_DETECT_MIN_PIXELS;
+    size_t max_stars = opts != NULL ? opts->max_stars : 0;
+
+    const uint8_t *pixels = bmp + header.data_offset;
+    size_t row_size = bmp_row_size(&header);
+    uint32_t width = header.width, rows = bmp_rows(&header);
+    int channels = header.bit_depth / 8;
+
+    size_t max_runs = width / 2 + 1;
+    Run *runs = malloc(2 * max_runs * sizeof(Run));
+    uint8_t *gray = channels == 3 ? malloc(width) : NULL;
+    Blob *blobs = NULL;
+    size_t blob_count = 0, blob_capacity = 0;
+    *stars = NULL;
+    *count = 0;
+    if (runs == NULL || (channels == 3 && gray == NULL)) {
+        goto fail;
+    }
+    Run *prev = runs, *cur = runs + max_runs;
+    uint32_t prev_count = 0;
+
+    uint8_t background;
+    int threshold;
+    sky_levels(pixels, row_size, width, rows, channels, sigmas, gray, &background, &threshold);
+    // Nothing can be above 255
+    for (uint32_t y = 0; y < rows && threshold < 255; y++) {
+        const uint8_t *row = pixels + y * row_size;
+        if (channels == 3) {
+            row_luminance(row, width, gray);
+            row = gray;
+        }
+        uint32_t cur_count = row_runs(row, width, threshold, cur);
+
+        uint32_t first = 0;
+        for (uint32_t i = 0; i < cur_count; i++) {
+            Run *run = &cur[i];
+            while (first < prev_count && prev[first].end < run->start) {
+                first++;
+            }
+            uint32_t blob = NO_BLOB;
+            for (uint32_t j = first; j < prev_count && prev[j].start <= run->end; j++) {
+                blob = blob == NO_BLOB ? blob_root(blobs, prev[j].blob) : blob_merge(blobs, blob, prev[j].blob);
+            }
+            if (blob == NO_BLOB) {
+                if (blob_count == blob_capacity) {
+                    size_t capacity = blob_capacity ? blob_capacity * 2 : 256;
+                    Blob *grown = capacity < NO_BLOB ? realloc(blobs, capacity * sizeof(Blob)) : NULL;
+                    if (grown == NULL) {
+                        goto fail;
+                    }
+                    blobs = grown;
+                    blob_capacity = capacity;
+                }
+                blob = blob_count++;
+                blobs[blob] = (Blob){ .parent = blob };
+            }
+            run->blob = blob;
+
+            uint64_t sum = 0, sum_x = 0;
+            uint8_t peak = blobs[blob].peak;
+            for (uint32_t x = run->start; x < run->end; x++) {
+                uint32_t value = row[x] - background;
+                sum += value;
+                sum_x += (uint64_t)value * x;
+                if (row[x] > peak) {
+                    peak = row[x];
+                }
+            }
+            blobs[blob].pixels += run->end - run->start;
+            blobs[blob].sum += sum;
+            blobs[blob].sum_x += sum_x;
+            blobs[blob].sum_y += sum * y;
+            blobs[blob].peak = peak;
+        }
+
+        Run *swap = prev;
+        prev = cur;
+        cur = swap;
+        prev_count = cur_count;
+    }
+    size_t found = 0;
+    for (size_t i = 0; i < blob_count; i++) {
+        found += blobs[i].parent == i && blobs[i].pixels >= min_pixels;
+    }
+    *stars = malloc((found ? found : 1) * sizeof(Star));
+    if (*stars == NULL) {
+        goto fail;
+    }
+    for (size_t i = 0; i < blob_count; i++) {
+        const Blob *b = &blobs[i];
+        if (b->parent != i || b->pixels < min_pixels) {
+            continue;
+        }
+        double file_y = (double)b->sum_y / b->sum;
+        Star *star = &(*stars)[(*count)++];
+        star->x = (double)b->sum_x / b->sum;
+        star->y = header.heigth > 0 ? rows - 1 - file_y : file_y;
+        star->flux = b->sum;
+        star->pixels = b->pixels;
+        star->peak = b->peak;
+    }
+    qsort(*stars, *count, sizeof(Star), brighter_first);
+    if (max_stars > 0 && *count > max_stars) {
+        *count = max_stars;
+    }
+
+    free(runs);
+    free(gray);
+    free(blobs);
+    return 0;
+
+fail:
+    perror("unable to detect stars");
+    free(*stars);
+    *stars = NULL;
+    *count = 0;
+    free(runs);
+    free(gray);
+    free(blobs);
+    return -1;
+}
@@ -1,6 +1,10 @@
 #ifndef IMAGE_PROCESSING_H
 #define IMAGE_PROCESSING_H
 #include <stdint.h>
+#include <stddef.h>
+
+#define BMP_SIGNATURE 0x4D42
+#define BMP_HEADER_LEN 54 // file header and BITMAPINFOHEADER as stored, without a palette
 
 typedef struct {
     int16_t signature; // must be 4D42 hex
@@ -29,4 +33,35 @@ typedef struct {
     double z2;
 } Box_Muller_Output;
 
+#define STAR_DETECT_SIGMAS 5.0   // default threshold, in noise sigmas above the background
+#define STAR_DETECT_MIN_PIXELS 2 // default, a lone pixel above the threshold is a hot pixel or a cosmic ray
+
+// A star found in a frame. Color frames are searched in their luminance.
+typedef struct {
+    float x;         // centroid in pixels, 0 is the center of the left column
+    float y;         // centroid in pixels, 0 is the center of the top row
+    float flux;      // sum of its pixels above the background
+    uint32_t pixels; // pixels above the threshold
+    uint8_t peak;    // brightest pixel
+} Star;
+
+typedef struct {
+    double sigmas;       // 0 = STAR_DETECT_SIGMAS
+    uint32_t min_pixels; // 0 = STAR_DETECT_MIN_PIXELS
+    size_t max_stars;    // only keep the brightest ones, 0 = all
+} Star_Detect_Options;
+
+// Public interface
+int bmp_parse_header(const uint8_t *buf, size_t len, Bmp_Header *header);
+size_t bmp_row_size(const Bmp_Header *header);
+uint32_t bmp_rows(const Bmp_Header *header);
+void box_muller_transform(Box_Muller_Output *output);
+int detect_stars(const uint8_t *bmp, size_t bmp_len, const Star_Detect_Options *opts, Star **stars, size_t *count);
+
+// Little endian fields, as in the BMP headers and the formats that carry them
+uint16_t read_le16(const uint8_t *p);
+uint32_t read_le32(const uint8_t *p);
+void write_le16(uint8_t *p, uint16_t v);
+void write_le32(uint8_t *p, uint32_t v);
+
 #endif
@@ -6,8 +6,8 @@
 #include <time.h>
 #include <unistd.h>
 #include "image-processing.h"
-
-void box_muller_transform(Box_Muller_Output *output);
+#include "image-noise.h"
+#include "progressive.h"
 
 int main(void)
 {
@@ -18,6 +18,23 @@ int main(void)
         return -1;
     }
 
+    // The whole file, the header is parsed out of it since Bmp_Header is not laid out as stored
+    fseek(fp_image, 0, SEEK_END);
+    long file_len = ftell(fp_image);
+    fseek(fp_image, 0, SEEK_SET);
+    size_t bmp_len = file_len > 0 ? (size_t)file_len : 0;
+    uint8_t *bmp = malloc(bmp_len > 0 ? bmp_len : 1);
+
+    if (bmp == NULL) {
+        fprintf(stderr, "Unable to allocate space for image buf");
+        return 1;
+    }
+
+    if (fread(bmp, 1, bmp_len, fp_image) != bmp_len) {
+        fprintf(stderr, "unable to read %zu bytes from image\n", bmp_len);
+        return 1;
+    }
+
     Bmp_Header *bmp_header = malloc(sizeof(Bmp_Header));
 
     if (bmp_header == NULL) {
@@ -25,43 +42,54 @@ int main(void)
         return -1;
     }
 
-    // Transfer header of fp_image into bmp_header
-    fread(bmp_header, 1, sizeof(Bmp_Header), fp_image);
+    if (bmp_parse_header(bmp, bmp_len, bmp_header) == -1) {
+        fprintf(stderr, "Not a BMP image this demo can read\n");
+        return 1;
+    }
 
     printf("Bit depth: %d\n", bmp_header->bit_depth);
     printf("width: %d\n", bmp_header->width);
     printf("heigth: %d\n", bmp_header->heigth);
     printf("offset: %d\n", bmp_header->data_offset);
 
-    // go to image data, SEEK_SET = beginning of file
-    fseek(fp_image, bmp_header->data_offset, SEEK_SET);
+    // The image data, padding included, right after the header and palette
+    size_t amount_of_bytes_to_read = bmp_row_size(bmp_header) * bmp_rows(bmp_header);
+    unsigned char *image_buf = bmp + bmp_header->data_offset;
 
-    int amount_of_bytes_to_read = bmp_header->data_size;
-    unsigned char *image_buf = malloc(amount_of_bytes_to_read);
+    // Gaussian noise, a block of pixels at a time, see image-noise.h
+    Noise_Rng rng;
+    noise_seed(&rng, clock());
+    float amount_of_noise_scale = 50;
 
-    if (image_buf == NULL) {
-        fprintf(stderr, "Unable to allocate space for image buf");
+    if (bmp_add_noise(&rng, bmp, bmp_len, amount_of_noise_scale) == -1) {
+        fprintf(stderr, "Unable to add noise to the image\n");
         return 1;
     }
 
-    if (fread(image_buf, 1, amount_of_bytes_to_read, fp_image) != amount_of_bytes_to_read) {
-        fprintf(stderr, "unable to read %d bytes from image\n", amount_of_bytes_to_read);
+    // The noisy image as the satellite sends it, coarse to fine, see progressive.h
+    uint8_t *stream, *received, *preview;
+    size_t stream_len, received_len, preview_len;
+    double complete;
+
+    if (progressive_encode(bmp, bmp_len, &stream, &stream_len) == -1 ||
+        progressive_decode(stream, stream_len, &received, &received_len, NULL) == -1) {
+        fprintf(stderr, "Unable to send the image progressively\n");
         return 1;
     }
+    size_t image_end = bmp_header->data_offset + amount_of_bytes_to_read;
+    printf("Progressive stream: %zu bytes, received image %s\n", stream_len,
+           received_len == image_end && memcmp(received, bmp, image_end) == 0 ? "matches" : "differs");
 
-    // Gaussian noise
-    srand(clock());
-    Box_Muller_Output output;
-    int width = (bmp_header->width * bmp_header->bit_depth) / 8;
-    int heigth = bmp_header->heigth;
-    double amount_of_noise_scale = 50;
-
-    for (int i = 0; i < heigth; i++) {
-        for (int j = 0; j < width; j++) {
-            int index = (i * width) + j;
-            box_muller_transform(&output);
-            image_buf[index] += (output.z1 * amount_of_noise_scale);
+    // A pass cut after a sixteenth of the stream still gives a whole frame, only coarser
+    if (progressive_decode(stream, stream_len / 16, &preview, &preview_len, &complete) == 0) {
+        FILE *fp_preview = fopen("images/test-preview.bmp", "wb");
+        if (fp_preview == NULL || fwrite(preview, 1, preview_len, fp_preview) != preview_len) {
+            fprintf(stderr, "Unable to write the preview image\n");
+            return 1;
         }
+        fclose(fp_preview);
+        printf("Wrote preview from %.1f%% of the pixels: %zu bytes\n", complete * 100, preview_len);
+        free(preview);
     }
 
     FILE *fo = fopen("images/test.bmp", "wb");
@@ -70,20 +98,23 @@ int main(void)
         return -1;
     }
 
-    if (fwrite(bmp_header, 1, sizeof(Bmp_Header), fo) != sizeof(Bmp_Header)) {
-        fprintf(stderr, "Unable to write header file of %lu bytes\n", sizeof(Bmp_Header));
+    if (fwrite(bmp, 1, bmp_header->data_offset, fo) != bmp_header->data_offset) {
+        fprintf(stderr, "Unable to write header file of %d bytes\n", bmp_header->data_offset);
         return -1;
     }
-    printf("Wrote header: %lu bytes\n", sizeof(Bmp_Header));
-    fseek(fo, bmp_header->data_offset, SEEK_SET);
+    printf("Wrote header: %d bytes\n", bmp_header->data_offset);
     if (fwrite(image_buf, 1, amount_of_bytes_to_read, fo) != amount_of_bytes_to_read) {
-        fprintf(stderr, "Unable to write image data of %d bytes\n", amount_of_bytes_to_read);
+        fprintf(stderr, "Unable to write image data of %zu bytes\n", amount_of_bytes_to_read);
         return 1;
     }
-    printf("Wrote image data: %d bytes\n", amount_of_bytes_to_read);
+    printf("Wrote image data: %zu bytes\n", amount_of_bytes_to_read);
     printf("File size: %d\n", bmp_header->file_size);
     printf("Data size: %d\n", bmp_header->data_size);
+    free(received);
+    free(stream);
+    free(bmp_header);
+    free(bmp);
     fclose(fp_image);
     fclose(fo);
     return 0;
-} 
\ No newline at end of file
+}
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE // ppoll
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "link-emu.h"
+#include "tftp-capture.h"
+#include "tftp.h"
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// splitmix64, spreads a seed over the state of the generator below
+static uint64_t mix_seed(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// xorshift64*, uniform in [0, 1)
+static double next_uniform(struct link_path *p)
+{
+    p->rng ^= p->rng >> 12;
+    p->rng ^= p->rng << 25;
+    p->rng ^= p->rng >> 27;
+    return ((p->rng * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+void link_path_init(struct link_path *p, const struct link_profile *profile, uint64_t seed)
+{
+    memset(p, 0, sizeof(struct link_path));
+    p->profile = *profile;
+    if (p->profile.queue_limit == 0) {
+        p->profile.queue_limit = LINK_QUEUE_LIMIT;
+    }
+    p->rng = mix_seed(seed);
+    if (p->rng == 0) {
+        p->rng = 1;
+    }
+}
+
+/*
+    Sends a datagram of len bytes into the link at now_us. It takes len / rate on the link once
+    the datagrams before it are through, which a lost datagram does too: it went out, it just
+    never arrived. Every copy that does arrive gets an arrival time in arrivals_us.
+    Returns the number of copies, 0 if the datagram was lost.
+*/
+int link_path_admit(struct link_path *p, size_t len, uint64_t now_us, uint64_t arrivals_us[2])
+{
+    const struct link_profile *profile = &p->profile;
+
+    uint64_t sent_us = p->busy_until_us > now_us ? p->busy_until_us : now_us;
+    if (profile->rate_bps > 0) {
+        sent_us += (uint64_t)len * 8 * 1000000 / profile->rate_bps;
+    }
+    p->busy_until_us = sent_us;
+
+    // Gilbert-Elliott moves between its states before the datagram is judged
+    double loss = profile->loss;
+    if (profile->ge_enter_bad > 0) {
+        if (p->bad) {
+            p->bad = next_uniform(p) >= profile->ge_leave_bad;
+        } else {
+            p->bad = next_uniform(p) < profile->ge_enter_bad;
+        }
+        loss = p->bad ? profile->ge_bad_loss : profile->loss;
+    }
+    if (loss > 0 && next_uniform(p) < loss) {
+        p->stats.lost++;
+        return 0;
+    }
+
+    int copies = 1;
+    if (profile->duplicate > 0 && next_uniform(p) < profile->duplicate) {
+        p->stats.duplicated++;
+        copies = 2;
+    }
+
+    for (int i = 0; i < copies; i++) {
+        int64_t delay_us = (int64_t)profile->delay_ms * 1000;
+        if (profile->jitter_ms > 0) {
+            delay_us += (int64_t)((next_uniform(p) * 2 - 1) * profile->jitter_ms * 1000);
+        }
+        if (profile->reorder > 0 && next_uniform(p) < profile->reorder) {
+            p->stats.reordered++;
+            delay_us = 0;
+        }
+        arrivals_us[i] = sent_us + (delay_us > 0 ? (uint64_t)delay_us : 0);
+    }
+    return copies;
+}
+
+static int datagram_before(const struct link_datagram *a, const struct link_datagram *b)
+{
+    return a->arrival_us < b->arrival_us || (a->arrival_us == b->arrival_us && a->seq < b->seq);
+}
+
+static int queue_push(struct link_emulator *e, const struct link_datagram *d)
+{
+    if (e->queue_len == e->queue_cap) {
+        size_t cap = e->queue_cap ? 2 * e->queue_cap : 256;
+        struct link_datagram *queue = realloc(e->queue, cap * sizeof(struct link_datagram));
+        if (queue == NULL) {
+            return -1;
+        }
+        e->queue = queue;
+        e->queue_cap = cap;
+    }
+
+    size_t i = e->queue_len++;
+    while (i > 0 && datagram_before(d, &e->queue[(i - 1) / 2])) {
+        e->queue[i] = e->queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    e->queue[i] = *d;
+    return 0;
+}
+
+static void queue_pop(struct link_emulator *e)
+{
+    struct link_datagram last = e->queue[--e->queue_len];
+    size_t i = 0;
+
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= e->queue_len) {
+            break;
+        }
+        if (child + 1 < e->queue_len && datagram_before(&e->queue[child + 1], &e->queue[child])) {
+            child++;
+        }
+        if (!datagram_before(&e->queue[child], &last)) {
+            break;
+        }
+        e->queue[i] = e->queue[child];
+        i = child;
+    }
+    if (e->queue_len > 0) {
+        e->queue[i] = last;
+    }
+}
+
+static int bind_socket(const char *path)
+{
+    int sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sfd < 0) {
+        perror("unable to open socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    unlink(path);
+    if (bind(sfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1) {
+        perror("unable to bind socket");
+        close(sfd);
+        return -1;
+    }
+    return sfd;
+}
+
+/*
+    Binds the socket the ground station sends to at listen_path, and the one relaying to the
+    satellite at satellite_path at relay_path. Each direction gets a seed of its own derived
+    from seed. Returns 0 on success, -1 on failure.
+*/
+int link_emulator_open(struct link_emulator *e, const char *listen_path, const char *relay_path,
+                       const char *satellite_path, const struct link_profile *uplink,
+                       const struct link_profile *downlink, uint64_t seed)
+{
+    memset(e, 0, sizeof(struct link_emulator));
+    strncpy(e->listen_path, listen_path, sizeof(e->listen_path) - 1);
+    strncpy(e->relay_path, relay_path, sizeof(e->relay_path) - 1);
+
+    e->satellite_addr.sun_family = AF_UNIX;
+    strncpy(e->satellite_addr.sun_path, satellite_path, sizeof(e->satellite_addr.sun_path) - 1);
+    e->peer_addr = e->satellite_addr;
+    e->peer_len = sizeof(struct sockaddr_un);
+
+    link_path_init(&e->uplink, uplink, seed);
+    link_path_init(&e->downlink, downlink, seed ^ 0x5a5a5a5a5a5a5a5aULL);
+
+    e->ground_fd = bind_socket(listen_path);
+    if (e->ground_fd < 0) {
+        return -1;
+    }
+    e->satellite_fd = bind_socket(relay_path);
+    if (e->satellite_fd < 0) {
+        close(e->ground_fd);
+        unlink(e->listen_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Puts everything waiting on sfd on its way through the path of that direction
+static int receive_all(struct link_emulator *e, int uplink)
+{
+    static uint8_t buf[LINK_MAX_DATAGRAM];
+    struct link_path *path = uplink ? &e->uplink : &e->downlink;
+    int sfd = uplink ? e->ground_fd : e->satellite_fd;
+
+    for (;;) {
+        struct sockaddr_un src_addr;
+        socklen_t src_len = sizeof(struct sockaddr_un);
+        ssize_t len = recvfrom(sfd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *) &src_addr, &src_len);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("unable to receive datagram");
+            return -1;
+        }
+
+        // Answers go back to whoever sent last on either side, the satellite may use a transfer ID
+        if (src_len > sizeof(sa_family_t)) {
+            if (uplink) {
+                e->ground_addr = src_addr;
+                e->ground_len = src_len;
+            } else {
+                e->peer_addr = src_addr;
+                e->peer_len = src_len;
+            }
+        }
+
+        if (path->queued >= path->profile.queue_limit) {
+            path->stats.dropped++;
+            continue;
+        }
+
+        uint64_t arrivals_us[2];
+        int copies = link_path_admit(path, len, now_us(), arrivals_us);
+        for (int i = 0; i < copies; i++) {
+            struct link_datagram d = {
+                .arrival_us = arrivals_us[i],
+                .seq = e->seq++,
+                .uplink = uplink,
+                .len = len,
+                .buf = malloc(len > 0 ? len : 1)
+            };
+            if (d.buf != NULL) {
+                memcpy(d.buf, buf, len);
+            }
+            if (d.buf == NULL || queue_push(e, &d) == -1) {
+                free(d.buf);
+                fprintf(stderr, "Unable to queue datagram\n");
+                return -1;
+            }
+            path->queued++;
+        }
+    }
+}
+
+// Delivers a datagram that arrived at the end of the link
+static void deliver(struct link_emulator *e, const struct link_datagram *d)
+{
+    struct link_path *path = d->uplink ? &e->uplink : &e->downlink;
+    const struct sockaddr_un *addr;
+    socklen_t addr_len;
+    int sfd;
+
+    if (d->uplink) {
+        // A read request always goes to the satellite's own socket, not to an earlier transfer ID
+        int rrq = d->len >= 2 && ((d->buf[0] << 8) | d->buf[1]) == TFTP_RRQ;
+        addr = rrq ? &e->satellite_addr : &e->peer_addr;
+        addr_len = rrq ? sizeof(struct sockaddr_un) : e->peer_len;
+        sfd = e->satellite_fd;
+    } else {
+        addr = &e->ground_addr;
+        addr_len = e->ground_len;
+        sfd = e->ground_fd;
+    }
+
+    // Nobody to deliver to, or the receiver's queue is full: lost like on a congested link
+    if (addr_len == 0 || sendto(sfd, d->buf, d->len, MSG_DONTWAIT, (const struct sockaddr *) addr, addr_len) == -1) {
+        path->stats.dropped++;
+        return;
+    }
+    path->stats.forwarded++;
+    if (e->capture != NULL) {
+        tftp_capture_write(e->capture, d->uplink, d->buf, d->len);
+    }
+}
+
+/*
+    Relays datagrams both ways until *stop is set, sleeping until the next one arrives at the
+    end of the link or one is sent into it. Returns 0 once stopped, -1 on failure.
+*/
+int link_emulator_run(struct link_emulator *e, volatile sig_atomic_t *stop)
+{
+    struct pollfd pfds[2] = {
+        { .fd = e->ground_fd, .events = POLLIN },
+        { .fd = e->satellite_fd, .events = POLLIN }
+    };
+
+    while (!*stop) {
+        struct timespec timeout;
+        struct timespec *timeout_ptr = NULL;
+        uint64_t now = now_us();
+
+        if (e->queue_len > 0) {
+            uint64_t wait_us = e->queue[0].arrival_us > now ? e->queue[0].arrival_us - now : 0;
+            timeout = (struct timespec) { .tv_sec = wait_us / 1000000, .tv_nsec = (wait_us % 1000000) * 1000 };
+            timeout_ptr = &timeout;
+        }
+
+        int ready = ppoll(pfds, 2, timeout_ptr, NULL);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            return -1;
+        }
+
+        if ((pfds[0].revents & POLLIN) && receive_all(e, 1) == -1) {
+            return -1;
+        }
+        if ((pfds[1].revents & POLLIN) && receive_all(e, 0) == -1) {
+            return -1;
+        }
+
+        now = now_us();
+        while (e->queue_len > 0 && e->queue[0].arrival_us <= now) {
+            struct link_datagram d = e->queue[0];
+            queue_pop(e);
+            deliver(e, &d);
+            (d.uplink ? &e->uplink : &e->downlink)->queued--;
+            free(d.buf);
+        }
+    }
+    return 0;
+}
+
+void link_emulator_close(struct link_emulator *e)
+{
+    for (size_t i = 0; i < e->queue_len; i++) {
+        free(e->queue[i].buf);
+    }
+    free(e->queue);
+    e->queue = NULL;
+    e->queue_len = 0;
+    close(e->ground_fd);
+    close(e->satellite_fd);
+    unlink(e->listen_path);
+    unlink(e->relay_path);
+}
@@ -0,0 +1,102 @@
+#ifndef LINK_EMU_H
+#define LINK_EMU_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+    Emulation of the radio link between the ground station and the satellite, for a plain
+    Linux box without tc/netem privileges.
+
+    A link_emulator is a datagram proxy between the two UNIX sockets. The ground station sends
+    to the emulator's socket instead of the satellite's, the emulator relays every datagram to
+    the satellite from a socket of its own and the answers back to the ground station. Each
+    direction is a link_path that decides whether a datagram arrives, how many times and when:
+      - one-way delay, with jitter drawn uniformly from +-jitter
+      - a bandwidth cap: a datagram takes len / rate on the link, behind the ones before it
+      - loss, either independent (Bernoulli) or in bursts (Gilbert-Elliott: a good and a bad
+        state with a loss rate each, switching with a probability per datagram)
+      - duplication, and reordering by letting some datagrams skip the delay
+    Every decision comes from a PRNG seeded per direction, so the same seed and the same
+    traffic give the same run. With a capture set, every datagram delivered is also recorded
+    for a replay, see tftp-capture.h.
+*/
+
+#define LINK_QUEUE_LIMIT 1024 // datagrams in flight per direction, above this they are dropped
+#define LINK_MAX_DATAGRAM 65536
+
+struct tftp_capture;
+
+struct link_profile {
+    uint32_t delay_ms;
+    uint32_t jitter_ms;
+    uint64_t rate_bps;    // bits per second, 0 = unlimited
+    double loss;          // probability per datagram, in the good state with Gilbert-Elliott
+    double ge_enter_bad;  // Gilbert-Elliott: good -> bad per datagram, 0 = Bernoulli loss only
+    double ge_leave_bad;  // bad -> good per datagram
+    double ge_bad_loss;   // loss probability in the bad state
+    double duplicate;
+    double reorder;       // probability that a datagram skips the delay
+    uint32_t queue_limit; // 0 = LINK_QUEUE_LIMIT
+};
+
+struct link_stats {
+    unsigned long forwarded;
+    unsigned long lost;
+    unsigned long duplicated;
+    unsigned long reordered;
+    unsigned long dropped; // the queue of the link or the receiver was full
+};
+
+// One direction of the link
+struct link_path {
+    struct link_profile profile;
+    uint64_t rng;
+    int bad;               // Gilbert-Elliott state
+    uint64_t busy_until_us; // the link is sending earlier datagrams until then
+    uint32_t queued;       // datagrams in flight
+    struct link_stats stats;
+};
+
+// A datagram in flight
+struct link_datagram {
+    uint64_t arrival_us;
+    uint64_t seq;          // orders datagrams arriving at the same time
+    int uplink;            // ground station -> satellite
+    size_t len;
+    uint8_t *buf;
+};
+
+struct link_emulator {
+    int ground_fd;          // bound at the address the ground station sends to
+    int satellite_fd;       // relays to the satellite
+    char listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char relay_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct sockaddr_un satellite_addr; // where a RRQ goes
+    struct sockaddr_un peer_addr;      // where the rest goes: the satellite or the socket it answered from
+    socklen_t peer_len;
+    struct sockaddr_un ground_addr;    // the ground station that sent last
+    socklen_t ground_len;
+    struct link_path uplink;
+    struct link_path downlink;
+    struct link_datagram *queue; // min-heap on arrival_us, seq
+    size_t queue_len;
+    size_t queue_cap;
+    uint64_t seq;
+    struct tftp_capture *capture; // records every datagram delivered, NULL to skip
+};
+
+// Public interface
+void link_path_init(struct link_path *p, const struct link_profile *profile, uint64_t seed);
+int link_path_admit(struct link_path *p, size_t len, uint64_t now_us, uint64_t arrivals_us[2]);
+
+int link_emulator_open(struct link_emulator *e, const char *listen_path, const char *relay_path,
+                       const char *satellite_path, const struct link_profile *uplink,
+                       const struct link_profile *downlink, uint64_t seed);
+int link_emulator_run(struct link_emulator *e, volatile sig_atomic_t *stop);
+void link_emulator_close(struct link_emulator *e);
+
+#endif // LINK_EMU_H
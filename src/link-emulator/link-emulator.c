@@ -0,0 +1,148 @@
+/*
+    Sits between the ground station and the satellite as a datagram proxy, and delays, drops,
+    duplicates and reorders what passes through like a real radio link would.
+
+    The satellite binds its socket as usual, and the ground station is pointed at the
+    emulator instead:
+        ./build/satellite
+        ./build/link-emulator -d 120 -j 10 -r 2000 -l 1
+        ./build/ground-station -a temp/link-socket
+
+    With -w, every datagram delivered to either end is recorded for ./build/replay.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "../link-emu.h"
+#include "../tftp-capture.h"
+
+#define SATELLITE_SOCKET_PATH "temp/server-socket"
+#define LINK_SOCKET_PATH "temp/link-socket"        // the ground station sends here
+#define RELAY_SOCKET_PATH "temp/link-relay-socket" // the satellite answers here
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_stop(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+void usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-d delay_ms] [-j jitter_ms] [-r kbit/s] [-l loss%%] [-g enter%%,leave%%,loss%%]\n", prog);
+	fprintf(stderr, "          [-u duplicate%%] [-o reorder%%] [-q queue_limit] [-S seed]\n");
+	fprintf(stderr, "  -d  one-way delay, in both directions\n");
+	fprintf(stderr, "  -j  jitter, the delay varies uniformly by up to this much either way\n");
+	fprintf(stderr, "  -r  bandwidth cap, unlimited by default\n");
+	fprintf(stderr, "  -l  independent loss, or the loss in the good state with -g\n");
+	fprintf(stderr, "  -g  Gilbert-Elliott burst loss: chance per datagram to enter and to leave the bad\n");
+	fprintf(stderr, "      state, and the loss while in it\n");
+	fprintf(stderr, "  -u  datagrams delivered twice\n");
+	fprintf(stderr, "  -o  datagrams that skip the delay, overtaking the ones in flight\n");
+	fprintf(stderr, "  -q  datagrams in flight per direction before more are dropped, %d by default\n", LINK_QUEUE_LIMIT);
+	fprintf(stderr, "  -S  seed of every random decision, the same seed replays the same link\n");
+	fprintf(stderr, "  -w  record every datagram delivered, for a replay of one transfer\n");
+	exit(1);
+}
+
+// A percentage as a probability, exits on anything outside 0-100
+static double parse_percent(const char *s, char *prog) {
+	char *end;
+	double percent = strtod(s, &end);
+
+	if (end == s || *end != '\0' || percent < 0 || percent > 100) {
+		usage(prog);
+	}
+	return percent / 100;
+}
+
+int main(int argc, char *argv[]) {
+	struct link_profile profile = { 0 };
+	uint64_t seed = 1;
+	const char *capture_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:j:r:l:g:u:o:q:S:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			profile.delay_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			profile.jitter_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			profile.rate_bps = strtoull(optarg, NULL, 10) * 1000;
+			break;
+		case 'l':
+			profile.loss = parse_percent(optarg, argv[0]);
+			break;
+		case 'g': {
+			char enter[32], leave[32], loss[32];
+			if (sscanf(optarg, "%31[^,],%31[^,],%31s", enter, leave, loss) != 3) {
+				usage(argv[0]);
+			}
+			profile.ge_enter_bad = parse_percent(enter, argv[0]);
+			profile.ge_leave_bad = parse_percent(leave, argv[0]);
+			profile.ge_bad_loss = parse_percent(loss, argv[0]);
+			break;
+		}
+		case 'u':
+			profile.duplicate = parse_percent(optarg, argv[0]);
+			break;
+		case 'o':
+			profile.reorder = parse_percent(optarg, argv[0]);
+			break;
+		case 'q':
+			profile.queue_limit = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			capture_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	struct sigaction sa = { .sa_handler = handle_stop };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	struct link_emulator emulator;
+	if (link_emulator_open(&emulator, LINK_SOCKET_PATH, RELAY_SOCKET_PATH, SATELLITE_SOCKET_PATH,
+			       &profile, &profile, seed) == -1) {
+		exit(1);
+	}
+	struct tftp_capture capture;
+	if (capture_path != NULL) {
+		if (tftp_capture_open(&capture, capture_path) == -1) {
+			link_emulator_close(&emulator);
+			exit(1);
+		}
+		emulator.capture = &capture;
+	}
+	printf("Relaying %s -> %s, seed %llu\n", LINK_SOCKET_PATH, SATELLITE_SOCKET_PATH, (unsigned long long)seed);
+
+	int result = link_emulator_run(&emulator, &stop);
+
+	const struct link_path *paths[] = { &emulator.uplink, &emulator.downlink };
+	const char *names[] = { "uplink", "downlink" };
+	for (int i = 0; i < 2; i++) {
+		const struct link_stats *stats = &paths[i]->stats;
+		printf("%s: %lu forwarded, %lu lost, %lu duplicated, %lu reordered, %lu dropped\n", names[i],
+		       stats->forwarded, stats->lost, stats->duplicated, stats->reordered, stats->dropped);
+	}
+
+	if (capture_path != NULL) {
+		printf("Captured %llu datagrams to %s\n", (unsigned long long)capture.datagrams, capture_path);
+		if (tftp_capture_close(&capture) == -1) {
+			result = -1;
+		}
+	}
+	link_emulator_close(&emulator);
+	exit(result == 0 ? 0 : 1);
+}
@@ -0,0 +1,130 @@
+/*
+    Adam7 ordering of BMP pixels, see progressive.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "progressive.h"
+
+#define PREAMBLE_LEN 9 // magic, version and BMP header length
+
+// Where each pass starts and how far apart its pixels are, as in PNG
+static const struct {
+    uint8_t x0, y0;
+    uint8_t dx, dy;
+} passes[PROGRESSIVE_PASSES] = {
+    { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+    { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 },
+};
+
+// The block a pixel of each pass stands for until the passes after it arrive
+static const struct {
+    uint8_t w, h;
+} blocks[PROGRESSIVE_PASSES] = {
+    { 8, 8 }, { 4, 8 }, { 4, 4 }, { 2, 4 }, { 2, 2 }, { 1, 2 }, { 1, 1 },
+};
+
+/*
+    Reorders the pixels of the BMP in bmp into a newly allocated *out, see progressive.h.
+    Returns 0 on success, -1 on failure.
+*/
+int progressive_encode(const uint8_t *bmp, size_t bmp_len, uint8_t **out, size_t *out_len)
+{
+    Bmp_Header header;
+    if (bmp_parse_header(bmp, bmp_len, &header) == -1 || header.data_offset > bmp_len ||
+        bmp_row_size(&header) * bmp_rows(&header) > bmp_len - header.data_offset) {
+        fprintf(stderr, "Not an uncompressed 8 or 24 bit BMP\n");
+        return -1;
+    }
+
+    const uint8_t *pixels = bmp + header.data_offset;
+    size_t row_size = bmp_row_size(&header);
+    uint32_t width = header.width, rows = bmp_rows(&header);
+    int channels = header.bit_depth / 8;
+
+    *out_len = PREAMBLE_LEN + header.data_offset + (size_t)width * rows * channels;
+    *out = malloc(*out_len);
+    if (*out == NULL) {
+        perror("unable to allocate progressive image");
+        return -1;
+    }
+
+    uint8_t *p = *out;
+    memcpy(p, PROGRESSIVE_MAGIC, 4);
+    p[4] = PROGRESSIVE_VERSION;
+    write_le32(p + 5, header.data_offset);
+    memcpy(p + PREAMBLE_LEN, bmp, header.data_offset);
+    p += PREAMBLE_LEN + header.data_offset;
+
+    for (int pass = 0; pass < PROGRESSIVE_PASSES; pass++) {
+        for (uint32_t y = passes[pass].y0; y < rows; y += passes[pass].dy) {
+            const uint8_t *row = pixels + y * row_size;
+            for (uint32_t x = passes[pass].x0; x < width; x += passes[pass].dx) {
+                memcpy(p, row + (size_t)x * channels, channels);
+                p += channels;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+    Rebuilds the BMP from the first len bytes of a progressive stream into a newly allocated
+    *bmp. Pixels that have not arrived take the value of the pixel of an earlier pass whose
+    block they are in, and are black before the first pass has reached them. *complete, unless
+    NULL, is set to the fraction of the pixels that arrived.
+    Returns 0 on success, -1 if buf does not hold the start of a progressive stream.
+*/
+int progressive_decode(const uint8_t *buf, size_t len, uint8_t **bmp, size_t *bmp_len, double *complete)
+{
+    Bmp_Header header;
+    if (len < PREAMBLE_LEN || memcmp(buf, PROGRESSIVE_MAGIC, 4) != 0 || buf[4] != PROGRESSIVE_VERSION ||
+        read_le32(buf + 5) > len - PREAMBLE_LEN ||
+        bmp_parse_header(buf + PREAMBLE_LEN, read_le32(buf + 5), &header) == -1 ||
+        header.data_offset != read_le32(buf + 5)) {
+        fprintf(stderr, "Not a progressive image\n");
+        return -1;
+    }
+
+    size_t row_size = bmp_row_size(&header);
+    uint32_t width = header.width, rows = bmp_rows(&header);
+    int channels = header.bit_depth / 8;
+    size_t pixel_count = (size_t)width * rows;
+
+    *bmp_len = header.data_offset + row_size * rows;
+    *bmp = calloc(*bmp_len, 1);
+    if (*bmp == NULL) {
+        perror("unable to allocate image");
+        return -1;
+    }
+    memcpy(*bmp, buf + PREAMBLE_LEN, header.data_offset);
+    uint8_t *pixels = *bmp + header.data_offset;
+
+    const uint8_t *p = buf + PREAMBLE_LEN + header.data_offset;
+    size_t received = (len - PREAMBLE_LEN - header.data_offset) / channels;
+    if (received > pixel_count) {
+        received = pixel_count;
+    }
+    if (complete != NULL) {
+        *complete = pixel_count ? (double)received / pixel_count : 1;
+    }
+
+    // Later passes paint over the blocks of the earlier ones
+    for (int pass = 0; pass < PROGRESSIVE_PASSES && received > 0; pass++) {
+        for (uint32_t y = passes[pass].y0; y < rows && received > 0; y += passes[pass].dy) {
+            uint32_t h = rows - y < blocks[pass].h ? rows - y : blocks[pass].h;
+            for (uint32_t x = passes[pass].x0; x < width && received > 0; x += passes[pass].dx, received--) {
+                uint32_t w = width - x < blocks[pass].w ? width - x : blocks[pass].w;
+                for (uint32_t by = y; by < y + h; by++) {
+                    uint8_t *dest = pixels + by * row_size + (size_t)x * channels;
+                    for (uint32_t bx = 0; bx < w; bx++, dest += channels) {
+                        memcpy(dest, p, channels);
+                    }
+                }
+                p += channels;
+            }
+        }
+    }
+    return 0;
+}
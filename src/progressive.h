@@ -0,0 +1,34 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image-processing.h"
+
+/*
+    Progressive ordering of a BMP for the downlink, so that a transfer cut short anywhere still
+    gives a whole frame.
+
+    The pixels are sent in the seven passes of Adam7 interlacing (as in PNG): every 8th pixel
+    of every 8th row first, then the grid is refined until the last pass fills in the odd rows.
+    The first pass is 1/64 of the pixels, and after 1/16 of them every 4x4 block has one. The
+    ground station gives each pixel it has the block up to the next pixels of its pass, so any
+    prefix of the stream decodes to a full frame, coarser the shorter it is. Nothing is added
+    or lost, the stream is as long as the pixels.
+
+    Stream, little endian:
+        "PROG" | version u8 | BMP header length u32 | BMP header
+        passes 1 to 7: rows of the pass in file order, pixels of the row left to right
+    The BMP header is everything up to the pixel array, palette included. Row padding comes
+    back as zeroes.
+*/
+
+#define PROGRESSIVE_MAGIC "PROG"
+#define PROGRESSIVE_VERSION 1
+#define PROGRESSIVE_PASSES 7
+
+// Public interface
+int progressive_encode(const uint8_t *bmp, size_t bmp_len, uint8_t **out, size_t *out_len);
+int progressive_decode(const uint8_t *buf, size_t len, uint8_t **bmp, size_t *bmp_len, double *complete);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+    Replays one side of a capture recorded by the link emulator against a live other end, to
+    reproduce a transfer exactly as it went over the link, loss and all, without the link:
+        ./build/link-emulator -l 2 -w temp/lossy.cap
+        ./build/ground-station -a temp/link-socket -w 16 -b 1024
+        ./build/replay -n 5 temp/lossy.cap
+
+    By default the satellite's side is played to a ground station retrieving the file into
+    memory, with -s the ground station's side to a satellite sending it. Either way the file is
+    the one the capture carried, and what the live end ends up with is checked against it.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "../tftp.h"
+#include "../tftp-io.h"
+#include "../tftp-capture.h"
+
+#define SUT_SOCKET_PATH "temp/replay-sut-socket"   // the live end
+#define PEER_SOCKET_PATH "temp/replay-peer-socket" // the side played from the capture
+#define SUT_TIMEOUT_S 5
+
+// What the capture says about the transfer
+struct recorded {
+	struct tftp_request rrq;
+	uint64_t offset;
+	uint16_t blksize;
+	uint64_t size;     // of the file
+	uint8_t *content;  // the file, zeroes before offset
+};
+
+// The live end, on a thread of its own
+struct sut {
+	int sfd;
+	int sending;
+	const struct recorded *recorded;
+	struct tftp_memory mem;
+	uint8_t *out;
+	int result;
+};
+
+void usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-s] [-t] [-n runs] [-w wait_ms] capture_file\n", prog);
+	fprintf(stderr, "  -s  play the ground station's side to a satellite, instead of the satellite's to a ground station\n");
+	fprintf(stderr, "  -t  keep the recorded gaps between datagrams instead of going as fast as the live end keeps up\n");
+	fprintf(stderr, "  -n  replay this many times, 1 by default\n");
+	fprintf(stderr, "  -w  give up waiting for a datagram of the capture after this long, %d ms by default\n",
+		TFTP_REPLAY_WAIT_MS);
+	exit(1);
+}
+
+static int bind_socket(const char *path, int timeout_s) {
+	int sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (sfd < 0) {
+		perror("unable to open socket");
+		return -1;
+	}
+
+	struct timeval tv = { .tv_sec = timeout_s, .tv_usec = 0 };
+	setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	unlink(path);
+	if (bind(sfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1) {
+		perror("unable to bind socket");
+		close(sfd);
+		return -1;
+	}
+	return sfd;
+}
+
+// Block numbers of DATA unwrapped from 16 bits past the furthest one so far
+static int64_t unwrap(int64_t *last, uint16_t block) {
+	int64_t unwrapped = *last < 0 ? block : *last + (int16_t)(block - (uint16_t)*last);
+	if (unwrapped > *last) {
+		*last = unwrapped;
+	}
+	return unwrapped;
+}
+
+/*
+    Puts the file back together from the DATA the ground station received, at the blksize and
+    offset of the OACK. Returns 0 on success, -1 if the capture holds no transfer.
+*/
+static int reassemble(const struct tftp_capture_log *log, struct recorded *r) {
+	int have_rrq = 0, have_tsize = 0;
+	uint64_t tsize = 0, end = 0;
+	int64_t last = -1;
+
+	memset(r, 0, sizeof(*r));
+	r->blksize = DEFAULT_BLKSIZE;
+	for (size_t i = 0; i < log->count; i++) {
+		const struct tftp_capture_datagram *d = &log->datagrams[i];
+		uint16_t opcode = d->len >= 2 ? (d->buf[0] << 8) | d->buf[1] : 0;
+
+		if (d->uplink && opcode == TFTP_RRQ && !have_rrq) {
+			deserialize_rrq_pkt((uint8_t *)d->buf, &r->rrq, d->len);
+			have_rrq = 1;
+		} else if (!d->uplink && opcode == TFTP_OACK) {
+			struct tftp_oack oack;
+			deserialize_oack_pkt((uint8_t *)d->buf, &oack, d->len);
+			if (oack.compress) {
+				fprintf(stderr, "The capture holds a compressed transfer, which can't be put back together\n");
+				return -1;
+			}
+			r->blksize = oack.blksize ? oack.blksize : DEFAULT_BLKSIZE;
+			r->offset = oack.offset;
+			have_tsize = oack.has_tsize;
+			tsize = oack.tsize;
+		} else if (!d->uplink && opcode == TFTP_DATA && d->len >= DATA_HDR_LEN) {
+			int64_t block = unwrap(&last, (d->buf[2] << 8) | d->buf[3]);
+			uint64_t block_end = r->offset + (uint64_t)(block - 1) * r->blksize + d->len - DATA_HDR_LEN;
+			end = block_end > end ? block_end : end;
+		}
+	}
+	if (!have_rrq) {
+		fprintf(stderr, "The capture holds no read request\n");
+		return -1;
+	}
+
+	r->size = have_tsize ? tsize : end;
+	r->content = calloc(r->size > end ? r->size : end ? end : 1, 1);
+	if (r->content == NULL) {
+		perror("unable to allocate file");
+		return -1;
+	}
+
+	last = -1;
+	for (size_t i = 0; i < log->count; i++) {
+		const struct tftp_capture_datagram *d = &log->datagrams[i];
+		if (d->uplink || d->len < DATA_HDR_LEN || ((d->buf[0] << 8) | d->buf[1]) != TFTP_DATA) {
+			continue;
+		}
+		int64_t block = unwrap(&last, (d->buf[2] << 8) | d->buf[3]);
+		memcpy(r->content + r->offset + (uint64_t)(block - 1) * r->blksize, d->buf + DATA_HDR_LEN,
+		       d->len - DATA_HDR_LEN);
+	}
+	return 0;
+}
+
+static void *run_sut(void *arg) {
+	struct sut *sut = arg;
+	const struct recorded *r = sut->recorded;
+
+	if (sut->sending) {
+		sut->result = tftp_send_file(sut->sfd, r->content, r->size, "[SATELLITE]");
+		return NULL;
+	}
+
+	struct tftp_options opts = {
+		.windowsize = r->rrq.windowsize,
+		.blksize = r->rrq.blksize,
+		.offset = r->rrq.offset,
+		.tsize = r->rrq.tsize
+	};
+	struct tftp_sink sink;
+	tftp_memory_sink(&sink, &sut->mem, sut->out, r->size + 1);
+
+	struct sockaddr_un peer_addr;
+	memset(&peer_addr, 0, sizeof(struct sockaddr_un));
+	peer_addr.sun_family = AF_UNIX;
+	strncpy(peer_addr.sun_path, PEER_SOCKET_PATH, sizeof(peer_addr.sun_path) - 1);
+	sut->result = tftp_retrieve_file(sut->sfd, peer_addr, &sink, &opts, "[GROUND STATION]");
+	return NULL;
+}
+
+// One replay against a fresh live end. Returns 0 if it went like the capture, -1 otherwise.
+static int replay_once(int run, const struct tftp_capture_log *log, const struct recorded *r,
+		       const struct tftp_replay_config *config) {
+	struct sut sut = { .sending = config->uplink, .recorded = r, .result = -1 };
+	struct tftp_replay_stats stats;
+	pthread_t thread;
+
+	sut.out = malloc(r->size + 1);
+	if (sut.out == NULL) {
+		perror("unable to allocate file");
+		return -1;
+	}
+	sut.sfd = bind_socket(SUT_SOCKET_PATH, SUT_TIMEOUT_S);
+	int sfd = bind_socket(PEER_SOCKET_PATH, SUT_TIMEOUT_S);
+	if (sut.sfd < 0 || sfd < 0 || pthread_create(&thread, NULL, run_sut, &sut) != 0) {
+		fprintf(stderr, "Unable to start the live end\n");
+		exit(1);
+	}
+
+	// A satellite is found at its socket, a ground station by its read request
+	struct sockaddr_un peer_addr;
+	socklen_t peer_len = 0;
+	memset(&peer_addr, 0, sizeof(struct sockaddr_un));
+	if (config->uplink) {
+		peer_addr.sun_family = AF_UNIX;
+		strncpy(peer_addr.sun_path, SUT_SOCKET_PATH, sizeof(peer_addr.sun_path) - 1);
+		peer_len = sizeof(struct sockaddr_un);
+	}
+	int result = tftp_replay_run(sfd, &peer_addr, &peer_len, log, config, &stats);
+	pthread_join(thread, NULL);
+	close(sut.sfd);
+	close(sfd);
+	unlink(SUT_SOCKET_PATH);
+	unlink(PEER_SOCKET_PATH);
+
+	// A satellite only has the file to check against, so there is nothing more to compare
+	int identical = config->uplink ||
+		memcmp(sut.out + r->offset, r->content + r->offset, r->size - r->offset) == 0;
+	free(sut.out);
+
+	double seconds = stats.elapsed_ns / 1e9;
+	printf("Run %d: %.3f ms, %.2f MB/s, %.0f datagrams/s, %llu sent, %llu received, %llu diverged, %s%s\n",
+	       run, seconds * 1000, seconds > 0 ? (r->size - r->offset) / seconds / 1e6 : 0,
+	       seconds > 0 ? (stats.sent + stats.received) / seconds : 0, (unsigned long long)stats.sent,
+	       (unsigned long long)stats.received, (unsigned long long)stats.diverged,
+	       sut.result == 0 ? "completed" : "failed", identical ? "" : ", data differs");
+	return result == 0 && sut.result == 0 && stats.diverged == 0 && identical ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+	struct tftp_replay_config config = { 0 };
+	int runs = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "stn:w:")) != -1) {
+		switch (opt) {
+		case 's':
+			config.uplink = 1;
+			break;
+		case 't':
+			config.timed = 1;
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			if (runs < 1) {
+				usage(argv[0]);
+			}
+			break;
+		case 'w':
+			config.wait_ms = atoi(optarg);
+			if (config.wait_ms < 1) {
+				usage(argv[0]);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	struct tftp_capture_log log;
+	struct recorded recorded;
+	if (tftp_capture_load(&log, argv[optind]) == -1 || reassemble(&log, &recorded) == -1) {
+		exit(1);
+	}
+	printf("Replaying %zu datagrams of %s (%llu bytes, blksize %u) to a live %s\n", log.count,
+	       recorded.rrq.filename, (unsigned long long)recorded.size, recorded.blksize,
+	       config.uplink ? "satellite" : "ground station");
+
+	int failed = 0;
+	for (int run = 1; run <= runs; run++) {
+		failed |= replay_once(run, &log, &recorded, &config) != 0;
+	}
+
+	free(recorded.content);
+	tftp_capture_free(&log);
+	exit(failed ? 1 : 0);
+}
@@ -8,29 +8,273 @@
 #include <sys/socket.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include "../tftp.h"
+#include "../tftp-server.h"
+#include "../tftp-shm.h"
+#include "../tftp-metrics.h"
+#include "../tftp-trace.h"
+#include "../star-codec.h"
+#include "../progressive.h"
+#include "../bmp-region.h"
+#include "../tftp-session.h"
 
 #define SATELLITE_SOCKET_PATH "temp/server-socket"
+#define IMAGE_PATH "images/some-random-stars.bmp"
+#define METRICS_PATH "temp/satellite-metrics"
 
 #define BUF_SIZE 100
 
 #define BACKLOG 5
 
+// With -e the star field encoding of the image is sent instead of the image, see star-codec.h
+static Star_Codec_Options *encoding = NULL;
+// With -c the list of the stars found in the image is sent instead, see detect_stars()
+static Star_Detect_Options *detection = NULL;
+// With -i the pixels are sent in progressive order, see progressive.h
+static int interlaced = 0;
+
 void exit_error(char *s) {
     perror(s);
     exit(1);
 }
 
+// Writes what the trace rings still hold on any exit
+static void stop_trace(void) {
+	tftp_trace_stop();
+}
+
+void usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-s [-t] | -m] [-e [-r] | -c | -i] [-T trace_file]\n", prog);
+	fprintf(stderr, "  -s  keep serving any number of ground stations at once\n");
+	fprintf(stderr, "  -t  answer every ground station from its own socket (transfer ID)\n");
+	fprintf(stderr, "  -m  send the image over shared memory to a ground station on this host\n");
+	fprintf(stderr, "  -e  send only the stars of the image, for a ground station started with -e\n");
+	fprintf(stderr, "  -r  with -e, add the rest of the pixels so the image comes back exactly\n");
+	fprintf(stderr, "  -c  send the list of the stars found in the image, for a ground station started with -c\n");
+	fprintf(stderr, "  -i  send the pixels coarse to fine, for a ground station started with -i\n");
+	fprintf(stderr, "  -T  trace every packet, timeout and retransmission to trace_file, see build/trace-decoder\n");
+	exit(1);
+}
+
+// Maps the image read-only, returns 0 on success, -1 on failure
+int map_image(uint8_t **buf, size_t *len) {
+	int fd = open(IMAGE_PATH, O_RDONLY);
+	struct stat st;
+
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "Unable to find image\n");
+		return -1;
+	}
+
+	*buf = NULL;
+	*len = st.st_size;
+	if (st.st_size > 0) {
+		*buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (*buf == MAP_FAILED) {
+			close(fd);
+			exit_error("unable to map image");
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+// Finds the stars of the mapped image and lists them, returns 0 on success, -1 on failure
+int list_stars(const uint8_t *image, size_t image_len, uint8_t **buf, size_t *len) {
+	struct timespec start, end;
+	Star *stars;
+	size_t count;
+	Bmp_Header header;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (detect_stars(image, image_len, detection, &stars, &count) == -1) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	bmp_parse_header(image, image_len, &header);
+
+	int result = star_list_encode(stars, count, header.width, bmp_rows(&header), buf, len);
+	if (result == 0) {
+		printf("Found %zu stars in %.2f ms, listed in %zu bytes\n", count,
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, *len);
+	}
+	free(stars);
+	return result;
+}
+
+// Whether the image is sent as something built from it in memory rather than as mapped
+static int image_transformed(void) {
+	return encoding != NULL || detection != NULL || interlaced;
+}
+
+// The image to send: mapped as is, encoded with -e, its stars with -c or reordered with -i.
+// Returns 0 on success, -1 on failure.
+int load_image(uint8_t **buf, size_t *len) {
+	if (!image_transformed()) {
+		return map_image(buf, len);
+	}
+
+	uint8_t *image;
+	size_t image_len, significant;
+	if (map_image(&image, &image_len) == -1) {
+		return -1;
+	}
+	int result;
+	if (detection != NULL) {
+		result = list_stars(image, image_len, buf, len);
+	} else if (interlaced) {
+		result = progressive_encode(image, image_len, buf, len);
+	} else {
+		result = star_encode(image, image_len, encoding, buf, len, &significant);
+		if (result == 0) {
+			printf("Encoded %zu bytes of image into %zu, %zu pixels kept\n", image_len, *len, significant);
+		}
+	}
+	if (image != NULL) {
+		munmap(image, image_len);
+	}
+	return result;
+}
+
+void release_image(uint8_t *buf, size_t len) {
+	if (image_transformed()) {
+		free(buf);
+	} else if (buf != NULL) {
+		munmap(buf, len);
+	}
+}
+
+// Serves the image to every ground station that asks, until killed
+int serve_image(int sfd, int ephemeral_tids) {
+	uint8_t *buf;
+	size_t len;
+
+	if (load_image(&buf, &len) == -1) {
+		return -1;
+	}
+
+	struct tftp_server_config config = {
+		.buf = buf,
+		.buf_len = len,
+		.ephemeral_tids = ephemeral_tids,
+		.log_prefix = "[SATELLITE]"
+	};
+	int result = tftp_server_run(sfd, &config, NULL);
+
+	release_image(buf, len);
+	return result;
+}
+
+// Sends the image once over the shared memory link, no socket involved
+int send_image_shm(void) {
+	struct tftp_shm_link link;
+	uint8_t *buf;
+	size_t len;
+
+	if (load_image(&buf, &len) == -1) {
+		return -1;
+	}
+
+	int result = -1;
+	if (tftp_shm_create(&link, SHM_LINK_NAME) == 0) {
+		printf("Shared memory link: %s\n", SHM_LINK_NAME);
+		result = tftp_shm_send_file(&link, buf, len, "[SATELLITE]");
+		tftp_shm_close(&link);
+	}
+
+	release_image(buf, len);
+	return result;
+}
+
+// Sends the image once from a mapping, or the region a ground station asks for, or what was built from it from memory
+int send_image(int sfd) {
+	if (!image_transformed()) {
+		Bmp_Region region;
+		struct tftp_cropper cropper;
+		bmp_region_cropper(&cropper, &region);
+		return tftp_send_mapped_image(sfd, IMAGE_PATH, &cropper, "[SATELLITE]");
+	}
+
+	uint8_t *buf;
+	size_t len;
+	if (load_image(&buf, &len) == -1) {
+		return -1;
+	}
+	int result = tftp_send_file(sfd, buf, len, "[SATELLITE]");
+	release_image(buf, len);
+	return result;
+}
+
 int main (int argc, char *argv[]) {
     int sfd;
 	struct sockaddr_un addr;
+	int server_mode = 0, ephemeral_tids = 0, shm_mode = 0;
+	Star_Codec_Options codec_opts = { 0 };
+	Star_Detect_Options detect_opts = { 0 };
+	const char *trace_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "stmerciT:")) != -1) {
+		switch (opt) {
+		case 's':
+			server_mode = 1;
+			break;
+		case 't':
+			ephemeral_tids = 1;
+			break;
+		case 'm':
+			shm_mode = 1;
+			break;
+		case 'e':
+			encoding = &codec_opts;
+			break;
+		case 'r':
+			codec_opts.residual = 1;
+			break;
+		case 'c':
+			detection = &detect_opts;
+			break;
+		case 'i':
+			interlaced = 1;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((ephemeral_tids && !server_mode) || (shm_mode && server_mode) || (codec_opts.residual && encoding == NULL) ||
+	    (encoding != NULL) + (detection != NULL) + interlaced > 1) {
+		usage(argv[0]);
+	}
+
+	if (trace_path != NULL) {
+		if (tftp_trace_start(trace_path) == -1) {
+			exit(1);
+		}
+		atexit(stop_trace);
+	}
+
+	// `kill -USR1` writes the metrics of the running transfers to METRICS_PATH
+	if (tftp_metrics_dump_on_signal(METRICS_PATH) == -1) {
+		exit(1);
+	}
+
+	if (shm_mode) {
+		exit(send_image_shm() == 0 ? 0 : 1);
+	}
 
 	sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
 
@@ -46,8 +290,8 @@ int main (int argc, char *argv[]) {
 
 
 	// Construct and bind satellite address
-	addr.sun_family = AF_UNIX;
 	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
 	strncpy(addr.sun_path, SATELLITE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
 
 	// Bind the socket to an established address
@@ -57,33 +301,12 @@ int main (int argc, char *argv[]) {
 
 	printf("Sfd: %d - Socket: %s\n", sfd, SATELLITE_SOCKET_PATH);
 
-	FILE *fp_image = fopen("images/some-random-stars.bmp", "r");
-
-    if (fp_image == NULL) {
-        fprintf(stderr, "Unable to find image\n");
-        return -1;
-    }
-
-    fseek(fp_image, 0L, SEEK_END);
-    long image_size = ftell(fp_image);
-    rewind(fp_image);
-
-    char *buf = malloc(image_size);
-
-    if (!buf) {
-        fprintf(stderr, "unable to allocate space for buf: %lu\n", image_size);
-        fclose(fp_image);
-        exit(1);
-    }
-
-    fread(buf, 1, image_size, fp_image);
-
-    fclose(fp_image);
-
-    printf("Ready to send file with size: %lu\n", image_size);
-	tftp_send_file(sfd, buf, image_size, "[SATELLITE]");
-
-	free(buf);
+	// The image is memory-mapped and sent without copying it into the heap
+	if (server_mode) {
+		serve_image(sfd, ephemeral_tids);
+	} else if (send_image(sfd) == -1) {
+		fprintf(stderr, "Unable to send image %s\n", IMAGE_PATH);
+	}
 
 	close(sfd);
 	unlink(SATELLITE_SOCKET_PATH);
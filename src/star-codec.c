@@ -0,0 +1,442 @@
+/*
+    Sparse star field encoding, see star-codec.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "star-codec.h"
+
+#define PREAMBLE_LEN 12 // magic, version, flags, tile and BMP header length
+#define MAX_CHANNELS 3
+#define MAX_TILE 4096   // keeps the pixel count of a tile in 32 bits
+
+// Where the pixels of a BMP are, and how a tile grid covers them
+typedef struct {
+    uint8_t *pixels;
+    size_t row_size;
+    uint32_t width;
+    uint32_t rows;
+    int channels;
+    int tile;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+} Frame;
+
+static void frame_init(Frame *f, const Bmp_Header *header, uint8_t *bmp, int tile)
+{
+    f->pixels = bmp + header->data_offset;
+    f->row_size = bmp_row_size(header);
+    f->width = header->width;
+    f->rows = bmp_rows(header);
+    f->channels = header->bit_depth / 8;
+    f->tile = tile;
+    f->tiles_x = (f->width + tile - 1) / tile;
+    f->tiles_y = (f->rows + tile - 1) / tile;
+}
+
+static uint8_t *frame_pixel(const Frame *f, uint32_t x, uint32_t y)
+{
+    return f->pixels + y * f->row_size + (size_t)x * f->channels;
+}
+
+static size_t write_varint(uint8_t *p, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+// Returns the bytes read, 0 if the varint runs past end
+static size_t read_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    *v = 0;
+    for (size_t n = 0; n < 5 && p + n < end; n++) {
+        *v |= (uint32_t)(p[n] & 0x7F) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+// The sample at or below which half of the histogram's count lies
+static int histogram_median(const uint32_t *histogram, uint32_t count)
+{
+    uint32_t seen = 0;
+    for (int value = 0; value < 256; value++) {
+        seen += histogram[value];
+        if (seen * 2 >= count) {
+            return value;
+        }
+    }
+    return 255;
+}
+
+/*
+    Background and threshold of one channel of the tile at (x0, y0): the median, and the
+    median absolute deviation scaled to a gaussian sigma. Pixels above the threshold are kept.
+*/
+static void tile_levels(const Frame *f, uint32_t x0, uint32_t y0, uint32_t w, uint32_t h, int c, double sigmas,
+                        uint8_t *background, uint8_t *threshold)
+{
+    uint32_t histogram[256] = { 0 }, deviations[256] = { 0 };
+    uint32_t count = w * h;
+
+    for (uint32_t y = y0; y < y0 + h; y++) {
+        for (uint32_t x = x0; x < x0 + w; x++) {
+            histogram[frame_pixel(f, x, y)[c]]++;
+        }
+    }
+    int median = histogram_median(histogram, count);
+    for (int value = 0; value < 256; value++) {
+        deviations[abs(value - median)] += histogram[value];
+    }
+
+    // A sensor whose noise stays within one level still has a quantization step of noise
+    double sigma = 1.4826 * histogram_median(deviations, count);
+    double level = median + sigmas * (sigma < 1 ? 1 : sigma);
+    *background = median;
+    *threshold = level > 255 ? 255 : (uint8_t)level;
+}
+
+static int is_significant(const uint8_t *pixel, const uint8_t *threshold, int channels)
+{
+    for (int c = 0; c < channels; c++) {
+        if (pixel[c] > threshold[c]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Encodes the BMP in bmp into a newly allocated *out, see star-codec.h. *significant, unless
+    NULL, is set to the number of pixels that were kept.
+    Returns 0 on success, -1 on failure.
+*/
+int star_encode(const uint8_t *bmp, size_t bmp_len, const Star_Codec_Options *opts, uint8_t **out,
+                size_t *out_len, size_t *significant)
+{
+    Bmp_Header header;
+    if (bmp_parse_header(bmp, bmp_len, &header) == -1 || header.data_offset > bmp_len ||
+        bmp_row_size(&header) * bmp_rows(&header) > bmp_len - header.data_offset) {
+        fprintf(stderr, "Not an uncompressed 8 or 24 bit BMP\n");
+        return -1;
+    }
+
+    int tile = opts != NULL && opts->tile > 0 ? opts->tile : STAR_CODEC_TILE;
+    double sigmas = opts != NULL && opts->sigmas > 0 ? opts->sigmas : STAR_CODEC_SIGMAS;
+    int residual = opts != NULL && opts->residual;
+    if (tile > MAX_TILE) {
+        fprintf(stderr, "Tile of %d pixels is too large\n", tile);
+        return -1;
+    }
+
+    Frame f;
+    frame_init(&f, &header, (uint8_t *)bmp, tile);
+    size_t pixel_count = (size_t)f.width * f.rows;
+    size_t tile_count = (size_t)f.tiles_x * f.tiles_y;
+
+    // Every pixel kept, or every residual stored raw, bounds the output
+    size_t residual_len = residual ? pixel_count * f.channels : 0;
+    size_t bound = PREAMBLE_LEN + header.data_offset + tile_count * (f.channels + 5) +
+                   pixel_count * (f.channels + 5) + (residual ? 4 + compressBound(residual_len) : 0);
+    uint8_t *buf = malloc(bound);
+    uint8_t *residuals = residual ? malloc(residual_len ? residual_len : 1) : NULL;
+    if (buf == NULL || (residual && residuals == NULL)) {
+        perror("unable to allocate encoded frame");
+        free(buf);
+        free(residuals);
+        return -1;
+    }
+
+    memcpy(buf, STAR_CODEC_MAGIC, 4);
+    buf[4] = STAR_CODEC_VERSION;
+    buf[5] = residual ? STAR_CODEC_RESIDUAL : 0;
+    buf[6] = tile;
+    buf[7] = tile >> 8;
+    write_le32(buf + 8, header.data_offset);
+    memcpy(buf + PREAMBLE_LEN, bmp, header.data_offset);
+    size_t pos = PREAMBLE_LEN + header.data_offset;
+
+    size_t kept = 0, residual_pos = 0;
+    for (uint32_t ty = 0; ty < f.tiles_y; ty++) {
+        for (uint32_t tx = 0; tx < f.tiles_x; tx++) {
+            uint32_t x0 = tx * tile, y0 = ty * tile;
+            uint32_t w = f.width - x0 < (uint32_t)tile ? f.width - x0 : (uint32_t)tile;
+            uint32_t h = f.rows - y0 < (uint32_t)tile ? f.rows - y0 : (uint32_t)tile;
+            uint8_t background[MAX_CHANNELS], threshold[MAX_CHANNELS];
+
+            uint32_t count = 0;
+            for (int c = 0; c < f.channels; c++) {
+                tile_levels(&f, x0, y0, w, h, c, sigmas, &background[c], &threshold[c]);
+                buf[pos++] = background[c];
+            }
+            for (uint32_t y = y0; y < y0 + h; y++) {
+                for (uint32_t x = x0; x < x0 + w; x++) {
+                    count += is_significant(frame_pixel(&f, x, y), threshold, f.channels);
+                }
+            }
+            pos += write_varint(buf + pos, count);
+
+            uint32_t index = 0, next = 0;
+            for (uint32_t y = y0; y < y0 + h; y++) {
+                for (uint32_t x = x0; x < x0 + w; x++, index++) {
+                    const uint8_t *pixel = frame_pixel(&f, x, y);
+                    if (is_significant(pixel, threshold, f.channels)) {
+                        pos += write_varint(buf + pos, index - next);
+                        memcpy(buf + pos, pixel, f.channels);
+                        pos += f.channels;
+                        next = index + 1;
+                    } else if (residual) {
+                        for (int c = 0; c < f.channels; c++) {
+                            residuals[residual_pos++] = pixel[c] - background[c];
+                        }
+                    }
+                }
+            }
+            kept += count;
+        }
+    }
+
+    if (residual) {
+        uLongf deflated_len = bound - pos - 4;
+        if (compress2(buf + pos + 4, &deflated_len, residuals, residual_pos, Z_BEST_COMPRESSION) != Z_OK) {
+            fprintf(stderr, "Unable to deflate the residual layer\n");
+            free(buf);
+            free(residuals);
+            return -1;
+        }
+        write_le32(buf + pos, deflated_len);
+        pos += 4 + deflated_len;
+        free(residuals);
+    }
+
+    *out = buf;
+    *out_len = pos;
+    if (significant != NULL) {
+        *significant = kept;
+    }
+    return 0;
+}
+
+/*
+    Rebuilds the BMP of an encoded frame into a newly allocated *bmp.
+    Returns 0 on success, -1 if buf is not a complete encoded frame.
+*/
+int star_decode(const uint8_t *buf, size_t len, uint8_t **bmp, size_t *bmp_len)
+{
+    const uint8_t *end = buf + len;
+    Bmp_Header header;
+
+    if (len < PREAMBLE_LEN || memcmp(buf, STAR_CODEC_MAGIC, 4) != 0 || buf[4] != STAR_CODEC_VERSION) {
+        fprintf(stderr, "Not an encoded star field\n");
+        return -1;
+    }
+    int residual = buf[5] & STAR_CODEC_RESIDUAL;
+    int tile = buf[6] | (buf[7] << 8);
+    uint32_t header_len = read_le32(buf + 8);
+    if (tile == 0 || tile > MAX_TILE || header_len > len - PREAMBLE_LEN ||
+        bmp_parse_header(buf + PREAMBLE_LEN, header_len, &header) == -1 || header.data_offset != header_len) {
+        fprintf(stderr, "Encoded star field holds no valid BMP header\n");
+        return -1;
+    }
+
+    size_t pixels_len = bmp_row_size(&header) * bmp_rows(&header);
+    uint8_t *out = calloc(header_len + pixels_len, 1);
+    if (out == NULL) {
+        perror("unable to allocate decoded frame");
+        return -1;
+    }
+    Frame f;
+    frame_init(&f, &header, out, tile);
+    uint8_t *mask = residual ? calloc((size_t)f.width * f.rows, 1) : NULL;
+    uint8_t *backgrounds = malloc((size_t)f.tiles_x * f.tiles_y * f.channels);
+    if ((residual && mask == NULL) || backgrounds == NULL) {
+        perror("unable to allocate decoded frame");
+        free(out);
+        free(mask);
+        free(backgrounds);
+        return -1;
+    }
+    memcpy(out, buf + PREAMBLE_LEN, header_len);
+
+    // Paint every tile with its background, then put its kept pixels back
+    const uint8_t *p = buf + PREAMBLE_LEN + header_len;
+    size_t kept = 0;
+    for (uint32_t ty = 0; ty < f.tiles_y; ty++) {
+        for (uint32_t tx = 0; tx < f.tiles_x; tx++) {
+            uint32_t x0 = tx * tile, y0 = ty * tile;
+            uint32_t w = f.width - x0 < (uint32_t)tile ? f.width - x0 : (uint32_t)tile;
+            uint32_t h = f.rows - y0 < (uint32_t)tile ? f.rows - y0 : (uint32_t)tile;
+            uint8_t *background = backgrounds + ((size_t)ty * f.tiles_x + tx) * f.channels;
+
+            uint32_t count;
+            size_t n;
+            if (end - p < f.channels || (n = read_varint(p + f.channels, end, &count)) == 0 || count > w * h) {
+                goto truncated;
+            }
+            memcpy(background, p, f.channels);
+            p += f.channels + n;
+            for (uint32_t y = y0; y < y0 + h; y++) {
+                for (uint32_t x = x0; x < x0 + w; x++) {
+                    memcpy(frame_pixel(&f, x, y), background, f.channels);
+                }
+            }
+
+            uint32_t next = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t skip;
+                if ((n = read_varint(p, end, &skip)) == 0 || skip >= w * h - next ||
+                    (size_t)(end - p) < n + f.channels) {
+                    goto truncated;
+                }
+                uint32_t index = next + skip;
+                uint32_t x = x0 + index % w, y = y0 + index / w;
+                memcpy(frame_pixel(&f, x, y), p + n, f.channels);
+                if (mask != NULL) {
+                    mask[(size_t)y * f.width + x] = 1;
+                }
+                p += n + f.channels;
+                next = index + 1;
+            }
+            kept += count;
+        }
+    }
+
+    // The residuals of every pixel that was not kept, in the same order
+    if (residual) {
+        uLongf residual_len = ((size_t)f.width * f.rows - kept) * f.channels;
+        uint8_t *residuals = malloc(residual_len ? residual_len : 1);
+        uint32_t deflated_len = end - p >= 4 ? read_le32(p) : 0;
+        if (residuals == NULL || end - p < 4 || deflated_len > (size_t)(end - p - 4) ||
+            uncompress(residuals, &residual_len, p + 4, deflated_len) != Z_OK ||
+            residual_len != ((size_t)f.width * f.rows - kept) * f.channels) {
+            free(residuals);
+            goto truncated;
+        }
+
+        size_t residual_pos = 0;
+        for (uint32_t ty = 0; ty < f.tiles_y; ty++) {
+            for (uint32_t tx = 0; tx < f.tiles_x; tx++) {
+                uint32_t x0 = tx * tile, y0 = ty * tile;
+                uint32_t w = f.width - x0 < (uint32_t)tile ? f.width - x0 : (uint32_t)tile;
+                uint32_t h = f.rows - y0 < (uint32_t)tile ? f.rows - y0 : (uint32_t)tile;
+                for (uint32_t y = y0; y < y0 + h; y++) {
+                    for (uint32_t x = x0; x < x0 + w; x++) {
+                        if (mask[(size_t)y * f.width + x]) {
+                            continue;
+                        }
+                        uint8_t *pixel = frame_pixel(&f, x, y);
+                        for (int c = 0; c < f.channels; c++) {
+                            pixel[c] += residuals[residual_pos++];
+                        }
+                    }
+                }
+            }
+        }
+        free(residuals);
+    }
+
+    free(mask);
+    free(backgrounds);
+    *bmp = out;
+    *bmp_len = header_len + pixels_len;
+    return 0;
+
+truncated:
+    fprintf(stderr, "Encoded star field is cut short or corrupt\n");
+    free(out);
+    free(mask);
+    free(backgrounds);
+    return -1;
+}
+
+static void write_float(uint8_t *p, float v)
+{
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    write_le32(p, bits);
+}
+
+static float read_float(const uint8_t *p)
+{
+    uint32_t bits = read_le32(p);
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+/*
+    Writes the count stars of a width x height frame into a newly allocated *out, see
+    star-codec.h. Returns 0 on success, -1 on failure.
+*/
+int star_list_encode(const Star *stars, size_t count, uint32_t width, uint32_t height, uint8_t **out,
+                     size_t *out_len)
+{
+    if (count > UINT32_MAX) {
+        fprintf(stderr, "Too many stars for a star list\n");
+        return -1;
+    }
+    *out_len = STAR_LIST_HEADER_LEN + count * STAR_LIST_ENTRY_LEN;
+    *out = malloc(*out_len);
+    if (*out == NULL) {
+        perror("unable to allocate star list");
+        return -1;
+    }
+
+    uint8_t *p = *out;
+    memcpy(p, STAR_LIST_MAGIC, 4);
+    p[4] = STAR_LIST_VERSION;
+    write_le32(p + 5, width);
+    write_le32(p + 9, height);
+    write_le32(p + 13, count);
+    p += STAR_LIST_HEADER_LEN;
+    for (size_t i = 0; i < count; i++, p += STAR_LIST_ENTRY_LEN) {
+        write_float(p, stars[i].x);
+        write_float(p + 4, stars[i].y);
+        write_float(p + 8, stars[i].flux);
+        write_le32(p + 12, stars[i].pixels);
+        p[16] = stars[i].peak;
+    }
+    return 0;
+}
+
+/*
+    Reads the star list in buf into a newly allocated *stars of *count, and the size of the
+    frame they were found in. Returns 0 on success, -1 if buf is not a whole star list.
+*/
+int star_list_decode(const uint8_t *buf, size_t len, Star **stars, size_t *count, uint32_t *width,
+                     uint32_t *height)
+{
+    if (len < STAR_LIST_HEADER_LEN || memcmp(buf, STAR_LIST_MAGIC, 4) != 0 || buf[4] != STAR_LIST_VERSION ||
+        (len - STAR_LIST_HEADER_LEN) / STAR_LIST_ENTRY_LEN != read_le32(buf + 13) ||
+        (len - STAR_LIST_HEADER_LEN) % STAR_LIST_ENTRY_LEN != 0) {
+        fprintf(stderr, "Not a star list\n");
+        return -1;
+    }
+
+    *width = read_le32(buf + 5);
+    *height = read_le32(buf + 9);
+    *count = read_le32(buf + 13);
+    *stars = malloc((*count ? *count : 1) * sizeof(Star));
+    if (*stars == NULL) {
+        perror("unable to allocate star list");
+        return -1;
+    }
+    const uint8_t *p = buf + STAR_LIST_HEADER_LEN;
+    for (size_t i = 0; i < *count; i++, p += STAR_LIST_ENTRY_LEN) {
+        (*stars)[i].x = read_float(p);
+        (*stars)[i].y = read_float(p + 4);
+        (*stars)[i].flux = read_float(p + 8);
+        (*stars)[i].pixels = read_le32(p + 12);
+        (*stars)[i].peak = p[16];
+    }
+    return 0;
+}
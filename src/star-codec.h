@@ -0,0 +1,62 @@
+#ifndef STAR_CODEC_H
+#define STAR_CODEC_H
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image-processing.h"
+
+/*
+    Sparse encoding of a star field BMP for the downlink.
+
+    The frame is cut into square tiles. Each tile gets its own background level (the median)
+    and noise (the median absolute deviation) per color channel, and only its pixels more than
+    a few noise sigmas above the background are sent, with their place in the tile. The ground
+    station paints every tile with its background and puts the pixels back, which keeps the
+    stars and drops the noise floor. With the residual layer the other pixels follow as their
+    difference to the background, deflated, and the BMP comes back exactly.
+
+    Encoded frame, little endian:
+        "STAR" | version u8 | flags u8 | tile u16 | BMP header length u32 | BMP header
+        per tile, left to right and top to bottom in file order:
+            background u8 per channel | pixel count varint
+            per pixel: pixels skipped since the last one varint | value u8 per channel
+        with STAR_CODEC_RESIDUAL: deflated length u32 | deflated residuals
+    The BMP header is everything up to the pixel array, palette included. Row padding comes
+    back as zeroes.
+*/
+
+#define STAR_CODEC_MAGIC "STAR"
+#define STAR_CODEC_VERSION 1
+#define STAR_CODEC_RESIDUAL 0x01 // flags: the lossless residual layer follows the tiles
+
+#define STAR_CODEC_TILE 32    // default side of a tile in pixels
+#define STAR_CODEC_SIGMAS 5.0 // default threshold, in noise sigmas above the background
+
+typedef struct {
+    int tile;      // 0 = STAR_CODEC_TILE
+    double sigmas; // 0 = STAR_CODEC_SIGMAS
+    int residual;  // add the residual layer, so the BMP is rebuilt exactly
+} Star_Codec_Options;
+
+/*
+    The stars found on board with detect_stars(), for passes that only need their positions
+    and fluxes. Little endian, floats as IEEE 754 single precision:
+        "STRL" | version u8 | frame width u32 | frame height u32 | star count u32
+        per star, the brightest first: x f32 | y f32 | flux f32 | pixels u32 | peak u8
+*/
+
+#define STAR_LIST_MAGIC "STRL"
+#define STAR_LIST_VERSION 1
+#define STAR_LIST_HEADER_LEN 17 // magic, version, frame size and star count
+#define STAR_LIST_ENTRY_LEN 17  // one star
+
+// Public interface
+int star_encode(const uint8_t *bmp, size_t bmp_len, const Star_Codec_Options *opts, uint8_t **out,
+                size_t *out_len, size_t *significant);
+int star_decode(const uint8_t *buf, size_t len, uint8_t **bmp, size_t *bmp_len);
+int star_list_encode(const Star *stars, size_t count, uint32_t width, uint32_t height, uint8_t **out,
+                     size_t *out_len);
+int star_list_decode(const uint8_t *buf, size_t len, Star **stars, size_t *count, uint32_t *width,
+                     uint32_t *height);
+
+#endif
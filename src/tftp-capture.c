@@ -0,0 +1,319 @@
+/*
+    Capture files and the replay of one side of them, see tftp-capture.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include "tftp.h"
+#include "tftp-capture.h"
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Starts a capture at path, its clock starts now. Returns 0 on success, -1 on failure.
+int tftp_capture_open(struct tftp_capture *c, const char *path)
+{
+    struct tftp_capture_header header = { .version = TFTP_CAPTURE_VERSION };
+    memcpy(header.magic, TFTP_CAPTURE_MAGIC, sizeof(TFTP_CAPTURE_MAGIC));
+
+    c->fp = fopen(path, "wb");
+    if (c->fp == NULL) {
+        perror("unable to open capture");
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, c->fp) != 1) {
+        perror("unable to write capture");
+        fclose(c->fp);
+        return -1;
+    }
+    c->start_ns = monotonic_ns();
+    c->datagrams = 0;
+    return 0;
+}
+
+// Appends a datagram delivered now. Returns 0 on success, -1 on failure.
+int tftp_capture_write(struct tftp_capture *c, int uplink, const uint8_t *buf, size_t len)
+{
+    struct tftp_capture_record rec = {
+        .time_ns = monotonic_ns() - c->start_ns,
+        .len = len,
+        .uplink = uplink != 0
+    };
+
+    if (fwrite(&rec, sizeof(rec), 1, c->fp) != 1 || (len > 0 && fwrite(buf, len, 1, c->fp) != 1)) {
+        perror("unable to write capture");
+        return -1;
+    }
+    c->datagrams++;
+    return 0;
+}
+
+// Returns 0 on success, -1 if the capture could not be written out
+int tftp_capture_close(struct tftp_capture *c)
+{
+    if (fclose(c->fp) != 0) {
+        perror("unable to write capture");
+        return -1;
+    }
+    return 0;
+}
+
+// Reads a whole capture into memory. Returns 0 on success, -1 on failure.
+int tftp_capture_load(struct tftp_capture_log *log, const char *path)
+{
+    memset(log, 0, sizeof(*log));
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror("unable to open capture");
+        return -1;
+    }
+
+    long len = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        len = ftell(fp);
+    }
+    log->data = len > 0 ? malloc(len) : NULL;
+    if (log->data == NULL || fseek(fp, 0, SEEK_SET) != 0 || fread(log->data, len, 1, fp) != 1) {
+        fprintf(stderr, "Unable to read capture %s\n", path);
+        fclose(fp);
+        tftp_capture_free(log);
+        return -1;
+    }
+    fclose(fp);
+
+    struct tftp_capture_header header;
+    memcpy(&header, log->data, (size_t)len < sizeof(header) ? (size_t)len : sizeof(header));
+    if ((size_t)len < sizeof(header) || memcmp(header.magic, TFTP_CAPTURE_MAGIC, sizeof(TFTP_CAPTURE_MAGIC)) != 0 ||
+        header.version != TFTP_CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        tftp_capture_free(log);
+        return -1;
+    }
+
+    // Every record is at least its header long, which bounds the count
+    size_t max_count = (len - sizeof(header)) / sizeof(struct tftp_capture_record);
+    log->datagrams = calloc(max_count ? max_count : 1, sizeof(*log->datagrams));
+    if (log->datagrams == NULL) {
+        perror("unable to allocate capture");
+        tftp_capture_free(log);
+        return -1;
+    }
+
+    size_t pos = sizeof(header);
+    while (pos + sizeof(struct tftp_capture_record) <= (size_t)len) {
+        struct tftp_capture_record rec;
+        memcpy(&rec, log->data + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if (rec.len > (size_t)len - pos) {
+            break;
+        }
+
+        log->datagrams[log->count++] = (struct tftp_capture_datagram) {
+            .time_ns = rec.time_ns,
+            .uplink = rec.uplink,
+            .len = rec.len,
+            .buf = log->data + pos
+        };
+        pos += rec.len;
+    }
+    if (pos != (size_t)len) {
+        fprintf(stderr, "Capture %s cut short after %zu datagrams\n", path, log->count);
+    }
+    return 0;
+}
+
+void tftp_capture_free(struct tftp_capture_log *log)
+{
+    free(log->datagrams);
+    free(log->data);
+    memset(log, 0, sizeof(*log));
+}
+
+// How far a transfer went in one direction: the furthest block per opcode, -1 before the first
+struct progress {
+    int64_t block[TFTP_OACK + 1];
+};
+
+struct replay {
+    int sfd;
+    struct sockaddr_un *peer_addr;
+    socklen_t *peer_len;
+    struct tftp_replay_stats *stats;
+    struct progress seen; // what the system under test sent
+};
+
+static int opcode_of(const uint8_t *buf, size_t len)
+{
+    return len >= 2 && buf[0] == 0 && buf[1] <= TFTP_OACK ? buf[1] : 0;
+}
+
+/*
+    Takes a datagram into p, block numbers unwrapped from 16 bits past the last one seen.
+    Returns 1 if it got further than any before it, 0 for a retransmission.
+*/
+static int advance(struct progress *p, const uint8_t *buf, size_t len)
+{
+    int opcode = opcode_of(buf, len);
+    uint16_t block = len >= 4 && (opcode == TFTP_DATA || opcode == TFTP_ACK) ? (buf[2] << 8) | buf[3] : 0;
+    int64_t last = p->block[opcode];
+    int64_t unwrapped = last < 0 ? block : last + (int16_t)(block - (uint16_t)last);
+
+    if (last >= 0 && unwrapped <= last) {
+        return 0;
+    }
+    p->block[opcode] = unwrapped;
+    return 1;
+}
+
+/*
+    Takes in whatever the system under test sent, waiting up to timeout_ms for the first
+    datagram (0 = only what is queued). Returns the number of datagrams, -1 on failure.
+*/
+static int receive(struct replay *r, int timeout_ms)
+{
+    static uint8_t buf[MAX_BLKSIZE + DATA_HDR_LEN];
+
+    if (timeout_ms > 0) {
+        struct pollfd pfd = { .fd = r->sfd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready <= 0) {
+            if (ready < 0 && errno != EINTR) {
+                perror("poll failed");
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    int count = 0;
+    for (;;) {
+        struct sockaddr_un src_addr;
+        socklen_t src_len = sizeof(src_addr);
+        ssize_t len = recvfrom(r->sfd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&src_addr, &src_len);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return count;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recvfrom failed");
+            return -1;
+        }
+
+        // Answer whoever sent last, the system under test may use a transfer ID
+        if (src_len > sizeof(sa_family_t)) {
+            *r->peer_addr = src_addr;
+            *r->peer_len = src_len;
+        }
+        advance(&r->seen, buf, len);
+        r->stats->received++;
+        count++;
+    }
+}
+
+// Sends one datagram of the capture, taking in what arrives while the peer's queue is full
+static int send_datagram(struct replay *r, const struct tftp_capture_datagram *d, int wait_ms)
+{
+    uint64_t deadline = monotonic_ns() + (uint64_t)wait_ms * 1000000;
+
+    // Nobody to send to before the system under test sent its RRQ
+    while (*r->peer_len == 0) {
+        if (monotonic_ns() >= deadline) {
+            fprintf(stderr, "Nothing to replay the capture to\n");
+            return -1;
+        }
+        if (receive(r, 1) < 0) {
+            return -1;
+        }
+    }
+
+    while (sendto(r->sfd, d->buf, d->len, MSG_DONTWAIT, (struct sockaddr *)r->peer_addr, *r->peer_len) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("sendto failed");
+            return -1;
+        }
+        if (receive(r, 1) < 0) {
+            return -1;
+        }
+    }
+    r->stats->sent++;
+    r->stats->bytes_sent += d->len;
+    return 0;
+}
+
+/*
+    Plays one side of a capture to the system under test on sfd, the other end of a transfer.
+    peer_addr is where it listens, or (peer_len 0) learned from its first datagram, and is
+    updated to whatever address it answers from. A datagram of the capture that the system
+    under test doesn't send within the wait counts as diverged and the replay goes on. After
+    the last datagram, what it still sends is taken in until it goes quiet, outside of the
+    elapsed time. Returns 0 on success, -1 on failure.
+*/
+int tftp_replay_run(int sfd, struct sockaddr_un *peer_addr, socklen_t *peer_len, const struct tftp_capture_log *log,
+                    const struct tftp_replay_config *config, struct tftp_replay_stats *stats)
+{
+    struct replay r = { .sfd = sfd, .peer_addr = peer_addr, .peer_len = peer_len, .stats = stats };
+    struct progress expected;
+    int wait_ms = config->wait_ms > 0 ? config->wait_ms : TFTP_REPLAY_WAIT_MS;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&r.seen, 0xff, sizeof(r.seen));
+    memset(&expected, 0xff, sizeof(expected));
+
+    uint64_t start = monotonic_ns();
+    uint64_t first_ns = log->count > 0 ? log->datagrams[0].time_ns : 0;
+    for (size_t i = 0; i < log->count; i++) {
+        const struct tftp_capture_datagram *d = &log->datagrams[i];
+
+        // The system under test sent this one: wait until it got as far, unless it's a retransmission
+        if (!d->uplink != !config->uplink) {
+            int opcode = opcode_of(d->buf, d->len);
+            if (!advance(&expected, d->buf, d->len)) {
+                continue;
+            }
+
+            uint64_t deadline = monotonic_ns() + (uint64_t)wait_ms * 1000000;
+            while (r.seen.block[opcode] < expected.block[opcode]) {
+                if (monotonic_ns() >= deadline) {
+                    stats->diverged++;
+                    break;
+                }
+                if (receive(&r, wait_ms) < 0) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        if (config->timed) {
+            uint64_t due = start + (d->time_ns - first_ns);
+            for (uint64_t now = monotonic_ns(); now < due; now = monotonic_ns()) {
+                if (receive(&r, (due - now + 999999) / 1000000) < 0) {
+                    return -1;
+                }
+            }
+        }
+
+        // Take in what the system under test sent meanwhile, so it never blocks on a full queue
+        if (receive(&r, 0) < 0 || send_datagram(&r, d, wait_ms) == -1) {
+            return -1;
+        }
+    }
+
+    stats->elapsed_ns = monotonic_ns() - start;
+
+    // The system under test may still be sending into a full queue, drain it until it is done
+    int received;
+    while ((received = receive(&r, TFTP_REPLAY_LINGER_MS)) > 0) {
+    }
+    return received < 0 ? -1 : 0;
+}
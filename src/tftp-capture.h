@@ -0,0 +1,89 @@
+#ifndef TFTP_CAPTURE_H
+#define TFTP_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+    Captures of the datagrams a transfer exchanged, and their replay against one end alone.
+
+    The link emulator records every datagram it delivers to either end (`link-emulator -w`),
+    with the time it was delivered, so a capture holds exactly what each end received: after
+    the loss, duplication and reordering of the link. One transfer per capture.
+
+    A replay plays one side of a capture against the other end of a live transfer, the system
+    under test, on its socket. It sends the recorded datagrams of its side in order and, before
+    going past a datagram the system under test sent in the capture, waits for it to send the
+    same (or a later) one. A retransmission in the capture is not waited for, so neither is the
+    timer that caused it. The same datagrams therefore reach the system under test in the
+    same order as in the capture, either as fast as it keeps up or with the recorded gaps.
+*/
+
+#define TFTP_CAPTURE_MAGIC "TFTPCAP"
+#define TFTP_CAPTURE_VERSION 1
+#define TFTP_REPLAY_WAIT_MS 5000 // default wait for a datagram the capture expects, longer than a timeout
+#define TFTP_REPLAY_LINGER_MS 100 // the system under test is done once quiet for this long
+
+struct tftp_capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+// Each is followed by len bytes of datagram
+struct tftp_capture_record {
+    uint64_t time_ns; // since the capture started
+    uint32_t len;
+    uint8_t uplink;   // ground station -> satellite: the RRQ and ACKs
+    uint8_t pad[3];
+};
+
+// A capture being written
+struct tftp_capture {
+    FILE *fp;
+    uint64_t start_ns;
+    uint64_t datagrams;
+};
+
+struct tftp_capture_datagram {
+    uint64_t time_ns;
+    int uplink;
+    size_t len;
+    const uint8_t *buf; // into the loaded capture
+};
+
+// A capture loaded into memory
+struct tftp_capture_log {
+    struct tftp_capture_datagram *datagrams;
+    size_t count;
+    uint8_t *data;
+};
+
+struct tftp_replay_config {
+    int uplink;  // play the ground station's side against a satellite, else the satellite's against a ground station
+    int timed;   // keep the recorded gaps between datagrams instead of going as fast as the peer keeps up
+    int wait_ms; // give up waiting for a datagram the capture expects after this long, 0 = TFTP_REPLAY_WAIT_MS
+};
+
+struct tftp_replay_stats {
+    uint64_t sent;
+    uint64_t received;
+    uint64_t bytes_sent;
+    uint64_t diverged; // datagrams of the capture the system under test never sent
+    uint64_t elapsed_ns;
+};
+
+// Public interface
+int tftp_capture_open(struct tftp_capture *c, const char *path);
+int tftp_capture_write(struct tftp_capture *c, int uplink, const uint8_t *buf, size_t len);
+int tftp_capture_close(struct tftp_capture *c);
+
+int tftp_capture_load(struct tftp_capture_log *log, const char *path);
+void tftp_capture_free(struct tftp_capture_log *log);
+
+int tftp_replay_run(int sfd, struct sockaddr_un *peer_addr, socklen_t *peer_len, const struct tftp_capture_log *log,
+                    const struct tftp_replay_config *config, struct tftp_replay_stats *stats);
+
+#endif // TFTP_CAPTURE_H
@@ -0,0 +1,139 @@
+/*
+    zlib transforms for a compressed transfer, see tftp-compress.h.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "tftp-compress.h"
+
+static int deflate_transform(void *ctx, const uint8_t *in, size_t *in_len, uint8_t *out, size_t *out_len, int final)
+{
+    z_stream *z = ctx;
+
+    z->next_in = (Bytef *)in;
+    z->avail_in = *in_len;
+    z->next_out = out;
+    z->avail_out = *out_len;
+    int ret = deflate(z, final ? Z_FINISH : Z_NO_FLUSH);
+    *in_len -= z->avail_in;
+    *out_len -= z->avail_out;
+
+    if (ret == Z_STREAM_END) {
+        return 1;
+    }
+    return ret == Z_OK || ret == Z_BUF_ERROR ? 0 : -1;
+}
+
+// Input past the end of the stream, or a stream that ends early, fails the sink stage
+static int inflate_transform(void *ctx, const uint8_t *in, size_t *in_len, uint8_t *out, size_t *out_len, int final)
+{
+    z_stream *z = ctx;
+    (void)final;
+
+    z->next_in = (Bytef *)in;
+    z->avail_in = *in_len;
+    z->next_out = out;
+    z->avail_out = *out_len;
+    int ret = inflate(z, Z_NO_FLUSH);
+    *in_len -= z->avail_in;
+    *out_len -= z->avail_out;
+
+    if (ret == Z_STREAM_END) {
+        return 1;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        fprintf(stderr, "Unable to inflate the file: %s\n", z->msg != NULL ? z->msg : "corrupt stream");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Deflates upstream at level, read front to back. Returns the source to send instead of
+    upstream, NULL on failure.
+*/
+const struct tftp_source *tftp_compress_source(struct tftp_compressor *c, const struct tftp_source *upstream,
+                                               int level)
+{
+    memset(&c->z, 0, sizeof(c->z));
+    if (deflateInit(&c->z, level) != Z_OK) {
+        fprintf(stderr, "Unable to start compression at level %d\n", level);
+        return NULL;
+    }
+    c->started = 1;
+
+    tftp_transform_source(&c->source, &c->stage, deflate_transform, &c->z, upstream);
+    return &c->source;
+}
+
+void tftp_compressor_end(struct tftp_compressor *c)
+{
+    if (c->started) {
+        deflateEnd(&c->z);
+        c->started = 0;
+    }
+}
+
+static int decompress_write(void *ctx, uint64_t offset, struct iovec *iovs, int iov_count)
+{
+    struct tftp_decompressor *d = ctx;
+    struct tftp_sink *next = d->level ? &d->inflated : d->downstream;
+    return next->write(next->ctx, offset, iovs, iov_count);
+}
+
+// A compressed file has no size up front, only a plain one is ever mapped
+static uint8_t *decompress_map(void *ctx, uint64_t size)
+{
+    struct tftp_decompressor *d = ctx;
+    return !d->level && d->downstream->map != NULL ? d->downstream->map(d->downstream->ctx, size) : NULL;
+}
+
+// The inflating stage reports the progress of what it inflated itself
+static void decompress_progress(void *ctx, uint64_t length)
+{
+    struct tftp_decompressor *d = ctx;
+    if (!d->level && d->downstream->progress != NULL) {
+        d->downstream->progress(d->downstream->ctx, length);
+    }
+}
+
+static int decompress_close(void *ctx, int complete)
+{
+    struct tftp_decompressor *d = ctx;
+    struct tftp_sink *next = d->level ? &d->inflated : d->downstream;
+    return next->close != NULL ? next->close(next->ctx, complete) : 0;
+}
+
+/*
+    Puts d in front of downstream, which is closed along with it. The receiving session sets
+    d->level from the OACK. Returns the sink to receive into, NULL on failure.
+*/
+struct tftp_sink *tftp_decompress_sink(struct tftp_decompressor *d, struct tftp_sink *downstream)
+{
+    d->level = 0;
+    d->downstream = downstream;
+    memset(&d->z, 0, sizeof(d->z));
+    if (inflateInit(&d->z) != Z_OK) {
+        fprintf(stderr, "Unable to start decompression\n");
+        return NULL;
+    }
+    d->started = 1;
+
+    tftp_transform_sink(&d->inflated, &d->stage, inflate_transform, &d->z, downstream);
+    d->sink = (struct tftp_sink) {
+        .write = decompress_write,
+        .map = decompress_map,
+        .progress = decompress_progress,
+        .close = decompress_close,
+        .fd = -1,
+        .ctx = d
+    };
+    return &d->sink;
+}
+
+void tftp_decompressor_end(struct tftp_decompressor *d)
+{
+    if (d->started) {
+        inflateEnd(&d->z);
+        d->started = 0;
+    }
+}
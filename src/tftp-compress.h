@@ -0,0 +1,53 @@
+#ifndef TFTP_COMPRESS_H
+#define TFTP_COMPRESS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include "tftp-io.h"
+
+/*
+    Compression of the file in flight, negotiated with the "compress" option of the RRQ.
+
+    The value is a zlib level, 1 (fast, TFTP_COMPRESS_FAST) to 9 (smallest, TFTP_COMPRESS_BEST).
+    A satellite that can compress answers with the level it uses in the OACK, one that can't
+    leaves the option out and the file goes out as is (RFC 2347). A compressed file is a zlib
+    stream, deflated block by block as the window moves over the file and inflated as it
+    arrives, so neither side ever holds a compressed copy of the whole file.
+
+    The compressed size is only known once the file was deflated, so a compressed file goes out
+    without a tsize and always from its start: a satellite asked to resume sends it as is.
+*/
+
+// A satellite deflating the file it sends
+struct tftp_compressor {
+    z_stream z;
+    int started;
+    struct tftp_source plain;  // the file, when the session sends a buffer
+    struct tftp_source source; // what the session reads instead
+    struct tftp_transform_stage stage;
+};
+
+/*
+    A ground station sink that inflates the file before handing it to downstream, if the
+    satellite agreed to compress it. Until then, and if it didn't, it hands the file on as is.
+*/
+struct tftp_decompressor {
+    int level;           // what the satellite compresses at, 0 = not compressed
+    struct tftp_sink sink;
+    struct tftp_sink *downstream;
+    z_stream z;
+    int started;
+    struct tftp_sink inflated;
+    struct tftp_transform_stage stage;
+};
+
+// Public interface
+const struct tftp_source *tftp_compress_source(struct tftp_compressor *c, const struct tftp_source *upstream,
+                                               int level);
+void tftp_compressor_end(struct tftp_compressor *c);
+
+struct tftp_sink *tftp_decompress_sink(struct tftp_decompressor *d, struct tftp_sink *downstream);
+void tftp_decompressor_end(struct tftp_decompressor *d);
+
+#endif // TFTP_COMPRESS_H
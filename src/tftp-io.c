@@ -0,0 +1,589 @@
+/*
+    Sources and sinks of a transfer, see tftp-io.h.
+*/
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tftp-io.h"
+#include "tftp-log.h"
+
+// Places a payload at offset in a mapping, unless it was received right there
+void tftp_place(uint8_t *map, uint64_t offset, const uint8_t *payload, size_t len)
+{
+    uint8_t *dest = map + offset;
+    if (payload != dest && len > 0) {
+        memmove(dest, payload, len);
+    }
+}
+
+// Copies what a source holding all of its data has at offset
+static ssize_t data_read(void *ctx, uint64_t offset, uint8_t *buf, size_t len)
+{
+    const struct tftp_source *src = ctx;
+
+    if (offset >= src->size) {
+        return 0;
+    }
+    if (len > src->size - offset) {
+        len = src->size - offset;
+    }
+    memcpy(buf, src->data + offset, len);
+    return len;
+}
+
+// A source sending len bytes of buf, which have to stay where they are, as does src itself
+void tftp_memory_source(struct tftp_source *src, const uint8_t *buf, size_t len)
+{
+    *src = (struct tftp_source) { .read = data_read, .data = buf, .size = len, .ctx = src };
+}
+
+/*
+    A source sending the file at path out of a read-only mapping of it, released again with
+    tftp_mmap_source_close(). Returns 0 on success, -1 on failure.
+*/
+int tftp_mmap_source(struct tftp_source *src, const char *path, const char *log_prefix)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s Unable to open %s: %s\n", log_prefix, path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat failed");
+        close(fd);
+        return -1;
+    }
+
+    // mmap refuses empty mappings, an empty file is just a single empty DATA block
+    uint8_t *buf = NULL;
+    if (st.st_size > 0) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (buf == MAP_FAILED) {
+            perror("mmap failed");
+            close(fd);
+            return -1;
+        }
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    tftp_memory_source(src, buf, st.st_size);
+    return 0;
+}
+
+void tftp_mmap_source_close(struct tftp_source *src)
+{
+    if (src->data != NULL) {
+        munmap((uint8_t *)src->data, src->size);
+        src->data = NULL;
+    }
+}
+
+// Reads len bytes at offset from a file, fewer only at its end
+static ssize_t fd_read(void *ctx, uint64_t offset, uint8_t *buf, size_t len)
+{
+    int fd = (int)(intptr_t)ctx;
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Reads the next len bytes of a pipe or socket, which has no offsets, fewer only at its end
+static ssize_t stream_read(void *ctx, uint64_t offset, uint8_t *buf, size_t len)
+{
+    int fd = (int)(intptr_t)ctx;
+    size_t done = 0;
+    (void)offset;
+
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/*
+    A source reading fd as the window reaches its blocks: a regular file with pread, anything
+    else (a pipe from a generator, a socket) front to back until it ends, without a size.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_file_source(struct tftp_source *src, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat failed");
+        return -1;
+    }
+
+    int regular = S_ISREG(st.st_mode);
+    *src = (struct tftp_source) {
+        .read = regular ? fd_read : stream_read,
+        .size = regular ? (uint64_t)st.st_size : TFTP_SIZE_UNKNOWN,
+        .ctx = (void *)(intptr_t)fd
+    };
+    return 0;
+}
+
+/*
+    Runs the transform of a source stage into its output buffer, reading input from upstream a
+    buffer at a time. Returns 0 on success, -1 on failure.
+*/
+static int stage_fill(struct tftp_transform_stage *stage)
+{
+    if (stage->in_len == 0 && !stage->input_done) {
+        ssize_t n = stage->upstream->read(stage->upstream->ctx, stage->in_pos, stage->in_buf, TRANSFORM_BUF_LEN);
+        if (n < 0) {
+            return -1;
+        }
+        stage->in_pos += n;
+        stage->in_start = 0;
+        stage->in_len = n;
+        stage->input_done = n < TRANSFORM_BUF_LEN;
+    }
+
+    size_t in_len = stage->in_len;
+    size_t out_len = TRANSFORM_BUF_LEN;
+    int status = stage->transform(stage->transform_ctx, stage->in_buf + stage->in_start, &in_len,
+                                  stage->out_buf, &out_len, stage->input_done);
+    if (status < 0 || (status == 0 && in_len == 0 && out_len == 0 && (stage->in_len > 0 || stage->input_done))) {
+        return -1;
+    }
+
+    stage->in_start += in_len;
+    stage->in_len -= in_len;
+    stage->out_start = 0;
+    stage->out_len = out_len;
+    stage->finished = status == 1;
+    return 0;
+}
+
+// Reads the next output of a transform, which only ever moves forward
+static ssize_t transform_read(void *ctx, uint64_t offset, uint8_t *buf, size_t len)
+{
+    struct tftp_transform_stage *stage = ctx;
+
+    if (offset != stage->out_pos) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        if (stage->out_len == 0) {
+            if (stage->finished) {
+                break;
+            }
+            if (stage_fill(stage) == -1) {
+                return -1;
+            }
+        }
+
+        size_t n = stage->out_len < len - done ? stage->out_len : len - done;
+        memcpy(buf + done, stage->out_buf + stage->out_start, n);
+        stage->out_start += n;
+        stage->out_len -= n;
+        done += n;
+    }
+    stage->out_pos += done;
+    return done;
+}
+
+/*
+    A source sending what transform makes of upstream, read front to back. Its size is unknown
+    until the transform finished, so the file goes out without a tsize.
+*/
+void tftp_transform_source(struct tftp_source *src, struct tftp_transform_stage *stage, tftp_transform_fn transform,
+                           void *transform_ctx, const struct tftp_source *upstream)
+{
+    memset(stage, 0, offsetof(struct tftp_transform_stage, in_buf));
+    stage->transform = transform;
+    stage->transform_ctx = transform_ctx;
+    stage->upstream = upstream;
+
+    *src = (struct tftp_source) { .read = transform_read, .size = TFTP_SIZE_UNKNOWN, .ctx = stage };
+}
+
+static int fd_write(void *ctx, uint64_t offset, struct iovec *iovs, int iov_count)
+{
+    return tftp_write_all((int)(intptr_t)ctx, iovs, &iov_count, offset);
+}
+
+// A sink writing to the file fd with pwritev, the file stays open
+void tftp_fd_sink(struct tftp_sink *sink, int fd)
+{
+    *sink = (struct tftp_sink) { .write = fd_write, .fd = fd, .ctx = (void *)(intptr_t)fd };
+}
+
+static int memory_write(void *ctx, uint64_t offset, struct iovec *iovs, int iov_count)
+{
+    struct tftp_memory *mem = ctx;
+
+    for (int i = 0; i < iov_count; i++) {
+        if (offset > mem->capacity || iovs[i].iov_len > mem->capacity - offset) {
+            errno = ENOSPC;
+            return -1;
+        }
+        memcpy(mem->buf + offset, iovs[i].iov_base, iovs[i].iov_len);
+        offset += iovs[i].iov_len;
+    }
+    return 0;
+}
+
+// A file that fits is received straight into the buffer
+static uint8_t *memory_map(void *ctx, uint64_t size)
+{
+    struct tftp_memory *mem = ctx;
+    return size <= mem->capacity ? mem->buf : NULL;
+}
+
+static void memory_progress(void *ctx, uint64_t length)
+{
+    struct tftp_memory *mem = ctx;
+    mem->length = length;
+}
+
+// A sink receiving into capacity bytes of buf, mem->length tells how many arrived
+void tftp_memory_sink(struct tftp_sink *sink, struct tftp_memory *mem, uint8_t *buf, size_t capacity)
+{
+    *mem = (struct tftp_memory) { .buf = buf, .capacity = capacity, .length = 0 };
+    *sink = (struct tftp_sink) {
+        .write = memory_write,
+        .map = memory_map,
+        .progress = memory_progress,
+        .fd = -1,
+        .ctx = mem
+    };
+}
+
+static int image_write(void *ctx, uint64_t offset, struct iovec *iovs, int iov_count)
+{
+    struct tftp_image *image = ctx;
+    return tftp_write_all(image->fd, iovs, &iov_count, offset);
+}
+
+static uint8_t *image_map(void *ctx, uint64_t size)
+{
+    struct tftp_image *image = ctx;
+    return tftp_image_map(image, size, image->log_prefix) == 0 ? image->map : NULL;
+}
+
+static void image_progress(void *ctx, uint64_t length)
+{
+    tftp_image_progress(ctx, length);
+}
+
+static int image_close(void *ctx, int complete)
+{
+    return tftp_image_close(ctx, complete);
+}
+
+// A sink receiving into an image opened with tftp_image_open(), closing it in the end
+void tftp_image_sink(struct tftp_sink *sink, struct tftp_image *image)
+{
+    *sink = (struct tftp_sink) {
+        .write = image_write,
+        .map = image_map,
+        .progress = image_progress,
+        .close = image_close,
+        .fd = image->fd,
+        .ctx = image
+    };
+}
+
+// Writes what the transform of a sink stage produced so far to downstream
+static int stage_flush(struct tftp_transform_stage *stage)
+{
+    if (stage->out_len == 0) {
+        return 0;
+    }
+
+    struct iovec iov = { .iov_base = stage->out_buf, .iov_len = stage->out_len };
+    if (stage->downstream->write(stage->downstream->ctx, stage->out_pos, &iov, 1) == -1) {
+        return -1;
+    }
+    stage->out_pos += stage->out_len;
+    stage->out_len = 0;
+    if (stage->downstream->progress != NULL) {
+        stage->downstream->progress(stage->downstream->ctx, stage->out_pos);
+    }
+    return 0;
+}
+
+// Feeds len bytes of in to the transform of a sink stage, or only the end of the input
+static int stage_consume(struct tftp_transform_stage *stage, const uint8_t *in, size_t len, int final)
+{
+    while ((len > 0 || final) && !stage->finished) {
+        size_t in_len = len;
+        size_t out_len = TRANSFORM_BUF_LEN - stage->out_len;
+        int status = stage->transform(stage->transform_ctx, in, &in_len, stage->out_buf + stage->out_len, &out_len,
+                                      final);
+        if (status < 0) {
+            return -1;
+        }
+
+        // Out of room for the next output, make some
+        if (status == 0 && in_len == 0 && out_len == 0) {
+            if (stage->out_len == 0 || stage_flush(stage) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        in += in_len;
+        len -= in_len;
+        stage->in_pos += in_len;
+        stage->out_len += out_len;
+        stage->finished = status == 1;
+    }
+    return len > 0 ? -1 : 0;
+}
+
+// Payloads arrive in order, a transform cannot pick up where an earlier retrieval stopped
+static int transform_write(void *ctx, uint64_t offset, struct iovec *iovs, int iov_count)
+{
+    struct tftp_transform_stage *stage = ctx;
+
+    if (offset != stage->in_pos) {
+        errno = ESPIPE;
+        return -1;
+    }
+    for (int i = 0; i < iov_count; i++) {
+        if (stage_consume(stage, iovs[i].iov_base, iovs[i].iov_len, 0) == -1) {
+            return -1;
+        }
+    }
+    return stage_flush(stage);
+}
+
+// Ends the transform of a complete file, then closes downstream
+static int transform_close(void *ctx, int complete)
+{
+    struct tftp_transform_stage *stage = ctx;
+    int result = 0;
+
+    if (complete && (stage_consume(stage, NULL, 0, 1) == -1 || stage_flush(stage) == -1)) {
+        result = -1;
+    }
+    if (stage->downstream->close != NULL && stage->downstream->close(stage->downstream->ctx, complete && result == 0) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+/*
+    A sink handing what transform makes of the received file to downstream, which is closed
+    along with it. The transfer has to start at byte 0.
+*/
+void tftp_transform_sink(struct tftp_sink *sink, struct tftp_transform_stage *stage, tftp_transform_fn transform,
+                         void *transform_ctx, struct tftp_sink *downstream)
+{
+    memset(stage, 0, offsetof(struct tftp_transform_stage, in_buf));
+    stage->transform = transform;
+    stage->transform_ctx = transform_ctx;
+    stage->downstream = downstream;
+
+    *sink = (struct tftp_sink) { .write = transform_write, .close = transform_close, .fd = -1, .ctx = stage };
+}
+
+/*
+    Saves the received length in the image's checkpoint, along with the size of the file.
+    Returns 0 on success, -1 on failure.
+*/
+static int save_checkpoint(struct tftp_image *image)
+{
+    FILE *fp = fopen(image->checkpoint_path, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    // The image itself has to hold what the checkpoint claims, fdatasync covers the mapping too
+    int result = fdatasync(image->fd) == 0 && fprintf(fp, "%llu %llu\n", (unsigned long long)image->length,
+                 (unsigned long long)(image->tsize == TFTP_SIZE_UNKNOWN ? 0 : image->tsize)) > 0 ? 0 : -1;
+    if (fclose(fp) != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        image->saved = image->length;
+    }
+    return result;
+}
+
+/*
+    Opens the image at path for a retrieval. When a checkpoint of an interrupted retrieval is
+    next to it, the image is kept and opts->offset asks the satellite to resume where it ended,
+    provided the satellite still announces the size in the checkpoint (opts->resume_tsize).
+    Otherwise the image starts out empty. opts->tsize asks for the size to map the image with,
+    and opts->announced has it kept for the checkpoint.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_image_open(struct tftp_image *image, const char *path, struct tftp_options *opts, const char *log_prefix)
+{
+    unsigned long long checkpoint = 0, checkpoint_tsize = 0;
+
+    image->map = NULL;
+    image->map_len = 0;
+    image->map_tried = 0;
+    image->sync = opts->sync;
+    image->log_prefix = log_prefix;
+
+    snprintf(image->checkpoint_path, sizeof(image->checkpoint_path), "%s%s", path, CHECKPOINT_SUFFIX);
+    FILE *fp = fopen(image->checkpoint_path, "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%llu %llu", &checkpoint, &checkpoint_tsize) < 1) {
+            checkpoint = 0;
+        }
+        fclose(fp);
+    }
+
+    // Without the size of its file nothing tells whether the satellite still has that file
+    if (checkpoint > 0 && (checkpoint_tsize == 0 || checkpoint > checkpoint_tsize)) {
+        TFTP_INFO("%s Checkpoint of %s has no file size, starting over\n", log_prefix, path);
+        checkpoint = 0;
+    }
+
+    // Read access too, a shared mapping that can be written needs it
+    image->fd = open(path, O_RDWR | O_CREAT | (checkpoint > 0 ? 0 : O_TRUNC), 0644);
+    if (image->fd == -1) {
+        perror("unable to allocate space for new image");
+        return -1;
+    }
+
+    // Never trust the checkpoint beyond what actually made it into the image
+    struct stat st;
+    if (checkpoint > 0 && fstat(image->fd, &st) == 0 && checkpoint > (unsigned long long)st.st_size) {
+        checkpoint = st.st_size;
+    }
+    if (checkpoint > 0) {
+        TFTP_INFO("%s Resuming %s from byte %llu\n", log_prefix, path, checkpoint);
+    }
+
+    image->length = checkpoint;
+    image->saved = checkpoint;
+    image->resume_tsize = checkpoint > 0 ? checkpoint_tsize : TFTP_SIZE_UNKNOWN;
+    image->tsize = image->resume_tsize;
+    opts->offset = checkpoint;
+    opts->tsize = 1;
+    opts->resume_tsize = checkpoint > 0 ? checkpoint_tsize : 0;
+    opts->announced = &image->tsize;
+    return 0;
+}
+
+/*
+    Preallocates the image for a file of size bytes and maps all of it, once per retrieval.
+    Returns 0 if the image is mapped, -1 if it keeps being written with pwrite.
+*/
+int tftp_image_map(struct tftp_image *image, uint64_t size, const char *log_prefix)
+{
+    if (image->map_tried) {
+        return image->map != NULL ? 0 : -1;
+    }
+    image->map_tried = 1;
+
+    // mmap refuses empty mappings, and an empty file has nothing to place anyway
+    if (size == 0 || size > SIZE_MAX) {
+        return -1;
+    }
+
+    // Allocate all blocks at once instead of growing the file one payload at a time
+    int err = posix_fallocate(image->fd, 0, size);
+    if (err != 0 && ftruncate(image->fd, size) == -1) {
+        fprintf(stderr, "%s Unable to preallocate %llu bytes: %s\n", log_prefix,
+                (unsigned long long)size, strerror(err));
+        return -1;
+    }
+
+    uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("unable to map image");
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    image->map = map;
+    image->map_len = size;
+    return 0;
+}
+
+// Records that the first length bytes of the image were received, saved every CHECKPOINT_INTERVAL bytes
+void tftp_image_progress(struct tftp_image *image, uint64_t length)
+{
+    image->length = length;
+    if (image->length - image->saved >= CHECKPOINT_INTERVAL && save_checkpoint(image) == -1) {
+        perror("unable to save checkpoint");
+    }
+}
+
+/*
+    Closes the image. A complete one is cut to the received length and its checkpoint removed,
+    an incomplete one keeps a checkpoint for the next retrieval to resume from, unless the
+    satellite turned out to have another file than the checkpoint's.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_image_close(struct tftp_image *image, int complete)
+{
+    int result = 0;
+
+    if (complete) {
+        if (ftruncate(image->fd, image->length) == -1) {
+            perror("unable to truncate image");
+            result = -1;
+        }
+        if (image->sync == TFTP_SYNC_MSYNC && image->map != NULL) {
+            if (msync(image->map, image->map_len, MS_SYNC) == -1) {
+                perror("unable to msync image");
+                result = -1;
+            }
+        } else if (image->sync != TFTP_SYNC_NONE && fdatasync(image->fd) == -1) {
+            perror("unable to fdatasync image");
+            result = -1;
+        }
+        unlink(image->checkpoint_path);
+    } else if (image->resume_tsize != TFTP_SIZE_UNKNOWN && image->tsize != image->resume_tsize) {
+        TFTP_INFO("%s Satellite's file changed since the checkpoint, the next retrieval starts over\n",
+                  image->log_prefix);
+        unlink(image->checkpoint_path);
+    } else if (image->length > 0 && save_checkpoint(image) == -1) {
+        perror("unable to save checkpoint");
+        result = -1;
+    }
+
+    if (image->map != NULL) {
+        munmap(image->map, image->map_len);
+        image->map = NULL;
+    }
+    close(image->fd);
+    image->fd = -1;
+    return result;
+}
+
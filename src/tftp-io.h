@@ -0,0 +1,142 @@
+#ifndef TFTP_IO_H
+#define TFTP_IO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "tftp.h"
+
+/*
+    Where a transfer gets its data from and where it delivers it.
+
+    A source is what the satellite sends. One that holds all of its data in memory (a buffer or
+    a file mapping) sets data, and DATA packets point straight into it. Any other source is
+    read block by block through its read callback, and the session keeps a window of blocks
+    around for retransmissions, so a source is read once, front to back.
+
+    A sink is what the ground station receives into. Payloads are handed to its write callback
+    at their offset in the file. A sink that can map the whole file once the satellite announced
+    its size returns the mapping from map, and payloads are placed right there instead.
+
+    Transforms sit between a source or sink and the next one, and may change the length of the
+    data, like a compressor would.
+*/
+
+#define TFTP_SIZE_UNKNOWN UINT64_MAX
+
+struct tftp_source {
+    /*
+        Fills buf with len bytes at offset, fewer only where the data ends. Every read picks up
+        where the last one ended. Returns the number of bytes read, -1 on failure.
+    */
+    ssize_t (*read)(void *ctx, uint64_t offset, uint8_t *buf, size_t len);
+    const uint8_t *data; // all of the data, NULL if it has to be read
+    uint64_t size;       // TFTP_SIZE_UNKNOWN if only the end of the data tells
+    void *ctx;
+};
+
+struct tftp_sink {
+    // Writes all of iovs at offset, may modify iovs. Returns 0 on success, -1 on failure.
+    int (*write)(void *ctx, uint64_t offset, struct iovec *iovs, int iov_count);
+    // Optional: the whole file for payloads to be placed into, or NULL
+    uint8_t *(*map)(void *ctx, uint64_t size);
+    // Optional: the first length bytes are in place
+    void (*progress)(void *ctx, uint64_t length);
+    // Optional: the transfer is over. Returns 0 on success, -1 on failure.
+    int (*close)(void *ctx, int complete);
+    int fd;              // file the writes go to, for transports that write on their own, or -1
+    void *ctx;
+};
+
+/*
+    Turns in_len bytes of in into at most out_len bytes of out, setting both to how much was
+    consumed and produced. All of in is consumed unless out is (nearly) full, a transform that
+    needs more input at once keeps it itself. final is set once no more input follows, and the
+    transform returns 1 once it produced all of its output. Returns 0 or 1 on success, -1 on
+    failure.
+*/
+typedef int (*tftp_transform_fn)(void *ctx, const uint8_t *in, size_t *in_len, uint8_t *out, size_t *out_len,
+                                 int final);
+
+#define TRANSFORM_BUF_LEN (64 * 1024)
+
+// A transform together with the source or sink it reads from or writes to
+struct tftp_transform_stage {
+    tftp_transform_fn transform;
+    void *transform_ctx;
+    const struct tftp_source *upstream;
+    struct tftp_sink *downstream;
+    uint64_t in_pos;  // source: bytes read from upstream, sink: bytes written to the stage
+    uint64_t out_pos; // source: bytes read from the stage, sink: bytes written to downstream
+    int input_done;   // upstream ended
+    int finished;     // the transform produced all of its output
+    size_t in_start, in_len;   // source only: input not transformed yet
+    size_t out_start, out_len; // output not handed on yet
+    uint8_t in_buf[TRANSFORM_BUF_LEN];
+    uint8_t out_buf[TRANSFORM_BUF_LEN];
+};
+
+// Window cache of a blocking sender reading a source, holds any window a client can ask for
+#define SOURCE_CACHE_LEN ((size_t)MAX_WINDOWSIZE * MAX_BLKSIZE)
+
+// A memory buffer to receive into
+struct tftp_memory {
+    uint8_t *buf;
+    size_t capacity;
+    size_t length; // bytes received
+};
+
+/*
+    A received image. Its progress is kept in a small sidecar checkpoint next to it while the
+    transfer is incomplete, and the next retrieval resumes from there instead of from byte 0.
+    The checkpoint holds the size the satellite announced as well: a satellite announcing
+    another size (or none) has another file, that retrieval fails and the checkpoint is dropped,
+    so the next one starts over.
+
+    Once the satellite announced the size of the image it is preallocated and mapped, and every
+    payload goes straight to its place in the mapping. Without a size it is written with pwrite.
+*/
+#define RECEIVED_IMAGE_PATH "received-images/test.bmp"
+#define CHECKPOINT_SUFFIX ".resume"
+#define CHECKPOINT_INTERVAL (1024 * 1024) // bytes received between two saves of the checkpoint
+
+struct tftp_image {
+    int fd;
+    uint64_t length; // bytes at the start of the file that were received
+    uint64_t saved;  // length as last saved in the checkpoint
+    uint64_t tsize;  // size of the file the image holds the start of as the satellite announced it, 0 if it did not
+    uint64_t resume_tsize; // tsize the checkpoint was saved with, TFTP_SIZE_UNKNOWN without a checkpoint
+    uint8_t *map;    // the whole image once its size is known, NULL until then
+    uint64_t map_len;
+    int map_tried;
+    enum tftp_sync sync;
+    const char *log_prefix;
+    char checkpoint_path[MAX_FILENAME_LEN + sizeof(CHECKPOINT_SUFFIX)];
+};
+
+// Sources
+void tftp_memory_source(struct tftp_source *src, const uint8_t *buf, size_t len);
+int tftp_mmap_source(struct tftp_source *src, const char *path, const char *log_prefix);
+void tftp_mmap_source_close(struct tftp_source *src);
+int tftp_file_source(struct tftp_source *src, int fd);
+void tftp_transform_source(struct tftp_source *src, struct tftp_transform_stage *stage, tftp_transform_fn transform,
+                           void *transform_ctx, const struct tftp_source *upstream);
+
+// Sinks
+void tftp_fd_sink(struct tftp_sink *sink, int fd);
+void tftp_memory_sink(struct tftp_sink *sink, struct tftp_memory *mem, uint8_t *buf, size_t capacity);
+void tftp_image_sink(struct tftp_sink *sink, struct tftp_image *image);
+void tftp_transform_sink(struct tftp_sink *sink, struct tftp_transform_stage *stage, tftp_transform_fn transform,
+                         void *transform_ctx, struct tftp_sink *downstream);
+
+// Received image and its checkpoint
+int tftp_image_open(struct tftp_image *image, const char *path, struct tftp_options *opts, const char *log_prefix);
+int tftp_image_map(struct tftp_image *image, uint64_t size, const char *log_prefix);
+void tftp_image_progress(struct tftp_image *image, uint64_t length);
+int tftp_image_close(struct tftp_image *image, int complete);
+
+// Places a payload at offset in a mapping, unless it was received right there
+void tftp_place(uint8_t *map, uint64_t offset, const uint8_t *payload, size_t len);
+
+#endif // TFTP_IO_H
@@ -0,0 +1,33 @@
+#ifndef TFTP_LOG_H
+#define TFTP_LOG_H
+
+#include <stdio.h>
+
+/*
+    Log levels of the transfer code. Anything above TFTP_LOG_LEVEL is compiled out, so
+    per-packet messages cost nothing unless a build asks for them:
+        make LOG_LEVEL=3    # every packet
+        make LOG_LEVEL=0    # nothing but errors, which always go to stderr
+    What a transfer did is counted in its tftp_metrics instead, see tftp-metrics.h.
+*/
+
+#define TFTP_LOG_WARN  1 // a transfer failed or a packet was dropped
+#define TFTP_LOG_INFO  2 // once per transfer: negotiated options, resumes, the summary
+#define TFTP_LOG_DEBUG 3 // once per packet
+
+#ifndef TFTP_LOG_LEVEL
+#define TFTP_LOG_LEVEL TFTP_LOG_INFO
+#endif
+
+#define TFTP_LOG(level, ...) \
+    do { \
+        if ((level) <= TFTP_LOG_LEVEL) { \
+            printf(__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define TFTP_WARN(...)  TFTP_LOG(TFTP_LOG_WARN, __VA_ARGS__)
+#define TFTP_INFO(...)  TFTP_LOG(TFTP_LOG_INFO, __VA_ARGS__)
+#define TFTP_DEBUG(...) TFTP_LOG(TFTP_LOG_DEBUG, __VA_ARGS__)
+
+#endif // TFTP_LOG_H
@@ -0,0 +1,221 @@
+/*
+    Transfer metrics and their SIGUSR1 dump, see tftp-metrics.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "tftp-metrics.h"
+#include "tftp-log.h"
+
+volatile sig_atomic_t tftp_metrics_dump_requested = 0;
+static char dump_path[256];
+
+static size_t bucket_index(uint32_t value)
+{
+    if (value < TFTP_HIST_SUB_COUNT) {
+        return value;
+    }
+
+    // The top TFTP_HIST_SUB_BITS + 1 bits pick the bucket, the rest is the precision given up
+    int shift = 31 - __builtin_clz(value) - TFTP_HIST_SUB_BITS;
+    return (size_t)(shift + 1) * TFTP_HIST_SUB_COUNT + ((value >> shift) - TFTP_HIST_SUB_COUNT);
+}
+
+// Highest value that lands in bucket i
+static uint64_t bucket_value(size_t i)
+{
+    if (i < TFTP_HIST_SUB_COUNT) {
+        return i;
+    }
+
+    int shift = i / TFTP_HIST_SUB_COUNT - 1;
+    uint64_t lowest = (uint64_t)(TFTP_HIST_SUB_COUNT + i % TFTP_HIST_SUB_COUNT) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+void tftp_histogram_record(struct tftp_histogram *h, uint64_t value)
+{
+    uint32_t v = value > UINT32_MAX ? UINT32_MAX : value;
+
+    if (h->count == 0 || v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+    h->count++;
+    h->sum += v;
+    h->buckets[bucket_index(v)]++;
+}
+
+/*
+    The value at or below which percentile percent of the recorded values are, rounded up to
+    the end of its bucket and never above the largest one recorded. 0 if nothing was recorded.
+*/
+uint64_t tftp_histogram_percentile(const struct tftp_histogram *h, double percentile)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100 * h->count + 0.5);
+    rank = rank < 1 ? 1 : rank > h->count ? h->count : rank;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < TFTP_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value > h->max ? h->max : value < h->min ? h->min : value;
+        }
+    }
+    return h->max;
+}
+
+void tftp_histogram_merge(struct tftp_histogram *into, const struct tftp_histogram *h)
+{
+    if (h->count == 0) {
+        return;
+    }
+    if (into->count == 0 || h->min < into->min) {
+        into->min = h->min;
+    }
+    if (h->max > into->max) {
+        into->max = h->max;
+    }
+    into->count += h->count;
+    into->sum += h->sum;
+    for (size_t i = 0; i < TFTP_HIST_BUCKETS; i++) {
+        into->buckets[i] += h->buckets[i];
+    }
+}
+
+// Adds the counters of m to into, the earliest start stays
+void tftp_metrics_merge(struct tftp_metrics *into, const struct tftp_metrics *m)
+{
+    if (m->start_ms != 0 && (into->start_ms == 0 || m->start_ms < into->start_ms)) {
+        into->start_ms = m->start_ms;
+    }
+    into->bytes += m->bytes;
+    into->blocks += m->blocks;
+    into->retransmits += m->retransmits;
+    into->duplicates += m->duplicates;
+    into->timeouts += m->timeouts;
+    tftp_histogram_merge(&into->rtt_ms, &m->rtt_ms);
+}
+
+// Milliseconds since the transfer started, on the clock the transfer loops give their sessions
+static uint64_t elapsed_ms(const struct tftp_metrics *m)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    return m->start_ms != 0 && now_ms > m->start_ms ? now_ms - m->start_ms : 0;
+}
+
+// Writes m as one line of JSON
+void tftp_metrics_write(FILE *fp, const char *name, const struct tftp_metrics *m)
+{
+    uint64_t elapsed = elapsed_ms(m);
+    const struct tftp_histogram *rtt = &m->rtt_ms;
+
+    fprintf(fp, "{\"name\": \"%s\", \"elapsed_ms\": %llu, \"bytes\": %llu, \"blocks\": %llu, \"mb_per_s\": %.3f, "
+            "\"retransmits\": %llu, \"duplicates\": %llu, \"timeouts\": %llu, "
+            "\"rtt_ms\": {\"count\": %llu, \"min\": %u, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %u}}\n",
+            name, (unsigned long long)elapsed, (unsigned long long)m->bytes, (unsigned long long)m->blocks,
+            elapsed ? m->bytes / (elapsed * 1000.0) : 0.0, (unsigned long long)m->retransmits,
+            (unsigned long long)m->duplicates, (unsigned long long)m->timeouts, (unsigned long long)rtt->count,
+            rtt->min, (unsigned long long)tftp_histogram_percentile(rtt, 50),
+            (unsigned long long)tftp_histogram_percentile(rtt, 90),
+            (unsigned long long)tftp_histogram_percentile(rtt, 99), rtt->max);
+}
+
+// The summary of a transfer, logged once it ended
+void tftp_metrics_log(const struct tftp_metrics *m, const char *log_prefix)
+{
+    uint64_t elapsed = elapsed_ms(m);
+
+    TFTP_INFO("%s %llu blocks, %llu bytes in %llu ms, %llu retransmits, %llu duplicates, %llu timeouts\n",
+              log_prefix, (unsigned long long)m->blocks, (unsigned long long)m->bytes, (unsigned long long)elapsed,
+              (unsigned long long)m->retransmits, (unsigned long long)m->duplicates, (unsigned long long)m->timeouts);
+    if (m->rtt_ms.count > 0) {
+        TFTP_INFO("%s Round trip p50 %llu ms, p99 %llu ms, max %u ms\n", log_prefix,
+                  (unsigned long long)tftp_histogram_percentile(&m->rtt_ms, 50),
+                  (unsigned long long)tftp_histogram_percentile(&m->rtt_ms, 99), m->rtt_ms.max);
+    }
+}
+
+static void request_dump(int sig)
+{
+    (void)sig;
+    tftp_metrics_dump_requested = 1;
+}
+
+/*
+    Makes SIGUSR1 write the metrics of the running transfers to path. Without SA_RESTART the
+    signal interrupts a blocking receive, so even a stalled transfer answers it right away.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_metrics_dump_on_signal(const char *path)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_dump;
+    sigemptyset(&sa.sa_mask);
+    strncpy(dump_path, path, sizeof(dump_path) - 1);
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        perror("unable to handle SIGUSR1");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Starts a dump: returns the file to write the metrics to with tftp_metrics_write(), which
+    replaces the previous dump once tftp_metrics_dump_end() closes it. NULL on failure.
+*/
+FILE *tftp_metrics_dump_begin(void)
+{
+    char tmp_path[sizeof(dump_path) + sizeof(".tmp")];
+
+    tftp_metrics_dump_requested = 0;
+    if (dump_path[0] == '\0') {
+        return NULL;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dump_path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        perror("unable to open metrics dump");
+    }
+    return fp;
+}
+
+// Returns 0 on success, -1 on failure
+int tftp_metrics_dump_end(FILE *fp)
+{
+    char tmp_path[sizeof(dump_path) + sizeof(".tmp")];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dump_path);
+    if (fclose(fp) != 0 || rename(tmp_path, dump_path) == -1) {
+        perror("unable to write metrics dump");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Dumps the metrics of a single transfer. Returns 0 on success, -1 on failure.
+int tftp_metrics_dump(const struct tftp_metrics *m, const char *name)
+{
+    FILE *fp = tftp_metrics_dump_begin();
+    if (fp == NULL) {
+        return -1;
+    }
+    tftp_metrics_write(fp, name, m);
+    return tftp_metrics_dump_end(fp);
+}
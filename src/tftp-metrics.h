@@ -0,0 +1,67 @@
+#ifndef TFTP_METRICS_H
+#define TFTP_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+
+/*
+    Per-transfer counters, kept by every tftp_session instead of logging each packet.
+
+    Round trips go into a log-linear histogram in the style of HdrHistogram: values below
+    TFTP_HIST_SUB_COUNT get a bucket each, above that every power of two is split into
+    TFTP_HIST_SUB_COUNT buckets, so any recorded value is known to within 1 / TFTP_HIST_SUB_COUNT
+    of itself at a fixed size, whatever the range. Recording is a few shifts and an increment.
+
+    A running transfer is read from outside by sending its process SIGUSR1 once
+    tftp_metrics_dump_on_signal() was called: the transfer loops check a flag once per batch
+    of packets and write their metrics to the file, one JSON object per line.
+*/
+
+#define TFTP_HIST_SUB_BITS 5
+#define TFTP_HIST_SUB_COUNT (1 << TFTP_HIST_SUB_BITS)
+#define TFTP_HIST_BUCKETS ((33 - TFTP_HIST_SUB_BITS) * TFTP_HIST_SUB_COUNT) // values up to UINT32_MAX
+
+struct tftp_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+    uint32_t buckets[TFTP_HIST_BUCKETS];
+};
+
+struct tftp_metrics {
+    uint64_t start_ms;    // CLOCK_MONOTONIC when the RRQ went out or came in, 0 before
+    uint64_t bytes;       // payload sent for the first time, or received in order
+    uint64_t blocks;
+    uint64_t retransmits; // packets sent again: DATA or the OACK by a sender, the RRQ or an ACK by a receiver
+    uint64_t duplicates;  // repeated ACKs at a sender, DATA blocks received again at a receiver
+    uint64_t timeouts;
+    struct tftp_histogram rtt_ms; // round trips measured for the retransmission timer
+};
+
+extern volatile sig_atomic_t tftp_metrics_dump_requested;
+
+// Public interface
+void tftp_histogram_record(struct tftp_histogram *h, uint64_t value);
+uint64_t tftp_histogram_percentile(const struct tftp_histogram *h, double percentile);
+void tftp_histogram_merge(struct tftp_histogram *into, const struct tftp_histogram *h);
+
+void tftp_metrics_merge(struct tftp_metrics *into, const struct tftp_metrics *m);
+void tftp_metrics_write(FILE *fp, const char *name, const struct tftp_metrics *m);
+void tftp_metrics_log(const struct tftp_metrics *m, const char *log_prefix);
+
+int tftp_metrics_dump_on_signal(const char *path);
+FILE *tftp_metrics_dump_begin(void);
+int tftp_metrics_dump_end(FILE *fp);
+int tftp_metrics_dump(const struct tftp_metrics *m, const char *name);
+
+// Writes m to the dump file if SIGUSR1 asked for it, a single load otherwise
+static inline void tftp_metrics_poll(const struct tftp_metrics *m, const char *name)
+{
+    if (tftp_metrics_dump_requested) {
+        tftp_metrics_dump(m, name);
+    }
+}
+
+#endif // TFTP_METRICS_H
@@ -0,0 +1,194 @@
+#define _GNU_SOURCE // syscall
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "tftp-ring.h"
+
+#define RING_SPIN 128 // polls before a thread goes to sleep on the futex
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Sleeps while *word still holds val, for at most timeout_ms (forever if it is < 0)
+static void futex_wait(uint32_t *word, uint32_t val, int timeout_ms)
+{
+    struct timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/*
+    Waits until *word no longer holds val, the same handshake as the shared-memory rings: the
+    waiting flag is raised before *word is read again, and the other side writes *word before
+    it reads the flag. Returns 0 once it changed, -1 on timeout.
+*/
+static int ring_wait_change(uint32_t *word, uint32_t *waiting, uint32_t val, int timeout_ms)
+{
+    for (int i = 0; i < RING_SPIN; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val) {
+            return 0;
+        }
+        cpu_relax();
+    }
+
+    uint64_t deadline = now_ms() + (timeout_ms < 0 ? 0 : timeout_ms);
+    int result = 0;
+
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == val) {
+        int64_t left = timeout_ms < 0 ? -1 : (int64_t)deadline - (int64_t)now_ms();
+        if (timeout_ms >= 0 && left <= 0) {
+            result = -1;
+            break;
+        }
+        futex_wait(word, val, (int)left);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return result;
+}
+
+/*
+    Allocates slot_count slots (a power of two) of slot_len bytes each. The buffers are only
+    touched once a datagram is received into them.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_ring_init(struct tftp_ring *r, uint32_t slot_count, size_t slot_len)
+{
+    memset(r, 0, sizeof(struct tftp_ring));
+    if (slot_count < 2 || (slot_count & (slot_count - 1)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    r->bufs = malloc((size_t)slot_count * slot_len);
+    r->slots = calloc(slot_count, sizeof(struct tftp_ring_slot));
+    if (r->bufs == NULL || r->slots == NULL) {
+        tftp_ring_free(r);
+        return -1;
+    }
+
+    r->slot_count = slot_count;
+    r->slot_len = slot_len;
+    for (uint32_t i = 0; i < slot_count; i++) {
+        r->slots[i].buf = r->bufs + (size_t)i * slot_len;
+    }
+    return 0;
+}
+
+void tftp_ring_free(struct tftp_ring *r)
+{
+    free(r->bufs);
+    free(r->slots);
+    r->bufs = NULL;
+    r->slots = NULL;
+}
+
+// Slots the producer may fill, one is always kept back for tftp_ring_close
+uint32_t tftp_ring_space(struct tftp_ring *r)
+{
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    return r->slot_count - 1 - (r->tail - head);
+}
+
+/*
+    Waits up to timeout_ms (forever if it is < 0) for a free slot.
+    Returns 0 once there is one, -1 with errno set to ETIMEDOUT on timeout, or to EPIPE once
+    the consumer gave up.
+*/
+int tftp_ring_wait_space(struct tftp_ring *r, int timeout_ms)
+{
+    uint32_t head;
+
+    while (r->slot_count - 1 - (r->tail - (head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))) == 0) {
+        if (__atomic_load_n(&r->aborted, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (ring_wait_change(&r->head, &r->producer_waiting, head, timeout_ms) == -1) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    if (__atomic_load_n(&r->aborted, __ATOMIC_ACQUIRE)) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+// The i-th free slot, i below tftp_ring_space
+struct tftp_ring_slot *tftp_ring_free_slot(struct tftp_ring *r, uint32_t i)
+{
+    return &r->slots[(r->tail + i) & (r->slot_count - 1)];
+}
+
+// Hands the first count free slots to the consumer, waking it if it sleeps
+void tftp_ring_publish(struct tftp_ring *r, uint32_t count)
+{
+    __atomic_store_n(&r->tail, r->tail + count, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&r->tail);
+    }
+}
+
+// Publishes the end of the stream in the slot kept back for it
+void tftp_ring_close(struct tftp_ring *r)
+{
+    struct tftp_ring_slot *slot = tftp_ring_free_slot(r, 0);
+
+    slot->len = 0;
+    slot->end = 1;
+    tftp_ring_publish(r, 1);
+}
+
+// Waits for published slots, returns how many there are
+uint32_t tftp_ring_wait(struct tftp_ring *r)
+{
+    ring_wait_change(&r->tail, &r->consumer_waiting, r->head, -1);
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - r->head;
+}
+
+// The i-th published slot, i below what tftp_ring_wait returned
+struct tftp_ring_slot *tftp_ring_ready_slot(struct tftp_ring *r, uint32_t i)
+{
+    return &r->slots[(r->head + i) & (r->slot_count - 1)];
+}
+
+// Hands the first count published slots back to the producer, waking it if it sleeps
+void tftp_ring_release(struct tftp_ring *r, uint32_t count)
+{
+    __atomic_store_n(&r->head, r->head + count, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->producer_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&r->head);
+    }
+}
+
+/*
+    Stops draining: every published slot is handed back and the producer's next
+    tftp_ring_wait_space fails.
+*/
+void tftp_ring_abort(struct tftp_ring *r)
+{
+    __atomic_store_n(&r->aborted, 1, __ATOMIC_SEQ_CST);
+    tftp_ring_release(r, __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - r->head);
+}
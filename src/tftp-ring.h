@@ -0,0 +1,60 @@
+#ifndef TFTP_RING_H
+#define TFTP_RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    Single-producer single-consumer ring of preallocated block buffers, between two threads
+    of one process.
+
+    A pipelined retrieval receives datagrams straight into the free slots on its network
+    thread, which validates and ACKs them and publishes the slots. A writer thread drains them
+    to the sink and hands them back. Neither thread takes a lock or makes a system call while
+    the other keeps up; a thread that runs out of slots (or of room) spins briefly and then
+    sleeps on a private futex, which the other side only wakes when it sees someone waiting.
+    The disk only slows the ACKs down once every slot is waiting to be written.
+*/
+
+#define TFTP_RING_SLOTS 256 // four windows of the largest windowsize, power of two
+
+struct tftp_ring_slot {
+    uint8_t *buf;           // slot_len bytes, the datagram is received here
+    const uint8_t *payload; // what to write, points into buf
+    size_t len;             // 0 = nothing to write (not a DATA packet, or a duplicate)
+    uint64_t offset;        // where the payload belongs in the file
+    int end;                // published by tftp_ring_close, no slots follow
+};
+
+struct tftp_ring {
+    uint32_t head;             // written by the consumer
+    uint32_t producer_waiting; // producer sleeps on head
+    uint8_t pad0[56];
+    uint32_t tail;             // written by the producer
+    uint32_t consumer_waiting; // consumer sleeps on tail
+    uint8_t pad1[56];
+    uint32_t aborted;          // the consumer gave up, nothing is drained anymore
+    uint32_t slot_count;
+    size_t slot_len;
+    uint8_t *bufs;
+    struct tftp_ring_slot *slots;
+};
+
+// Public interface
+int tftp_ring_init(struct tftp_ring *r, uint32_t slot_count, size_t slot_len);
+void tftp_ring_free(struct tftp_ring *r);
+
+// Producer
+uint32_t tftp_ring_space(struct tftp_ring *r);
+int tftp_ring_wait_space(struct tftp_ring *r, int timeout_ms);
+struct tftp_ring_slot *tftp_ring_free_slot(struct tftp_ring *r, uint32_t i);
+void tftp_ring_publish(struct tftp_ring *r, uint32_t count);
+void tftp_ring_close(struct tftp_ring *r);
+
+// Consumer
+uint32_t tftp_ring_wait(struct tftp_ring *r);
+struct tftp_ring_slot *tftp_ring_ready_slot(struct tftp_ring *r, uint32_t i);
+void tftp_ring_release(struct tftp_ring *r, uint32_t count);
+void tftp_ring_abort(struct tftp_ring *r);
+
+#endif // TFTP_RING_H
@@ -0,0 +1,546 @@
+/*
+    Long-running satellite server.
+
+    A single epoll loop multiplexes any number of transfers. Every transfer is a sender
+    tftp_session keyed by the client address, this file only does its I/O: datagrams from the
+    client are fed to the session, and whatever the session wants to send goes out right away
+    without blocking. A window that does not fit in the client's socket queue is finished
+    later, and the sessions' deadlines live in a min-heap.
+*/
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include "tftp-server.h"
+#include "tftp-log.h"
+#include "tftp-trace.h"
+
+#define RECV_BATCH 64
+#define MAX_EVENTS 256
+#define INITIAL_BUCKETS 1024
+
+struct session {
+    struct tftp_session core;
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int sfd;       // listening socket, or the session's own TID socket
+    int own_sfd;   // sfd belongs to this session
+    int finished;  // counted in the stats, freed by the event loop
+
+    uint64_t deadline_ms; // 0 once finished
+    size_t heap_index;
+    struct session *hash_next;
+};
+
+struct server {
+    const struct tftp_server_config *config;
+    struct tftp_server_stats *stats;
+    int epfd;
+
+    // Sessions by client address
+    struct session **buckets;
+    size_t bucket_count;
+    size_t session_count;
+
+    // Sessions by retransmission deadline
+    struct session **heap;
+    size_t heap_len;
+    size_t heap_cap;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a over the address bytes
+static size_t addr_hash(const struct sockaddr_un *addr, socklen_t addr_len)
+{
+    const uint8_t *bytes = (const uint8_t *)addr;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (socklen_t i = 0; i < addr_len; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct session *session_find(struct server *server, const struct sockaddr_un *addr, socklen_t addr_len)
+{
+    struct session *s = server->buckets[addr_hash(addr, addr_len) & (server->bucket_count - 1)];
+
+    while (s != NULL && (s->addr_len != addr_len || memcmp(&s->addr, addr, addr_len) != 0)) {
+        s = s->hash_next;
+    }
+    return s;
+}
+
+// Returns 0 on success, -1 on failure.
+static int session_insert(struct server *server, struct session *s)
+{
+    // Keep chains short by doubling the table once it holds a session per bucket
+    if (server->session_count >= server->bucket_count) {
+        size_t bucket_count = server->bucket_count * 2;
+        struct session **buckets = calloc(bucket_count, sizeof(struct session *));
+        if (buckets == NULL) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < server->bucket_count; i++) {
+            struct session *next;
+            for (struct session *old = server->buckets[i]; old != NULL; old = next) {
+                next = old->hash_next;
+                size_t bucket = addr_hash(&old->addr, old->addr_len) & (bucket_count - 1);
+                old->hash_next = buckets[bucket];
+                buckets[bucket] = old;
+            }
+        }
+        free(server->buckets);
+        server->buckets = buckets;
+        server->bucket_count = bucket_count;
+    }
+
+    size_t bucket = addr_hash(&s->addr, s->addr_len) & (server->bucket_count - 1);
+    s->hash_next = server->buckets[bucket];
+    server->buckets[bucket] = s;
+    server->session_count++;
+    return 0;
+}
+
+static void session_unlink(struct server *server, struct session *s)
+{
+    struct session **link = &server->buckets[addr_hash(&s->addr, s->addr_len) & (server->bucket_count - 1)];
+
+    while (*link != s) {
+        link = &(*link)->hash_next;
+    }
+    *link = s->hash_next;
+    server->session_count--;
+}
+
+static void heap_swap(struct server *server, size_t a, size_t b)
+{
+    struct session *tmp = server->heap[a];
+
+    server->heap[a] = server->heap[b];
+    server->heap[b] = tmp;
+    server->heap[a]->heap_index = a;
+    server->heap[b]->heap_index = b;
+}
+
+// Restores the heap order around index i after its deadline changed
+static void heap_fix(struct server *server, size_t i)
+{
+    while (i > 0 && server->heap[i]->deadline_ms < server->heap[(i - 1) / 2]->deadline_ms) {
+        heap_swap(server, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    while (1) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = 2 * i + 2;
+
+        if (left < server->heap_len && server->heap[left]->deadline_ms < server->heap[smallest]->deadline_ms) {
+            smallest = left;
+        }
+        if (right < server->heap_len && server->heap[right]->deadline_ms < server->heap[smallest]->deadline_ms) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        heap_swap(server, i, smallest);
+        i = smallest;
+    }
+}
+
+// Returns 0 on success, -1 on failure.
+static int heap_push(struct server *server, struct session *s)
+{
+    if (server->heap_len == server->heap_cap) {
+        size_t heap_cap = server->heap_cap ? server->heap_cap * 2 : INITIAL_BUCKETS;
+        struct session **heap = realloc(server->heap, heap_cap * sizeof(struct session *));
+        if (heap == NULL) {
+            return -1;
+        }
+        server->heap = heap;
+        server->heap_cap = heap_cap;
+    }
+
+    s->heap_index = server->heap_len;
+    server->heap[server->heap_len++] = s;
+    heap_fix(server, s->heap_index);
+    return 0;
+}
+
+static void heap_remove(struct server *server, struct session *s)
+{
+    size_t i = s->heap_index;
+
+    server->heap_len--;
+    if (i != server->heap_len) {
+        heap_swap(server, i, server->heap_len);
+        heap_fix(server, i);
+    }
+}
+
+static void session_schedule(struct server *server, struct session *s, uint64_t deadline_ms)
+{
+    s->deadline_ms = deadline_ms;
+    heap_fix(server, s->heap_index);
+}
+
+// Marks a session as finished, it is freed by the event loop
+static void session_finish(struct server *server, struct session *s, int failed)
+{
+    s->finished = 1;
+    tftp_metrics_merge(&server->stats->metrics, &s->core.metrics);
+    if (failed) {
+        server->stats->failed++;
+    } else {
+        server->stats->completed++;
+    }
+    session_schedule(server, s, 0);
+}
+
+static void session_free(struct server *server, struct session *s)
+{
+    heap_remove(server, s);
+    session_unlink(server, s);
+    if (s->own_sfd) {
+        close(s->sfd);
+    }
+    free(s);
+}
+
+/*
+    Sends whatever the session has to send without blocking, then files it under its next
+    deadline, or finishes it once the transfer is over.
+*/
+static void session_transmit(struct server *server, struct session *s, uint64_t now)
+{
+    struct tftp_tx txs[MAX_WINDOWSIZE];
+    struct iovec iovs[MAX_WINDOWSIZE][2];
+    struct mmsghdr msgs[MAX_WINDOWSIZE];
+    int tx_count = tftp_session_poll_tx(&s->core, now, txs, MAX_WINDOWSIZE);
+
+    if (tx_count > 0) {
+        for (int i = 0; i < tx_count; i++) {
+            iovs[i][0] = (struct iovec) { .iov_base = (uint8_t *)txs[i].hdr, .iov_len = txs[i].hdr_len };
+            iovs[i][1] = (struct iovec) { .iov_base = (uint8_t *)txs[i].payload, .iov_len = txs[i].payload_len };
+            msgs[i].msg_hdr = (struct msghdr) {
+                // A TID socket is connected to its client
+                .msg_name = s->own_sfd ? NULL : &s->addr,
+                .msg_namelen = s->own_sfd ? 0 : s->addr_len,
+                .msg_iov = iovs[i],
+                .msg_iovlen = txs[i].payload_len ? 2 : 1
+            };
+        }
+
+        int sent = sendmmsg(s->sfd, msgs, tx_count, MSG_DONTWAIT);
+        if (sent < 0 && errno != EAGAIN) {
+            TFTP_WARN("%s Unable to send to client: %s\n", server->config->log_prefix, strerror(errno));
+            session_finish(server, s, 1);
+            return;
+        }
+        for (int i = 0; i < sent; i++) {
+            tftp_trace_packet(txs[i].hdr, txs[i].hdr_len, txs[i].payload_len, 0);
+        }
+        tftp_session_tx_done(&s->core, sent > 0 ? sent : 0, now);
+    }
+
+    if (s->core.state == TFTP_SESSION_FAILED) {
+        session_finish(server, s, 1);
+    } else if (s->core.state == TFTP_SESSION_DONE) {
+        session_finish(server, s, 0);
+    } else {
+        session_schedule(server, s, tftp_session_next_deadline(&s->core));
+    }
+}
+
+// Creates a session for a new RRQ and sends the first window (or OACK)
+static void session_start(struct server *server, int sfd, uint8_t *pkt_buf, size_t pkt_len,
+                          struct sockaddr_un *addr, socklen_t addr_len, uint64_t now)
+{
+    const struct tftp_server_config *config = server->config;
+    struct tftp_session_config session_config = {
+        .timeout_ms = config->timeout_ms,
+        .max_retries = config->max_retries,
+        .log_prefix = config->log_prefix
+    };
+
+    struct session *s = calloc(1, sizeof(struct session));
+    if (s == NULL) {
+        perror("unable to allocate session");
+        return;
+    }
+
+    memcpy(&s->addr, addr, addr_len);
+    s->addr_len = addr_len;
+    s->sfd = sfd;
+    tftp_session_init_sender(&s->core, config->buf, config->buf_len, &session_config);
+
+    if (tftp_session_on_datagram(&s->core, pkt_buf, pkt_len, now, NULL) == -1 || session_insert(server, s) == -1) {
+        server->stats->failed++;
+        free(s);
+        return;
+    }
+    if (heap_push(server, s) == -1) {
+        session_unlink(server, s);
+        server->stats->failed++;
+        free(s);
+        return;
+    }
+
+    if (server->session_count > server->stats->max_sessions) {
+        server->stats->max_sessions = server->session_count;
+    }
+
+    /*
+        With ephemeral TIDs the transfer continues on a socket of its own, autobound to a unique
+        abstract address and connected to the client so it only hears from that client.
+    */
+    if (config->ephemeral_tids) {
+        struct sockaddr_un tid_addr = { .sun_family = AF_UNIX };
+        int tid_sfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (tid_sfd == -1 ||
+            bind(tid_sfd, (struct sockaddr *)&tid_addr, sizeof(sa_family_t)) == -1 ||
+            connect(tid_sfd, (struct sockaddr *)addr, addr_len) == -1) {
+            perror("unable to open session socket");
+            if (tid_sfd != -1) {
+                close(tid_sfd);
+            }
+            session_finish(server, s, 1);
+            return;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+        s->sfd = tid_sfd;
+        s->own_sfd = 1;
+        if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, tid_sfd, &ev) == -1) {
+            perror("unable to watch session socket");
+            session_finish(server, s, 1);
+            return;
+        }
+    }
+
+    session_transmit(server, s, now);
+}
+
+// Dispatches one datagram received on the listening socket or a session socket
+static void handle_datagram(struct server *server, int sfd, struct session *s, uint8_t *pkt_buf, size_t pkt_len,
+                            struct sockaddr_un *addr, socklen_t addr_len, uint64_t now)
+{
+    struct tftp_pkt_view pkt;
+
+    /*
+        Sessions are keyed by the client's address. Every client that never bound its socket
+        has the same empty one, and nothing can be sent back to it, not even an ERROR, so its
+        RRQs are refused outright instead of ending up in one session.
+    */
+    if (s == NULL && addr_len <= sizeof(sa_family_t)) {
+        if (tftp_parse_pkt(pkt_buf, pkt_len, &pkt) == 0 && pkt.opcode == TFTP_RRQ) {
+            TFTP_WARN("%s Refused a RRQ from an unnamed client, it has to bind its socket\n",
+                      server->config->log_prefix);
+            server->stats->refused++;
+        }
+        return;
+    }
+
+    if (s == NULL) {
+        s = session_find(server, addr, addr_len);
+    }
+
+    // Only a RRQ starts a transfer, anything else from an unknown client is dropped
+    if (s == NULL) {
+        if (tftp_parse_pkt(pkt_buf, pkt_len, &pkt) == 0 && pkt.opcode == TFTP_RRQ) {
+            session_start(server, sfd, pkt_buf, pkt_len, addr, addr_len, now);
+        }
+        return;
+    }
+
+    if (!s->finished) {
+        tftp_session_on_datagram(&s->core, pkt_buf, pkt_len, now, NULL);
+        session_transmit(server, s, now);
+    }
+}
+
+// Drains a socket, dispatching every datagram. Returns 0 on success, -1 on failure.
+static int drain_socket(struct server *server, int sfd, struct session *s, uint8_t *recv_bufs, size_t pkt_buf_len)
+{
+    struct sockaddr_un addrs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+
+    while (1) {
+        for (int i = 0; i < RECV_BATCH; i++) {
+            iovs[i] = (struct iovec) { .iov_base = recv_bufs + i * pkt_buf_len, .iov_len = pkt_buf_len };
+            msgs[i].msg_hdr = (struct msghdr) {
+                .msg_name = &addrs[i],
+                .msg_namelen = sizeof(struct sockaddr_un),
+                .msg_iov = &iovs[i],
+                .msg_iovlen = 1
+            };
+        }
+
+        int received = recvmmsg(sfd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            // A session socket reports an ICMP-like error once its client is gone
+            if (s != NULL) {
+                if (!s->finished) {
+                    session_finish(server, s, 1);
+                }
+                return 0;
+            }
+            perror("recvmmsg failed");
+            return -1;
+        }
+
+        uint64_t now = now_ms();
+        for (int i = 0; i < received; i++) {
+            tftp_trace_packet(recv_bufs + i * pkt_buf_len, msgs[i].msg_len, 0, 1);
+            handle_datagram(server, sfd, s, recv_bufs + i * pkt_buf_len, msgs[i].msg_len,
+                            &addrs[i], msgs[i].msg_hdr.msg_namelen, now);
+        }
+
+        if (received < RECV_BATCH) {
+            return 0;
+        }
+    }
+}
+
+/*
+    Writes the transfers that ended added up, then every transfer in flight, to the dump file
+    SIGUSR1 asked for.
+*/
+static void dump_metrics(struct server *server)
+{
+    FILE *fp = tftp_metrics_dump_begin();
+    if (fp == NULL) {
+        return;
+    }
+
+    char name[sizeof(((struct sockaddr_un *)0)->sun_path) + 64];
+    snprintf(name, sizeof(name), "%s ended", server->config->log_prefix);
+    tftp_metrics_write(fp, name, &server->stats->metrics);
+    for (size_t i = 0; i < server->heap_len; i++) {
+        const struct session *s = server->heap[i];
+        if (!s->finished) {
+            snprintf(name, sizeof(name), "%s %s", server->config->log_prefix,
+                     s->addr_len > sizeof(sa_family_t) ? s->addr.sun_path : "unnamed client");
+            tftp_metrics_write(fp, name, &s->core.metrics);
+        }
+    }
+    tftp_metrics_dump_end(fp);
+}
+
+/*
+    The satellite serving buf to any number of ground stations at once.
+    Runs until config->max_transfers transfers ended, or forever if that is 0.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_server_run(int sfd, const struct tftp_server_config *config, struct tftp_server_stats *stats)
+{
+    struct tftp_server_config cfg = *config;
+    struct tftp_server_stats local_stats;
+    struct server server = { .config = &cfg, .stats = stats ? stats : &local_stats };
+    int result = -1;
+
+    cfg.timeout_ms = cfg.timeout_ms > 0 ? cfg.timeout_ms : DEFAULT_TIMEOUT_MS;
+    cfg.max_retries = cfg.max_retries > 0 ? cfg.max_retries : DEFAULT_MAX_RETRIES;
+    cfg.log_prefix = cfg.log_prefix ? cfg.log_prefix : "";
+    memset(server.stats, 0, sizeof(struct tftp_server_stats));
+
+    // Requests and ACKs are small, only RECV_BATCH of them are buffered at once
+    size_t pkt_buf_len = MAX_BUF_SIZE;
+    uint8_t *recv_bufs = malloc(RECV_BATCH * pkt_buf_len);
+    server.bucket_count = INITIAL_BUCKETS;
+    server.buckets = calloc(server.bucket_count, sizeof(struct session *));
+    server.epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (recv_bufs == NULL || server.buckets == NULL || server.epfd == -1) {
+        perror("unable to set up server");
+        goto cleanup;
+    }
+
+    int flags = fcntl(sfd, F_GETFL);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (flags == -1 || fcntl(sfd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        epoll_ctl(server.epfd, EPOLL_CTL_ADD, sfd, &ev) == -1) {
+        perror("unable to watch server socket");
+        goto cleanup;
+    }
+
+    TFTP_INFO("%s Serving %zu bytes%s\n", cfg.log_prefix, cfg.buf_len, cfg.ephemeral_tids ? " from ephemeral TIDs" : "");
+
+    struct epoll_event events[MAX_EVENTS];
+    while (cfg.max_transfers == 0 || server.stats->completed + server.stats->failed < cfg.max_transfers) {
+        int timeout = -1;
+        if (server.heap_len > 0) {
+            uint64_t now = now_ms();
+            uint64_t deadline = server.heap[0]->deadline_ms;
+            timeout = deadline > now ? (int)(deadline - now) : 0;
+        }
+
+        int event_count = epoll_wait(server.epfd, events, MAX_EVENTS, timeout);
+        if (tftp_metrics_dump_requested) {
+            dump_metrics(&server);
+        }
+        if (event_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            goto cleanup;
+        }
+
+        for (int i = 0; i < event_count; i++) {
+            struct session *s = events[i].data.ptr;
+            if (drain_socket(&server, s ? s->sfd : sfd, s, recv_bufs, pkt_buf_len) == -1) {
+                goto cleanup;
+            }
+        }
+
+        // Fire expired timers and free finished sessions, both sit at the top of the heap
+        uint64_t now = now_ms();
+        while (server.heap_len > 0 && server.heap[0]->deadline_ms <= now) {
+            struct session *s = server.heap[0];
+            if (s->finished) {
+                session_free(&server, s);
+            } else {
+                session_transmit(&server, s, now);
+            }
+        }
+    }
+
+    TFTP_INFO("%s Served %lu transfers, %lu failed\n", cfg.log_prefix, server.stats->completed, server.stats->failed);
+    tftp_metrics_log(&server.stats->metrics, cfg.log_prefix);
+    result = 0;
+
+cleanup:
+    while (server.heap_len > 0) {
+        session_free(&server, server.heap[0]);
+    }
+    if (server.epfd != -1) {
+        close(server.epfd);
+    }
+    free(server.heap);
+    free(server.buckets);
+    free(recv_bufs);
+    return result;
+}
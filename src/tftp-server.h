@@ -0,0 +1,30 @@
+#ifndef TFTP_SERVER_H
+#define TFTP_SERVER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "tftp.h"
+#include "tftp-session.h"
+
+struct tftp_server_config {
+    uint8_t *buf;                // file served to every client
+    size_t buf_len;
+    int ephemeral_tids;          // answer every RRQ from a socket of its own, like a TFTP TID
+    int timeout_ms;              // 0 = DEFAULT_TIMEOUT_MS
+    int max_retries;             // 0 = DEFAULT_MAX_RETRIES
+    unsigned long max_transfers; // return once this many transfers ended, 0 = serve forever
+    const char *log_prefix;
+};
+
+struct tftp_server_stats {
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long refused;      // RRQs from unnamed clients, which can't be told apart or answered
+    unsigned long max_sessions; // most transfers in flight at the same time
+    struct tftp_metrics metrics; // every ended transfer added up
+};
+
+// Public interface
+int tftp_server_run(int sfd, const struct tftp_server_config *config, struct tftp_server_stats *stats);
+
+#endif // TFTP_SERVER_H
@@ -0,0 +1,846 @@
+/*
+    TFTP transfer state machine.
+
+    A sender session starts in REQUEST, waiting for the RRQ. Requested options are answered
+    with an OACK that stands in for block 0, then DATA goes out in windows of up to windowsize
+    blocks (RFC 7440). A RRQ with an offset resumes an interrupted transfer: block 1 then
+    carries the file from that byte on.
+
+    A sender either points its DATA packets into a buffer holding the whole file, or reads the
+    file block by block from a source as the window moves over it. Read blocks are kept in a
+    cache of one window for retransmissions, which caps the negotiated window to what fits
+    there. A source that does not know its size is sent without a tsize and always from its
+    start, since it can only be read front to back, and its first short block ends the transfer.
+    A sender with a compressor and a cache deflates the file when the RRQ asks for it, which
+    turns it into such a source (see tftp-compress.h). A sender with a cropper, a cache and the
+    file in memory sends only the region of the image a RRQ asks for, as a smaller image read
+    from a source of known size, which can then be deflated too.
+
+    Block numbers on the wire are 16 bits and roll over from 65535 to 0, so files of more
+    than 65535 blocks keep going. Both sides count blocks in 32 bits and map the wire
+    numbers back onto that count, which is never ambiguous since a window is much smaller
+    than the wire range. Every ACK moves the window to the block right after it, so an ACK that
+    stops short of the window end (the receiver saw a gap) resends the rest.
+
+    A receiver session starts in REQUEST with its RRQ pending. An OACK is confirmed with ACK 0,
+    in-order DATA payloads are handed back to the caller along with their place in the file,
+    and the last block of every window, the last block of the file and the last in-order block
+    before a gap are ACKed. After the ACK of the last block the receiver dallies for
+    DALLY_RTOS timeouts (RFC 1350): should that ACK go missing the sender resends the block,
+    which is ACKed again, instead of giving up on a file that was delivered.
+
+    Both sides retransmit once their deadline passes without progress: the sender resends the
+    window, the receiver its RRQ or latest ACK. The deadline follows the measured round trip
+    time (RFC 6298): a sender times the last block of a window until its ACK, a receiver its
+    RRQ or ACK until the next in-order packet. Retransmitted packets are never timed (Karn's
+    algorithm), and every timeout in a row doubles the timeout until max_retries gives up.
+
+    Neither side answers every copy of a packet. A sender resends the window for the first
+    repeated ACK only, and a receiver ACKs out-of-order blocks once: answering each duplicate
+    with more duplicates (the Sorcerer's Apprentice bug) would double the traffic for the rest
+    of the transfer.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "tftp-session.h"
+#include "tftp-compress.h"
+#include "tftp-log.h"
+#include "tftp-trace.h"
+
+static void session_init(struct tftp_session *s, enum tftp_session_role role, const struct tftp_session_config *config)
+{
+    memset(s, 0, sizeof(struct tftp_session));
+    s->role = role;
+    s->state = TFTP_SESSION_REQUEST;
+    if (config != NULL) {
+        s->config = *config;
+    }
+    s->config.timeout_ms = s->config.timeout_ms > 0 ? s->config.timeout_ms : DEFAULT_TIMEOUT_MS;
+    s->config.max_retries = s->config.max_retries > 0 ? s->config.max_retries : DEFAULT_MAX_RETRIES;
+    s->config.log_prefix = s->config.log_prefix ? s->config.log_prefix : "";
+    s->windowsize = DEFAULT_WINDOWSIZE;
+    s->blksize = DEFAULT_BLKSIZE;
+    s->rto_ms = s->config.timeout_ms > MAX_RTO_MS ? MAX_RTO_MS : s->config.timeout_ms;
+}
+
+// A session serving buf to the client whose RRQ is passed to tftp_session_on_datagram()
+void tftp_session_init_sender(struct tftp_session *s, const uint8_t *buf, size_t buf_len,
+                              const struct tftp_session_config *config)
+{
+    session_init(s, TFTP_SESSION_SENDER, config);
+    s->buf = buf;
+    s->buf_len = buf_len;
+    s->tsize = buf_len;
+}
+
+/*
+    A session serving src. A source holding all of its data is sent straight out of it, any
+    other one is read into cache, which has to hold at least a block of DEFAULT_BLKSIZE bytes.
+    The cache of the former is only used if the file goes out deflated, NULL refuses that.
+*/
+void tftp_session_init_source(struct tftp_session *s, const struct tftp_source *src, uint8_t *cache, size_t cache_len,
+                              const struct tftp_session_config *config)
+{
+    if (src->data != NULL || src->size == 0) {
+        tftp_session_init_sender(s, src->data, src->size, config);
+        s->cache = cache;
+        s->cache_len = cache_len;
+        return;
+    }
+
+    session_init(s, TFTP_SESSION_SENDER, config);
+    s->src = src;
+    s->cache = cache;
+    s->cache_len = cache_len;
+    s->tsize = src->size;
+}
+
+// A session retrieving filename, asking for the options in opts (NULL means protocol defaults)
+void tftp_session_init_receiver(struct tftp_session *s, const char *filename, const struct tftp_options *opts,
+                                const struct tftp_session_config *config)
+{
+    session_init(s, TFTP_SESSION_RECEIVER, config);
+    if (opts != NULL) {
+        s->requested = *opts;
+    }
+    if (s->requested.compressed != NULL) {
+        *s->requested.compressed = 0;
+    }
+    if (s->requested.granted != NULL) {
+        memset(s->requested.granted, 0, sizeof(*s->requested.granted));
+    }
+    if (s->requested.region.width && s->requested.region.step == 0) {
+        s->requested.region.step = 1;
+    }
+    strncpy(s->filename, filename, sizeof(s->filename) - 1);
+    s->expected_block = 1;
+}
+
+static int session_fail(struct tftp_session *s)
+{
+    s->state = TFTP_SESSION_FAILED;
+    return -1;
+}
+
+// Starts measuring a round trip that ends with the peer's answer to what was just sent
+static void session_rtt_start(struct tftp_session *s, uint64_t now_ms, uint32_t block)
+{
+    s->rtt_timing = 1;
+    s->rtt_start_ms = now_ms;
+    s->rtt_block = block;
+}
+
+// Folds the measured round trip into SRTT and RTTVAR, and sets the timeout from them
+static void session_rtt_sample(struct tftp_session *s, uint64_t now_ms)
+{
+    uint64_t elapsed = now_ms > s->rtt_start_ms ? now_ms - s->rtt_start_ms : 0;
+    int64_t rtt = elapsed > MAX_RTO_MS ? MAX_RTO_MS : (int64_t)elapsed;
+
+    s->rtt_timing = 0;
+    tftp_histogram_record(&s->metrics.rtt_ms, elapsed);
+    if (s->rtt_samples++ == 0) {
+        s->srtt8 = rtt << 3;
+        s->rttvar4 = rtt << 1;
+    } else {
+        // SRTT += (R - SRTT) / 8, RTTVAR += (|R - SRTT| - RTTVAR) / 4
+        int64_t delta = rtt - (s->srtt8 >> 3);
+        s->srtt8 += delta;
+        s->rttvar4 += (delta < 0 ? -delta : delta) - (s->rttvar4 >> 2);
+    }
+
+    // RTO = SRTT + 4 * RTTVAR, at least a clock tick above SRTT
+    uint32_t rto = (s->srtt8 >> 3) + (s->rttvar4 > 1 ? s->rttvar4 : 1);
+    uint32_t min_rto = s->config.timeout_ms < MIN_RTO_MS ? s->config.timeout_ms : MIN_RTO_MS;
+    s->rto_ms = rto < min_rto ? min_rto : rto > MAX_RTO_MS ? MAX_RTO_MS : rto;
+}
+
+// Last block of the current window, never past the end of the file
+static uint32_t session_window_end(const struct tftp_session *s)
+{
+    if (s->base == 0) {
+        return 0;
+    }
+
+    uint32_t window_end = s->base + s->windowsize - 1;
+    return window_end > s->last_block ? s->last_block : window_end;
+}
+
+// Negotiates the options of a RRQ. Returns 0 on success, -1 on failure.
+static int sender_on_rrq(struct tftp_session *s, const uint8_t *buf, size_t buf_len)
+{
+    struct tftp_request rrq;
+
+    deserialize_rrq_pkt((uint8_t *)buf, &rrq, buf_len);
+
+    // A region is cut out of the image as it is read, the image has to be in memory for that
+    if (rrq.region.width && s->config.cropper != NULL && s->buf != NULL && s->cache != NULL) {
+        struct tftp_region region = rrq.region;
+        const struct tftp_source *cropped = s->config.cropper->crop(s->config.cropper->ctx, s->buf, s->buf_len, &region);
+        if (cropped != NULL) {
+            s->src = cropped;
+            s->buf = NULL;
+            s->tsize = cropped->size;
+            s->region = region;
+            TFTP_INFO("%s Sending the region %ux%u at %u,%u, every %u pixels, %llu bytes\n", s->config.log_prefix,
+                      region.width, region.height, region.x, region.y, region.step,
+                      (unsigned long long)s->tsize);
+        }
+    }
+
+    // A deflated file is read through the compressor from its start, its size is only known at its end
+    if (rrq.compress && !rrq.offset && s->config.compressor != NULL && s->cache != NULL) {
+        const struct tftp_source *plain = s->src;
+        if (plain == NULL) {
+            tftp_memory_source(&s->config.compressor->plain, s->buf, s->buf_len);
+            plain = &s->config.compressor->plain;
+        }
+        const struct tftp_source *deflated = tftp_compress_source(s->config.compressor, plain, rrq.compress);
+        if (deflated != NULL) {
+            s->src = deflated;
+            s->buf = NULL;
+            s->tsize = TFTP_SIZE_UNKNOWN;
+            s->compress = rrq.compress;
+            TFTP_INFO("%s Deflating the file at level %d\n", s->config.log_prefix, s->compress);
+        }
+    }
+
+    if (rrq.windowsize) {
+        s->windowsize = rrq.windowsize > MAX_WINDOWSIZE ? MAX_WINDOWSIZE : rrq.windowsize;
+    }
+    if (rrq.blksize) {
+        s->blksize = rrq.blksize > MAX_BLKSIZE ? MAX_BLKSIZE : rrq.blksize;
+    }
+
+    // A whole window of blocks read from the source has to fit in the cache
+    if (s->src != NULL) {
+        if (rrq.blksize && s->blksize > s->cache_len) {
+            s->blksize = s->cache_len;
+        }
+        if (s->blksize > s->cache_len) {
+            TFTP_WARN("%s No room for a block of %zu bytes\n", s->config.log_prefix, s->blksize);
+            return session_fail(s);
+        }
+        if (s->windowsize > s->cache_len / s->blksize) {
+            s->windowsize = s->cache_len / s->blksize;
+        }
+    }
+
+    // Requested options are answered with an OACK, which becomes block 0 of the transfer
+    int size_known = s->tsize != TFTP_SIZE_UNKNOWN;
+    s->base = 1;
+    if (rrq.windowsize || rrq.blksize || rrq.offset || (rrq.tsize && size_known) || s->compress || s->region.width) {
+        struct tftp_oack oack_pkt = { .opcode = TFTP_OACK };
+
+        oack_pkt.windowsize = rrq.windowsize ? s->windowsize : 0;
+        oack_pkt.blksize = rrq.blksize ? s->blksize : 0;
+        if (rrq.offset && size_known) {
+            // Whatever the client has beyond the end of the file is not ours to extend
+            s->offset = rrq.offset > s->tsize ? s->tsize : rrq.offset;
+            oack_pkt.offset = s->offset;
+            TFTP_INFO("%s Resuming at byte %llu\n", s->config.log_prefix, (unsigned long long)s->offset);
+        }
+        if (rrq.tsize && size_known) {
+            oack_pkt.has_tsize = 1;
+            oack_pkt.tsize = s->tsize;
+        }
+        oack_pkt.compress = s->compress;
+        oack_pkt.region = s->region;
+        s->ctrl_len = serialize_oack_pkt(s->ctrl_pkt, &oack_pkt);
+        s->base = 0;
+    }
+    s->next_block = s->base;
+    s->read_end = 1;
+
+    // The final block always carries less than blksize bytes, possibly none at all
+    uint64_t remaining = size_known ? s->tsize - s->offset : 0;
+    uint64_t blocks = remaining / s->blksize + 1;
+    if (blocks > UINT32_MAX - MAX_WINDOWSIZE) {
+        TFTP_WARN("%s File of %llu bytes does not fit in %u blocks of %zu bytes\n", s->config.log_prefix,
+                  (unsigned long long)remaining, UINT32_MAX - MAX_WINDOWSIZE, s->blksize);
+        return session_fail(s);
+    }
+
+    // Without a size the last block is only known once the source ran short
+    s->last_block = size_known ? blocks : UINT32_MAX - MAX_WINDOWSIZE;
+
+    s->state = TFTP_SESSION_TRANSFER;
+    s->deadline_ms = 0;
+    return 0;
+}
+
+static int sender_on_datagram(struct tftp_session *s, const uint8_t *buf, size_t buf_len, uint64_t now_ms,
+                              struct tftp_pkt_view *pkt)
+{
+    if (s->state == TFTP_SESSION_REQUEST) {
+        if (pkt->opcode != TFTP_RRQ) {
+            TFTP_WARN("%s Expected RRQ, got opcode %d\n", s->config.log_prefix, pkt->opcode);
+            return session_fail(s);
+        }
+        s->metrics.start_ms = now_ms;
+        return sender_on_rrq(s, buf, buf_len);
+    }
+
+    // A repeated RRQ is a duplicate of the one that started the transfer
+    if (pkt->opcode == TFTP_RRQ) {
+        return 0;
+    }
+    if (pkt->opcode != TFTP_ACK) {
+        TFTP_WARN("%s Expected ACK, got opcode %d\n", s->config.log_prefix, pkt->opcode);
+        return session_fail(s);
+    }
+
+    /*
+        The ACK stands for the first block at or after the last ACKed one that has its wire
+        number. ACKs of older windows map to far beyond anything sent, so they are dropped
+        along with ACKs of blocks that were never sent.
+    */
+    uint32_t acked = s->base == 0 ? 0 : s->base - 1;
+    uint32_t block = acked + (uint16_t)(pkt->block - (uint16_t)acked);
+    if (block >= s->sent_end) {
+        return 0;
+    }
+
+    /*
+        The ACK before the window again: the receiver missed the window's first block, or it
+        is a late copy crossing the retransmitted window. Only the first one resends the window.
+    */
+    if (s->base > 0 && block == acked) {
+        s->metrics.duplicates++;
+        if (!s->dup_acked) {
+            s->dup_acked = 1;
+            s->next_block = s->base;
+            s->rtt_timing = 0;
+            s->deadline_ms = 0;
+        }
+        return 0;
+    }
+
+    // An ACK short of the timed block means that block gets resent, and cannot be timed anymore
+    if (s->rtt_timing && block >= s->rtt_block) {
+        session_rtt_sample(s, now_ms);
+    }
+    s->rtt_timing = 0;
+
+    if (s->base > 0 && block == s->last_block) {
+        s->state = TFTP_SESSION_DONE;
+        return 0;
+    }
+
+    s->base = block + 1;
+    s->next_block = s->base;
+    s->dup_acked = 0;
+    s->retries = 0;
+    s->deadline_ms = 0;
+    return 0;
+}
+
+// Whether a region the sender acknowledged is the requested one, clipped at most
+static int region_within(const struct tftp_region *granted, const struct tftp_region *requested)
+{
+    return requested->width && granted->x == requested->x && granted->y == requested->y &&
+           granted->width <= requested->width && granted->height <= requested->height &&
+           granted->step == requested->step;
+}
+
+static int receiver_on_datagram(struct tftp_session *s, struct tftp_pkt_view *pkt, const uint8_t *buf, size_t buf_len,
+                                uint64_t now_ms, struct tftp_pkt_view *data)
+{
+    /*
+        Any block again means our ACK of the last one went missing and the sender resends its
+        window: ACK the last block again, once for the window, and dally anew.
+    */
+    if (s->complete) {
+        if (s->state != TFTP_SESSION_DALLY || pkt->opcode != TFTP_DATA) {
+            return 0;
+        }
+        s->metrics.duplicates++;
+        if (!s->ack_pending) {
+            TFTP_DEBUG("%s Block %d again, ACKing the last block %d again\n", s->config.log_prefix, pkt->block,
+                       s->ack_block);
+            s->ack_pending = 1;
+            s->resending = 1;
+        }
+        return 0;
+    }
+
+    // The sender acknowledged our options, confirm with ACK 0 before the data starts
+    if (pkt->opcode == TFTP_OACK && s->expected_block == 1) {
+        struct tftp_oack oack_pkt;
+        size_t max_blksize = s->requested.blksize > DEFAULT_BLKSIZE ? s->requested.blksize : DEFAULT_BLKSIZE;
+        uint16_t max_windowsize = s->requested.windowsize > MAX_WINDOWSIZE ? MAX_WINDOWSIZE : s->requested.windowsize;
+
+        deserialize_oack_pkt((uint8_t *)buf, &oack_pkt, buf_len);
+        if (oack_pkt.blksize > max_blksize || oack_pkt.windowsize > (max_windowsize ? max_windowsize : 1) ||
+            oack_pkt.offset > s->requested.offset || (oack_pkt.compress && !s->requested.compress) ||
+            (oack_pkt.region.width && !region_within(&oack_pkt.region, &s->requested.region))) {
+            TFTP_WARN("%s Satellite raised the requested options\n", s->config.log_prefix);
+            return session_fail(s);
+        }
+        s->windowsize = oack_pkt.windowsize ? oack_pkt.windowsize : DEFAULT_WINDOWSIZE;
+        s->blksize = oack_pkt.blksize ? oack_pkt.blksize : DEFAULT_BLKSIZE;
+        s->offset = oack_pkt.offset;
+        s->tsize = oack_pkt.tsize;
+        s->tsize_known = oack_pkt.has_tsize;
+        if (s->requested.announced != NULL) {
+            *s->requested.announced = s->tsize_known ? s->tsize : 0;
+        }
+        s->compress = oack_pkt.compress;
+        if (s->requested.compressed != NULL) {
+            *s->requested.compressed = s->compress;
+        }
+        s->region = oack_pkt.region;
+        if (s->requested.granted != NULL) {
+            *s->requested.granted = s->region;
+        }
+        TFTP_INFO("%s Received OACK, windowsize: %d, blksize: %zu\n", s->config.log_prefix, s->windowsize, s->blksize);
+        if (s->tsize_known) {
+            TFTP_INFO("%s Satellite sends a file of %llu bytes\n", s->config.log_prefix, (unsigned long long)s->tsize);
+        }
+        // What was received before has to be the start of this very file
+        if (s->requested.offset && s->requested.resume_tsize &&
+            (!s->tsize_known || s->tsize != s->requested.resume_tsize)) {
+            TFTP_WARN("%s Satellite's file is not the one of %llu bytes the offset is into\n", s->config.log_prefix,
+                      (unsigned long long)s->requested.resume_tsize);
+            return session_fail(s);
+        }
+        if (s->offset != s->requested.offset) {
+            TFTP_INFO("%s Satellite resumes at byte %llu instead\n", s->config.log_prefix, (unsigned long long)s->offset);
+        }
+        if (s->compress) {
+            TFTP_INFO("%s Satellite deflates the file at level %d\n", s->config.log_prefix, s->compress);
+        } else if (s->requested.compress) {
+            TFTP_INFO("%s Satellite sends the file as is\n", s->config.log_prefix);
+        }
+        if (s->region.width) {
+            TFTP_INFO("%s Satellite sends the region %ux%u at %u,%u\n", s->config.log_prefix, s->region.width,
+                      s->region.height, s->region.x, s->region.y);
+        } else if (s->requested.region.width) {
+            TFTP_INFO("%s Satellite sends the whole image\n", s->config.log_prefix);
+        }
+
+        if (s->rtt_timing) {
+            session_rtt_sample(s, now_ms);
+        }
+        s->state = TFTP_SESSION_TRANSFER;
+        s->ack_pending = 1;
+        s->ack_block = 0;
+        s->retries = 0;
+        return 0;
+    }
+
+    if (pkt->opcode != TFTP_DATA) {
+        TFTP_WARN("%s Expected DATA, got opcode %d\n", s->config.log_prefix, pkt->opcode);
+        return session_fail(s);
+    }
+
+    // DATA without an OACK, the satellite ignored the options and sends the file from its start
+    if (s->state == TFTP_SESSION_REQUEST && s->requested.announced != NULL) {
+        *s->requested.announced = 0;
+    }
+    s->state = TFTP_SESSION_TRANSFER;
+
+    if (pkt->payload_len > s->blksize) {
+        TFTP_WARN("%s Dropping oversized DATA packet of %zu bytes\n", s->config.log_prefix, buf_len);
+        return 0;
+    }
+
+    /*
+        Blocks that were already delivered are duplicates and are never handed back twice. A
+        block from further ahead means one went missing, a duplicate that our ACK went missing:
+        either way ACK the last block received in order, once, and the sender resends the
+        window starting right after it (RFC 7440).
+    */
+    if (pkt->block != (uint16_t)s->expected_block) {
+        int duplicate = (uint16_t)(pkt->block - s->expected_block) >= 0x8000;
+        s->metrics.duplicates += duplicate;
+        if (!s->gap_acked) {
+            TFTP_DEBUG("%s %s block %d, ACKing %d\n", s->config.log_prefix, duplicate ? "Duplicate" : "Unexpected",
+                       pkt->block, (uint16_t)(s->expected_block - 1));
+            s->ack_pending = 1;
+            s->ack_block = s->expected_block - 1;
+            s->gap_acked = 1;
+            s->blocks_in_window = 0;
+        }
+        return 0;
+    }
+
+    // The rest of the window is on its way, wait a full timeout for it before ACKing again
+    if (s->rtt_timing) {
+        session_rtt_sample(s, now_ms);
+    }
+    s->expected_block++;
+    s->blocks_in_window++;
+    s->gap_acked = 0;
+    s->retries = 0;
+    s->deadline_ms = now_ms + s->rto_ms;
+
+    // ACK the last block of the window, or the last block of the file
+    s->complete = pkt->payload_len < s->blksize;
+    if (s->tsize_known && s->offset + s->received + pkt->payload_len > s->tsize) {
+        TFTP_WARN("%s Satellite sent more than the %llu bytes it announced\n", s->config.log_prefix,
+                  (unsigned long long)s->tsize);
+        return session_fail(s);
+    }
+    if (s->complete && s->tsize_known && s->offset + s->received + pkt->payload_len != s->tsize) {
+        TFTP_WARN("%s Transfer ended after %llu of %llu bytes\n", s->config.log_prefix,
+                  (unsigned long long)(s->offset + s->received + pkt->payload_len), (unsigned long long)s->tsize);
+        return session_fail(s);
+    }
+    if (s->complete || s->blocks_in_window == s->windowsize) {
+        s->ack_pending = 1;
+        s->ack_block = pkt->block;
+        s->blocks_in_window = 0;
+    }
+
+    *data = *pkt;
+    data->offset = s->offset + s->received;
+    s->received += pkt->payload_len;
+    s->metrics.blocks++;
+    s->metrics.bytes += pkt->payload_len;
+    return TFTP_SESSION_DATA;
+}
+
+// Handles a parsed packet from the peer
+static int session_on_pkt(struct tftp_session *s, struct tftp_pkt_view *pkt, const uint8_t *buf, size_t buf_len,
+                          uint64_t now_ms, struct tftp_pkt_view *data)
+{
+    if (pkt->opcode == TFTP_ERROR && s->state == TFTP_SESSION_DALLY) {
+        TFTP_WARN("%s Peer gave up with error %d after the whole file arrived\n", s->config.log_prefix, pkt->block);
+        s->state = TFTP_SESSION_DONE;
+        return 0;
+    }
+    if (pkt->opcode == TFTP_ERROR) {
+        TFTP_WARN("%s Peer aborted the transfer with error %d\n", s->config.log_prefix, pkt->block);
+        return session_fail(s);
+    }
+
+    if (s->role == TFTP_SESSION_SENDER) {
+        return sender_on_datagram(s, buf, buf_len, now_ms, pkt);
+    }
+    return receiver_on_datagram(s, pkt, buf, buf_len, now_ms, data);
+}
+
+/*
+    Feeds a datagram from the peer into the session. A receiver hands in-order DATA payloads
+    back through data, pointing into buf, and returns TFTP_SESSION_DATA: the caller has to
+    store them at data->offset in the file before the next tftp_session_poll_tx() call,
+    which may ACK them.
+    Returns 0 or TFTP_SESSION_DATA on success, -1 once the transfer failed.
+*/
+int tftp_session_on_datagram(struct tftp_session *s, const uint8_t *buf, size_t buf_len, uint64_t now_ms,
+                             struct tftp_pkt_view *data)
+{
+    struct tftp_pkt_view pkt;
+
+    if (s->state == TFTP_SESSION_FAILED) {
+        return -1;
+    }
+    if (s->state == TFTP_SESSION_DONE) {
+        return 0;
+    }
+
+    if (tftp_parse_pkt(buf, buf_len, &pkt) == -1) {
+        TFTP_WARN("%s Dropping short packet of %zu bytes\n", s->config.log_prefix, buf_len);
+        return 0;
+    }
+    return session_on_pkt(s, &pkt, buf, buf_len, now_ms, data);
+}
+
+/*
+    Feeds a receiver a DATA packet whose payload was received apart from its DATA_HDR_LEN
+    bytes long header, see tftp_session_on_datagram(). The payload handed back is payload.
+*/
+int tftp_session_on_data(struct tftp_session *s, const uint8_t *hdr, const uint8_t *payload, size_t payload_len,
+                         uint64_t now_ms, struct tftp_pkt_view *data)
+{
+    struct tftp_pkt_view pkt;
+
+    if (s->state == TFTP_SESSION_FAILED) {
+        return -1;
+    }
+    if (s->state == TFTP_SESSION_DONE) {
+        return 0;
+    }
+
+    tftp_parse_pkt(hdr, DATA_HDR_LEN, &pkt);
+    pkt.payload = payload;
+    pkt.payload_len = payload_len;
+    return session_on_pkt(s, &pkt, hdr, DATA_HDR_LEN + payload_len, now_ms, data);
+}
+
+
+// Handles an expired deadline. Returns 0 on success, -1 once the peer is given up on.
+static int session_on_timeout(struct tftp_session *s)
+{
+    s->metrics.timeouts++;
+    tftp_trace(TFTP_TRACE_TIMEOUT, s->role == TFTP_SESSION_SENDER ? s->base : s->ack_block, s->retries + 1);
+    if (++s->retries > s->config.max_retries) {
+        TFTP_WARN("%s Peer stopped responding, giving up\n", s->config.log_prefix);
+        return session_fail(s);
+    }
+
+    TFTP_DEBUG("%s No answer within %u ms, retransmitting (%d/%d)\n", s->config.log_prefix, s->rto_ms,
+               s->retries, s->config.max_retries);
+
+    // Back off, and never time what is resent: its answer could belong to either copy
+    s->rto_ms = s->rto_ms * 2 > MAX_RTO_MS ? MAX_RTO_MS : s->rto_ms * 2;
+    s->rtt_timing = 0;
+    s->resending = 1;
+
+    if (s->role == TFTP_SESSION_SENDER) {
+        // The peer's own retransmitted ACK will cross the resent window, do not answer it again
+        s->next_block = s->base;
+        s->dup_acked = 1;
+    } else if (s->state == TFTP_SESSION_REQUEST) {
+        s->rrq_sent = 0;
+    } else {
+        s->ack_pending = 1;
+    }
+    return 0;
+}
+
+// Bytes that block_num carries, the size of a source that has not ended yet counts as unlimited
+static size_t session_block_len(const struct tftp_session *s, uint32_t block_num)
+{
+    uint64_t left = s->tsize - (s->offset + (uint64_t)(block_num - 1) * s->blksize);
+    return left > s->blksize ? s->blksize : left;
+}
+
+// Where block_num is kept in the cache, no two blocks of a window share a slot
+static uint8_t *session_cache_slot(const struct tftp_session *s, uint32_t block_num)
+{
+    return s->cache + (size_t)(block_num % s->windowsize) * s->blksize;
+}
+
+/*
+    Reads the blocks of the window that were not read from the source yet. The first short
+    block of a source without a size is its last one.
+    Returns 0 on success, -1 on failure.
+*/
+static int session_read_window(struct tftp_session *s)
+{
+    while (s->read_end <= session_window_end(s)) {
+        uint32_t block_num = s->read_end;
+        uint64_t offset = s->offset + (uint64_t)(block_num - 1) * s->blksize;
+        size_t expected = session_block_len(s, block_num);
+
+        ssize_t len = s->src->read(s->src->ctx, offset, session_cache_slot(s, block_num), expected);
+        if (len < 0) {
+            TFTP_WARN("%s Unable to read block %u of the file\n", s->config.log_prefix, block_num);
+            return session_fail(s);
+        }
+        if (s->tsize != TFTP_SIZE_UNKNOWN && (size_t)len != expected) {
+            TFTP_WARN("%s File ended at byte %llu of %llu\n", s->config.log_prefix,
+                      (unsigned long long)(offset + len), (unsigned long long)s->tsize);
+            return session_fail(s);
+        }
+        if (s->tsize == TFTP_SIZE_UNKNOWN && (size_t)len < s->blksize) {
+            s->tsize = offset + len;
+            s->last_block = block_num;
+        } else if (s->tsize == TFTP_SIZE_UNKNOWN && block_num == s->last_block) {
+            TFTP_WARN("%s File does not fit in %u blocks of %zu bytes\n", s->config.log_prefix, block_num, s->blksize);
+            return session_fail(s);
+        }
+        s->read_end++;
+    }
+    return 0;
+}
+
+static int sender_poll_tx(struct tftp_session *s, struct tftp_tx *txs, int max_txs)
+{
+    if (s->base == 0) {
+        txs[0] = (struct tftp_tx) { .hdr = s->ctrl_pkt, .hdr_len = s->ctrl_len };
+        return 1;
+    }
+    if (s->src != NULL && session_read_window(s) == -1) {
+        return -1;
+    }
+
+    uint32_t window_end = session_window_end(s);
+    int tx_count = 0;
+
+    for (uint32_t block_num = s->next_block; block_num <= window_end && tx_count < max_txs; block_num++, tx_count++) {
+        uint64_t offset = s->offset + (uint64_t)(block_num - 1) * s->blksize;
+        size_t data_size = session_block_len(s, block_num);
+
+        struct tftp_data data_pkt = {
+            .opcode = TFTP_DATA,
+            .block = (uint16_t)block_num
+        };
+        serialize_data_hdr(s->hdrs[tx_count], &data_pkt);
+
+        txs[tx_count] = (struct tftp_tx) {
+            .hdr = s->hdrs[tx_count],
+            .hdr_len = DATA_HDR_LEN,
+            .payload = s->src != NULL ? session_cache_slot(s, block_num) : s->buf + offset,
+            .payload_len = data_size
+        };
+    }
+    return tx_count;
+}
+
+static int receiver_poll_tx(struct tftp_session *s, struct tftp_tx *txs)
+{
+    size_t pkt_len;
+
+    if (!s->rrq_sent) {
+        struct tftp_request rrq = {
+            .opcode = TFTP_RRQ,
+            .windowsize = s->requested.windowsize,
+            .blksize = s->requested.blksize,
+            .offset = s->requested.offset,
+            .tsize = s->requested.tsize,
+            .compress = s->requested.compress,
+            .region = s->requested.region
+        };
+        strcpy(rrq.filename, s->filename);
+        strcpy(rrq.mode, tftp_mode_str[MODE_OCTET]);
+        pkt_len = serialize_rrq_pkt(s->ctrl_pkt, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+    } else if (s->ack_pending) {
+        struct tftp_ack ack_pkt = {
+            .opcode = TFTP_ACK,
+            .block = s->ack_block
+        };
+        serialize_ack_pkt(s->ctrl_pkt, &ack_pkt);
+        pkt_len = DATA_HDR_LEN;
+    } else {
+        return 0;
+    }
+
+    txs[0] = (struct tftp_tx) { .hdr = s->ctrl_pkt, .hdr_len = pkt_len };
+    return 1;
+}
+
+// Nothing is left to send until the peer answers or the deadline passes
+static int session_idle(const struct tftp_session *s)
+{
+    if (s->role == TFTP_SESSION_SENDER) {
+        return s->state == TFTP_SESSION_REQUEST || s->next_block > session_window_end(s);
+    }
+    return s->rrq_sent && !s->ack_pending;
+}
+
+/*
+    Fills txs with up to max_txs packets that should go out now, without consuming them:
+    report how many were actually sent with tftp_session_tx_done(). Packets point into the
+    session and the sender's buffer or cache, and stay valid until the next call on the session.
+    A sender reads the blocks of a source here, as the window reaches them.
+    Returns the number of packets, 0 if there is nothing to send, -1 once the transfer failed.
+*/
+int tftp_session_poll_tx(struct tftp_session *s, uint64_t now_ms, struct tftp_tx *txs, int max_txs)
+{
+    if (s->state == TFTP_SESSION_FAILED) {
+        return -1;
+    }
+    if (s->state == TFTP_SESSION_DONE || max_txs < 1) {
+        return 0;
+    }
+
+    // The last block did not come again while dallying, so the sender got its ACK
+    if (s->state == TFTP_SESSION_DALLY && !s->ack_pending && now_ms >= s->deadline_ms) {
+        s->state = TFTP_SESSION_DONE;
+        return 0;
+    }
+
+    // Retransmit only once everything was sent and the peer still did not answer in time
+    if (session_idle(s) && s->deadline_ms != 0 && now_ms >= s->deadline_ms && session_on_timeout(s) == -1) {
+        return -1;
+    }
+
+    if (s->role == TFTP_SESSION_SENDER) {
+        return s->state == TFTP_SESSION_REQUEST || session_idle(s) ? 0 : sender_poll_tx(s, txs, max_txs);
+    }
+    return receiver_poll_tx(s, txs);
+}
+
+/*
+    Consumes the first sent packets of the last tftp_session_poll_tx() call. Packets the peer's
+    queue had no room for are polled again after SEND_RETRY_MS, once all of them went out the
+    retransmission timer starts.
+*/
+void tftp_session_tx_done(struct tftp_session *s, int sent, uint64_t now_ms)
+{
+    if (s->state == TFTP_SESSION_DONE || s->state == TFTP_SESSION_FAILED) {
+        return;
+    }
+    if (sent <= 0) {
+        s->deadline_ms = now_ms + SEND_RETRY_MS;
+        return;
+    }
+
+    if (s->role == TFTP_SESSION_SENDER) {
+        // Blocks below sent_end went out before, the OACK counts as block 0
+        uint32_t sent_blocks = s->base == 0 ? 1 : sent;
+        for (uint32_t block_num = s->next_block; block_num < s->next_block + sent_blocks; block_num++) {
+            if (block_num < s->sent_end) {
+                s->metrics.retransmits++;
+                tftp_trace(TFTP_TRACE_RETRANSMIT, block_num, 0);
+            } else if (block_num > 0) {
+                s->metrics.blocks++;
+                s->metrics.bytes += session_block_len(s, block_num);
+            }
+        }
+        s->next_block += sent_blocks;
+
+        // Time the window by its last block, as long as that went out for the first time
+        uint32_t last_sent = s->base == 0 ? 0 : s->next_block - 1;
+        if (last_sent >= s->sent_end) {
+            if (!s->rtt_timing) {
+                session_rtt_start(s, now_ms, last_sent);
+            }
+            s->sent_end = last_sent + 1;
+        }
+    } else {
+        if (s->resending) {
+            s->metrics.retransmits++;
+            tftp_trace(TFTP_TRACE_RETRANSMIT, s->rrq_sent ? s->ack_block : 0, 0);
+        }
+        if (!s->rrq_sent) {
+            s->rrq_sent = 1;
+            if (s->metrics.start_ms == 0) {
+                s->metrics.start_ms = now_ms;
+            }
+        } else {
+            s->ack_pending = 0;
+            // Nothing follows the ACK of the last block, but the block itself if the ACK went missing
+            if (s->complete) {
+                s->state = TFTP_SESSION_DALLY;
+            }
+        }
+
+        if (!s->resending) {
+            session_rtt_start(s, now_ms, 0);
+        }
+        s->resending = 0;
+    }
+
+    if (s->state == TFTP_SESSION_DALLY) {
+        s->deadline_ms = now_ms + (uint64_t)DALLY_RTOS * s->rto_ms;
+    } else {
+        s->deadline_ms = now_ms + (session_idle(s) ? s->rto_ms : SEND_RETRY_MS);
+    }
+}
+
+// Time at which tftp_session_poll_tx() wants to be called again
+uint64_t tftp_session_next_deadline(const struct tftp_session *s)
+{
+    if (s->state == TFTP_SESSION_DONE || s->state == TFTP_SESSION_FAILED ||
+        (s->role == TFTP_SESSION_SENDER && s->state == TFTP_SESSION_REQUEST)) {
+        return TFTP_SESSION_NO_DEADLINE;
+    }
+    return s->deadline_ms;
+}
+
+/*
+    Returns how many bytes at the start of a sender's buffer the receiver has ACKed, counting
+    the ones it already had when it resumed.
+*/
+size_t tftp_session_acked_bytes(const struct tftp_session *s)
+{
+    if (s->role != TFTP_SESSION_SENDER || s->base <= 1) {
+        return 0;
+    }
+
+    uint64_t acked = s->offset + (uint64_t)(s->base - 1) * s->blksize;
+    return acked > s->tsize ? s->tsize : acked;
+}
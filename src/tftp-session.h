@@ -0,0 +1,152 @@
+#ifndef TFTP_SESSION_H
+#define TFTP_SESSION_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "tftp.h"
+#include "tftp-io.h"
+#include "tftp-metrics.h"
+
+/*
+    The protocol core shared by the blocking transfer functions, the satellite server and any
+    event loop built on top of them.
+
+    A session is a pure state machine: it never touches a socket or a clock. The caller feeds
+    it every datagram from the peer with tftp_session_on_datagram(), asks tftp_session_poll_tx()
+    what to send, reports how much of that actually went out with tftp_session_tx_done(), and
+    calls tftp_session_poll_tx() again once tftp_session_next_deadline() has passed.
+*/
+
+// Retransmission defaults
+#define DEFAULT_TIMEOUT_MS 1000 // until the first round trip was measured
+#define DEFAULT_MAX_RETRIES 5
+#define MIN_RTO_MS 200          // lower bound of a measured timeout, unless timeout_ms is lower still
+#define MAX_RTO_MS 60000        // upper bound of the timeout, backoff included
+#define SEND_RETRY_MS 1 // wait before retrying packets the peer's queue had no room for
+#define DALLY_RTOS 2    // timeouts a receiver waits after its last ACK, the sender's own one and as much again
+
+#define CTRL_PKT_LEN 512 // RRQ, OACK and ACK packets built by a session
+
+// tftp_session_on_datagram() handed back a DATA payload for the caller to store
+#define TFTP_SESSION_DATA 1
+
+// tftp_session_next_deadline() of a session that waits on its peer without a timer
+#define TFTP_SESSION_NO_DEADLINE UINT64_MAX
+
+enum tftp_session_role {
+    TFTP_SESSION_SENDER,   // the satellite, answering a RRQ
+    TFTP_SESSION_RECEIVER  // the ground station, sending the RRQ
+};
+
+enum tftp_session_state {
+    TFTP_SESSION_REQUEST,  // sender waits for the RRQ, receiver for the first answer
+    TFTP_SESSION_TRANSFER,
+    TFTP_SESSION_DALLY,    // receiver has the whole file, and ACKs its last block again if it is resent
+    TFTP_SESSION_DONE,
+    TFTP_SESSION_FAILED
+};
+
+// Deflates the file of a sender, see tftp-compress.h
+struct tftp_compressor;
+
+/*
+    Cuts the region a RRQ asks for out of an image the sender holds in memory. crop clips
+    region to the image and returns the source of the smaller image, or NULL if the file has
+    no such region and goes out whole. The source is read through the window cache.
+*/
+struct tftp_cropper {
+    const struct tftp_source *(*crop)(void *ctx, const uint8_t *file, uint64_t size, struct tftp_region *region);
+    void *ctx;
+};
+
+struct tftp_session_config {
+    int timeout_ms;         // initial retransmission timeout, 0 = DEFAULT_TIMEOUT_MS
+    int max_retries;        // timeouts in a row, 0 = DEFAULT_MAX_RETRIES
+    const char *log_prefix;
+    struct tftp_compressor *compressor; // sender: deflates the file if the RRQ asks, NULL to always send it as is
+    const struct tftp_cropper *cropper; // sender: sends the region the RRQ asks for, NULL to always send the whole file
+};
+
+// One packet to send: a header built by the session, and a payload pointing into the caller's buffer
+struct tftp_tx {
+    const uint8_t *hdr;
+    size_t hdr_len;
+    const uint8_t *payload;
+    size_t payload_len;
+};
+
+struct tftp_session {
+    enum tftp_session_role role;
+    enum tftp_session_state state;
+    struct tftp_session_config config;
+
+    uint16_t windowsize;
+    size_t blksize;
+    uint64_t offset;     // byte of the file that block 1 starts at, above 0 when resuming
+    uint64_t tsize;      // size of the whole file, TFTP_SIZE_UNKNOWN until a sender's source ended
+    int tsize_known;     // receiver: the sender announced tsize
+    int compress;        // zlib level the file is deflated at, 0 = sent as is
+    struct tftp_region region; // region of the image the file is cut to, width 0 = the whole file
+
+    // Sender
+    const uint8_t *buf;
+    size_t buf_len;
+    const struct tftp_source *src; // read block by block into the window cache, NULL to send buf
+    uint8_t *cache;      // window of blocks read from src, block n in slot n % windowsize
+    size_t cache_len;
+    uint32_t read_end;   // one past the last block read from src
+    uint32_t base;       // oldest unacknowledged block, 0 while the OACK is unacknowledged
+    uint32_t next_block; // next block to send
+    uint32_t last_block;
+    uint32_t sent_end;   // one past the highest block sent so far, the OACK counts as block 0
+    int dup_acked;       // the window was already resent for a repeated ACK
+
+    // Receiver
+    struct tftp_options requested;
+    char filename[MAX_FILENAME_LEN];
+    int rrq_sent;
+    int ack_pending;     // ack_block still has to be sent
+    uint16_t ack_block;  // latest ACK, sent again on timeout
+    uint32_t expected_block; // counts on where the block number on the wire rolls over
+    uint16_t blocks_in_window;
+    int gap_acked;
+    int complete;        // last block received, its ACK may still be pending
+    int dup_data_acked;  // the latest ACK was already resent for a duplicate block
+    uint64_t received;   // payload bytes handed back, the next one belongs at offset + received
+
+    // Retransmission timer (RFC 6298), SRTT and RTTVAR are kept scaled by 8 and 4
+    int retries;
+    int resending;        // the pending packet is a retransmission, which is never timed (Karn)
+    int rtt_timing;       // a round trip is being measured
+    uint64_t rtt_start_ms;
+    uint32_t rtt_block;   // sender: the ACK that ends the measured round trip
+    int rtt_samples;
+    uint32_t srtt8;
+    uint32_t rttvar4;
+    uint32_t rto_ms;
+    uint64_t deadline_ms; // 0 = send right away
+
+    struct tftp_metrics metrics;
+
+    uint8_t ctrl_pkt[CTRL_PKT_LEN]; // RRQ, OACK or ACK
+    size_t ctrl_len;
+    uint8_t hdrs[MAX_WINDOWSIZE][DATA_HDR_LEN];
+};
+
+// Public interface
+void tftp_session_init_sender(struct tftp_session *s, const uint8_t *buf, size_t buf_len,
+                              const struct tftp_session_config *config);
+void tftp_session_init_source(struct tftp_session *s, const struct tftp_source *src, uint8_t *cache, size_t cache_len,
+                              const struct tftp_session_config *config);
+void tftp_session_init_receiver(struct tftp_session *s, const char *filename, const struct tftp_options *opts,
+                                const struct tftp_session_config *config);
+int tftp_session_on_datagram(struct tftp_session *s, const uint8_t *buf, size_t buf_len, uint64_t now_ms,
+                             struct tftp_pkt_view *data);
+int tftp_session_on_data(struct tftp_session *s, const uint8_t *hdr, const uint8_t *payload, size_t payload_len,
+                         uint64_t now_ms, struct tftp_pkt_view *data);
+int tftp_session_poll_tx(struct tftp_session *s, uint64_t now_ms, struct tftp_tx *txs, int max_txs);
+void tftp_session_tx_done(struct tftp_session *s, int sent, uint64_t now_ms);
+uint64_t tftp_session_next_deadline(const struct tftp_session *s);
+size_t tftp_session_acked_bytes(const struct tftp_session *s);
+
+#endif // TFTP_SESSION_H
@@ -0,0 +1,549 @@
+#define _GNU_SOURCE // syscall
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+#include "tftp-shm.h"
+#include "tftp-session.h"
+#include "tftp-log.h"
+
+#define SHM_MAGIC 0x54465350 // "TFSP"
+#define SHM_VERSION 1
+
+#define SHM_REC_HDR 4            // record length in front of every packet
+#define SHM_REC_ALIGN 8
+#define SHM_WRAP UINT32_MAX      // record length that skips to the start of the ring
+#define SHM_SPIN 128             // polls before a side goes to sleep on the futex
+#define SHM_ATTACH_WAIT_MS 1000  // for the satellite to finish setting the segment up
+
+/*
+    Producer and consumer positions live on cache lines of their own, so the two sides never
+    write to the same line. Positions are byte offsets that run freely and wrap at 2^32, the
+    ring sizes are powers of two so they wrap together with them.
+*/
+struct shm_ring_ctl {
+    uint32_t head;             // written by the consumer
+    uint32_t producer_waiting; // producer sleeps on head
+    uint8_t pad0[56];
+    uint32_t tail;             // written by the producer
+    uint32_t consumer_waiting; // consumer sleeps on tail
+    uint8_t pad1[56];
+};
+
+struct shm_segment {
+    uint32_t magic;   // set last, once both rings are ready
+    uint32_t version;
+    uint32_t data_size;
+    uint32_t ack_size;
+    uint8_t pad[48];
+    struct shm_ring_ctl data;
+    struct shm_ring_ctl ack;
+};
+
+#define SHM_DATA_OFFSET 4096
+#define SHM_ACK_OFFSET (SHM_DATA_OFFSET + SHM_DATA_RING_SIZE)
+#define SHM_SEGMENT_LEN (SHM_ACK_OFFSET + SHM_ACK_RING_SIZE)
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static uint32_t record_space(size_t len)
+{
+    return (SHM_REC_HDR + len + SHM_REC_ALIGN - 1) & ~(uint32_t)(SHM_REC_ALIGN - 1);
+}
+
+/*
+    Sleeps while *word still holds val, for at most timeout_ms (forever if it is < 0). The
+    segment is shared between processes, so these are not FUTEX_PRIVATE operations.
+*/
+static void futex_wait(struct tftp_shm_ring *r, uint32_t *word, uint32_t val, int timeout_ms)
+{
+    struct timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+
+    r->futex_calls++;
+    syscall(SYS_futex, word, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static void futex_wake(struct tftp_shm_ring *r, uint32_t *word)
+{
+    r->futex_calls++;
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+    Waits until *word no longer holds val. The waiting flag is raised before *word is read
+    again, and the other side writes *word before it reads the flag, so either the other side
+    sees the flag and wakes us, or we see the new value and don't sleep at all.
+    Returns 0 once it changed, -1 on timeout.
+*/
+static int ring_wait_change(struct tftp_shm_ring *r, uint32_t *word, uint32_t *waiting, uint32_t val, int timeout_ms)
+{
+    for (int i = 0; i < SHM_SPIN; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val) {
+            return 0;
+        }
+        cpu_relax();
+    }
+
+    uint64_t deadline = now_ms() + (timeout_ms < 0 ? 0 : timeout_ms);
+    int result = 0;
+
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == val) {
+        int64_t left = timeout_ms < 0 ? -1 : (int64_t)deadline - (int64_t)now_ms();
+        if (timeout_ms >= 0 && left <= 0) {
+            result = -1;
+            break;
+        }
+        futex_wait(r, word, val, (int)left);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return result;
+}
+
+static void ring_init(struct tftp_shm_ring *r, struct shm_ring_ctl *ctl, uint8_t *data, uint32_t size)
+{
+    memset(r, 0, sizeof(struct tftp_shm_ring));
+    r->ctl = ctl;
+    r->data = data;
+    r->size = size;
+    r->next = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+}
+
+static void link_init(struct tftp_shm_link *link, const char *name, void *map, int owner)
+{
+    struct shm_segment *seg = map;
+
+    link->map = map;
+    link->map_len = SHM_SEGMENT_LEN;
+    link->owner = owner;
+    strncpy(link->name, name, sizeof(link->name) - 1);
+    link->name[sizeof(link->name) - 1] = '\0';
+    ring_init(&link->data, &seg->data, (uint8_t *)map + SHM_DATA_OFFSET, SHM_DATA_RING_SIZE);
+    ring_init(&link->ack, &seg->ack, (uint8_t *)map + SHM_ACK_OFFSET, SHM_ACK_RING_SIZE);
+}
+
+/*
+    The satellite side: creates the segment under name, replacing one left behind by an
+    earlier run. Returns 0 on success, -1 on failure.
+*/
+int tftp_shm_create(struct tftp_shm_link *link, const char *name)
+{
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        perror("unable to create shared memory link");
+        return -1;
+    }
+
+    if (ftruncate(fd, SHM_SEGMENT_LEN) == -1) {
+        perror("unable to size shared memory link");
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    void *map = mmap(NULL, SHM_SEGMENT_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("unable to map shared memory link");
+        shm_unlink(name);
+        return -1;
+    }
+
+    // A fresh segment is all zeroes: both rings are empty and nobody waits
+    struct shm_segment *seg = map;
+    seg->version = SHM_VERSION;
+    seg->data_size = SHM_DATA_RING_SIZE;
+    seg->ack_size = SHM_ACK_RING_SIZE;
+    __atomic_store_n(&seg->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    link_init(link, name, map, 1);
+    return 0;
+}
+
+/*
+    The ground station side: maps the segment the satellite created under name.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_shm_attach(struct tftp_shm_link *link, const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        perror("unable to open shared memory link");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < SHM_SEGMENT_LEN) {
+        fprintf(stderr, "Shared memory link %s is not set up\n", name);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, SHM_SEGMENT_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("unable to map shared memory link");
+        return -1;
+    }
+
+    struct shm_segment *seg = map;
+    uint64_t give_up = now_ms() + SHM_ATTACH_WAIT_MS;
+    while (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC && now_ms() < give_up) {
+        usleep(1000);
+    }
+    if (seg->magic != SHM_MAGIC || seg->version != SHM_VERSION ||
+        seg->data_size != SHM_DATA_RING_SIZE || seg->ack_size != SHM_ACK_RING_SIZE) {
+        fprintf(stderr, "Shared memory link %s has an unknown layout\n", name);
+        munmap(map, SHM_SEGMENT_LEN);
+        return -1;
+    }
+
+    link_init(link, name, map, 0);
+    return 0;
+}
+
+void tftp_shm_close(struct tftp_shm_link *link)
+{
+    munmap(link->map, link->map_len);
+    if (link->owner) {
+        shm_unlink(link->name);
+    }
+}
+
+/*
+    Reserves room for a packet of len bytes on a ring this side produces, waiting up to
+    timeout_ms for the consumer to make room. The packet becomes visible with tftp_shm_commit.
+    Returns where to write the packet, NULL on timeout or if it could never fit.
+*/
+uint8_t *tftp_shm_reserve(struct tftp_shm_ring *r, size_t len, int timeout_ms)
+{
+    uint32_t space = record_space(len);
+    if (space > r->size / 2) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    // A record never wraps, a tail too short for it is skipped
+    uint32_t tail = r->ctl->tail;
+    uint32_t offset = tail & (r->size - 1);
+    uint32_t needed = offset + space > r->size ? (r->size - offset) + space : space;
+
+    uint32_t head;
+    while (tail - (head = __atomic_load_n(&r->ctl->head, __ATOMIC_ACQUIRE)) > r->size - needed) {
+        if (ring_wait_change(r, &r->ctl->head, &r->ctl->producer_waiting, head, timeout_ms) == -1) {
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+    }
+
+    r->reserved_pos = tail;
+    r->reserved_len = needed;
+    if (needed != space) {
+        *(uint32_t *)(r->data + offset) = SHM_WRAP;
+        offset = 0;
+    }
+    *(uint32_t *)(r->data + offset) = len;
+    return r->data + offset + SHM_REC_HDR;
+}
+
+// Publishes the packet written to the last tftp_shm_reserve, waking the consumer if it sleeps
+void tftp_shm_commit(struct tftp_shm_ring *r)
+{
+    __atomic_store_n(&r->ctl->tail, r->reserved_pos + r->reserved_len, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->ctl->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(r, &r->ctl->tail);
+    }
+}
+
+/*
+    Waits up to timeout_ms (forever if it is < 0) for a packet on a ring this side consumes.
+    Returns 0 once there is one, -1 on timeout.
+*/
+int tftp_shm_wait(struct tftp_shm_ring *r, int timeout_ms)
+{
+    return ring_wait_change(r, &r->ctl->tail, &r->ctl->consumer_waiting, r->next, timeout_ms);
+}
+
+/*
+    Returns the next packet on a ring this side consumes and its length, NULL if there is none.
+    It stays valid, in place, until tftp_shm_release.
+*/
+const uint8_t *tftp_shm_next(struct tftp_shm_ring *r, size_t *len)
+{
+    uint32_t tail = __atomic_load_n(&r->ctl->tail, __ATOMIC_ACQUIRE);
+
+    while (r->next != tail) {
+        uint32_t offset = r->next & (r->size - 1);
+        uint32_t rec_len = *(uint32_t *)(r->data + offset);
+
+        if (rec_len == SHM_WRAP) {
+            r->next += r->size - offset;
+            continue;
+        }
+
+        r->next += record_space(rec_len);
+        *len = rec_len;
+        return r->data + offset + SHM_REC_HDR;
+    }
+    return NULL;
+}
+
+// Hands the packets returned by tftp_shm_next back to the producer
+void tftp_shm_release(struct tftp_shm_ring *r)
+{
+    __atomic_store_n(&r->ctl->head, r->next, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->ctl->producer_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(r, &r->ctl->head);
+    }
+}
+
+// How long to wait for the peer before the session wants to retransmit
+static int session_wait_ms(const struct tftp_session *session)
+{
+    uint64_t deadline = tftp_session_next_deadline(session);
+    uint64_t now = now_ms();
+
+    if (deadline == TFTP_SESSION_NO_DEADLINE) {
+        return -1;
+    }
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+/*
+    Moves everything the session has to send onto ring. DATA packets are framed by
+    serialize_data_pkt, straight into the ring, so the payload is copied exactly once.
+    Returns 0 on success, -1 on failure.
+*/
+static int shm_flush(struct tftp_shm_ring *r, struct tftp_session *session, const char *log_prefix)
+{
+    struct tftp_tx txs[MAX_WINDOWSIZE];
+    int tx_count;
+
+    while ((tx_count = tftp_session_poll_tx(session, now_ms(), txs, MAX_WINDOWSIZE)) > 0) {
+        for (int i = 0; i < tx_count; i++) {
+            uint8_t *pkt = tftp_shm_reserve(r, txs[i].hdr_len + txs[i].payload_len, session->rto_ms);
+            if (pkt == NULL) {
+                fprintf(stderr, "%s Unable to queue packet on the shared memory link: %s\n", log_prefix, strerror(errno));
+                return -1;
+            }
+
+            uint16_t opcode = (txs[i].hdr[0] << 8) | txs[i].hdr[1];
+            if (opcode == TFTP_DATA && txs[i].hdr_len == DATA_HDR_LEN) {
+                struct tftp_data data_pkt = {
+                    .opcode = TFTP_DATA,
+                    .block = (txs[i].hdr[2] << 8) | txs[i].hdr[3],
+                    .data = (uint8_t *)txs[i].payload
+                };
+                serialize_data_pkt(pkt, &data_pkt, txs[i].payload_len);
+            } else {
+                memcpy(pkt, txs[i].hdr, txs[i].hdr_len);
+                memcpy(pkt + txs[i].hdr_len, txs[i].payload, txs[i].payload_len);
+            }
+            tftp_shm_commit(r);
+        }
+        tftp_session_tx_done(session, tx_count, now_ms());
+    }
+    return tx_count;
+}
+
+static void report_futex_calls(const struct tftp_shm_link *link, unsigned long packets, const char *log_prefix)
+{
+    unsigned long calls = link->data.futex_calls + link->ack.futex_calls;
+
+    if (packets > 0) {
+        TFTP_INFO("%s Shared memory: %lu packets, %lu futex calls (%.3f per packet)\n", log_prefix,
+                  packets, calls, (double)calls / packets);
+    }
+}
+
+/*
+    The satellite sending buf over a shared-memory link, see tftp_send_file.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_shm_send_file(struct tftp_shm_link *link, const uint8_t *buf, size_t buf_len, const char *log_prefix)
+{
+    TFTP_INFO("%s Starting file send of %zu bytes over shared memory\n", log_prefix, buf_len);
+
+    struct tftp_session_config config = { .log_prefix = log_prefix };
+    struct tftp_session session;
+    tftp_session_init_sender(&session, buf, buf_len, &config);
+    unsigned long packets = 0;
+
+    while (session.state != TFTP_SESSION_DONE) {
+        // Send DATA packets (or the OACK) of the current window
+        uint32_t next_block = session.next_block;
+        if (shm_flush(&link->data, &session, log_prefix) == -1) {
+            return -1;
+        }
+        packets += session.next_block - next_block;
+
+        // Wait for the RRQ, then for ACKs
+        int ready = tftp_shm_wait(&link->ack, session_wait_ms(&session));
+        tftp_metrics_poll(&session.metrics, log_prefix);
+        if (ready == -1) {
+            continue;
+        }
+
+        const uint8_t *pkt;
+        size_t pkt_len;
+        while ((pkt = tftp_shm_next(&link->ack, &pkt_len)) != NULL) {
+            enum tftp_session_state state = session.state;
+            uint32_t base = session.base;
+            if (tftp_session_on_datagram(&session, pkt, pkt_len, now_ms(), NULL) == -1) {
+                return -1;
+            }
+
+            if (state == TFTP_SESSION_REQUEST) {
+                TFTP_INFO("%s Received RRQ from client, windowsize: %d, blksize: %zu\n", log_prefix,
+                          session.windowsize, session.blksize);
+            } else if (session.base != base) {
+                TFTP_DEBUG("%s Received ACK for block %d\n", log_prefix, session.base - 1);
+            }
+        }
+        tftp_shm_release(&link->ack);
+    }
+
+    TFTP_INFO("%s File send completed successfully\n", log_prefix);
+    tftp_metrics_log(&session.metrics, log_prefix);
+    report_futex_calls(link, packets, log_prefix);
+    return 0;
+}
+
+/*
+    The ground station retrieving a file over a shared-memory link into sink, see
+    tftp_retrieve_file. Payloads are written to the sink straight out of the ring, which only
+    gets the space back once they are written, or copied into the sink's mapping once the
+    satellite announced the size. Returns 0 on success, -1 on failure.
+*/
+int tftp_shm_retrieve_file(struct tftp_shm_link *link, struct tftp_sink *sink, const struct tftp_options *opts,
+                           const char *log_prefix)
+{
+    TFTP_INFO("%s Starting file retrieval over shared memory\n", log_prefix);
+
+    struct tftp_options resume_opts = { 0 };
+    if (opts != NULL) {
+        resume_opts = *opts;
+    }
+    resume_opts.tsize = 1;
+
+    // Open the image, or what an earlier pass left of it
+    struct tftp_image image;
+    struct tftp_sink image_sink;
+    if (sink == NULL) {
+        if (tftp_image_open(&image, RECEIVED_IMAGE_PATH, &resume_opts, log_prefix) == -1) {
+            return -1;
+        }
+        tftp_image_sink(&image_sink, &image);
+        sink = &image_sink;
+    }
+
+    struct tftp_session_config config = { .log_prefix = log_prefix };
+    struct tftp_session session;
+    tftp_session_init_receiver(&session, "temp_file", &resume_opts, &config);
+
+    struct iovec write_iovs[MAX_WINDOWSIZE];
+    int write_count = 0;
+    uint64_t write_offset = 0, write_end = resume_opts.offset, progress_end = resume_opts.offset;
+    uint8_t *map = NULL;
+    int map_tried = 0;
+    unsigned long packets = 0;
+    int result = -1;
+
+    // Send a RRQ
+    if (shm_flush(&link->ack, &session, log_prefix) == -1) {
+        goto cleanup;
+    }
+
+    while (session.state != TFTP_SESSION_DONE) {
+        int ready = tftp_shm_wait(&link->data, session_wait_ms(&session));
+        tftp_metrics_poll(&session.metrics, log_prefix);
+        if (ready == 0) {
+            const uint8_t *pkt;
+            size_t pkt_len;
+
+            // At most a window per round, so its ACK isn't held back by the next one
+            int round_pkts = 0;
+            while (round_pkts++ < MAX_WINDOWSIZE && (pkt = tftp_shm_next(&link->data, &pkt_len)) != NULL) {
+                struct tftp_pkt_view data;
+                int status = tftp_session_on_datagram(&session, pkt, pkt_len, now_ms(), &data);
+                if (status == -1) {
+                    goto cleanup;
+                }
+                if (session.tsize_known && !map_tried) {
+                    map_tried = 1;
+                    map = sink->map != NULL ? sink->map(sink->ctx, session.tsize) : NULL;
+                }
+
+                if (status == TFTP_SESSION_DATA) {
+                    TFTP_DEBUG("%s Received Data packet. Opcode: %d, Block: %d\n", log_prefix, data.opcode, data.block);
+                    if (map != NULL) {
+                        tftp_place(map, data.offset, data.payload, data.payload_len);
+                    } else {
+                        if (write_count == 0) {
+                            write_offset = data.offset;
+                        }
+                        write_iovs[write_count++] = (struct iovec) {
+                            .iov_base = (uint8_t *)data.payload,
+                            .iov_len = data.payload_len
+                        };
+                    }
+                    write_end = data.offset + data.payload_len;
+                    packets++;
+                }
+            }
+
+            if (write_count > 0 && sink->write(sink->ctx, write_offset, write_iovs, write_count) == -1) {
+                perror("unable to write image");
+                goto cleanup;
+            }
+            write_count = 0;
+            if (write_end != progress_end) {
+                progress_end = write_end;
+                if (sink->progress != NULL) {
+                    sink->progress(sink->ctx, write_end);
+                }
+            }
+            tftp_shm_release(&link->data);
+        }
+
+        // ACK what was just written, or resend the last ACK once the session times out
+        if (shm_flush(&link->ack, &session, log_prefix) == -1) {
+            goto cleanup;
+        }
+    }
+
+    TFTP_INFO("%s Sent Ack packet with block: %d!\n", log_prefix, session.ack_block);
+    report_futex_calls(link, packets, log_prefix);
+    result = 0;
+
+cleanup:
+    tftp_metrics_log(&session.metrics, log_prefix);
+    if (resume_opts.metrics != NULL) {
+        *resume_opts.metrics = session.metrics;
+    }
+    if (sink->close != NULL && sink->close(sink->ctx, result == 0) == -1) {
+        result = -1;
+    }
+    return result;
+}
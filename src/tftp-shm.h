@@ -0,0 +1,62 @@
+#ifndef TFTP_SHM_H
+#define TFTP_SHM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "tftp.h"
+
+/*
+    Shared-memory link between a satellite and a ground station on the same host.
+
+    The satellite creates a POSIX shared-memory segment holding two single-producer
+    single-consumer rings: DATA packets flow to the ground station on one, the RRQ and ACKs
+    flow back on the other. Every record is a complete TFTP packet, framed exactly like a
+    datagram on the socket (DATA packets are written by serialize_data_pkt), so both ends run
+    the same tftp_session as over AF_UNIX. Neither side makes a system call while the other
+    keeps up; a side that runs out of records (or of room) spins briefly and then sleeps on a
+    futex in the segment, which the other side only wakes when it sees someone waiting.
+*/
+
+#define SHM_LINK_NAME "/satellite-link"
+
+#define SHM_DATA_RING_SIZE (8 * 1024 * 1024) // a full window of the largest blocks, twice
+#define SHM_ACK_RING_SIZE (64 * 1024)
+
+struct shm_ring_ctl; // positions and wait flags, shared with the peer
+
+// One direction of the link, as seen by one side
+struct tftp_shm_ring {
+    struct shm_ring_ctl *ctl;
+    uint8_t *data;
+    uint32_t size;          // power of two
+    uint32_t next;          // consumer: next record, handed back to the producer by tftp_shm_release
+    uint32_t reserved_pos;  // producer: where tftp_shm_reserve placed the record
+    uint32_t reserved_len;  // producer: space it takes, including a skipped tail of the ring
+    unsigned long futex_calls;
+};
+
+struct tftp_shm_link {
+    void *map;
+    size_t map_len;
+    int owner; // created the segment, removes it on close
+    char name[MAX_FILENAME_LEN];
+    struct tftp_shm_ring data; // satellite -> ground station
+    struct tftp_shm_ring ack;  // ground station -> satellite
+};
+
+// Public interface
+int tftp_shm_create(struct tftp_shm_link *link, const char *name);
+int tftp_shm_attach(struct tftp_shm_link *link, const char *name);
+void tftp_shm_close(struct tftp_shm_link *link);
+
+uint8_t *tftp_shm_reserve(struct tftp_shm_ring *r, size_t len, int timeout_ms);
+void tftp_shm_commit(struct tftp_shm_ring *r);
+int tftp_shm_wait(struct tftp_shm_ring *r, int timeout_ms);
+const uint8_t *tftp_shm_next(struct tftp_shm_ring *r, size_t *len);
+void tftp_shm_release(struct tftp_shm_ring *r);
+
+int tftp_shm_send_file(struct tftp_shm_link *link, const uint8_t *buf, size_t buf_len, const char *log_prefix);
+int tftp_shm_retrieve_file(struct tftp_shm_link *link, struct tftp_sink *sink, const struct tftp_options *opts,
+                           const char *log_prefix);
+
+#endif // TFTP_SHM_H
@@ -0,0 +1,198 @@
+/*
+    Per-thread trace rings and the thread flushing them to the trace file, see tftp-trace.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "tftp-trace.h"
+
+int tftp_trace_enabled = 0;
+__thread struct tftp_trace_ring *tftp_trace_ring = NULL;
+
+// Every ring ever attached, the flusher walks them. Rings are never freed.
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tftp_trace_ring *rings = NULL;
+static int ring_count = 0;
+
+static int trace_fd = -1;
+static pthread_t flusher;
+static int flusher_stop;
+static struct tftp_trace_header header;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The first event of a thread gives it a ring, NULL once 256 threads have one
+struct tftp_trace_ring *tftp_trace_attach(void)
+{
+    pthread_mutex_lock(&rings_lock);
+    struct tftp_trace_ring *r = NULL;
+    if (ring_count <= UINT8_MAX && (r = calloc(1, sizeof(*r))) != NULL) {
+        r->thread = ring_count++;
+        r->next = rings;
+        rings = r;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    tftp_trace_ring = r;
+    return r;
+}
+
+// Writes count records from the ring, which may wrap. Returns 0 on success, -1 on failure.
+static int write_records(struct tftp_trace_ring *r, uint64_t from, uint64_t count)
+{
+    while (count > 0) {
+        uint64_t index = from & (TFTP_TRACE_RING_RECORDS - 1);
+        uint64_t chunk = TFTP_TRACE_RING_RECORDS - index < count ? TFTP_TRACE_RING_RECORDS - index : count;
+        size_t len = chunk * sizeof(struct tftp_trace_record);
+        const uint8_t *p = (const uint8_t *)&r->records[index];
+
+        while (len > 0) {
+            ssize_t written = write(trace_fd, p, len);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            p += written;
+            len -= written;
+        }
+        from += chunk;
+        count -= chunk;
+        header.records += chunk;
+    }
+    return 0;
+}
+
+// Rewrites the header for the records so far, so a process killed mid-trace leaves a readable file
+static int write_header(void)
+{
+    header.end_ticks = tftp_trace_ticks();
+    header.end_ns = monotonic_ns();
+    return pwrite(trace_fd, &header, sizeof(header), 0) == sizeof(header) ? 0 : -1;
+}
+
+// Moves whatever the rings hold to the file. Returns 0 on success, -1 on failure.
+static int drain(void)
+{
+    pthread_mutex_lock(&rings_lock);
+    struct tftp_trace_ring *r = rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    // Rings are only ever pushed at the front, the ones behind r stay put
+    int result = 0;
+    for (; r != NULL; r = r->next) {
+        uint64_t tail = r->tail;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head != tail && write_records(r, tail, head - tail) == -1) {
+            result = -1;
+        }
+        __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    }
+    return result;
+}
+
+static void *flush_rings(void *arg)
+{
+    (void)arg;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = TFTP_TRACE_FLUSH_MS * 1000000L };
+
+    while (!__atomic_load_n(&flusher_stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        if (drain() == -1 || write_header() == -1) {
+            perror("unable to write trace");
+        }
+    }
+    return NULL;
+}
+
+/*
+    Starts tracing every thread of the process to a new file at path, with a thread flushing
+    the rings in the background. Returns 0 on success, -1 on failure.
+*/
+int tftp_trace_start(const char *path)
+{
+    if (trace_fd != -1) {
+        fprintf(stderr, "Tracing already started\n");
+        return -1;
+    }
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd == -1) {
+        perror("unable to open trace file");
+        return -1;
+    }
+
+    // Records go after the header, which is rewritten with every flush
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TFTP_TRACE_MAGIC, sizeof(TFTP_TRACE_MAGIC));
+    header.version = TFTP_TRACE_VERSION;
+    header.record_size = sizeof(struct tftp_trace_record);
+    header.start_ns = monotonic_ns();
+    header.start_ticks = tftp_trace_ticks();
+    if (write_header() == -1 || lseek(trace_fd, sizeof(header), SEEK_SET) == -1) {
+        perror("unable to write trace header");
+        goto fail;
+    }
+
+    // Nothing an earlier trace left behind belongs in this one
+    pthread_mutex_lock(&rings_lock);
+    for (struct tftp_trace_ring *r = rings; r != NULL; r = r->next) {
+        r->tail = r->head;
+        r->dropped = 0;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    flusher_stop = 0;
+    int err = pthread_create(&flusher, NULL, flush_rings, NULL);
+    if (err != 0) {
+        fprintf(stderr, "unable to start trace flusher: %s\n", strerror(err));
+        goto fail;
+    }
+
+    __atomic_store_n(&tftp_trace_enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+}
+
+// Stops tracing and writes what the rings still hold. Returns 0 on success, -1 on failure.
+int tftp_trace_stop(void)
+{
+    if (trace_fd == -1) {
+        return 0;
+    }
+
+    __atomic_store_n(&tftp_trace_enabled, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&flusher_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+
+    int result = drain();
+    pthread_mutex_lock(&rings_lock);
+    for (struct tftp_trace_ring *r = rings; r != NULL; r = r->next) {
+        header.dropped += r->dropped;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if (result == -1 || write_header() == -1) {
+        perror("unable to write trace");
+        result = -1;
+    }
+    if (close(trace_fd) == -1) {
+        perror("unable to close trace file");
+        result = -1;
+    }
+    trace_fd = -1;
+    return result;
+}
@@ -0,0 +1,156 @@
+#ifndef TFTP_TRACE_H
+#define TFTP_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "tftp.h"
+
+/*
+    Binary event tracing of the packet hot path: every DATA, ACK, RRQ and OACK sent or
+    received, every timeout and every retransmission, with the time it happened.
+
+    Each thread that emits an event gets a single-producer ring of fixed-size records of its
+    own, allocated once and kept for the life of the process. Emitting is a timestamp, one
+    record filled in and a release store, with neither a lock nor a system call. A flusher
+    thread drains the rings to the trace file every few milliseconds. A full ring drops the
+    event and counts it, so tracing never stalls a transfer. While tracing is stopped, each
+    event costs a single load and branch.
+
+    Time is read from the TSC where there is one. The file header carries the monotonic
+    clock at both ends of the trace, so the decoder (build/trace-decoder) turns ticks into
+    nanoseconds. It is rewritten with every flush, so even the trace of a process that was
+    killed can be decoded up to its last flush. Start and stop tracing while no transfer is
+    running.
+
+    The file is a struct tftp_trace_header followed by the records, each thread's records in
+    order, but interleaved with the other threads' in chunks.
+*/
+
+#define TFTP_TRACE_MAGIC "TFTPTRC"
+#define TFTP_TRACE_VERSION 1
+#define TFTP_TRACE_RING_RECORDS (1 << 14) // per thread, power of two
+#define TFTP_TRACE_FLUSH_MS 10
+
+enum tftp_trace_event {
+    // Packets, the TFTP opcode plus whether it was sent or received
+    TFTP_TRACE_TX = 0x00,
+    TFTP_TRACE_RX = 0x10,
+    TFTP_TRACE_RRQ_TX = TFTP_TRACE_TX | TFTP_RRQ,
+    TFTP_TRACE_DATA_TX = TFTP_TRACE_TX | TFTP_DATA,
+    TFTP_TRACE_ACK_TX = TFTP_TRACE_TX | TFTP_ACK,
+    TFTP_TRACE_ERROR_TX = TFTP_TRACE_TX | TFTP_ERROR,
+    TFTP_TRACE_OACK_TX = TFTP_TRACE_TX | TFTP_OACK,
+    TFTP_TRACE_RRQ_RX = TFTP_TRACE_RX | TFTP_RRQ,
+    TFTP_TRACE_DATA_RX = TFTP_TRACE_RX | TFTP_DATA,
+    TFTP_TRACE_ACK_RX = TFTP_TRACE_RX | TFTP_ACK,
+    TFTP_TRACE_ERROR_RX = TFTP_TRACE_RX | TFTP_ERROR,
+    TFTP_TRACE_OACK_RX = TFTP_TRACE_RX | TFTP_OACK,
+
+    // Session events
+    TFTP_TRACE_TIMEOUT = 0x20,    // block: the oldest unacknowledged one, len: timeouts in a row
+    TFTP_TRACE_RETRANSMIT = 0x21, // block: the block sent again, 0 for the RRQ or OACK
+};
+
+struct tftp_trace_record {
+    uint64_t ticks;
+    uint32_t block; // 16 bits on the wire, the session's 32-bit count for session events
+    uint16_t len;   // payload bytes of a packet
+    uint8_t event;  // enum tftp_trace_event
+    uint8_t thread; // which ring, in the order threads first emitted
+};
+
+struct tftp_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t start_ticks; // the clock of the records, when tracing started
+    uint64_t start_ns;    // CLOCK_MONOTONIC at the same time
+    uint64_t end_ticks;
+    uint64_t end_ns;
+    uint64_t records;     // written after the header
+    uint64_t dropped;     // lost to full rings
+};
+
+struct tftp_trace_ring {
+    uint64_t head;       // written by the emitting thread
+    uint64_t tail_cache; // the emitting thread's last look at tail
+    uint64_t dropped;
+    uint8_t thread;
+    uint8_t pad0[64 - 3 * sizeof(uint64_t) - 1];
+    uint64_t tail;       // written by the flusher
+    uint8_t pad1[64 - sizeof(uint64_t)];
+    struct tftp_trace_ring *next;
+    struct tftp_trace_record records[TFTP_TRACE_RING_RECORDS];
+};
+
+extern int tftp_trace_enabled;
+extern __thread struct tftp_trace_ring *tftp_trace_ring;
+
+// Public interface
+int tftp_trace_start(const char *path);
+int tftp_trace_stop(void);
+struct tftp_trace_ring *tftp_trace_attach(void);
+
+static inline uint64_t tftp_trace_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Records an event in the calling thread's ring, nothing unless tracing was started
+static inline void tftp_trace(enum tftp_trace_event event, uint32_t block, uint16_t len)
+{
+    if (!__atomic_load_n(&tftp_trace_enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    struct tftp_trace_ring *r = tftp_trace_ring;
+    if (r == NULL && (r = tftp_trace_attach()) == NULL) {
+        return;
+    }
+
+    // Only reread the flusher's tail when the ring looks full
+    uint64_t head = r->head;
+    if (head - r->tail_cache >= TFTP_TRACE_RING_RECORDS) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head - r->tail_cache >= TFTP_TRACE_RING_RECORDS) {
+            r->dropped++;
+            return;
+        }
+    }
+
+    struct tftp_trace_record *rec = &r->records[head & (TFTP_TRACE_RING_RECORDS - 1)];
+    rec->ticks = tftp_trace_ticks();
+    rec->block = block;
+    rec->len = len;
+    rec->event = event;
+    rec->thread = r->thread;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Records a packet sent or received from its first hdr_len bytes: the opcode picks the event,
+    DATA and ACK carry their block and DATA the length of its payload.
+*/
+static inline void tftp_trace_packet(const uint8_t *hdr, size_t hdr_len, size_t payload_len, int rx)
+{
+    if (!__atomic_load_n(&tftp_trace_enabled, __ATOMIC_RELAXED) || hdr_len < 2) {
+        return;
+    }
+
+    uint8_t opcode = hdr[1] & 0x0f;
+    uint16_t block = hdr_len >= 4 && (opcode == TFTP_DATA || opcode == TFTP_ACK) ? (hdr[2] << 8) | hdr[3] : 0;
+    uint16_t len = opcode != TFTP_DATA ? 0 : payload_len > UINT16_MAX ? UINT16_MAX : payload_len;
+    tftp_trace((rx ? TFTP_TRACE_RX : TFTP_TRACE_TX) | opcode, block, len);
+}
+
+#endif // TFTP_TRACE_H
@@ -0,0 +1,786 @@
+#define _GNU_SOURCE // struct msghdr helpers, syscall
+#include "tftp-uring.h"
+
+#ifdef TFTP_IO_URING
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "tftp-session.h"
+#include "tftp-io.h"
+#include "tftp-log.h"
+
+/*
+    There is no liburing on the satellite, the rings are driven through the raw system calls.
+    One submission ring and one completion ring are shared with the kernel: requests are
+    written into the SQ and published by moving its tail, results are read from the CQ and
+    released by moving its head. Nothing is submitted until ring_enter(), so everything a
+    window needs goes out with a single io_uring_enter call, which also waits for completions.
+*/
+
+#define RING_ENTRIES 256 // two windows of receives, the writes of one and an ACK
+
+// What a completion belongs to, kept in the upper half of its user_data next to a slot index
+#define OP_SEND   (1ULL << 32)
+#define OP_RECV   (2ULL << 32)
+#define OP_WRITE  (3ULL << 32)
+#define OP_CANCEL (4ULL << 32)
+#define OP_KIND(user_data) ((user_data) & ~0xFFFFFFFFULL)
+#define OP_SLOT(user_data) ((unsigned int)((user_data) & 0xFFFFFFFFULL))
+
+#define RECV_SLOTS (2 * MAX_WINDOWSIZE)
+#define DRAIN_TIMEOUT_MS 1000
+
+struct ring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail; // SQEs filled in, published by ring_enter
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring_map;
+    size_t ring_map_len;
+    size_t sqes_len;
+    int inflight;           // requests submitted and not completed yet, cancels aside
+    unsigned long enters;   // io_uring_enter calls
+};
+
+struct completion {
+    uint64_t user_data;
+    int res;
+};
+
+// Returns 0 on success, -1 with errno set if the kernel can't run this backend
+static int ring_init(struct ring *r, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(struct ring));
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    // Timeouts on io_uring_enter and a shared SQ/CQ mapping, both since Linux 5.11
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_map_len = sq_len > cq_len ? sq_len : cq_len;
+    r->ring_map = mmap(NULL, r->ring_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_SQ_RING);
+    if (r->ring_map == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    r->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->ring_map, r->ring_map_len);
+        close(r->fd);
+        return -1;
+    }
+
+    uint8_t *map = r->ring_map;
+    r->sq_head = (unsigned int *)(map + params.sq_off.head);
+    r->sq_tail = (unsigned int *)(map + params.sq_off.tail);
+    r->sq_array = (unsigned int *)(map + params.sq_off.array);
+    r->sq_mask = *(unsigned int *)(map + params.sq_off.ring_mask);
+    r->sq_entries = params.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned int *)(map + params.cq_off.head);
+    r->cq_tail = (unsigned int *)(map + params.cq_off.tail);
+    r->cq_mask = *(unsigned int *)(map + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+    return 0;
+}
+
+static void ring_free(struct ring *r)
+{
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->ring_map, r->ring_map_len);
+    close(r->fd);
+}
+
+/*
+    Sets up the ring for a transfer. Without io_uring the caller falls back to plain syscalls,
+    which is only reported once. Returns 0 on success, -1 on failure.
+*/
+static int ring_open(struct ring *r, const char *log_prefix)
+{
+    static int reported = 0;
+
+    if (ring_init(r, RING_ENTRIES) == -1) {
+        if (!reported) {
+            TFTP_INFO("%s io_uring unavailable (%s), using plain syscalls\n", log_prefix, strerror(errno));
+            reported = 1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned int ring_cq_ready(const struct ring *r)
+{
+    return __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+}
+
+/*
+    Publishes the SQEs filled in since the last call, and blocks until wait_nr completions are
+    ready or timeout_ms passed (forever if it is < 0). Skips the system call when there is
+    nothing to submit and enough completions are already waiting.
+    Returns 0 on success, -1 with errno set on failure (ETIME on timeout).
+*/
+static int ring_enter(struct ring *r, unsigned int wait_nr, int timeout_ms)
+{
+    unsigned int to_submit = r->sq_local_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L
+    };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+
+    if (to_submit == 0 && ring_cq_ready(r) >= wait_nr) {
+        return 0;
+    }
+
+    // Submitting may stop short, the wait only comes with the call that submits the rest
+    do {
+        unsigned int flags = 0;
+        void *argp = NULL;
+        size_t argsz = 0;
+
+        if (wait_nr > 0) {
+            flags |= IORING_ENTER_GETEVENTS;
+            if (timeout_ms >= 0) {
+                flags |= IORING_ENTER_EXT_ARG;
+                argp = &arg;
+                argsz = sizeof(arg);
+            }
+        }
+
+        r->enters++;
+        int submitted = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, flags, argp, argsz);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        to_submit -= submitted;
+    } while (to_submit > 0);
+
+    // The kernel reports a timeout as success when it submitted something in the same call
+    if (ring_cq_ready(r) < wait_nr) {
+        errno = ETIME;
+        return -1;
+    }
+    return 0;
+}
+
+// Returns a zeroed SQE to fill in, submitting what is queued when the SQ is full
+static struct io_uring_sqe *ring_sqe(struct ring *r, uint64_t user_data)
+{
+    while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        ring_enter(r, 0, 0);
+    }
+
+    unsigned int index = r->sq_local_tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = user_data;
+    r->sq_array[index] = index;
+    r->sq_local_tail++;
+
+    if (OP_KIND(user_data) != OP_CANCEL) {
+        r->inflight++;
+    }
+    return sqe;
+}
+
+static struct io_uring_sqe *ring_prep(struct ring *r, uint8_t opcode, int fd, const void *addr,
+                                      unsigned int len, uint64_t offset, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = ring_sqe(r, user_data);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    return sqe;
+}
+
+// Takes the next completion off the CQ, returns 0 if there is none
+static int ring_reap(struct ring *r, struct completion *c)
+{
+    while (ring_cq_ready(r)) {
+        unsigned int head = *r->cq_head;
+        struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+        c->user_data = cqe->user_data;
+        c->res = cqe->res;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (OP_KIND(c->user_data) != OP_CANCEL) {
+            r->inflight--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Cancels the receives and sends still in flight and waits until nothing is left, they point
+    into buffers of the caller. Writes to a regular file always finish on their own.
+*/
+static void ring_drain(struct ring *r, unsigned int recv_slots, unsigned int send_slots)
+{
+    for (unsigned int i = 0; i < recv_slots; i++) {
+        ring_prep(r, IORING_OP_ASYNC_CANCEL, -1, (void *)(uintptr_t)(OP_RECV | i), 0, 0, OP_CANCEL);
+    }
+    for (unsigned int i = 0; i < send_slots; i++) {
+        ring_prep(r, IORING_OP_ASYNC_CANCEL, -1, (void *)(uintptr_t)(OP_SEND | i), 0, 0, OP_CANCEL);
+    }
+
+    struct completion c;
+    while (ring_enter(r, r->inflight > 0 ? 1 : 0, DRAIN_TIMEOUT_MS) == 0 && r->inflight > 0) {
+        while (ring_reap(r, &c)) {
+        }
+    }
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+    How long to wait for completions: until the session's next deadline, or one timeout while
+    its packets are still being sent, and at most until the socket's receive timeout expires.
+*/
+static int wait_timeout_ms(const struct tftp_session *session, int sock_timeout_ms, uint64_t last_rx, int sending)
+{
+    uint64_t now = now_ms();
+    int64_t wait_ms = INT32_MAX;
+    int bounded = 0;
+
+    // Silence is what a receiver dallying after its last ACK waits for
+    if (sock_timeout_ms >= 0 && session->state != TFTP_SESSION_DALLY) {
+        wait_ms = (int64_t)(last_rx + sock_timeout_ms) - (int64_t)now;
+        bounded = 1;
+    }
+
+    uint64_t deadline = tftp_session_next_deadline(session);
+    if (sending) {
+        deadline = now + session->rto_ms;
+    }
+    if (deadline != TFTP_SESSION_NO_DEADLINE) {
+        int64_t until_deadline = (int64_t)deadline - (int64_t)now;
+        wait_ms = until_deadline < wait_ms ? until_deadline : wait_ms;
+        bounded = 1;
+    }
+
+    if (!bounded) {
+        return -1;
+    }
+    return wait_ms < 1 ? 1 : (int)wait_ms;
+}
+
+static void report_syscalls(const struct ring *r, unsigned long packets, const char *log_prefix)
+{
+    if (packets > 0) {
+        TFTP_INFO("%s io_uring: %lu packets in %lu syscalls (%.2f per packet)\n", log_prefix, packets,
+                  r->enters, (double)r->enters / packets);
+    }
+}
+
+/*
+    The satellite side of send_buf on io_uring.
+
+    Every window (or the OACK) is queued as linked sendmsg requests, so they go out in order,
+    and a recvmsg for the RRQ and the ACKs is always posted next to them. An ACK is only handed
+    to the session once the window it acknowledges has fully completed. With a cropper, a
+    client asking for a region of the image gets it read into a cache of one window instead.
+    Returns 0 on success, -1 on failure, TFTP_URING_UNSUPPORTED if io_uring is unavailable.
+*/
+int tftp_uring_send_buf(int sfd, const uint8_t *buf, size_t buf_len, int drop_acked,
+                        const struct tftp_cropper *cropper, const char *log_prefix)
+{
+    struct ring ring;
+    if (ring_open(&ring, log_prefix) == -1) {
+        return TFTP_URING_UNSUPPORTED;
+    }
+
+    uint8_t *cache = NULL;
+    if (cropper != NULL && buf_len > 0) {
+        cache = malloc(SOURCE_CACHE_LEN);
+        if (cache == NULL) {
+            fprintf(stderr, "%s Unable to allocate a window cache\n", log_prefix);
+            ring_free(&ring);
+            return -1;
+        }
+    }
+
+    struct tftp_session_config config = { .log_prefix = log_prefix, .cropper = cropper };
+    struct tftp_session session;
+    struct tftp_source src;
+    tftp_memory_source(&src, buf, buf_len);
+    tftp_session_init_source(&session, &src, cache, SOURCE_CACHE_LEN, &config);
+
+    struct sockaddr_un client_addr, recv_addr;
+    socklen_t client_len = sizeof(client_addr);
+    uint8_t recv_buf[MAX_BUF_SIZE];
+    struct iovec recv_iov = { .iov_base = recv_buf, .iov_len = sizeof(recv_buf) };
+    struct msghdr recv_msg;
+    int recv_posted = 0;
+    int recv_len = -1; // completed receive that waits for the window to finish
+
+    struct tftp_tx txs[MAX_WINDOWSIZE];
+    struct iovec send_iovs[MAX_WINDOWSIZE][2];
+    struct msghdr send_msgs[MAX_WINDOWSIZE];
+    int sends_queued = 0;
+    int sends_done = 0;
+    int sends_whole = 0; // leading sends that went out complete
+    uint64_t queued_ms = 0;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t dropped = 0;
+    unsigned long packets = 0;
+    int sock_timeout_ms = tftp_socket_timeout_ms(sfd);
+    uint64_t last_rx = now_ms();
+    int result = -1;
+
+    while (session.state != TFTP_SESSION_DONE) {
+        // Queue the DATA packets (or the OACK) of the current window
+        if (sends_queued == 0) {
+            int tx_count = tftp_session_poll_tx(&session, now_ms(), txs, MAX_WINDOWSIZE);
+            if (tx_count < 0) {
+                goto cleanup;
+            }
+
+            for (int i = 0; i < tx_count; i++) {
+                send_iovs[i][0] = (struct iovec) { .iov_base = (uint8_t *)txs[i].hdr, .iov_len = txs[i].hdr_len };
+                send_iovs[i][1] = (struct iovec) { .iov_base = (uint8_t *)txs[i].payload, .iov_len = txs[i].payload_len };
+                send_msgs[i] = (struct msghdr) {
+                    .msg_name = &client_addr,
+                    .msg_namelen = client_len,
+                    .msg_iov = send_iovs[i],
+                    .msg_iovlen = txs[i].payload_len ? 2 : 1
+                };
+                struct io_uring_sqe *sqe = ring_prep(&ring, IORING_OP_SENDMSG, sfd, &send_msgs[i], 1, 0, OP_SEND | i);
+                if (i < tx_count - 1) {
+                    sqe->flags |= IOSQE_IO_LINK;
+                }
+            }
+            sends_queued = tx_count;
+            sends_done = 0;
+            sends_whole = tx_count;
+            queued_ms = now_ms();
+        }
+
+        // Wait for the RRQ, then for ACKs
+        if (!recv_posted && recv_len < 0) {
+            recv_msg = (struct msghdr) {
+                .msg_name = &recv_addr,
+                .msg_namelen = sizeof(recv_addr),
+                .msg_iov = &recv_iov,
+                .msg_iovlen = 1
+            };
+            ring_prep(&ring, IORING_OP_RECVMSG, sfd, &recv_msg, 1, 0, OP_RECV);
+            recv_posted = 1;
+        }
+
+        // Sleep until the window went out and the next ACK (or the RRQ) is in
+        unsigned int wait_nr = (sends_queued - sends_done) + recv_posted;
+        int wait_ms = wait_timeout_ms(&session, sock_timeout_ms, last_rx, sends_queued > 0);
+        int timed_out = 0;
+        if (ring_enter(&ring, wait_nr, wait_ms) == -1) {
+            if (errno != ETIME) {
+                perror("io_uring_enter failed");
+                goto cleanup;
+            }
+            timed_out = 1;
+        }
+        tftp_metrics_poll(&session.metrics, log_prefix);
+
+        struct completion c;
+        while (ring_reap(&ring, &c)) {
+            if (OP_KIND(c.user_data) == OP_SEND) {
+                if (c.res < 0) {
+                    fprintf(stderr, "%s sendmsg failed: %s\n", log_prefix, strerror(-c.res));
+                    goto cleanup;
+                }
+
+                /*
+                    A datagram send that found the peer's queue full is retried by the kernel,
+                    and some kernels retry it with the payload already consumed: it goes out
+                    empty. The session resends everything from the first such packet on.
+                */
+                unsigned int index = OP_SLOT(c.user_data);
+                if ((size_t)c.res != send_iovs[index][0].iov_len + send_iovs[index][1].iov_len &&
+                    (int)index < sends_whole) {
+                    sends_whole = index;
+                }
+
+                /*
+                    The sends went out when they were submitted, but their completions are
+                    usually reaped together with the ACK: the timer starts from submission.
+                */
+                if (++sends_done == sends_queued) {
+                    tftp_session_tx_done(&session, sends_whole, queued_ms);
+                    packets += sends_done;
+                    sends_queued = 0;
+                }
+            } else if (OP_KIND(c.user_data) == OP_RECV) {
+                if (c.res < 0) {
+                    fprintf(stderr, "%s recvmsg failed: %s\n", log_prefix, strerror(-c.res));
+                    goto cleanup;
+                }
+                recv_posted = 0;
+                recv_len = c.res;
+            }
+        }
+
+        if (timed_out && recv_len < 0 && sock_timeout_ms >= 0 && now_ms() >= last_rx + sock_timeout_ms) {
+            TFTP_WARN("%s Timeout waiting for %s\n", log_prefix,
+                      session.state == TFTP_SESSION_REQUEST ? "client connection" : "ACK");
+            goto cleanup;
+        }
+
+        // The session can only take an ACK for packets it knows went out
+        if (recv_len >= 0 && sends_queued == 0) {
+            client_addr = recv_addr;
+            client_len = recv_msg.msg_namelen;
+            last_rx = now_ms();
+
+            enum tftp_session_state state = session.state;
+            uint32_t base = session.base;
+            if (tftp_session_on_datagram(&session, recv_buf, recv_len, last_rx, NULL) == -1) {
+                goto cleanup;
+            }
+            recv_len = -1;
+
+            if (state == TFTP_SESSION_REQUEST) {
+                TFTP_INFO("%s Received RRQ from client, windowsize: %d, blksize: %zu\n", log_prefix,
+                          session.windowsize, session.blksize);
+            } else if (session.base != base) {
+                TFTP_DEBUG("%s Received ACK for block %d\n", log_prefix, session.base - 1);
+            }
+
+            // Whole pages the client has ACKed are never sent again, release them in batches
+            if (drop_acked && session.src == NULL) {
+                size_t acked = tftp_session_acked_bytes(&session);
+                acked -= acked % page_size;
+                if (acked - dropped >= (size_t)page_size * 64) {
+                    madvise((uint8_t *)buf + dropped, acked - dropped, MADV_DONTNEED);
+                    dropped = acked;
+                }
+            }
+        }
+    }
+
+    TFTP_INFO("%s File send completed successfully\n", log_prefix);
+    report_syscalls(&ring, packets, log_prefix);
+    result = 0;
+
+cleanup:
+    tftp_metrics_log(&session.metrics, log_prefix);
+    ring_drain(&ring, 1, MAX_WINDOWSIZE);
+    ring_free(&ring);
+    free(cache);
+    return result;
+}
+
+// A receive buffer of the ground station and what it is used for
+enum slot_state {
+    SLOT_IDLE,
+    SLOT_RECV,    // recvmsg posted
+    SLOT_READY,   // datagram received, not handed to the session yet
+    SLOT_WRITE    // payload being written to the sink's file
+};
+
+struct recv_slot {
+    enum slot_state state;
+    uint8_t *buf;
+    int len;
+    struct iovec iov;
+    struct msghdr msg;
+    struct sockaddr_un addr;
+};
+
+/*
+    The ground station side of tftp_retrieve_file on io_uring.
+
+    A recvmsg is kept posted on every receive buffer of the window, and the payloads of
+    in-order blocks are written to the sink's file straight out of those buffers, which are
+    registered with the kernel once so the writes don't have to map them again. The ACK of a
+    window is linked behind the writes of its blocks, so it only goes out once they are on disk.
+    Once the sink mapped the file, payloads are copied into the mapping instead and need no
+    writes at all. A sink without a file is written to right away, before the ACK is queued.
+    Returns 0 on success, -1 on failure, TFTP_URING_UNSUPPORTED if io_uring is unavailable.
+*/
+int tftp_uring_retrieve(int sfd, struct sockaddr_un dest_addr, struct tftp_sink *sink,
+                        const struct tftp_options *opts, const char *log_prefix)
+{
+    struct ring ring;
+    if (ring_open(&ring, log_prefix) == -1) {
+        return TFTP_URING_UNSUPPORTED;
+    }
+
+    struct tftp_session_config config = { .log_prefix = log_prefix };
+    struct tftp_session session;
+    tftp_session_init_receiver(&session, "temp_file", opts, &config);
+
+    // Any window the satellite may send fits, see tftp_retrieve_file
+    size_t max_blksize = session.requested.blksize > DEFAULT_BLKSIZE ? session.requested.blksize : DEFAULT_BLKSIZE;
+    size_t pkt_buf_len = DATA_HDR_LEN + max_blksize;
+    unsigned int batch = session.requested.windowsize > MAX_WINDOWSIZE ? MAX_WINDOWSIZE : session.requested.windowsize;
+    batch = batch > 0 ? batch : 1;
+
+    // Twice the window, so the next one can arrive while the last one is being written
+    unsigned int slot_count = 2 * batch;
+    uint8_t *recv_bufs = malloc(slot_count * pkt_buf_len);
+    if (recv_bufs == NULL) {
+        fprintf(stderr, "%s Unable to allocate buffers for blksize %zu\n", log_prefix, max_blksize);
+        ring_free(&ring);
+        return -1;
+    }
+
+    // Registering pins the buffers, over RLIMIT_MEMLOCK the writes just map them every time
+    struct iovec registered = { .iov_base = recv_bufs, .iov_len = slot_count * pkt_buf_len };
+    int fixed_bufs = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &registered, 1) == 0;
+
+    struct recv_slot slots[RECV_SLOTS];
+    for (unsigned int i = 0; i < slot_count; i++) {
+        slots[i].state = SLOT_IDLE;
+        slots[i].buf = recv_bufs + i * pkt_buf_len;
+        slots[i].iov = (struct iovec) { .iov_base = slots[i].buf, .iov_len = pkt_buf_len };
+    }
+
+    // Received datagrams in arrival order, handed to the session while no ACK is in flight
+    unsigned int ready[RECV_SLOTS];
+    unsigned int ready_head = 0, ready_count = 0;
+
+    // The first named sender to answer becomes the peer, see tftp_retrieve_file
+    struct sockaddr_un peer_addr = dest_addr;
+    socklen_t peer_len = sizeof(struct sockaddr_un);
+    int peer_locked = 0;
+
+    struct tftp_tx tx;
+    struct iovec ctrl_iov;
+    struct msghdr ctrl_msg;
+    int ctrl_inflight = 0;
+    uint64_t ctrl_queued_ms = 0;
+
+    struct io_uring_sqe *round_writes[MAX_WINDOWSIZE];
+    int round_write_count = 0;
+    int writes_inflight = 0;
+    int recvs_posted = 0;
+    uint64_t file_end = opts->offset; // end of the payloads queued for writing
+    uint64_t progress_end = opts->offset;
+    uint8_t *map = NULL;
+    int map_tried = 0;
+
+    unsigned long packets = 0;
+    int sock_timeout_ms = tftp_socket_timeout_ms(sfd);
+    uint64_t last_rx = now_ms();
+    int result = -1;
+
+    while (session.state != TFTP_SESSION_DONE || writes_inflight > 0) {
+        /*
+            The session only learns a RRQ or ACK went out when its send completes, until then
+            new datagrams wait in their buffers.
+        */
+        round_write_count = 0;
+        while (!ctrl_inflight && ready_count > 0) {
+            struct recv_slot *slot = &slots[ready[ready_head]];
+            ready_head = (ready_head + 1) % RECV_SLOTS;
+            ready_count--;
+            slot->state = SLOT_IDLE;
+
+            socklen_t src_len = slot->msg.msg_namelen;
+            if (src_len > sizeof(sa_family_t)) {
+                if (!peer_locked) {
+                    peer_addr = slot->addr;
+                    peer_len = src_len;
+                    peer_locked = 1;
+                } else if (src_len != peer_len || memcmp(&slot->addr, &peer_addr, src_len) != 0) {
+                    TFTP_DEBUG("%s Dropping packet from unknown transfer ID\n", log_prefix);
+                    continue;
+                }
+            }
+
+            struct tftp_pkt_view data;
+            int status = tftp_session_on_datagram(&session, slot->buf, slot->len, now_ms(), &data);
+            if (status == -1) {
+                goto cleanup;
+            }
+            if (session.tsize_known && !map_tried) {
+                map_tried = 1;
+                map = sink->map != NULL ? sink->map(sink->ctx, session.tsize) : NULL;
+            }
+
+            if (status == TFTP_SESSION_DATA) {
+                TFTP_DEBUG("%s Received Data packet. Opcode: %d, Block: %d\n", log_prefix, data.opcode, data.block);
+                packets++;
+
+                // The payload is written to its place in the file straight out of the buffer
+                if (map != NULL) {
+                    tftp_place(map, data.offset, data.payload, data.payload_len);
+                } else if (sink->fd == -1) {
+                    struct iovec iov = { .iov_base = (uint8_t *)data.payload, .iov_len = data.payload_len };
+                    if (data.payload_len > 0 && sink->write(sink->ctx, data.offset, &iov, 1) == -1) {
+                        perror("unable to write image");
+                        goto cleanup;
+                    }
+                } else if (data.payload_len > 0) {
+                    unsigned int index = slot - slots;
+                    uint8_t opcode = fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                    struct io_uring_sqe *sqe = ring_prep(&ring, opcode, sink->fd, data.payload, data.payload_len,
+                                                         data.offset, OP_WRITE | index);
+                    round_writes[round_write_count++] = sqe;
+                    slot->len = data.payload_len;
+                    slot->state = SLOT_WRITE;
+                    writes_inflight++;
+                }
+                file_end = data.offset + data.payload_len;
+            }
+        }
+
+        // The RRQ, or the ACK of what was just queued for writing, linked behind those writes
+        if (!ctrl_inflight) {
+            int tx_count = tftp_session_poll_tx(&session, now_ms(), &tx, 1);
+            if (tx_count < 0) {
+                goto cleanup;
+            }
+            if (tx_count > 0) {
+                for (int i = 0; i < round_write_count; i++) {
+                    round_writes[i]->flags |= IOSQE_IO_LINK;
+                }
+                ctrl_iov = (struct iovec) { .iov_base = (uint8_t *)tx.hdr, .iov_len = tx.hdr_len };
+                ctrl_msg = (struct msghdr) {
+                    .msg_name = &peer_addr,
+                    .msg_namelen = peer_len,
+                    .msg_iov = &ctrl_iov,
+                    .msg_iovlen = 1
+                };
+                ring_prep(&ring, IORING_OP_SENDMSG, sfd, &ctrl_msg, 1, 0, OP_SEND);
+                ctrl_inflight = 1;
+                ctrl_queued_ms = now_ms();
+            }
+        }
+
+        // Keep a receive posted on every free buffer
+        for (unsigned int i = 0; i < slot_count && session.state != TFTP_SESSION_DONE; i++) {
+            if (slots[i].state == SLOT_IDLE) {
+                slots[i].msg = (struct msghdr) {
+                    .msg_name = &slots[i].addr,
+                    .msg_namelen = sizeof(struct sockaddr_un),
+                    .msg_iov = &slots[i].iov,
+                    .msg_iovlen = 1
+                };
+                ring_prep(&ring, IORING_OP_RECVMSG, sfd, &slots[i].msg, 1, 0, OP_RECV | i);
+                slots[i].state = SLOT_RECV;
+                recvs_posted++;
+            }
+        }
+
+        // Sleep until the writes and the ACK are done and the next datagram is in
+        unsigned int wait_nr = writes_inflight + ctrl_inflight + (session.state != TFTP_SESSION_DONE && recvs_posted > 0);
+        int wait_ms = wait_timeout_ms(&session, sock_timeout_ms, last_rx, ctrl_inflight);
+        int timed_out = 0;
+        if (ring_enter(&ring, wait_nr, wait_ms) == -1) {
+            if (errno != ETIME) {
+                perror("io_uring_enter failed");
+                goto cleanup;
+            }
+            timed_out = 1;
+        }
+        tftp_metrics_poll(&session.metrics, log_prefix);
+
+        struct completion c;
+        while (ring_reap(&ring, &c)) {
+            unsigned int index = OP_SLOT(c.user_data);
+
+            if (OP_KIND(c.user_data) == OP_RECV) {
+                if (c.res < 0) {
+                    fprintf(stderr, "%s error while receiving: %s\n", log_prefix, strerror(-c.res));
+                    goto cleanup;
+                }
+                recvs_posted--;
+                slots[index].len = c.res;
+                slots[index].state = SLOT_READY;
+                ready[(ready_head + ready_count++) % RECV_SLOTS] = index;
+                last_rx = now_ms();
+            } else if (OP_KIND(c.user_data) == OP_WRITE) {
+                writes_inflight--;
+                if (c.res < 0 || c.res != slots[index].len) {
+                    fprintf(stderr, "%s unable to write image: %s\n", log_prefix,
+                            c.res < 0 ? strerror(-c.res) : "short write");
+                    goto cleanup;
+                }
+                slots[index].state = SLOT_IDLE;
+            } else if (OP_KIND(c.user_data) == OP_SEND) {
+                if (c.res < 0) {
+                    fprintf(stderr, "%s sendmsg failed: %s\n", log_prefix, strerror(-c.res));
+                    goto cleanup;
+                }
+                ctrl_inflight = 0;
+                tftp_session_tx_done(&session, (size_t)c.res == tx.hdr_len, ctrl_queued_ms);
+            }
+        }
+
+        // Writes complete in any order, the file only has all of them once none is left
+        if (writes_inflight == 0 && file_end != progress_end) {
+            progress_end = file_end;
+            if (sink->progress != NULL) {
+                sink->progress(sink->ctx, file_end);
+            }
+        }
+
+        if (timed_out && ready_count == 0 && sock_timeout_ms >= 0 && session.state != TFTP_SESSION_DALLY &&
+            now_ms() >= last_rx + sock_timeout_ms) {
+            TFTP_WARN("%s Timeout waiting for data\n", log_prefix);
+            goto cleanup;
+        }
+    }
+
+    TFTP_INFO("%s Sent Ack packet with block: %d!\n", log_prefix, session.ack_block);
+    report_syscalls(&ring, packets, log_prefix);
+    result = 0;
+
+cleanup:
+    tftp_metrics_log(&session.metrics, log_prefix);
+    if (opts->metrics != NULL) {
+        *opts->metrics = session.metrics;
+    }
+    ring_drain(&ring, slot_count, 1);
+    ring_free(&ring);
+    free(recv_bufs);
+    return result;
+}
+
+#endif // TFTP_IO_URING
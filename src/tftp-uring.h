@@ -0,0 +1,26 @@
+#ifndef TFTP_URING_H
+#define TFTP_URING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/un.h>
+#include "tftp.h"
+
+/*
+    io_uring transport for tftp_send_file, tftp_send_mapped_file and tftp_retrieve_file.
+
+    Only compiled in with `make uring` (or IO_URING=1), which defines TFTP_IO_URING. The
+    functions below speak the same protocol as the plain syscall path, through a tftp_session,
+    but queue every sendmsg, recvmsg and file write on one submission ring and reap them from
+    its completion ring, so a whole window costs a single io_uring_enter.
+*/
+
+// The kernel has no (usable) io_uring, the caller has to fall back to plain syscalls
+#define TFTP_URING_UNSUPPORTED -2
+
+int tftp_uring_send_buf(int sfd, const uint8_t *buf, size_t buf_len, int drop_acked,
+                        const struct tftp_cropper *cropper, const char *log_prefix);
+int tftp_uring_retrieve(int sfd, struct sockaddr_un dest_addr, struct tftp_sink *sink,
+                        const struct tftp_options *opts, const char *log_prefix);
+
+#endif // TFTP_URING_H
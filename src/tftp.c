@@ -1,11 +1,28 @@
+#define _GNU_SOURCE // sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
 #include "tftp.h"
+#include "tftp-io.h"
+#include "tftp-session.h"
+#include "tftp-compress.h"
+#include "tftp-uring.h"
+#include "tftp-ring.h"
+#include "tftp-log.h"
+#include "tftp-trace.h"
 
 // Forward declaration for visibility warning
 struct sockaddr_un;
@@ -36,8 +53,109 @@ size_t unpack_str(uint8_t *src_buf, char *dest_buf, size_t max_str_len)
     return str_len + 1;
 }
 
-// Saved in Big Endian
-void serialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, size_t filename_len, size_t mode_len)
+// Returns amount of bytes saved in buf, options are sent as "name\0value\0" (RFC 2347)
+static size_t pack_option_str(uint8_t *buf, const char *name, const char *value)
+{
+    size_t offset = 0;
+
+    offset += pack_str(buf + offset, name, strlen(name));
+    offset += pack_str(buf + offset, value, strlen(value));
+
+    return offset;
+}
+
+static size_t pack_option(uint8_t *buf, const char *name, unsigned long value)
+{
+    char value_str[MAX_OPTION_LEN];
+
+    snprintf(value_str, sizeof(value_str), "%lu", value);
+    return pack_option_str(buf, name, value_str);
+}
+
+static size_t pack_region(uint8_t *buf, const struct tftp_region *region)
+{
+    char value_str[MAX_OPTION_LEN];
+
+    snprintf(value_str, sizeof(value_str), "%u,%u,%u,%u,%u", region->x, region->y, region->width, region->height,
+             region->step);
+    return pack_option_str(buf, OPT_REGION, value_str);
+}
+
+/*
+    Reads the next "name\0value\0" pair from src_buf without reading past buf_len.
+    Returns amount of bytes read from src_buf, 0 if there is no (complete) option left.
+*/
+static size_t unpack_option(uint8_t *src_buf, size_t buf_len, char *name, char *value)
+{
+    uint8_t *name_end = memchr(src_buf, '\0', buf_len);
+    if (name_end == NULL || name_end == src_buf) {
+        return 0;
+    }
+
+    size_t name_len = name_end - src_buf;
+    uint8_t *value_end = memchr(name_end + 1, '\0', buf_len - name_len - 1);
+    if (value_end == NULL) {
+        return 0;
+    }
+
+    unpack_str(src_buf, name, MAX_OPTION_LEN);
+    unpack_str(name_end + 1, value, MAX_OPTION_LEN);
+
+    return (value_end - src_buf) + 1;
+}
+
+// Returns the numeric option value, or 0 if it is not a number in [min, max]
+static unsigned long option_value(const char *value, unsigned long min, unsigned long max)
+{
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+
+    if (end == value || *end != '\0' || n < min || n > max) {
+        return 0;
+    }
+    return n;
+}
+
+/*
+    Reads a region from "x,y,width,height" or "x,y,width,height,step", as in the region option.
+    Returns 0 on success, -1 if value is no such region, which leaves region without a width.
+*/
+int tftp_parse_region(const char *value, struct tftp_region *region)
+{
+    unsigned long fields[5] = { 0, 0, 0, 0, 1 };
+    const char *p = value;
+    int count = 0;
+
+    memset(region, 0, sizeof(*region));
+    while (count < 5) {
+        char *end;
+        if (*p < '0' || *p > '9') {
+            return -1;
+        }
+        fields[count++] = strtoul(p, &end, 10);
+        if (fields[count - 1] > UINT32_MAX || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        p = end;
+        if (*p == '\0') {
+            break;
+        }
+        p++;
+    }
+    if (*p != '\0' || count < 4 || fields[2] == 0 || fields[3] == 0 || fields[4] == 0) {
+        return -1;
+    }
+
+    region->x = fields[0];
+    region->y = fields[1];
+    region->width = fields[2];
+    region->height = fields[3];
+    region->step = fields[4];
+    return 0;
+}
+
+// Saved in Big Endian, returns the length of the serialized packet
+size_t serialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, size_t filename_len, size_t mode_len)
 {
     size_t offset = 0;
 
@@ -49,11 +167,33 @@ void serialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, size_t filena
     offset += pack_str(buf + offset, rrq_pkt->filename, filename_len);
 
     // Save mode
-    pack_str(buf + offset, rrq_pkt->mode, mode_len);
+    offset += pack_str(buf + offset, rrq_pkt->mode, mode_len);
+
+    // Save options
+    if (rrq_pkt->windowsize) {
+        offset += pack_option(buf + offset, OPT_WINDOWSIZE, rrq_pkt->windowsize);
+    }
+    if (rrq_pkt->blksize) {
+        offset += pack_option(buf + offset, OPT_BLKSIZE, rrq_pkt->blksize);
+    }
+    if (rrq_pkt->offset) {
+        offset += pack_option(buf + offset, OPT_OFFSET, rrq_pkt->offset);
+    }
+    if (rrq_pkt->tsize) {
+        offset += pack_option(buf + offset, OPT_TSIZE, 0);
+    }
+    if (rrq_pkt->compress) {
+        offset += pack_option(buf + offset, OPT_COMPRESS, rrq_pkt->compress);
+    }
+    if (rrq_pkt->region.width) {
+        offset += pack_region(buf + offset, &rrq_pkt->region);
+    }
+
+    return offset;
 }
 
-// Saved in Big Endian
-void serialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_len)
+// Saved in Big Endian, only the DATA_HDR_LEN bytes in front of the payload
+void serialize_data_hdr(uint8_t *buf, struct tftp_data *data_pkt)
 {
     int offset = 0;
 
@@ -63,9 +203,17 @@ void serialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_le
     // Save block number
     buf[offset++] = (data_pkt->block >> 8) & 0xFF;
     buf[offset++] = data_pkt->block & 0xFF;
+}
+
+// Saved in Big Endian
+void serialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_len)
+{
+    int offset = DATA_HDR_LEN;
+
+    serialize_data_hdr(buf, data_pkt);
     /*
         Save Data buf
-        a lenth under 512 means that this is the last data packet to be sent.
+        a lenth under the negotiated blksize means that this is the last data packet to be sent.
     */
     memcpy(buf + offset, data_pkt->data, data_len);
     offset += data_len;
@@ -84,6 +232,38 @@ void serialize_ack_pkt(uint8_t *buf, struct tftp_ack *ack_pkt)
     buf[offset++] = ack_pkt->block & 0xFF;
 }
 
+// Saved in Big Endian, returns the length of the serialized packet
+size_t serialize_oack_pkt(uint8_t *buf, struct tftp_oack *oack_pkt)
+{
+    size_t offset = 0;
+
+    // Save opcode
+    buf[offset++] = (oack_pkt->opcode >> 8) & 0xFF;
+    buf[offset++] = oack_pkt->opcode & 0xFF;
+
+    // Save acknowledged options
+    if (oack_pkt->windowsize) {
+        offset += pack_option(buf + offset, OPT_WINDOWSIZE, oack_pkt->windowsize);
+    }
+    if (oack_pkt->blksize) {
+        offset += pack_option(buf + offset, OPT_BLKSIZE, oack_pkt->blksize);
+    }
+    if (oack_pkt->offset) {
+        offset += pack_option(buf + offset, OPT_OFFSET, oack_pkt->offset);
+    }
+    if (oack_pkt->has_tsize) {
+        offset += pack_option(buf + offset, OPT_TSIZE, oack_pkt->tsize);
+    }
+    if (oack_pkt->compress) {
+        offset += pack_option(buf + offset, OPT_COMPRESS, oack_pkt->compress);
+    }
+    if (oack_pkt->region.width) {
+        offset += pack_region(buf + offset, &oack_pkt->region);
+    }
+
+    return offset;
+}
+
 
 // Received buf is stored in Big Endian
 void deserialize_ack_pkt(uint8_t *buf, struct tftp_ack *ack_pkt)
@@ -94,8 +274,9 @@ void deserialize_ack_pkt(uint8_t *buf, struct tftp_ack *ack_pkt)
 
 //  Received buf is stored in Big Endian, assumes RRQ has enough space
 void deserialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, int buf_len) {
-    (void)buf_len; // Mark as unused
     size_t offset = 0;
+    char name[MAX_OPTION_LEN], value[MAX_OPTION_LEN];
+    size_t opt_len;
 
     // Opcode
     rrq_pkt->opcode = ((buf[offset] << 8) | buf[offset + 1]) & 0xFFFF;
@@ -103,7 +284,72 @@ void deserialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, int buf_len
     // Filename
     offset += unpack_str(buf + offset, rrq_pkt->filename, MAX_FILENAME_LEN);
     // Block
-    unpack_str(buf + offset, rrq_pkt->mode, MAX_MODE_LEN);
+    offset += unpack_str(buf + offset, rrq_pkt->mode, MAX_MODE_LEN);
+
+    // Options, unknown or malformed ones are ignored (RFC 2347)
+    rrq_pkt->windowsize = 0;
+    rrq_pkt->blksize = 0;
+    rrq_pkt->offset = 0;
+    rrq_pkt->tsize = 0;
+    rrq_pkt->compress = 0;
+    memset(&rrq_pkt->region, 0, sizeof(rrq_pkt->region));
+    while (offset < (size_t)buf_len &&
+           (opt_len = unpack_option(buf + offset, buf_len - offset, name, value)) > 0) {
+        if (strcasecmp(name, OPT_WINDOWSIZE) == 0) {
+            rrq_pkt->windowsize = option_value(value, 1, UINT16_MAX);
+        } else if (strcasecmp(name, OPT_BLKSIZE) == 0) {
+            rrq_pkt->blksize = option_value(value, MIN_BLKSIZE, UINT16_MAX);
+        } else if (strcasecmp(name, OPT_OFFSET) == 0) {
+            rrq_pkt->offset = option_value(value, 1, ULONG_MAX);
+        } else if (strcasecmp(name, OPT_TSIZE) == 0) {
+            rrq_pkt->tsize = 1;
+        } else if (strcasecmp(name, OPT_COMPRESS) == 0) {
+            rrq_pkt->compress = option_value(value, TFTP_COMPRESS_FAST, TFTP_COMPRESS_BEST);
+        } else if (strcasecmp(name, OPT_REGION) == 0) {
+            tftp_parse_region(value, &rrq_pkt->region);
+        }
+        offset += opt_len;
+    }
+}
+
+//  Received buf is stored in Big Endian
+void deserialize_oack_pkt(uint8_t *buf, struct tftp_oack *oack_pkt, size_t buf_len)
+{
+    size_t offset = 0;
+    char name[MAX_OPTION_LEN], value[MAX_OPTION_LEN];
+    size_t opt_len;
+
+    // Opcode
+    oack_pkt->opcode = ((buf[offset] << 8) | buf[offset + 1]) & 0xFFFF;
+    offset += 2;
+
+    // Options
+    oack_pkt->windowsize = 0;
+    oack_pkt->blksize = 0;
+    oack_pkt->offset = 0;
+    oack_pkt->has_tsize = 0;
+    oack_pkt->tsize = 0;
+    oack_pkt->compress = 0;
+    memset(&oack_pkt->region, 0, sizeof(oack_pkt->region));
+    while (offset < buf_len &&
+           (opt_len = unpack_option(buf + offset, buf_len - offset, name, value)) > 0) {
+        if (strcasecmp(name, OPT_WINDOWSIZE) == 0) {
+            oack_pkt->windowsize = option_value(value, 1, MAX_WINDOWSIZE);
+        } else if (strcasecmp(name, OPT_BLKSIZE) == 0) {
+            oack_pkt->blksize = option_value(value, MIN_BLKSIZE, MAX_BLKSIZE);
+        } else if (strcasecmp(name, OPT_OFFSET) == 0) {
+            oack_pkt->offset = option_value(value, 1, ULONG_MAX);
+        } else if (strcasecmp(name, OPT_TSIZE) == 0) {
+            // An empty file is a valid size
+            oack_pkt->tsize = option_value(value, 1, ULONG_MAX);
+            oack_pkt->has_tsize = oack_pkt->tsize > 0 || strcmp(value, "0") == 0;
+        } else if (strcasecmp(name, OPT_COMPRESS) == 0) {
+            oack_pkt->compress = option_value(value, TFTP_COMPRESS_FAST, TFTP_COMPRESS_BEST);
+        } else if (strcasecmp(name, OPT_REGION) == 0) {
+            tftp_parse_region(value, &oack_pkt->region);
+        }
+        offset += opt_len;
+    }
 }
 
 //  Received buf is stored in Big Endian
@@ -121,202 +367,883 @@ void deserialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_
     memcpy(data_pkt->data, buf + offset, data_len);
 }
 
+/*
+    Decodes the fixed header of a received packet in place. For DATA packets the payload is
+    left in buf, pkt->payload points at it. Returns 0 on success, -1 if buf is too short.
+*/
+int tftp_parse_pkt(const uint8_t *buf, size_t buf_len, struct tftp_pkt_view *pkt)
+{
+    if (buf_len < 2) {
+        return -1;
+    }
+
+    pkt->opcode = ((buf[0] << 8) | buf[1]) & 0xFFFF;
+    pkt->block = 0;
+    pkt->payload = buf + 2;
+    pkt->payload_len = buf_len - 2;
+
+    // DATA, ACK and ERROR carry a block number (or error code) after the opcode
+    if (pkt->opcode == TFTP_DATA || pkt->opcode == TFTP_ACK || pkt->opcode == TFTP_ERROR) {
+        if (buf_len < DATA_HDR_LEN) {
+            return -1;
+        }
+        pkt->block = ((buf[2] << 8) | buf[3]) & 0xFFFF;
+        pkt->payload = buf + DATA_HDR_LEN;
+        pkt->payload_len = buf_len - DATA_HDR_LEN;
+    }
+    return 0;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+    Sends everything the session has to send to dest_addr, blocking while the peer's queue is
+    full. A whole window goes out with sendmmsg, every datagram gathered from the session's
+    header and a pointer into the data. Returns 0 on success, -1 on failure.
+*/
+static int flush_session(int sfd, struct tftp_session *session, struct sockaddr_un *dest_addr, socklen_t dest_len)
+{
+    struct tftp_tx txs[MAX_WINDOWSIZE];
+    struct iovec iovs[MAX_WINDOWSIZE][2];
+    struct mmsghdr msgs[MAX_WINDOWSIZE];
+    int tx_count;
+
+    while ((tx_count = tftp_session_poll_tx(session, now_ms(), txs, MAX_WINDOWSIZE)) > 0) {
+        for (int i = 0; i < tx_count; i++) {
+            iovs[i][0] = (struct iovec) { .iov_base = (uint8_t *)txs[i].hdr, .iov_len = txs[i].hdr_len };
+            iovs[i][1] = (struct iovec) { .iov_base = (uint8_t *)txs[i].payload, .iov_len = txs[i].payload_len };
+            msgs[i].msg_hdr = (struct msghdr) {
+                .msg_name = dest_addr,
+                .msg_namelen = dest_len,
+                .msg_iov = iovs[i],
+                .msg_iovlen = txs[i].payload_len ? 2 : 1
+            };
+        }
+
+        // sendmmsg may stop early when the socket queue is full
+        int tx_sent = 0;
+        while (tx_sent < tx_count) {
+            int sent = sendmmsg(sfd, msgs + tx_sent, tx_count - tx_sent, 0);
+            if (sent < 0) {
+                perror("sendmmsg failed");
+                return -1;
+            }
+            for (int i = tx_sent; i < tx_sent + sent; i++) {
+                tftp_trace_packet(txs[i].hdr, txs[i].hdr_len, txs[i].payload_len, 0);
+            }
+            tx_sent += sent;
+        }
+        tftp_session_tx_done(session, tx_sent, now_ms());
+    }
+    return tx_count;
+}
+
+// SO_RCVTIMEO of sfd in milliseconds, -1 if receives block forever
+int tftp_socket_timeout_ms(int sfd)
+{
+    struct timeval tv;
+    socklen_t len = sizeof(tv);
+
+    if (getsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, &len) == -1 || (tv.tv_sec == 0 && tv.tv_usec == 0)) {
+        return -1;
+    }
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/*
+    Waits for a datagram on sfd until the session wants to retransmit. The socket's receive
+    timeout no longer ends a transfer at the first silence, it only bounds how long the peer may
+    stay silent in total (since last_rx) before the transfer is given up. A receiver that
+    dallies after its last ACK expects silence, and only waits for its deadline.
+    Returns 1 once a datagram is ready, 0 when the session is due, -1 with errno set to
+    ETIMEDOUT once the peer was silent for too long, or on failure.
+*/
+static int wait_for_peer(int sfd, const struct tftp_session *session, int sock_timeout_ms, uint64_t last_rx)
+{
+    struct pollfd pfd = { .fd = sfd, .events = POLLIN };
+    uint64_t deadline = tftp_session_next_deadline(session);
+    uint64_t now = now_ms();
+    int64_t wait_ms = -1;
+
+    if (deadline != TFTP_SESSION_NO_DEADLINE) {
+        wait_ms = deadline > now ? (int64_t)(deadline - now) : 0;
+    }
+    if (sock_timeout_ms >= 0 && session->state != TFTP_SESSION_DALLY) {
+        int64_t silence_left = (int64_t)(last_rx + sock_timeout_ms) - (int64_t)now;
+        if (silence_left <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        wait_ms = wait_ms < 0 || silence_left < wait_ms ? silence_left : wait_ms;
+    }
+
+    int ready = poll(&pfd, 1, wait_ms > INT32_MAX ? INT32_MAX : (int)wait_ms);
+    if (ready < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    return ready;
+}
+
+// Writes all of iovs to fd at offset, and resets the count. Returns 0 on success, -1 on failure.
+int tftp_write_all(int fd, struct iovec *iovs, int *iov_count, uint64_t offset)
+{
+    int first = 0;
+
+    while (first < *iov_count) {
+        ssize_t written = pwritev(fd, iovs + first, *iov_count - first, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += written;
+
+        // Skip what was written, a short write can stop in the middle of an iovec
+        while (first < *iov_count && (size_t)written >= iovs[first].iov_len) {
+            written -= iovs[first].iov_len;
+            first++;
+        }
+        if (first < *iov_count) {
+            iovs[first].iov_base = (uint8_t *)iovs[first].iov_base + written;
+            iovs[first].iov_len -= written;
+        }
+    }
+
+    *iov_count = 0;
+    return 0;
+}
+
 /*
     The Ground Station Receiving Images from a Satellite.
 
     Retrieve a file using a custom (simplified) TFTP proctol.
     The flow of the protocol is as follows:
-        - Send a Read Request to the specified socket
+        - Send a Read Request to the specified socket, asking for the options in opts
+        - If the satellite accepts any option it answers with an OACK, which is ACKed with block 0
         - Specified socket keeps on sending Data pakcets untill the length of the
-            data packet is < 512
+            data packet is < blksize (512 unless negotiated, RFC 2348)
+        - With a windowsize > 1 only the last block of every window is ACKed (RFC 7440)
+
+    The protocol itself is a receiver tftp_session, this function only does the I/O for it,
+    waking up whenever the session wants to resend its RRQ or ACK.
+    Up to a window of datagrams is drained with a single recvmmsg call. Packets are decoded in
+    place and the payloads of in-order blocks are handed to the sink with one write,
+    straight out of the receive buffers, before they are ACKed.
+    Once the sink mapped the file, every datagram of a batch is scattered instead: its header
+    goes to a receive buffer and its payload straight to where the next blocks belong in the
+    mapping. Only a payload that arrived in another block's place (after a lost or duplicate
+    one) is moved, the rest never gets copied in userspace. The places too close to the end of
+    the file for a whole block are received into the buffers and copied.
     Returns 0 on success, -1 on failure.
 */
-int tftp_retrieve_file(int sfd, struct sockaddr_un dest_addr, uint8_t *buf, size_t len, const char *log_prefix)
+static int retrieve_with_syscalls(int sfd, struct sockaddr_un dest_addr, struct tftp_sink *sink,
+                                  const struct tftp_options *opts, const char *log_prefix)
 {
-    printf("%s Starting file retrieval\n", log_prefix);
-    (void)buf;
-    (void)len;
-    // Create RRQ
-    char *filename = "temp_file";
-    char *mode = tftp_mode_str[MODE_OCTET];
+    struct tftp_session_config config = { .log_prefix = log_prefix };
+    struct tftp_session session;
+    tftp_session_init_receiver(&session, "temp_file", opts, &config);
 
-    struct tftp_request rrq = { .opcode = TFTP_RRQ };
-    strcpy(rrq.filename, filename);
-    strcpy(rrq.mode, mode);
+    /*
+        The satellite may only lower the requested blksize and windowsize, so a batch of
+        windowsize buffers of the requested blksize holds any window it sends.
+    */
+    size_t max_blksize = session.requested.blksize > DEFAULT_BLKSIZE ? session.requested.blksize : DEFAULT_BLKSIZE;
+    size_t pkt_buf_len = DATA_HDR_LEN + max_blksize;
+    unsigned int batch = session.requested.windowsize > MAX_WINDOWSIZE ? MAX_WINDOWSIZE : session.requested.windowsize;
+    batch = batch > 0 ? batch : 1;
 
-    size_t filename_len = strlen(filename);
-    size_t mode_len = strlen(mode);
+    uint8_t *recv_bufs = malloc(batch * pkt_buf_len);
+    if (recv_bufs == NULL) {
+        fprintf(stderr, "%s Unable to allocate buffers for blksize %zu\n", log_prefix, max_blksize);
+        return -1;
+    }
 
-    // Serialize RRQ packet
-    int serial_buf_len = sizeof(rrq.opcode) + filename_len + 1 + mode_len + 1;
+    struct sockaddr_un src_addrs[MAX_WINDOWSIZE];
+    struct iovec recv_iovs[MAX_WINDOWSIZE][2];
+    struct mmsghdr msgs[MAX_WINDOWSIZE];
+    for (unsigned int i = 0; i < batch; i++) {
+        msgs[i].msg_hdr = (struct msghdr) { .msg_name = &src_addrs[i], .msg_iov = recv_iovs[i] };
+    }
 
-    uint8_t serial_buf[serial_buf_len];
+    /*
+        The satellite may answer from a socket of its own (its transfer ID). The first named
+        sender to answer becomes the peer for the rest of the transfer, and ACKs go there.
+    */
+    struct sockaddr_un peer_addr = dest_addr;
+    socklen_t peer_len = sizeof(struct sockaddr_un);
+    int peer_locked = 0;
 
-    serialize_rrq_pkt(serial_buf, &rrq, filename_len, mode_len);
+    int result = -1;
 
     // Send a RRQ to destination address
-    if (sendto(sfd, serial_buf, serial_buf_len, 0, (struct sockaddr *) &dest_addr, sizeof(struct sockaddr_un)) == -1) {
-        perror("Unable to send request packet to destination address");
-        return -1;
-    }
-
-    // Open new image
-    FILE *fp_image= fopen("received-images/test.bmp", "wb");
-
-    if (fp_image == NULL) {
-        perror("unable to allocate space for new image");
-        return -1;
+    if (flush_session(sfd, &session, &peer_addr, peer_len) == -1) {
+        goto cleanup;
     }
 
     /*
         This setups a loop to receive data packets and send acknowledgement pakcets.
         The end of a transmission is determined by the size of the data packet received.
-        If the data in the received data packet is < 512, it will stop transmission.
+        If the data in the received data packet is < blksize, it will stop transmission.
     */
-    uint8_t recv_buf[MAX_BUF_SIZE];
-    size_t recv_len;
+    struct iovec write_iovs[MAX_WINDOWSIZE];
+    int write_count = 0;
+    uint64_t write_offset = 0, write_end = opts->offset, progress_end = opts->offset;
+    uint8_t *map = NULL;
+    uint64_t map_len = 0;
+    int map_tried = 0;
+    int sock_timeout_ms = tftp_socket_timeout_ms(sfd);
+    uint64_t last_rx = now_ms();
 
-    while (1) {
-        // Receive Data Packet
-        recv_len = (size_t)recvfrom(sfd, recv_buf, MAX_BUF_SIZE, 0, NULL, NULL);
-        if (recv_len == (size_t)-1) {
+    while (session.state != TFTP_SESSION_DONE) {
+        int ready = wait_for_peer(sfd, &session, sock_timeout_ms, last_rx);
+        tftp_metrics_poll(&session.metrics, log_prefix);
+        if (ready == -1) {
+            if (errno == ETIMEDOUT) {
+                TFTP_WARN("%s Timeout waiting for data\n", log_prefix);
+            } else {
+                perror("poll failed");
+            }
+            goto cleanup;
+        }
+
+        // Nothing arrived in time, let the session retransmit
+        if (ready == 0) {
+            if (flush_session(sfd, &session, &peer_addr, peer_len) == -1) {
+                goto cleanup;
+            }
+            continue;
+        }
+
+        // Payloads of a mapped file go to where the next blocks belong, if they come in order
+        uint64_t next_pos = session.offset + session.received;
+        int scatter = map != NULL;
+        for (unsigned int i = 0; i < batch; i++) {
+            uint8_t *pkt_buf = recv_bufs + i * pkt_buf_len;
+            uint64_t pos = next_pos + (uint64_t)i * session.blksize;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+
+            // Near the end of the file a place can't hold a whole block, whichever lands there
+            if (scatter && pos < map_len && map_len - pos >= session.blksize) {
+                recv_iovs[i][0] = (struct iovec) { .iov_base = pkt_buf, .iov_len = DATA_HDR_LEN };
+                recv_iovs[i][1] = (struct iovec) { .iov_base = map + pos, .iov_len = session.blksize };
+                msgs[i].msg_hdr.msg_iovlen = 2;
+            } else {
+                recv_iovs[i][0] = (struct iovec) { .iov_base = pkt_buf, .iov_len = pkt_buf_len };
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+        }
+
+        // Receive Data Packets, blocking only until the first one arrives
+        int received = recvmmsg(sfd, msgs, batch, MSG_WAITFORONE, NULL);
+        if (received < 0) {
             perror("error while receiving");
-            fclose(fp_image);
-            return -1;
+            goto cleanup;
         }
-        struct tftp_data data_pkt;
-        size_t data_len = recv_len - sizeof(data_pkt.opcode) - sizeof(data_pkt.block);
 
-        printf("%s just received: %lu\n", log_prefix, recv_len);
-        uint8_t *recv_buf_p = recv_buf + sizeof(data_pkt.opcode) + sizeof(data_pkt.block);
+        uint64_t now = now_ms();
+        last_rx = now;
+        for (int i = 0; i < received; i++) {
+            socklen_t src_len = msgs[i].msg_hdr.msg_namelen;
+            struct tftp_pkt_view data;
 
+            if (src_len > sizeof(sa_family_t)) {
+                if (!peer_locked) {
+                    peer_addr = src_addrs[i];
+                    peer_len = src_len;
+                    peer_locked = 1;
+                } else if (src_len != peer_len || memcmp(&src_addrs[i], &peer_addr, src_len) != 0) {
+                    TFTP_DEBUG("%s Dropping packet from unknown transfer ID\n", log_prefix);
+                    continue;
+                }
+            }
 
-        deserialize_data_pkt(recv_buf, &data_pkt, data_len);
+            uint8_t *pkt_buf = recv_iovs[i][0].iov_base;
+            size_t pkt_len = msgs[i].msg_len;
+            int status;
+            tftp_trace_packet(pkt_buf, pkt_len, pkt_len > DATA_HDR_LEN ? pkt_len - DATA_HDR_LEN : 0, 1);
+            if (msgs[i].msg_hdr.msg_iovlen == 1) {
+                status = tftp_session_on_datagram(&session, pkt_buf, pkt_len, now, &data);
+            } else if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                // Larger than the negotiated blksize
+                TFTP_DEBUG("%s Dropping truncated packet\n", log_prefix);
+                continue;
+            } else if (pkt_len >= DATA_HDR_LEN && ((pkt_buf[0] << 8) | pkt_buf[1]) == TFTP_DATA) {
+                status = tftp_session_on_data(&session, pkt_buf, recv_iovs[i][1].iov_base, pkt_len - DATA_HDR_LEN,
+                                              now, &data);
+            } else {
+                // Anything else is decoded from one piece
+                if (pkt_len > DATA_HDR_LEN) {
+                    memcpy(pkt_buf + DATA_HDR_LEN, recv_iovs[i][1].iov_base, pkt_len - DATA_HDR_LEN);
+                }
+                status = tftp_session_on_datagram(&session, pkt_buf, pkt_len, now, &data);
+            }
+            if (status == -1) {
+                goto cleanup;
+            }
 
-        printf("%s Received Data packet. Opcode: %d, Block: %d\n", log_prefix, data_pkt.opcode, data_pkt.block);
+            // The OACK announced the size, the rest of the file goes straight into the sink's mapping
+            if (session.tsize_known && !map_tried) {
+                map_tried = 1;
+                map = sink->map != NULL ? sink->map(sink->ctx, session.tsize) : NULL;
+                map_len = session.tsize;
+            }
 
-        // Write buf to new image file
-        if (fwrite(data_pkt.data, 1, data_len, fp_image) != data_len) {
-            fprintf(stderr, "%s Unable to write header file of %lu bytes\n", log_prefix, data_len);
-            fclose(fp_image);
-            return -1;
+            // Queue the payload for the sink, it is written before the next ACK
+            if (status == TFTP_SESSION_DATA) {
+                TFTP_DEBUG("%s Received Data packet. Opcode: %d, Block: %d\n", log_prefix, data.opcode, data.block);
+                if (map != NULL) {
+                    tftp_place(map, data.offset, data.payload, data.payload_len);
+                } else {
+                    if (write_count == 0) {
+                        write_offset = data.offset;
+                    }
+                    write_iovs[write_count++] = (struct iovec) {
+                        .iov_base = (uint8_t *)data.payload,
+                        .iov_len = data.payload_len
+                    };
+                }
+                write_end = data.offset + data.payload_len;
+            }
+        }
+
+        // The receive buffers are reused by the next batch
+        if (write_count > 0 && sink->write(sink->ctx, write_offset, write_iovs, write_count) == -1) {
+            perror("unable to write image");
+            goto cleanup;
+        }
+        write_count = 0;
+        if (write_end != progress_end) {
+            progress_end = write_end;
+            if (sink->progress != NULL) {
+                sink->progress(sink->ctx, write_end);
+            }
+        }
+
+        // ACK what was just written
+        if (flush_session(sfd, &session, &peer_addr, peer_len) == -1) {
+            goto cleanup;
         }
+    }
 
-        // Send ACK Packet
-        struct tftp_ack ack_pkt = {
-            .opcode = TFTP_ACK,
-            .block = data_pkt.block
-        };
+    TFTP_INFO("%s Sent Ack packet with block: %d!\n", log_prefix, session.ack_block);
+    result = 0;
 
-        size_t ack_pkt_len = sizeof(ack_pkt.opcode) + sizeof(ack_pkt.block);
-        uint8_t ack_pkt_buf[ack_pkt_len];
+cleanup:
+    tftp_metrics_log(&session.metrics, log_prefix);
+    if (opts->metrics != NULL) {
+        *opts->metrics = session.metrics;
+    }
+    free(recv_bufs);
+    return result;
+}
 
-        serialize_ack_pkt(ack_pkt_buf, &ack_pkt);
+// The writer thread of a pipelined retrieval
+struct pipeline_writer {
+    struct tftp_ring *ring;
+    struct tftp_sink *sink;
+    uint64_t write_end; // the first bytes of the file that are in the sink
+    uint64_t map_size;  // size of the file for the sink to map, TFTP_SIZE_UNKNOWN until announced
+    int failed;
+};
 
-        // Send an ACK to destination address
-        if (sendto(sfd, ack_pkt_buf, ack_pkt_len, 0, (struct sockaddr *) &dest_addr, sizeof(struct sockaddr_un)) == -1) {
-            perror("Unable to send request packet to destination address");
-            fclose(fp_image);
-            return -1;
+/*
+    Drains the ring into the sink until the network thread closes it: payloads are placed in
+    the sink's mapping once there is one, and written in batches of up to a window otherwise.
+    Progress is reported after every batch, so a checkpoint never gets ahead of the disk.
+    A failed write aborts the ring, which fails the retrieval on the network thread.
+*/
+static void *pipeline_write(void *arg)
+{
+    struct pipeline_writer *w = arg;
+    struct tftp_sink *sink = w->sink;
+    struct iovec iovs[MAX_WINDOWSIZE];
+    int iov_count = 0;
+    uint64_t write_offset = 0, write_end = w->write_end;
+    uint8_t *map = NULL;
+    int map_tried = 0;
+    int end = 0;
+
+    while (!end) {
+        uint32_t ready = tftp_ring_wait(w->ring);
+
+        // The network thread sets the size before it publishes the slots that follow the OACK
+        uint64_t map_size = __atomic_load_n(&w->map_size, __ATOMIC_RELAXED);
+        if (map_size != TFTP_SIZE_UNKNOWN && !map_tried) {
+            map_tried = 1;
+            map = sink->map != NULL ? sink->map(sink->ctx, map_size) : NULL;
         }
 
-        printf("%s Sent Ack packet with block: %d!\n", log_prefix, ack_pkt.block);
-        if (data_len < MAX_DATA_LEN) {
-            break;
+        for (uint32_t i = 0; i < ready && !end; i++) {
+            struct tftp_ring_slot *slot = tftp_ring_ready_slot(w->ring, i);
+            end = slot->end;
+            if (slot->len == 0) {
+                continue;
+            }
+
+            if (map != NULL) {
+                tftp_place(map, slot->offset, slot->payload, slot->len);
+            } else {
+                if (iov_count == MAX_WINDOWSIZE) {
+                    if (sink->write(sink->ctx, write_offset, iovs, iov_count) == -1) {
+                        goto fail;
+                    }
+                    iov_count = 0;
+                }
+                if (iov_count == 0) {
+                    write_offset = slot->offset;
+                }
+                iovs[iov_count++] = (struct iovec) { .iov_base = (uint8_t *)slot->payload, .iov_len = slot->len };
+            }
+            write_end = slot->offset + slot->len;
         }
 
+        // The slots are handed back once nothing points into them anymore
+        if (iov_count > 0 && sink->write(sink->ctx, write_offset, iovs, iov_count) == -1) {
+            goto fail;
+        }
+        iov_count = 0;
+        if (write_end != w->write_end) {
+            w->write_end = write_end;
+            if (sink->progress != NULL) {
+                sink->progress(sink->ctx, write_end);
+            }
+        }
+        tftp_ring_release(w->ring, ready);
     }
+    return NULL;
 
-    // split buff into chucks
-    fclose(fp_image);
-    return 0;
+fail:
+    perror("unable to write image");
+    __atomic_store_n(&w->failed, 1, __ATOMIC_RELEASE);
+    tftp_ring_abort(w->ring);
+    return NULL;
 }
 
 /*
-    The satellite sending data (images) packets
+    retrieve_with_syscalls split across two threads, so a stalled disk doesn't hold the ACKs
+    back. This (network) thread receives a batch of datagrams straight into free slots of a
+    ring, runs them through the session, ACKs them and publishes the slots. A writer thread
+    drains them into the sink behind it. The network thread only waits for the writer when
+    every slot is taken, until then the ACKs go out as fast as the data comes in.
     Returns 0 on success, -1 on failure.
 */
-int tftp_send_file(int sfd, uint8_t *buf, size_t buf_len, const char *log_prefix) {
-    printf("%s Starting file send of %zu bytes\n", log_prefix, buf_len);
-    
-    // Wait for client connection
-    struct sockaddr_un client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    uint8_t recv_buf[1024];
-    ssize_t recv_len = recvfrom(sfd, recv_buf, sizeof(recv_buf), 0,
-                               (struct sockaddr *)&client_addr, &client_len);
-    if (recv_len < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            printf("%s Timeout waiting for client connection\n", log_prefix);
-            return -1;
-        }
-        perror("recvfrom failed");
+static int retrieve_pipelined(int sfd, struct sockaddr_un dest_addr, struct tftp_sink *sink,
+                              const struct tftp_options *opts, const char *log_prefix)
+{
+    struct tftp_session_config config = { .log_prefix = log_prefix };
+    struct tftp_session session;
+    tftp_session_init_receiver(&session, "temp_file", opts, &config);
+
+    // See retrieve_with_syscalls, a slot holds any datagram of the largest block
+    size_t max_blksize = session.requested.blksize > DEFAULT_BLKSIZE ? session.requested.blksize : DEFAULT_BLKSIZE;
+    unsigned int batch = session.requested.windowsize > MAX_WINDOWSIZE ? MAX_WINDOWSIZE : session.requested.windowsize;
+    batch = batch > 0 ? batch : 1;
+
+    struct tftp_ring ring;
+    if (tftp_ring_init(&ring, TFTP_RING_SLOTS, DATA_HDR_LEN + max_blksize) == -1) {
+        fprintf(stderr, "%s Unable to allocate buffers for blksize %zu\n", log_prefix, max_blksize);
         return -1;
     }
-    
-    // Parse RRQ packet
-    uint16_t opcode = ntohs(*(uint16_t*)recv_buf);
-    if (opcode != TFTP_RRQ) {
-        printf("%s Expected RRQ, got opcode %d\n", log_prefix, opcode);
+
+    struct pipeline_writer writer = {
+        .ring = &ring,
+        .sink = sink,
+        .write_end = opts->offset,
+        .map_size = TFTP_SIZE_UNKNOWN
+    };
+    pthread_t writer_thread;
+    int error = pthread_create(&writer_thread, NULL, pipeline_write, &writer);
+    if (error != 0) {
+        fprintf(stderr, "%s Unable to start the writer thread: %s\n", log_prefix, strerror(error));
+        tftp_ring_free(&ring);
         return -1;
     }
-    printf("%s Received RRQ from client\n", log_prefix);
 
-    // Send data in blocks
-    size_t offset = 0;
-    uint16_t block_num = 1;
-    while (offset < buf_len) {
-        // Prepare DATA packet
-        uint8_t send_buf[1024];
-        size_t data_size = (buf_len - offset) > MAX_DATA_LEN ? MAX_DATA_LEN : (buf_len - offset);
-        
-        struct tftp_data data_pkt = {
-            .opcode = TFTP_DATA,
-            .block = block_num
-        };
-        memcpy(data_pkt.data, buf + offset, data_size);
-        serialize_data_pkt(send_buf, &data_pkt, data_size);
-        size_t pkt_size = sizeof(data_pkt.opcode) + sizeof(data_pkt.block) + data_size;
-        
-        printf("%s Sending block %d (%zu bytes)\n", log_prefix, block_num, data_size);
-        
-        // Send DATA packet
-        if (sendto(sfd, send_buf, pkt_size, 0,
-                  (struct sockaddr *)&client_addr, client_len) < 0) {
-            perror("sendto failed");
-            return -1;
+    struct sockaddr_un src_addrs[MAX_WINDOWSIZE];
+    struct iovec recv_iovs[MAX_WINDOWSIZE];
+    struct mmsghdr msgs[MAX_WINDOWSIZE];
+    for (unsigned int i = 0; i < batch; i++) {
+        msgs[i].msg_hdr = (struct msghdr) { .msg_name = &src_addrs[i], .msg_iov = &recv_iovs[i], .msg_iovlen = 1 };
+    }
+
+    struct sockaddr_un peer_addr = dest_addr;
+    socklen_t peer_len = sizeof(struct sockaddr_un);
+    int peer_locked = 0;
+    int result = -1;
+
+    // Send a RRQ to destination address
+    if (flush_session(sfd, &session, &peer_addr, peer_len) == -1) {
+        goto cleanup;
+    }
+
+    int sock_timeout_ms = tftp_socket_timeout_ms(sfd);
+    uint64_t last_rx = now_ms();
+
+    while (session.state != TFTP_SESSION_DONE) {
+        // Backpressure: with every slot waiting for the disk, nothing is received or ACKed
+        uint32_t space = tftp_ring_space(&ring);
+        if (space == 0) {
+            if (tftp_ring_wait_space(&ring, -1) == -1) {
+                goto cleanup;
+            }
+            space = tftp_ring_space(&ring);
+            last_rx = now_ms();
+        }
+        if (__atomic_load_n(&writer.failed, __ATOMIC_ACQUIRE)) {
+            goto cleanup;
         }
 
-        // Wait for ACK
-        recv_len = recvfrom(sfd, recv_buf, sizeof(recv_buf), 0,
-                          (struct sockaddr *)&client_addr, &client_len);
-        if (recv_len < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                printf("%s Timeout waiting for ACK\n", log_prefix);
-                return -1;
+        int ready = wait_for_peer(sfd, &session, sock_timeout_ms, last_rx);
+        tftp_metrics_poll(&session.metrics, log_prefix);
+        if (ready == -1) {
+            if (errno == ETIMEDOUT) {
+                TFTP_WARN("%s Timeout waiting for data\n", log_prefix);
+            } else {
+                perror("poll failed");
             }
-            perror("recvfrom failed");
+            goto cleanup;
+        }
+
+        // Nothing arrived in time, let the session retransmit
+        if (ready == 0) {
+            if (flush_session(sfd, &session, &peer_addr, peer_len) == -1) {
+                goto cleanup;
+            }
+            continue;
+        }
+
+        unsigned int slots = space < batch ? space : batch;
+        for (unsigned int i = 0; i < slots; i++) {
+            recv_iovs[i] = (struct iovec) { .iov_base = tftp_ring_free_slot(&ring, i)->buf, .iov_len = ring.slot_len };
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+        }
+
+        // Receive Data Packets, blocking only until the first one arrives
+        int received = recvmmsg(sfd, msgs, slots, MSG_WAITFORONE, NULL);
+        if (received < 0) {
+            perror("error while receiving");
+            goto cleanup;
+        }
+
+        uint64_t now = now_ms();
+        last_rx = now;
+        for (int i = 0; i < received; i++) {
+            struct tftp_ring_slot *slot = tftp_ring_free_slot(&ring, i);
+            socklen_t src_len = msgs[i].msg_hdr.msg_namelen;
+            struct tftp_pkt_view data;
+
+            slot->len = 0;
+            slot->end = 0;
+            if (src_len > sizeof(sa_family_t)) {
+                if (!peer_locked) {
+                    peer_addr = src_addrs[i];
+                    peer_len = src_len;
+                    peer_locked = 1;
+                } else if (src_len != peer_len || memcmp(&src_addrs[i], &peer_addr, src_len) != 0) {
+                    TFTP_DEBUG("%s Dropping packet from unknown transfer ID\n", log_prefix);
+                    continue;
+                }
+            }
+
+            tftp_trace_packet(slot->buf, msgs[i].msg_len,
+                              msgs[i].msg_len > DATA_HDR_LEN ? msgs[i].msg_len - DATA_HDR_LEN : 0, 1);
+            int status = tftp_session_on_datagram(&session, slot->buf, msgs[i].msg_len, now, &data);
+            if (status == -1) {
+                goto cleanup;
+            }
+            if (session.tsize_known && writer.map_size == TFTP_SIZE_UNKNOWN) {
+                __atomic_store_n(&writer.map_size, session.tsize, __ATOMIC_RELAXED);
+            }
+
+            // Hand the payload to the writer, it is written behind the ACK
+            if (status == TFTP_SESSION_DATA) {
+                TFTP_DEBUG("%s Received Data packet. Opcode: %d, Block: %d\n", log_prefix, data.opcode, data.block);
+                slot->payload = data.payload;
+                slot->len = data.payload_len;
+                slot->offset = data.offset;
+            }
+        }
+        tftp_ring_publish(&ring, received);
+
+        if (flush_session(sfd, &session, &peer_addr, peer_len) == -1) {
+            goto cleanup;
+        }
+    }
+
+    TFTP_INFO("%s Sent Ack packet with block: %d!\n", log_prefix, session.ack_block);
+    result = 0;
+
+cleanup:
+    // The slot kept back for the end is always free, even behind a writer that gave up
+    tftp_ring_close(&ring);
+    pthread_join(writer_thread, NULL);
+    if (writer.failed) {
+        result = -1;
+    }
+    tftp_ring_free(&ring);
+    tftp_metrics_log(&session.metrics, log_prefix);
+    if (opts->metrics != NULL) {
+        *opts->metrics = session.metrics;
+    }
+    return result;
+}
+
+/*
+    The Ground Station Receiving Images from a Satellite, see retrieve_with_syscalls for the
+    protocol. Built with TFTP_IO_URING the transfer runs on io_uring when the kernel has it.
+    With opts->pipelined set the sink is written on a thread of its own, see retrieve_pipelined.
+    With opts->compress set the satellite is asked to deflate the file, which is then inflated
+    on its way to the sink (see tftp-compress.h). The file is handed to sink, which is closed
+    in the end. Without a sink it goes to RECEIVED_IMAGE_PATH: an interrupted retrieval leaves
+    a checkpoint next to the image, and the next one asks the satellite to resume from there.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_retrieve_file(int sfd, struct sockaddr_un dest_addr, struct tftp_sink *sink,
+                       const struct tftp_options *opts, const char *log_prefix)
+{
+    TFTP_INFO("%s Starting file retrieval\n", log_prefix);
+
+    struct tftp_options resume_opts = { 0 };
+    if (opts != NULL) {
+        resume_opts = *opts;
+    }
+    resume_opts.tsize = 1;
+
+    // Open the image, or what an earlier pass left of it
+    struct tftp_image image;
+    struct tftp_sink image_sink;
+    if (sink == NULL) {
+        if (tftp_image_open(&image, RECEIVED_IMAGE_PATH, &resume_opts, log_prefix) == -1) {
             return -1;
         }
+        tftp_image_sink(&image_sink, &image);
+        sink = &image_sink;
+    }
 
-        // Parse ACK packet
-        opcode = ntohs(*(uint16_t*)recv_buf);
-        if (opcode != TFTP_ACK) {
-            printf("%s Expected ACK, got opcode %d\n", log_prefix, opcode);
+    // Inflated on the way to the sink if the satellite agrees to deflate the file
+    struct tftp_decompressor *decompressor = NULL;
+    if (resume_opts.compress) {
+        decompressor = malloc(sizeof(*decompressor));
+        struct tftp_sink *inflating = decompressor != NULL ? tftp_decompress_sink(decompressor, sink) : NULL;
+        if (inflating == NULL) {
+            fprintf(stderr, "%s Unable to set up decompression\n", log_prefix);
+            free(decompressor);
+            if (sink->close != NULL) {
+                sink->close(sink->ctx, 0);
+            }
             return -1;
         }
+        sink = inflating;
+        resume_opts.compressed = &decompressor->level;
+    }
 
-        uint16_t ack_block = ntohs(*(uint16_t*)(recv_buf + 2));
-        if (ack_block != block_num) {
-            printf("%s Expected ACK for block %d, got %d\n", log_prefix, block_num, ack_block);
+    int result;
+    if (resume_opts.pipelined) {
+        result = retrieve_pipelined(sfd, dest_addr, sink, &resume_opts, log_prefix);
+    } else {
+#ifdef TFTP_IO_URING
+        result = tftp_uring_retrieve(sfd, dest_addr, sink, &resume_opts, log_prefix);
+        if (result == TFTP_URING_UNSUPPORTED) {
+            result = retrieve_with_syscalls(sfd, dest_addr, sink, &resume_opts, log_prefix);
+        }
+#else
+        result = retrieve_with_syscalls(sfd, dest_addr, sink, &resume_opts, log_prefix);
+#endif
+    }
+
+    if (sink->close != NULL && sink->close(sink->ctx, result == 0) == -1) {
+        result = -1;
+    }
+    if (decompressor != NULL) {
+        if (opts != NULL && opts->compressed != NULL) {
+            *opts->compressed = decompressor->level;
+        }
+        tftp_decompressor_end(decompressor);
+        free(decompressor);
+    }
+    return result;
+}
+
+/*
+    The satellite sending data (images) packets from src.
+
+    The protocol itself is a sender tftp_session, this function only does the I/O for it,
+    waking up whenever the session wants to resend the window.
+    Every DATA datagram is gathered from a DATA_HDR_LEN header and a pointer to its payload,
+    and a whole window goes out in one sendmmsg call. A source holding all of its data is
+    sent straight out of it, so the payload is never copied in userspace, any other source is
+    read into a cache of one window as the transfer gets there.
+    With drop_acked set, the source is a file mapping whose pages are released once the client
+    has ACKed them, which keeps the resident size independent of the file size. A cropper, if
+    any, sends the region of an image the client asks for instead (see tftp-session.h).
+    Returns 0 on success, -1 on failure.
+*/
+static int send_source(int sfd, const struct tftp_source *src, int drop_acked, const struct tftp_cropper *cropper,
+                       const char *log_prefix) {
+    if (src->size == TFTP_SIZE_UNKNOWN) {
+        TFTP_INFO("%s Starting file send\n", log_prefix);
+    } else {
+        TFTP_INFO("%s Starting file send of %llu bytes\n", log_prefix, (unsigned long long)src->size);
+    }
+
+#ifdef TFTP_IO_URING
+    if (src->data != NULL || src->size == 0) {
+        int result = tftp_uring_send_buf(sfd, src->data, src->size, drop_acked, cropper, log_prefix);
+        if (result != TFTP_URING_UNSUPPORTED) {
+            return result;
+        }
+    }
+#endif
+
+    /*
+        Untouched pages of the cache cost nothing, so any window the client asks for fits. A
+        source holding all of its data only reads into it if the client asks for it deflated or
+        for a region of it.
+    */
+    uint8_t *cache = NULL;
+    struct tftp_compressor *compressor = NULL;
+    if (src->size > 0) {
+        cache = malloc(SOURCE_CACHE_LEN);
+        compressor = malloc(sizeof(*compressor));
+        if (cache == NULL || compressor == NULL) {
+            fprintf(stderr, "%s Unable to allocate a window cache\n", log_prefix);
+            free(cache);
+            free(compressor);
             return -1;
         }
-        printf("%s Received ACK for block %d\n", log_prefix, block_num);
+        compressor->started = 0;
+    }
+
+    struct tftp_session_config config = { .log_prefix = log_prefix, .compressor = compressor, .cropper = cropper };
+    struct tftp_session session;
+    tftp_session_init_source(&session, src, cache, SOURCE_CACHE_LEN, &config);
+
+    struct sockaddr_un client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    uint8_t recv_buf[MAX_BUF_SIZE];
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t dropped = 0; // bytes at the start of the mapping that were released
+    int sock_timeout_ms = tftp_socket_timeout_ms(sfd);
+    uint64_t last_rx = now_ms();
+    int result = -1;
+
+    while (session.state != TFTP_SESSION_DONE) {
+        // Send DATA packets (or the OACK) of the current window, or resend it
+        if (flush_session(sfd, &session, &client_addr, client_len) == -1) {
+            goto cleanup;
+        }
 
-        offset += data_size;
-        block_num++;
+        // Wait for the RRQ, then for ACKs until the window is due again
+        int ready = wait_for_peer(sfd, &session, sock_timeout_ms, last_rx);
+        tftp_metrics_poll(&session.metrics, log_prefix);
+        if (ready == -1) {
+            if (errno == ETIMEDOUT) {
+                TFTP_WARN("%s Timeout waiting for %s\n", log_prefix,
+                          session.state == TFTP_SESSION_REQUEST ? "client connection" : "ACK");
+            } else {
+                perror("poll failed");
+            }
+            goto cleanup;
+        }
+        if (ready == 0) {
+            continue;
+        }
+
+        client_len = sizeof(client_addr);
+        ssize_t recv_len = recvfrom(sfd, recv_buf, sizeof(recv_buf), 0,
+                                    (struct sockaddr *)&client_addr, &client_len);
+        if (recv_len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recvfrom failed");
+            goto cleanup;
+        }
+        last_rx = now_ms();
+        tftp_trace_packet(recv_buf, recv_len, 0, 1);
+
+        enum tftp_session_state state = session.state;
+        uint32_t base = session.base;
+        if (tftp_session_on_datagram(&session, recv_buf, recv_len, now_ms(), NULL) == -1) {
+            goto cleanup;
+        }
+
+        if (state == TFTP_SESSION_REQUEST) {
+            TFTP_INFO("%s Received RRQ from client, windowsize: %d, blksize: %zu\n", log_prefix,
+                      session.windowsize, session.blksize);
+        } else if (session.base != base) {
+            TFTP_DEBUG("%s Received ACK for block %d\n", log_prefix, session.base - 1);
+        }
+
+        // Whole pages the client has ACKed are never sent again, release them in batches
+        if (drop_acked && src->data != NULL && session.src == NULL) {
+            size_t acked = tftp_session_acked_bytes(&session);
+            acked -= acked % page_size;
+            if (acked - dropped >= (size_t)page_size * 64) {
+                madvise((uint8_t *)src->data + dropped, acked - dropped, MADV_DONTNEED);
+                dropped = acked;
+            }
+        }
     }
 
-    printf("%s File send completed successfully\n", log_prefix);
-    return 0;
+    if (session.compress) {
+        TFTP_INFO("%s Deflated %llu bytes into %llu\n", log_prefix, (unsigned long long)compressor->stage.in_pos,
+                  (unsigned long long)compressor->stage.out_pos);
+    }
+    TFTP_INFO("%s File send completed successfully\n", log_prefix);
+    result = 0;
+
+cleanup:
+    tftp_metrics_log(&session.metrics, log_prefix);
+    if (compressor != NULL) {
+        tftp_compressor_end(compressor);
+        free(compressor);
+    }
+    free(cache);
+    return result;
+}
+
+// The satellite sending an in-memory buffer. Returns 0 on success, -1 on failure.
+int tftp_send_file(int sfd, uint8_t *buf, size_t buf_len, const char *log_prefix) {
+    struct tftp_source src;
+    tftp_memory_source(&src, buf, buf_len);
+    return send_source(sfd, &src, 0, NULL, log_prefix);
+}
+
+/*
+    The satellite sending the file at path without reading it into memory: the file is
+    mapped read-only and DATA packets point straight into the mapping.
+    Returns 0 on success, -1 on failure.
+*/
+int tftp_send_mapped_file(int sfd, const char *path, const char *log_prefix) {
+    return tftp_send_mapped_image(sfd, path, NULL, log_prefix);
+}
+
+/*
+    Like tftp_send_mapped_file(), but a client asking for a region of the image gets what
+    cropper cuts out of the mapping for it. Returns 0 on success, -1 on failure.
+*/
+int tftp_send_mapped_image(int sfd, const char *path, const struct tftp_cropper *cropper, const char *log_prefix) {
+    struct tftp_source src;
+    if (tftp_mmap_source(&src, path, log_prefix) == -1) {
+        return -1;
+    }
+
+    int result = send_source(sfd, &src, 1, cropper, log_prefix);
+    tftp_mmap_source_close(&src);
+    return result;
+}
+
+/*
+    The satellite sending whatever src produces: a file, a generator, the output of a
+    transform. Returns 0 on success, -1 on failure.
+*/
+int tftp_send_source(int sfd, const struct tftp_source *src, const char *log_prefix) {
+    return send_source(sfd, src, 0, NULL, log_prefix);
 }
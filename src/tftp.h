@@ -3,13 +3,28 @@
 
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <stdlib.h>
 
 // Constants
 #define MAX_BUF_SIZE 8192
 #define MAX_FILENAME_LEN 128
-#define MAX_DATA_LEN 512
 #define MAX_MODE_LEN 20
+#define MAX_OPTION_LEN 64 // fits a region, five 32 bit numbers
+#define DATA_HDR_LEN 4 // opcode + block
+
+/*
+    Block size negotiation (RFC 2348). Without a blksize option every DATA packet carries
+    DEFAULT_BLKSIZE bytes. MAX_BLKSIZE keeps a DATA datagram below 64 KiB, which fits in the
+    default send buffer of an AF_UNIX datagram socket.
+*/
+#define DEFAULT_BLKSIZE 512
+#define MIN_BLKSIZE 8
+#define MAX_BLKSIZE 65464
+
+// Window size negotiation (RFC 7440)
+#define DEFAULT_WINDOWSIZE 1
+#define MAX_WINDOWSIZE 64
 
 // TFTP opcodes
 #define TFTP_RRQ   1
@@ -17,6 +32,30 @@
 #define TFTP_DATA  3
 #define TFTP_ACK   4
 #define TFTP_ERROR 5
+#define TFTP_OACK  6
+
+// TFTP option names (RFC 2347)
+#define OPT_WINDOWSIZE "windowsize"
+#define OPT_BLKSIZE    "blksize"
+#define OPT_OFFSET     "offset" // resume a read at this byte of the file
+#define OPT_TSIZE      "tsize"  // size of the file, RFC 2349
+#define OPT_COMPRESS   "compress" // deflate the file in flight at this zlib level, see tftp-compress.h
+#define OPT_REGION     "region"   // send only a region of the image, "x,y,width,height,step"
+
+#define TFTP_COMPRESS_FAST 1 // cheapest on the satellite's CPU
+#define TFTP_COMPRESS_BEST 9 // fewest blocks over the link
+
+/*
+    A rectangle of an image's pixels, of which every step-th pixel of every step-th row is
+    sent. The satellite sends it as an image of its own, and clips it to the image in its OACK.
+*/
+struct tftp_region {
+    uint32_t x;      // left column
+    uint32_t y;      // top row, counted from the top of the image
+    uint32_t width;  // 0 = no region, the whole file
+    uint32_t height;
+    uint32_t step;   // 1 = every pixel
+};
 
 // TFTP modes
 #define MODE_NETASCII 0
@@ -31,12 +70,18 @@ struct tftp_request {
     uint16_t opcode;
     char filename[MAX_FILENAME_LEN];
     char mode[MAX_MODE_LEN];
+    uint16_t windowsize; // 0 = option not requested
+    uint16_t blksize;    // 0 = option not requested
+    uint64_t offset;     // 0 = option not requested
+    int tsize;           // 0 = option not requested, it is always sent as 0
+    int compress;        // 0 = option not requested
+    struct tftp_region region; // width 0 = option not requested
 };
 
 struct tftp_data {
     uint16_t opcode;
     uint16_t block;
-    uint8_t data[MAX_DATA_LEN];
+    uint8_t *data; // caller provided, up to the negotiated blksize
 };
 
 struct tftp_ack {
@@ -44,26 +89,93 @@ struct tftp_ack {
     uint16_t block;
 };
 
+struct tftp_oack {
+    uint16_t opcode;
+    uint16_t windowsize; // 0 = option not acknowledged
+    uint16_t blksize;    // 0 = option not acknowledged
+    uint64_t offset;     // 0 = option not acknowledged, the file is sent from its start
+    int has_tsize;       // 0 = option not acknowledged
+    uint64_t tsize;
+    int compress;        // 0 = option not acknowledged, the file is sent as is
+    struct tftp_region region; // width 0 = option not acknowledged, the whole file is sent
+};
+
 struct tftp_error {
     uint16_t opcode;
     uint16_t error_code;
     char error_msg[512];
 };
 
+// Decoded view of a received packet, payload points into the receive buffer
+struct tftp_pkt_view {
+    uint16_t opcode;
+    uint16_t block;         // DATA and ACK block number, ERROR code
+    const uint8_t *payload; // DATA payload, or whatever follows the opcode
+    size_t payload_len;
+    uint64_t offset;        // DATA handed back by a session: where the payload belongs in the file
+};
+
+// How a complete image is flushed to disk before the transfer counts as done
+enum tftp_sync {
+    TFTP_SYNC_NONE,     // left to the page cache
+    TFTP_SYNC_MSYNC,    // msync of the mapping, fdatasync if the image was not mapped
+    TFTP_SYNC_FDATASYNC
+};
+
+// Options requested by the retrieving side, NULL means protocol defaults
+struct tftp_options {
+    uint16_t windowsize;
+    uint16_t blksize;
+    uint64_t offset; // resume at this byte, 0 = from the start
+    int tsize;       // ask for the size of the file up front
+    uint64_t resume_tsize; // size of the file offset is into, the transfer fails if the satellite announces another
+    uint64_t *announced;   // set to the size the satellite announces, 0 if none, left as is until its OACK, NULL to skip
+    enum tftp_sync sync;
+    int pipelined;   // write to the sink on a thread of its own, behind the ACKs
+    struct tftp_metrics *metrics; // filled in with the metrics of the transfer, NULL to skip
+    int compress;    // ask for the file deflated at this level, 0 = as is
+    int *compressed; // set to the level the satellite deflates at, 0 if it doesn't, NULL to skip
+    struct tftp_region region;   // ask for this region of the image, width 0 = the whole file
+    struct tftp_region *granted; // set to the region the satellite sends, width 0 if the whole file, NULL to skip
+};
+
+// Where a transfer reads from and writes to, see tftp-io.h
+struct tftp_source;
+struct tftp_sink;
+// Cuts a region out of an image, see tftp-session.h
+struct tftp_cropper;
+// What a transfer did, see tftp-metrics.h
+struct tftp_metrics;
+
 // String packing/unpacking functions
 size_t pack_str(uint8_t *buf, const char *str, size_t str_len);
 size_t unpack_str(uint8_t *src_buf, char *dest_buf, size_t max_str_len);
 
 // Packet serialization/deserialization functions
-void serialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, size_t filename_len, size_t mode_len);
+size_t serialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, size_t filename_len, size_t mode_len);
+void serialize_data_hdr(uint8_t *buf, struct tftp_data *data_pkt);
 void serialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_len);
 void serialize_ack_pkt(uint8_t *buf, struct tftp_ack *ack_pkt);
+size_t serialize_oack_pkt(uint8_t *buf, struct tftp_oack *oack_pkt);
 void deserialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, int buf_len);
 void deserialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_len);
 void deserialize_ack_pkt(uint8_t *buf, struct tftp_ack *ack_pkt);
+void deserialize_oack_pkt(uint8_t *buf, struct tftp_oack *oack_pkt, size_t buf_len);
+int tftp_parse_pkt(const uint8_t *buf, size_t buf_len, struct tftp_pkt_view *pkt);
+int tftp_parse_region(const char *value, struct tftp_region *region);
+
+// Writes all of iovs to fd at offset (retrying short writes), and resets the count
+int tftp_write_all(int fd, struct iovec *iovs, int *iov_count, uint64_t offset);
+
+// SO_RCVTIMEO of sfd in milliseconds, -1 if receives block forever
+int tftp_socket_timeout_ms(int sfd);
 
 // Public interface
 int tftp_send_file(int sfd, uint8_t *buf, size_t buf_len, const char *log_prefix);
-int tftp_retrieve_file(int sfd, struct sockaddr_un dest_addr, uint8_t *buf, size_t len, const char *log_prefix);
+int tftp_send_mapped_file(int sfd, const char *path, const char *log_prefix);
+int tftp_send_mapped_image(int sfd, const char *path, const struct tftp_cropper *cropper, const char *log_prefix);
+int tftp_send_source(int sfd, const struct tftp_source *src, const char *log_prefix);
+int tftp_retrieve_file(int sfd, struct sockaddr_un dest_addr, struct tftp_sink *sink,
+                       const struct tftp_options *opts, const char *log_prefix);
 
 #endif // TFTP_H
@@ -0,0 +1,174 @@
+/*
+    Turns a binary trace written by tftp_trace_start() into a timeline, one event per line,
+    or into the Chrome trace format that chrome://tracing and Perfetto load:
+        ./build/satellite -T temp/satellite.trace
+        ./build/trace-decoder temp/satellite.trace
+        ./build/trace-decoder -c -o temp/satellite.json temp/satellite.trace
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../tftp-trace.h"
+
+struct event {
+	struct tftp_trace_record rec;
+	uint64_t ns; // since the trace started
+	uint64_t seq; // position in the file, keeps equal timestamps in order
+};
+
+void usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-c] [-o output] trace-file\n", prog);
+	fprintf(stderr, "  -c  write the Chrome trace format instead of a timeline\n");
+	fprintf(stderr, "  -o  write to output instead of stdout\n");
+	exit(1);
+}
+
+static const char *event_name(uint8_t event) {
+	switch (event) {
+	case TFTP_TRACE_RRQ_TX: return "RRQ sent";
+	case TFTP_TRACE_DATA_TX: return "DATA sent";
+	case TFTP_TRACE_ACK_TX: return "ACK sent";
+	case TFTP_TRACE_ERROR_TX: return "ERROR sent";
+	case TFTP_TRACE_OACK_TX: return "OACK sent";
+	case TFTP_TRACE_RRQ_RX: return "RRQ received";
+	case TFTP_TRACE_DATA_RX: return "DATA received";
+	case TFTP_TRACE_ACK_RX: return "ACK received";
+	case TFTP_TRACE_ERROR_RX: return "ERROR received";
+	case TFTP_TRACE_OACK_RX: return "OACK received";
+	case TFTP_TRACE_TIMEOUT: return "timeout";
+	case TFTP_TRACE_RETRANSMIT: return "retransmit";
+	default: return "unknown";
+	}
+}
+
+static int compare_events(const void *a, const void *b) {
+	const struct event *x = a, *y = b;
+
+	if (x->ns != y->ns) {
+		return x->ns < y->ns ? -1 : 1;
+	}
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void write_timeline(FILE *out, const struct event *events, size_t count) {
+	uint64_t prev_ns = 0;
+
+	fprintf(out, "%14s %12s  %-6s %-14s %8s %8s\n", "time_us", "delta_us", "thread", "event", "block", "bytes");
+	for (size_t i = 0; i < count; i++) {
+		const struct event *e = &events[i];
+		fprintf(out, "%14.3f %12.3f  %-6u %-14s", e->ns / 1000.0, (e->ns - prev_ns) / 1000.0,
+			e->rec.thread, event_name(e->rec.event));
+		if (e->rec.event == TFTP_TRACE_TIMEOUT) {
+			fprintf(out, " %8u %8s  (%u in a row)\n", e->rec.block, "", e->rec.len);
+		} else if ((e->rec.event & 0x0f) == TFTP_DATA || e->rec.event == TFTP_TRACE_RETRANSMIT ||
+			   (e->rec.event & 0x0f) == TFTP_ACK) {
+			fprintf(out, " %8u %8u\n", e->rec.block, e->rec.len);
+		} else {
+			fprintf(out, "\n");
+		}
+		prev_ns = e->ns;
+	}
+}
+
+// Instant events, timeouts and retransmissions marked across the whole process
+static void write_chrome(FILE *out, const struct event *events, size_t count, int threads) {
+	fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	for (int t = 0; t < threads; t++) {
+		fprintf(out, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+			"\"args\": {\"name\": \"thread %d\"}},\n", t, t);
+	}
+	for (size_t i = 0; i < count; i++) {
+		const struct event *e = &events[i];
+		int session_event = e->rec.event == TFTP_TRACE_TIMEOUT || e->rec.event == TFTP_TRACE_RETRANSMIT;
+
+		fprintf(out, "  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"i\", \"s\": \"%s\", \"ts\": %.3f, "
+			"\"pid\": 1, \"tid\": %u, \"args\": {\"block\": %u, \"len\": %u}}%s\n",
+			event_name(e->rec.event), session_event ? "session" : e->rec.event & TFTP_TRACE_RX ? "rx" : "tx",
+			session_event ? "p" : "t", e->ns / 1000.0, e->rec.thread, e->rec.block, e->rec.len,
+			i + 1 < count ? "," : "");
+	}
+	fprintf(out, "]}\n");
+}
+
+int main(int argc, char *argv[]) {
+	const char *out_path = NULL;
+	int chrome = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "co:")) != -1) {
+		switch (opt) {
+		case 'c':
+			chrome = 1;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	FILE *in = fopen(argv[optind], "rb");
+	if (in == NULL) {
+		perror("unable to open trace");
+		exit(1);
+	}
+
+	struct tftp_trace_header header;
+	if (fread(&header, sizeof(header), 1, in) != 1 ||
+	    memcmp(header.magic, TFTP_TRACE_MAGIC, sizeof(TFTP_TRACE_MAGIC)) != 0 ||
+	    header.version != TFTP_TRACE_VERSION || header.record_size != sizeof(struct tftp_trace_record)) {
+		fprintf(stderr, "%s is not a trace\n", argv[optind]);
+		exit(1);
+	}
+
+	struct event *events = calloc(header.records ? header.records : 1, sizeof(*events));
+	if (events == NULL) {
+		perror("unable to allocate events");
+		exit(1);
+	}
+
+	// Ticks to nanoseconds, by how far both clocks went over the whole trace
+	double ns_per_tick = header.end_ticks > header.start_ticks ?
+		(double)(header.end_ns - header.start_ns) / (header.end_ticks - header.start_ticks) : 1.0;
+	size_t count = 0;
+	int threads = 0;
+	while (count < header.records && fread(&events[count].rec, sizeof(events[count].rec), 1, in) == 1) {
+		struct event *e = &events[count];
+		e->ns = e->rec.ticks > header.start_ticks ? (e->rec.ticks - header.start_ticks) * ns_per_tick : 0;
+		e->seq = count++;
+		threads = e->rec.thread >= threads ? e->rec.thread + 1 : threads;
+	}
+	fclose(in);
+	if (count < header.records) {
+		fprintf(stderr, "Trace cut short: %zu of %llu records\n", count, (unsigned long long)header.records);
+	}
+
+	// Every thread's records are in order, but the threads come in chunks
+	qsort(events, count, sizeof(*events), compare_events);
+
+	FILE *out = out_path ? fopen(out_path, "w") : stdout;
+	if (out == NULL) {
+		perror("unable to open output");
+		exit(1);
+	}
+	if (chrome) {
+		write_chrome(out, events, count, threads);
+	} else {
+		write_timeline(out, events, count);
+	}
+	if (out != stdout && fclose(out) != 0) {
+		perror("unable to write output");
+		exit(1);
+	}
+
+	fprintf(stderr, "%zu events from %d threads over %.3f ms, %llu dropped\n", count, threads,
+		(header.end_ns - header.start_ns) / 1e6, (unsigned long long)header.dropped);
+	free(events);
+	return 0;
+}
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "../src/tftp.h"
+#include "../src/tftp-io.h"
+#include "../src/tftp-session.h"
+#include "../src/tftp-metrics.h"
+#include "../src/bmp-region.h"
+#include "tftp_test_fixture.h"
+#include "bmp_test_image.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define SATELLITE_SOCKET_PATH "temp/server-socket"
+#define GROUND_STATION_SOCKET_PATH "temp/client-socket"
+#define IMAGE_FILE_PATH "temp/stars.bmp"
+
+/*
+    A BMP whose every byte tells where it comes from, so a misplaced pixel shows. 8 bit images
+    carry a grayscale palette. Returns the BMP, NULL on failure.
+*/
+static uint8_t *make_image(int32_t width, int32_t height, int bit_depth, size_t *len)
+{
+    uint32_t rows = height < 0 ? -height : height;
+    size_t row_size = test_bmp_row_size(width, bit_depth);
+    uint32_t data_offset = test_bmp_data_offset(bit_depth);
+    uint8_t *bmp = make_test_bmp(width, height, bit_depth, len);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    for (uint32_t y = 0; y < rows; y++) {
+        for (size_t x = 0; x < (size_t)width * bit_depth / 8; x++) {
+            bmp[data_offset + y * row_size + x] = (y * 31 + x * 7) ^ (x >> 8);
+        }
+    }
+    return bmp;
+}
+
+/*
+    The pixel at column x and row y from the top of the image, plain and slow, to check the
+    region against. Returns a pointer to its first byte.
+*/
+static const uint8_t *pixel(const uint8_t *bmp, const Bmp_Header *header, uint32_t x, uint32_t y)
+{
+    uint32_t row = header->heigth > 0 ? bmp_rows(header) - 1 - y : y;
+    return bmp + header->data_offset + row * bmp_row_size(header) + x * (header->bit_depth / 8);
+}
+
+// Whether the BMP cut holds the region of bmp, clipped to the image
+static int holds_region(const uint8_t *cut, size_t cut_len, const uint8_t *bmp, size_t len,
+                        const struct tftp_region *region)
+{
+    Bmp_Header image, header;
+    if (bmp_parse_header(bmp, len, &image) == -1 || bmp_parse_header(cut, cut_len, &header) == -1) {
+        return 0;
+    }
+    uint32_t width = (region->width - 1) / region->step + 1, rows = (region->height - 1) / region->step + 1;
+    if ((uint32_t)header.width != width || bmp_rows(&header) != rows || (header.heigth > 0) != (image.heigth > 0) ||
+        header.bit_depth != image.bit_depth || header.data_offset != image.data_offset ||
+        cut_len != header.data_offset + bmp_row_size(&header) * rows ||
+        memcmp(cut + BMP_HEADER_LEN, bmp + BMP_HEADER_LEN, header.data_offset - BMP_HEADER_LEN) != 0) {
+        return 0;
+    }
+
+    int channels = image.bit_depth / 8;
+    for (uint32_t y = 0; y < rows; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            const uint8_t *want = pixel(bmp, &image, region->x + x * region->step, region->y + y * region->step);
+            if (memcmp(pixel(cut, &header, x, y), want, channels) != 0) {
+                return 0;
+            }
+        }
+        const uint8_t *padding = pixel(cut, &header, width, y);
+        for (size_t i = 0; i < bmp_row_size(&header) - (size_t)width * channels; i++) {
+            if (padding[i] != 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// The option goes out in the RRQ and comes back in the OACK, anything but a region is ignored
+static int test_option(void)
+{
+    printf("[TEST] Region option\n");
+    uint8_t buf[512];
+
+    struct tftp_request rrq = { .opcode = TFTP_RRQ, .filename = "image.bmp", .mode = "octet",
+                                .region = { 1023, 7, 640, 480, 4 } };
+    size_t len = serialize_rrq_pkt(buf, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+    struct tftp_request parsed;
+    deserialize_rrq_pkt(buf, &parsed, len);
+    TEST_ASSERT(memcmp(&parsed.region, &rrq.region, sizeof(rrq.region)) == 0);
+
+    struct tftp_oack oack = { .opcode = TFTP_OACK, .region = { 0, 0, 4294967295u, 1, 1 } };
+    len = serialize_oack_pkt(buf, &oack);
+    struct tftp_oack parsed_oack;
+    deserialize_oack_pkt(buf, &parsed_oack, len);
+    TEST_ASSERT(memcmp(&parsed_oack.region, &oack.region, sizeof(oack.region)) == 0);
+
+    uint8_t bad[] = { 0, TFTP_OACK, 'r', 'e', 'g', 'i', 'o', 'n', 0, '1', ',', '2', 0 };
+    deserialize_oack_pkt(bad, &parsed_oack, sizeof(bad));
+    TEST_ASSERT(parsed_oack.region.width == 0);
+
+    struct tftp_region region;
+    TEST_ASSERT(tftp_parse_region("10,20,30,40", &region) == 0);
+    TEST_ASSERT(region.x == 10 && region.y == 20 && region.width == 30 && region.height == 40 && region.step == 1);
+    TEST_ASSERT(tftp_parse_region("0,0,1,1,8", &region) == 0 && region.step == 8);
+    const char *invalid[] = { "", "1,2,3", "1,2,3,4,", "1,2,0,4", "1,2,3,0", "1,2,3,4,0", "1,2,3,4,5,6",
+                              "-1,2,3,4", "1,2,3,4x", "1,,3,4", "4294967296,0,1,1" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        TEST_ASSERT(tftp_parse_region(invalid[i], &region) == -1 && region.width == 0);
+    }
+    return 0;
+}
+
+/*
+    Reads the region out of the image in chunks of odd sizes at odd offsets, as a session
+    asking for blocks at any offset would. Returns the region's BMP, NULL on failure.
+*/
+static uint8_t *read_region(const uint8_t *bmp, size_t len, struct tftp_region *region, size_t *cut_len)
+{
+    Bmp_Region r;
+    const struct tftp_source *src = bmp_region_source(&r, bmp, len, region);
+    if (src == NULL || src->data != NULL || src->size == TFTP_SIZE_UNKNOWN) {
+        return NULL;
+    }
+
+    *cut_len = src->size;
+    uint8_t *cut = malloc(*cut_len + 1);
+    if (cut == NULL) {
+        return NULL;
+    }
+    size_t pos = 0, chunk = 1;
+    while (pos < *cut_len) {
+        ssize_t n = src->read(src->ctx, pos, cut + pos, chunk);
+        if (n <= 0) {
+            free(cut);
+            return NULL;
+        }
+        pos += n;
+        chunk = chunk * 5 % 997 + 1;
+    }
+    if (src->read(src->ctx, pos, cut + pos, 1) != 0) {
+        free(cut);
+        return NULL;
+    }
+    return cut;
+}
+
+// Every layout of the image gives the region's pixels, in the order and padding of a BMP
+static int test_crop(int32_t width, int32_t height, int bit_depth, struct tftp_region region)
+{
+    printf("[TEST] Region %ux%u at %u,%u every %u of a %dx%d %d bit image\n", region.width, region.height,
+           region.x, region.y, region.step, width, height, bit_depth);
+    size_t len, cut_len;
+    uint8_t *bmp = make_image(width, height, bit_depth, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    struct tftp_region asked = region;
+    uint8_t *cut = read_region(bmp, len, &region, &cut_len);
+    TEST_ASSERT(cut != NULL);
+    int32_t rows = height < 0 ? -height : height;
+    int clipped = region.width == (asked.x + asked.width > (uint32_t)width ? width - asked.x : asked.width) &&
+                  region.height == (asked.y + asked.height > (uint32_t)rows ? rows - asked.y : asked.height);
+    int holds = holds_region(cut, cut_len, bmp, len, &region);
+    free(cut);
+    free(bmp);
+    TEST_ASSERT(clipped);
+    TEST_ASSERT(holds);
+    return 0;
+}
+
+// A region starting outside of the image, or anything that isn't a BMP, is refused
+static int test_refused(void)
+{
+    printf("[TEST] Region refused\n");
+    size_t len;
+    uint8_t *bmp = make_image(64, 48, 8, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    Bmp_Region r;
+    struct tftp_region outside = { 64, 0, 8, 8, 1 };
+    TEST_ASSERT(bmp_region_source(&r, bmp, len, &outside) == NULL);
+    outside = (struct tftp_region) { 0, 48, 8, 8, 1 };
+    TEST_ASSERT(bmp_region_source(&r, bmp, len, &outside) == NULL);
+    struct tftp_region inside = { 0, 0, 8, 8, 1 };
+    TEST_ASSERT(bmp_region_source(&r, bmp, len - 1, &inside) == NULL);
+    bmp[0] = 'X';
+    TEST_ASSERT(bmp_region_source(&r, bmp, len, &inside) == NULL);
+    free(bmp);
+    return 0;
+}
+
+// The satellite of a transfer, on a thread of its own
+struct satellite {
+    int sfd;
+    int crops; // cut out the region the ground station asks for, otherwise send the whole image
+    int result;
+};
+
+static void *run_satellite(void *arg)
+{
+    struct satellite *sat = arg;
+
+    if (!sat->crops) {
+        sat->result = tftp_send_mapped_file(sat->sfd, IMAGE_FILE_PATH, "[SATELLITE]");
+        return NULL;
+    }
+    Bmp_Region region;
+    struct tftp_cropper cropper;
+    bmp_region_cropper(&cropper, &region);
+    sat->result = tftp_send_mapped_image(sat->sfd, IMAGE_FILE_PATH, &cropper, "[SATELLITE]");
+    return NULL;
+}
+
+/*
+    Retrieves the image with opts from a satellite that crops it or not, into out of out_len
+    bytes. Returns 0 on success, 1 on failure.
+*/
+static int transfer(int crops, struct tftp_options *opts, uint8_t *out, size_t out_len, size_t *len,
+                    struct tftp_metrics *metrics)
+{
+    struct satellite sat = { .crops = crops, .result = -1 };
+    sat.sfd = open_socket(SATELLITE_SOCKET_PATH);
+    int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(sat.sfd >= 0 && sfd >= 0);
+
+    pthread_t thread;
+    TEST_ASSERT(pthread_create(&thread, NULL, run_satellite, &sat) == 0);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, SATELLITE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    struct tftp_memory mem;
+    struct tftp_sink sink;
+    tftp_memory_sink(&sink, &mem, out, out_len);
+    opts->metrics = metrics;
+    int result = tftp_retrieve_file(sfd, addr, &sink, opts, "[GROUND STATION]");
+
+    pthread_join(thread, NULL);
+    close(sat.sfd);
+    close(sfd);
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(result == 0);
+    TEST_ASSERT(sat.result == 0);
+    *len = mem.length;
+    return 0;
+}
+
+// Only the region crosses the link, and a satellite that can't crop sends the whole image
+static int test_region_transfer(void)
+{
+    printf("[TEST] Region transfer\n");
+    size_t len, received;
+    uint8_t *bmp = make_image(1024, 768, 8, &len);
+    TEST_ASSERT(bmp != NULL);
+    uint8_t *out = malloc(len + 1);
+    TEST_ASSERT(out != NULL);
+
+    FILE *fp = fopen(IMAGE_FILE_PATH, "wb");
+    TEST_ASSERT(fp != NULL);
+    TEST_ASSERT(fwrite(bmp, len, 1, fp) == 1);
+    fclose(fp);
+
+    struct tftp_region granted;
+    struct tftp_metrics whole, cut;
+    struct tftp_options opts = { .windowsize = 8, .blksize = 1024, .tsize = 1,
+                                 .region = { 900, 100, 200, 128, 2 }, .granted = &granted };
+    int failed = transfer(1, &opts, out, len + 1, &received, &cut);
+    struct tftp_region expected = { 900, 100, 124, 128, 2 };
+    int granted_clipped = memcmp(&granted, &expected, sizeof(expected)) == 0;
+    int holds = !failed && holds_region(out, received, bmp, len, &granted);
+
+    failed |= transfer(0, &opts, out, len + 1, &received, &whole);
+    int whole_image = granted.width == 0 && received == len && memcmp(out, bmp, len) == 0;
+
+    opts.region = (struct tftp_region) { 1024, 0, 16, 16, 1 };
+    failed |= transfer(1, &opts, out, len + 1, &received, &whole);
+    int refused = granted.width == 0 && received == len && memcmp(out, bmp, len) == 0;
+    free(out);
+    free(bmp);
+    unlink(IMAGE_FILE_PATH);
+
+    printf("[TEST] %llu bytes for the region, %llu for the image\n", (unsigned long long)cut.bytes,
+           (unsigned long long)whole.bytes);
+    TEST_ASSERT(!failed);
+    TEST_ASSERT(granted_clipped);
+    TEST_ASSERT(holds);
+    TEST_ASSERT(whole_image);
+    TEST_ASSERT(refused);
+    TEST_ASSERT(cut.bytes * 50 < whole.bytes);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting BMP region tests...\n");
+
+    char scratch_dir[] = "/tmp/bmp-region-test-XXXXXX";
+    if (enter_scratch_dir(scratch_dir, "temp", NULL) == -1) {
+        return 1;
+    }
+
+    int failed = 0;
+    failed |= test_option();
+    failed |= test_crop(101, 37, 8, (struct tftp_region) { 3, 5, 40, 20, 1 });
+    failed |= test_crop(101, -37, 24, (struct tftp_region) { 0, 0, 101, 37, 1 });
+    failed |= test_crop(101, 37, 24, (struct tftp_region) { 7, 2, 61, 30, 3 });
+    failed |= test_crop(64, -48, 8, (struct tftp_region) { 50, 40, 100, 100, 5 });
+    failed |= test_crop(333, 250, 24, (struct tftp_region) { 332, 249, 1, 1, 1 });
+    failed |= test_refused();
+    failed |= test_region_transfer();
+
+    leave_scratch_dir(scratch_dir, "temp", NULL);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
@@ -0,0 +1,54 @@
+#ifndef BMP_TEST_IMAGE_H
+#define BMP_TEST_IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "../src/image-processing.h"
+
+// BMP images built by the image tests, which fill in the pixels themselves
+
+// Bytes of a row of pixels, padding included
+static inline size_t test_bmp_row_size(int32_t width, int bit_depth)
+{
+    return ((size_t)width * bit_depth + 31) / 32 * 4;
+}
+
+// Where the pixels start, after the grayscale palette of 8 bit images
+static inline uint32_t test_bmp_data_offset(int bit_depth)
+{
+    return BMP_HEADER_LEN + (bit_depth == 8 ? 256 * 4 : 0);
+}
+
+/*
+    An uncompressed BMP of the given size and depth, its pixels and row padding all zero. Rows
+    are stored bottom up unless height is negative. 8 bit images carry a grayscale palette.
+    Returns the BMP, NULL on failure.
+*/
+static inline uint8_t *make_test_bmp(int32_t width, int32_t height, int bit_depth, size_t *len)
+{
+    uint32_t rows = height < 0 ? -height : height;
+    size_t row_size = test_bmp_row_size(width, bit_depth);
+    uint32_t data_offset = test_bmp_data_offset(bit_depth);
+
+    *len = data_offset + row_size * rows;
+    uint8_t *bmp = calloc(*len, 1);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    write_le16(bmp, BMP_SIGNATURE);
+    write_le32(bmp + 2, *len);
+    write_le32(bmp + 10, data_offset);
+    write_le32(bmp + 14, 40);
+    write_le32(bmp + 18, width);
+    write_le32(bmp + 22, height);
+    write_le16(bmp + 26, 1);
+    write_le16(bmp + 28, bit_depth);
+    write_le32(bmp + 34, row_size * rows);
+    for (uint32_t i = BMP_HEADER_LEN; i < data_offset; i += 4) {
+        bmp[i] = bmp[i + 1] = bmp[i + 2] = (i - BMP_HEADER_LEN) / 4;
+    }
+    return bmp;
+}
+
+#endif // BMP_TEST_IMAGE_H
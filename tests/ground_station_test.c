@@ -19,7 +19,8 @@ static int tests_passed = 0;
 #define RECEIVED_FILE_PATH "received-images/test.bmp"
 
 // Forward declarations
-int tftp_retrieve_file(int sfd, struct sockaddr_un dest_addr, uint8_t *buf, size_t len, const char *log_prefix);
+int tftp_retrieve_file(int sfd, struct sockaddr_un dest_addr, struct tftp_sink *sink,
+                       const struct tftp_options *opts, const char *log_prefix);
 void serialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_len);
 void deserialize_ack_pkt(uint8_t *buf, struct tftp_ack *ack_pkt);
 
@@ -64,9 +65,9 @@ static void run_mock_satellite(void) {
     // Send data in one packet
     struct tftp_data data_pkt = {
         .opcode = TFTP_DATA,
-        .block = 1
+        .block = 1,
+        .data = test_data
     };
-    memcpy(data_pkt.data, test_data, 100);
 
     size_t pkt_len = sizeof(data_pkt.opcode) + sizeof(data_pkt.block) + 100;
     uint8_t pkt_buf[pkt_len];
@@ -138,7 +139,7 @@ int main() {
     }
 
     // Retrieve the file
-    int result = tftp_retrieve_file(sfd, satellite_addr, NULL, 1, "[GROUND STATION]");
+    int result = tftp_retrieve_file(sfd, satellite_addr, NULL, NULL, "[GROUND STATION]");
     TEST_ASSERT(result == 0);
 
     // Verify the file was created and contains the expected data
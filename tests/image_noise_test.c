@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../src/image-processing.h"
+#include "../src/image-noise.h"
+#include "bmp_test_image.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define SAMPLES (1 << 20)
+#define SEED 42
+
+// A BMP of the given size and depth, every pixel at level. Returns NULL on failure.
+static uint8_t *make_frame(int32_t width, int32_t height, int bit_depth, uint8_t level, size_t *len)
+{
+    uint32_t rows = height < 0 ? -height : height;
+    size_t row_size = test_bmp_row_size(width, bit_depth);
+    uint32_t data_offset = test_bmp_data_offset(bit_depth);
+    uint8_t *bmp = make_test_bmp(width, height, bit_depth, len);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    for (uint32_t y = 0; y < rows; y++) {
+        memset(bmp + data_offset + y * row_size, level, (size_t)width * bit_depth / 8);
+    }
+    return bmp;
+}
+
+// The numbers have the moments and the tails of a standard normal distribution
+static int test_distribution(Noise_Kernel kernel)
+{
+    printf("[TEST] Normal distribution, %s kernel\n", noise_kernel_name(kernel));
+    Noise_Rng rng;
+    noise_seed(&rng, SEED);
+    TEST_ASSERT(noise_use_kernel(&rng, kernel) == 0);
+    float *z = malloc(SAMPLES * sizeof(float));
+    TEST_ASSERT(z != NULL);
+    noise_gaussian(&rng, z, SAMPLES);
+
+    int finite = 1;
+    double sum = 0, sumsq = 0, pairs = 0, max = 0;
+    size_t tail = 0;
+    for (size_t i = 0; i < SAMPLES; i++) {
+        finite &= isfinite(z[i]);
+        sum += z[i];
+        sumsq += (double)z[i] * z[i];
+        tail += fabs(z[i]) > 3;
+        max = fabs(z[i]) > max ? fabs(z[i]) : max;
+    }
+    // The cosine and the sine of a lane come from the same two uniform numbers
+    for (size_t i = 0; i < SAMPLES; i += NOISE_BLOCK) {
+        for (int lane = 0; lane < NOISE_LANES; lane++) {
+            pairs += (double)z[i + lane] * z[i + NOISE_LANES + lane];
+        }
+    }
+    free(z);
+
+    double mean = sum / SAMPLES;
+    double stddev = sqrt(sumsq / SAMPLES - mean * mean);
+    double correlation = pairs / (SAMPLES / 2);
+    double tail_fraction = (double)tail / SAMPLES;
+    printf("[TEST] mean %.4f, stddev %.4f, pair correlation %.4f, beyond 3 sigmas %.5f, max %.2f\n", mean,
+           stddev, correlation, tail_fraction, max);
+    TEST_ASSERT(finite);
+    TEST_ASSERT(fabs(mean) < 0.005);
+    TEST_ASSERT(fabs(stddev - 1.0) < 0.005);
+    TEST_ASSERT(fabs(correlation) < 0.01);
+    TEST_ASSERT(fabs(tail_fraction - 0.0027) < 0.0004);
+    TEST_ASSERT(max > 4.0 && max < 6.0);
+    return 0;
+}
+
+// Every kernel gives the numbers of the scalar one, counts that aren't whole blocks included
+static int test_kernels_agree(void)
+{
+    printf("[TEST] Kernels agree bit for bit\n");
+    size_t count = 10007;
+    float *expected = malloc(count * sizeof(float));
+    float *z = malloc(count * sizeof(float));
+    uint8_t expected_pixels[1003], pixels[1003];
+    TEST_ASSERT(expected != NULL && z != NULL);
+
+    Noise_Rng rng;
+    noise_seed(&rng, SEED);
+    noise_use_kernel(&rng, NOISE_KERNEL_SCALAR);
+    noise_gaussian(&rng, expected, count);
+    for (size_t i = 0; i < sizeof(expected_pixels); i++) {
+        expected_pixels[i] = i * 37;
+    }
+    noise_add(&rng, expected_pixels, sizeof(expected_pixels), 40.0f);
+
+    int agree = 1, kernels = 0;
+    for (Noise_Kernel kernel = NOISE_KERNEL_SSE2; kernel <= NOISE_KERNEL_AVX2; kernel++) {
+        noise_seed(&rng, SEED);
+        if (noise_use_kernel(&rng, kernel) == -1) {
+            printf("[TEST] No %s kernel here\n", noise_kernel_name(kernel));
+            continue;
+        }
+        kernels++;
+        noise_gaussian(&rng, z, count);
+        for (size_t i = 0; i < sizeof(pixels); i++) {
+            pixels[i] = i * 37;
+        }
+        noise_add(&rng, pixels, sizeof(pixels), 40.0f);
+        agree &= memcmp(z, expected, count * sizeof(float)) == 0;
+        agree &= memcmp(pixels, expected_pixels, sizeof(pixels)) == 0;
+    }
+    free(expected);
+    free(z);
+    printf("[TEST] %d kernels checked against the scalar one\n", kernels);
+    TEST_ASSERT(agree);
+    return 0;
+}
+
+// A seed always gives the same noise, other seeds and other lanes give other noise
+static int test_seed(void)
+{
+    printf("[TEST] Seeds\n");
+    float a[NOISE_BLOCK * 4], b[NOISE_BLOCK * 4];
+    Noise_Rng rng;
+
+    noise_seed(&rng, SEED);
+    noise_gaussian(&rng, a, NOISE_BLOCK * 4);
+    noise_seed(&rng, SEED);
+    noise_gaussian(&rng, b, NOISE_BLOCK * 4);
+    TEST_ASSERT(memcmp(a, b, sizeof(a)) == 0);
+
+    noise_seed(&rng, SEED + 1);
+    noise_gaussian(&rng, b, NOISE_BLOCK * 4);
+    TEST_ASSERT(memcmp(a, b, sizeof(a)) != 0);
+
+    int lanes_differ = 1;
+    for (int lane = 1; lane < NOISE_LANES; lane++) {
+        lanes_differ &= a[lane] != a[0];
+    }
+    TEST_ASSERT(lanes_differ);
+
+    // A call that stops within a block drops the rest of it
+    noise_seed(&rng, SEED);
+    noise_gaussian(&rng, b, 3);
+    noise_gaussian(&rng, b + 3, NOISE_BLOCK);
+    TEST_ASSERT(memcmp(a, b, 3 * sizeof(float)) == 0);
+    TEST_ASSERT(memcmp(a + NOISE_BLOCK, b + 3, NOISE_BLOCK * sizeof(float)) == 0);
+    return 0;
+}
+
+// Pixels keep their level on average, spread by sigma, and saturate instead of wrapping
+static int test_noise_add(void)
+{
+    printf("[TEST] Noise added to pixels\n");
+    size_t len = 1 << 16;
+    uint8_t *pixels = malloc(len);
+    TEST_ASSERT(pixels != NULL);
+    Noise_Rng rng;
+    noise_seed(&rng, SEED);
+
+    memset(pixels, 128, len);
+    noise_add(&rng, pixels, len, 10.0f);
+    double sum = 0, sumsq = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += pixels[i];
+        sumsq += (double)pixels[i] * pixels[i];
+    }
+    double mean = sum / len, stddev = sqrt(sumsq / len - mean * mean);
+    printf("[TEST] mean %.2f, stddev %.2f\n", mean, stddev);
+    TEST_ASSERT(fabs(mean - 128) < 0.2);
+    TEST_ASSERT(fabs(stddev - 10) < 0.2);
+
+    memset(pixels, 250, len);
+    noise_add(&rng, pixels, len, 20.0f);
+    size_t saturated = 0, wrapped = 0;
+    for (size_t i = 0; i < len; i++) {
+        saturated += pixels[i] == 255;
+        wrapped += pixels[i] < 50;
+    }
+    TEST_ASSERT(saturated > len / 3 && wrapped == 0);
+
+    memset(pixels, 7, len);
+    noise_add(&rng, pixels, len - 5, 0.0f);
+    int unchanged = 1;
+    for (size_t i = 0; i < len; i++) {
+        unchanged &= pixels[i] == 7;
+    }
+    free(pixels);
+    TEST_ASSERT(unchanged);
+    return 0;
+}
+
+// Only the pixels of a BMP get noise, its header, palette and row padding stay as they were
+static int test_bmp(int32_t width, int32_t height, int bit_depth)
+{
+    printf("[TEST] Noise added to a %dx%d %d bit BMP\n", width, height, bit_depth);
+    size_t len;
+    uint8_t *bmp = make_frame(width, height, bit_depth, 100, &len);
+    uint8_t *original = make_frame(width, height, bit_depth, 100, &len);
+    TEST_ASSERT(bmp != NULL && original != NULL);
+
+    Noise_Rng rng;
+    noise_seed(&rng, SEED);
+    TEST_ASSERT(bmp_add_noise(&rng, bmp, len, 5.0f) == 0);
+
+    Bmp_Header header;
+    TEST_ASSERT(bmp_parse_header(bmp, len, &header) == 0);
+    int header_kept = memcmp(bmp, original, header.data_offset) == 0;
+    size_t pixel_bytes = (size_t)width * bit_depth / 8, changed = 0;
+    int padding_kept = 1;
+    for (uint32_t y = 0; y < bmp_rows(&header); y++) {
+        uint8_t *row = bmp + header.data_offset + y * bmp_row_size(&header);
+        for (size_t x = 0; x < bmp_row_size(&header); x++) {
+            if (x < pixel_bytes) {
+                changed += row[x] != 100;
+            } else {
+                padding_kept &= row[x] == 0;
+            }
+        }
+    }
+    free(original);
+    TEST_ASSERT(header_kept);
+    TEST_ASSERT(padding_kept);
+    TEST_ASSERT(changed > pixel_bytes * bmp_rows(&header) / 2);
+
+    bmp[0] = 'X';
+    TEST_ASSERT(bmp_add_noise(&rng, bmp, len, 5.0f) == -1);
+    free(bmp);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting image noise tests...\n");
+
+    int failed = 0;
+    Noise_Rng rng;
+    noise_seed(&rng, SEED);
+    for (Noise_Kernel kernel = NOISE_KERNEL_SCALAR; kernel <= NOISE_KERNEL_AVX2; kernel++) {
+        if (noise_use_kernel(&rng, kernel) == 0) {
+            failed |= test_distribution(kernel);
+        }
+    }
+    failed |= test_kernels_agree();
+    failed |= test_seed();
+    failed |= test_noise_add();
+    failed |= test_bmp(101, 37, 24);
+    failed |= test_bmp(64, -48, 8);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
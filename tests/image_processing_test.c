@@ -1,7 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 #include <assert.h>
 #include "../src/image-processing.h"
+#include "bmp_test_image.h"
 
 static int tests_run = 0;
 static int tests_passed = 0;
@@ -12,7 +16,80 @@ static int tests_passed = 0;
 // Forward declaration if not in header
 void box_muller_transform(Box_Muller_Output *output);
 
-int main() {
+#define BACKGROUND 30
+#define STARS 40
+
+typedef struct {
+    double x, y;
+    double brightness;
+} Placed_Star;
+
+// A BMP of the given size and depth, every pixel at BACKGROUND. Returns NULL on failure.
+static uint8_t *make_frame(int32_t width, int32_t height, int bit_depth, size_t *len)
+{
+    uint32_t rows = height < 0 ? -height : height;
+    size_t row_size = test_bmp_row_size(width, bit_depth);
+    uint32_t data_offset = test_bmp_data_offset(bit_depth);
+    uint8_t *bmp = make_test_bmp(width, height, bit_depth, len);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    for (uint32_t y = 0; y < rows; y++) {
+        memset(bmp + data_offset + y * row_size, BACKGROUND, (size_t)width * bit_depth / 8);
+    }
+    return bmp;
+}
+
+// Sets the pixel at (x, y), y from the top, to value on every channel
+static void set_pixel(uint8_t *bmp, int x, int y, uint8_t value)
+{
+    Bmp_Header header;
+    assert(bmp_parse_header(bmp, BMP_HEADER_LEN, &header) == 0);
+    uint32_t rows = bmp_rows(&header);
+    uint32_t file_y = header.heigth > 0 ? rows - 1 - y : (uint32_t)y;
+    uint8_t *pixel = bmp + header.data_offset + file_y * bmp_row_size(&header) + (size_t)x * header.bit_depth / 8;
+    memset(pixel, value, header.bit_depth / 8);
+}
+
+/*
+    A frame of gaussian stars at fractional places on a grid, so they never touch, over a
+    noisy background.
+*/
+static uint8_t *make_star_field(int32_t width, int32_t height, int bit_depth, Placed_Star *placed, size_t *len)
+{
+    uint8_t *bmp = make_frame(width, height, bit_depth, len);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    uint32_t rows = height < 0 ? -height : height;
+    unsigned seed = 11;
+    for (uint32_t y = 0; y < rows; y++) {
+        for (int32_t x = 0; x < width; x++) {
+            seed = seed * 1103515245 + 12345;
+            set_pixel(bmp, x, y, BACKGROUND + (seed >> 16) % 5 - 2);
+        }
+    }
+
+    int columns = width / 20;
+    for (int i = 0; i < STARS; i++) {
+        seed = seed * 1103515245 + 12345;
+        placed[i].x = 10 + (i % columns) * 20 + ((seed >> 8) % 100) / 100.0;
+        placed[i].y = 10 + (i / columns) * 20 + ((seed >> 18) % 100) / 100.0;
+        placed[i].brightness = 60 + i * 4;
+        for (int y = (int)placed[i].y - 4; y <= (int)placed[i].y + 5; y++) {
+            for (int x = (int)placed[i].x - 4; x <= (int)placed[i].x + 5; x++) {
+                double r2 = (x - placed[i].x) * (x - placed[i].x) + (y - placed[i].y) * (y - placed[i].y);
+                double value = BACKGROUND + placed[i].brightness * exp(-r2 / (2 * 1.2 * 1.2));
+                set_pixel(bmp, x, y, value > 255 ? 255 : (uint8_t)(value + 0.5));
+            }
+        }
+    }
+    return bmp;
+}
+
+static int test_box_muller(void)
+{
+    printf("[TEST] Box-Muller transform\n");
     Box_Muller_Output output;
     int nan_count = 0, inf_count = 0;
     int N = 10000;
@@ -36,11 +113,121 @@ int main() {
     TEST_ASSERT(nan_count == 0 && inf_count == 0);
     TEST_ASSERT(fabs(mean_z1) < 0.1 && fabs(mean_z2) < 0.1); // mean should be close to 0
     TEST_ASSERT(fabs(stddev_z1 - 1.0) < 0.1 && fabs(stddev_z2 - 1.0) < 0.1); // stddev should be close to 1
+    return 0;
+}
+
+// Every star is found once, at its place to a fraction of a pixel, and the brightest first
+static int test_detect(int32_t width, int32_t height, int bit_depth)
+{
+    printf("[TEST] Star detection in a %dx%d %d bit frame\n", width, height, bit_depth);
+    Placed_Star placed[STARS];
+    size_t len;
+    uint8_t *bmp = make_star_field(width, height, bit_depth, placed, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    Star *stars;
+    size_t count;
+    TEST_ASSERT(detect_stars(bmp, len, NULL, &stars, &count) == 0);
+    free(bmp);
+    TEST_ASSERT(count == STARS);
+
+    double worst = 0;
+    int sorted = 1;
+    for (size_t i = 0; i < count; i++) {
+        const Placed_Star *p = &placed[STARS - 1 - i];
+        worst = fmax(worst, hypot(stars[i].x - p->x, stars[i].y - p->y));
+        sorted &= i == 0 || stars[i].flux <= stars[i - 1].flux;
+    }
+    printf("[TEST] Centroids within %.3f pixels\n", worst);
+    TEST_ASSERT(worst < 0.1);
+    TEST_ASSERT(sorted);
+    TEST_ASSERT(stars[0].peak > BACKGROUND + placed[STARS - 1].brightness / 2 && stars[0].pixels > 4);
+    free(stars);
+    return 0;
+}
 
-    if (tests_run == tests_passed) {
+// A U is one star even though its arms only meet rows after they start, a diagonal too
+static int test_connected(void)
+{
+    printf("[TEST] Connected components\n");
+    size_t len;
+    uint8_t *bmp = make_frame(40, -20, 8, &len);
+    TEST_ASSERT(bmp != NULL);
+    for (int y = 2; y < 10; y++) {
+        set_pixel(bmp, 5, y, 200);
+        set_pixel(bmp, 15, y, 200);
+    }
+    for (int x = 5; x <= 15; x++) {
+        set_pixel(bmp, x, 10, 200);
+    }
+    for (int i = 0; i < 5; i++) {
+        set_pixel(bmp, 25 + i, 5 + i, 100);
+    }
+    set_pixel(bmp, 35, 15, 255); // a hot pixel
+
+    Star *stars;
+    size_t count;
+    TEST_ASSERT(detect_stars(bmp, len, NULL, &stars, &count) == 0);
+    TEST_ASSERT(count == 2);
+    TEST_ASSERT(stars[0].pixels == 27 && fabs(stars[0].x - 10) < 1e-3 && stars[0].peak == 200);
+    TEST_ASSERT(stars[1].pixels == 5 && fabs(stars[1].x - 27) < 1e-3 && fabs(stars[1].y - 7) < 1e-3);
+    free(stars);
+
+    Star_Detect_Options opts = { .min_pixels = 1, .max_stars = 1 };
+    TEST_ASSERT(detect_stars(bmp, len, &opts, &stars, &count) == 0);
+    TEST_ASSERT(count == 1 && stars[0].pixels == 27);
+    free(stars);
+
+    bmp[0] = 'X';
+    TEST_ASSERT(detect_stars(bmp, len, NULL, &stars, &count) == -1);
+    free(bmp);
+    return 0;
+}
+
+// Not a pass/fail test, it shows what a frame costs
+static int test_throughput(void)
+{
+    printf("[TEST] Detection throughput\n");
+    Placed_Star placed[STARS];
+    size_t len;
+    uint8_t *bmp = make_star_field(2048, 2048, 8, placed, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    struct timespec start, end;
+    Star *stars;
+    size_t count;
+    int frames = 20, result = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < frames && result == 0; i++) {
+        result = detect_stars(bmp, len, NULL, &stars, &count);
+        if (result == 0) {
+            free(stars);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(bmp);
+    TEST_ASSERT(result == 0);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("[TEST] 2048x2048 frame in %.2f ms, %.0f Mpixels/s\n", seconds * 1000 / frames,
+           2048.0 * 2048 * frames / seconds / 1e6);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting image processing tests...\n");
+
+    int failed = 0;
+    failed |= test_box_muller();
+    failed |= test_detect(433, 250, 8);
+    failed |= test_detect(433, -250, 24);
+    failed |= test_connected();
+    failed |= test_throughput();
+
+    if (tests_run == tests_passed && !failed) {
         printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
     } else {
         printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
     }
-    return 0;
-} 
\ No newline at end of file
+    return failed;
+}
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "../src/tftp.h"
+#include "../src/tftp-io.h"
+#include "../src/link-emu.h"
+#include "tftp_test_fixture.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define SATELLITE_SOCKET_PATH "temp/server-socket"
+#define GROUND_STATION_SOCKET_PATH "temp/client-socket"
+#define LINK_SOCKET_PATH "temp/link-socket"
+#define RELAY_SOCKET_PATH "temp/link-relay-socket"
+
+#define SAMPLES 200000
+
+// The same seed and traffic give the same link, another seed another one
+static int test_determinism(void)
+{
+    printf("[TEST] Determinism\n");
+    struct link_profile profile = {
+        .delay_ms = 20, .jitter_ms = 5, .rate_bps = 1000000, .loss = 0.05,
+        .duplicate = 0.05, .reorder = 0.05
+    };
+    struct link_path a, b, c;
+    link_path_init(&a, &profile, 42);
+    link_path_init(&b, &profile, 42);
+    link_path_init(&c, &profile, 43);
+
+    int same = 1, differs = 0;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t arrivals_a[2], arrivals_b[2], arrivals_c[2];
+        size_t len = 100 + (i * 37) % 1400;
+        int copies_a = link_path_admit(&a, len, (uint64_t)i * 1000, arrivals_a);
+        int copies_b = link_path_admit(&b, len, (uint64_t)i * 1000, arrivals_b);
+        int copies_c = link_path_admit(&c, len, (uint64_t)i * 1000, arrivals_c);
+        same &= copies_a == copies_b && memcmp(arrivals_a, arrivals_b, copies_a * sizeof(uint64_t)) == 0;
+        differs |= copies_a != copies_c || memcmp(arrivals_a, arrivals_c, copies_a * sizeof(uint64_t)) != 0;
+    }
+    TEST_ASSERT(same);
+    TEST_ASSERT(differs);
+    TEST_ASSERT(a.stats.lost == b.stats.lost && a.stats.duplicated == b.stats.duplicated);
+    return 0;
+}
+
+static int test_bernoulli_loss(void)
+{
+    printf("[TEST] Bernoulli loss\n");
+    struct link_profile profile = { .loss = 0.1 };
+    struct link_path path;
+    link_path_init(&path, &profile, 7);
+
+    int undelayed = 1;
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t arrivals[2];
+        int copies = link_path_admit(&path, 512, 0, arrivals);
+        undelayed &= copies == 0 || (copies == 1 && arrivals[0] == 0);
+    }
+    TEST_ASSERT(undelayed);
+    TEST_ASSERT(path.stats.lost > SAMPLES * 0.09 && path.stats.lost < SAMPLES * 0.11);
+    TEST_ASSERT(path.stats.duplicated == 0 && path.stats.reordered == 0);
+    return 0;
+}
+
+/*
+    Gilbert-Elliott losses come in bursts: a datagram right after a lost one is lost far more
+    often than on average, which independent losses of the same rate never do.
+*/
+static int test_gilbert_elliott_loss(void)
+{
+    printf("[TEST] Gilbert-Elliott loss\n");
+    struct link_profile profile = { .ge_enter_bad = 0.01, .ge_leave_bad = 0.1, .ge_bad_loss = 0.5 };
+    struct link_path path;
+    link_path_init(&path, &profile, 7);
+
+    unsigned long lost_after_lost = 0, lost_before = 0;
+    int was_lost = 0;
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t arrivals[2];
+        int lost = link_path_admit(&path, 512, 0, arrivals) == 0;
+        if (was_lost) {
+            lost_before++;
+            lost_after_lost += lost;
+        }
+        was_lost = lost;
+    }
+
+    // A tenth of the time in the bad state (0.01 / (0.01 + 0.1)), losing half of it
+    double rate = (double)path.stats.lost / SAMPLES;
+    TEST_ASSERT(rate > 0.035 && rate < 0.055);
+    TEST_ASSERT((double)lost_after_lost / lost_before > 5 * rate);
+    return 0;
+}
+
+// A datagram takes len / rate on the link, behind the ones still being sent
+static int test_rate(void)
+{
+    printf("[TEST] Bandwidth cap\n");
+    struct link_profile profile = { .delay_ms = 10, .rate_bps = 8000000 }; // a byte per microsecond
+    struct link_path path;
+    link_path_init(&path, &profile, 1);
+
+    int paced = 1;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t arrivals[2];
+        paced &= link_path_admit(&path, 1000, 0, arrivals) == 1 && arrivals[0] == (uint64_t)(i + 1) * 1000 + 10000;
+    }
+    TEST_ASSERT(paced);
+
+    // After a pause the link is idle again
+    uint64_t arrivals[2];
+    TEST_ASSERT(link_path_admit(&path, 500, 2000000, arrivals) == 1);
+    TEST_ASSERT(arrivals[0] == 2000000 + 500 + 10000);
+    return 0;
+}
+
+static int test_delay_duplication_reordering(void)
+{
+    printf("[TEST] Delay, jitter, duplication and reordering\n");
+    struct link_profile profile = { .delay_ms = 50, .jitter_ms = 10, .duplicate = 0.05, .reorder = 0.2 };
+    struct link_path path;
+    link_path_init(&path, &profile, 99);
+
+    unsigned long copies_total = 0, early = 0, jittered_low = 0, jittered_high = 0;
+    int in_bounds = 1;
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t now = (uint64_t)i * 100;
+        uint64_t arrivals[2];
+        int copies = link_path_admit(&path, 512, now, arrivals);
+        for (int j = 0; j < copies; j++) {
+            uint64_t delay = arrivals[j] - now;
+            if (delay == 0) {
+                early++;
+                continue;
+            }
+            in_bounds &= delay >= 40000 && delay <= 60000;
+            jittered_low += delay < 45000;
+            jittered_high += delay > 55000;
+        }
+        copies_total += copies;
+    }
+
+    TEST_ASSERT(in_bounds);
+    TEST_ASSERT(path.stats.lost == 0);
+    TEST_ASSERT(path.stats.duplicated > SAMPLES * 0.045 && path.stats.duplicated < SAMPLES * 0.055);
+    TEST_ASSERT(copies_total == SAMPLES + path.stats.duplicated);
+    TEST_ASSERT(early == path.stats.reordered);
+    TEST_ASSERT(early > copies_total * 0.19 && early < copies_total * 0.21);
+    TEST_ASSERT(jittered_low > 0 && jittered_high > 0);
+    return 0;
+}
+
+/*
+    Sends buf from a satellite child process to this one through an emulator in another
+    child, then checks that every byte made it across intact.
+*/
+static int run_emulated_transfer(const char *name, uint8_t *buf, size_t buf_len, const struct link_profile *profile,
+                                 const struct tftp_options *opts)
+{
+    printf("[TEST] Transfer of %zu bytes over %s\n", buf_len, name);
+
+    // Both ends are bound before either child starts, so no datagram goes to a missing socket
+    struct link_emulator emulator;
+    TEST_ASSERT(link_emulator_open(&emulator, LINK_SOCKET_PATH, RELAY_SOCKET_PATH, SATELLITE_SOCKET_PATH,
+                                   profile, profile, 1234) == 0);
+    int satellite_fd = open_socket(SATELLITE_SOCKET_PATH);
+    TEST_ASSERT(satellite_fd >= 0);
+
+    fflush(stdout);
+    pid_t satellite = fork();
+    TEST_ASSERT(satellite >= 0);
+    if (satellite == 0) {
+        int result = tftp_send_file(satellite_fd, buf, buf_len, "[SATELLITE]");
+        exit(result == 0 ? 0 : 1);
+    }
+    close(satellite_fd);
+
+    pid_t link = fork();
+    TEST_ASSERT(link >= 0);
+    if (link == 0) {
+        static volatile sig_atomic_t stop = 0;
+        exit(link_emulator_run(&emulator, &stop) == 0 ? 0 : 1);
+    }
+    close(emulator.ground_fd);
+    close(emulator.satellite_fd);
+
+    uint8_t *out = malloc(buf_len + 1);
+    TEST_ASSERT(out != NULL);
+    struct tftp_memory mem;
+    struct tftp_sink sink;
+    tftp_memory_sink(&sink, &mem, out, buf_len + 1);
+
+    int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(sfd >= 0);
+    struct sockaddr_un link_addr;
+    memset(&link_addr, 0, sizeof(struct sockaddr_un));
+    link_addr.sun_family = AF_UNIX;
+    strncpy(link_addr.sun_path, LINK_SOCKET_PATH, sizeof(link_addr.sun_path) - 1);
+    int result = tftp_retrieve_file(sfd, link_addr, &sink, opts, "[GROUND STATION]");
+    close(sfd);
+
+    int status;
+    TEST_ASSERT(waitpid(satellite, &status, 0) == satellite);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    kill(link, SIGTERM);
+    TEST_ASSERT(waitpid(link, &status, 0) == link);
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+    unlink(LINK_SOCKET_PATH);
+    unlink(RELAY_SOCKET_PATH);
+
+    int matches = mem.length == buf_len && memcmp(out, buf, buf_len) == 0;
+    free(out);
+    TEST_ASSERT(result == 0);
+    TEST_ASSERT(matches);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting link emulator tests...\n");
+
+    char scratch_dir[] = "/tmp/link-emu-test-XXXXXX";
+    if (enter_scratch_dir(scratch_dir, "temp", NULL) == -1) {
+        return 1;
+    }
+
+    int failed = 0;
+    failed |= test_determinism();
+    failed |= test_bernoulli_loss();
+    failed |= test_gilbert_elliott_loss();
+    failed |= test_rate();
+    failed |= test_delay_duplication_reordering();
+
+    size_t len = 50000;
+    uint8_t *buf = malloc(len);
+    if (buf == NULL) {
+        perror("unable to allocate test data");
+        return 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (i * 7 + i / 512) % 251;
+    }
+
+    struct tftp_options opts = { .windowsize = 8, .blksize = 1428 };
+    struct link_profile clean = { 0 };
+    struct link_profile slow = { .delay_ms = 5, .jitter_ms = 2, .rate_bps = 20000000 };
+    struct link_profile lossy = { .delay_ms = 2, .jitter_ms = 1, .loss = 0.03, .duplicate = 0.02, .reorder = 0.02 };
+    struct link_profile bursty = { .delay_ms = 2, .ge_enter_bad = 0.02, .ge_leave_bad = 0.3, .ge_bad_loss = 0.5 };
+    failed |= run_emulated_transfer("a clean link", buf, len, &clean, NULL);
+    failed |= run_emulated_transfer("a slow link", buf, len, &slow, &opts);
+    failed |= run_emulated_transfer("a lossy link", buf, len, &lossy, &opts);
+    failed |= run_emulated_transfer("a link with burst losses", buf, len, &bursty, &opts);
+    free(buf);
+
+    leave_scratch_dir(scratch_dir, "temp", NULL);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
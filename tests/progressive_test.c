@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/image-processing.h"
+#include "../src/progressive.h"
+#include "bmp_test_image.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+// A BMP of smooth gradients with a little noise, 8 bit ones with a grayscale palette
+static uint8_t *make_image(int32_t width, int32_t height, int bit_depth, size_t *len)
+{
+    int channels = bit_depth / 8;
+    uint32_t rows = height < 0 ? -height : height;
+    size_t row_size = test_bmp_row_size(width, bit_depth);
+    uint32_t data_offset = test_bmp_data_offset(bit_depth);
+    uint8_t *bmp = make_test_bmp(width, height, bit_depth, len);
+    if (bmp == NULL) {
+        return NULL;
+    }
+
+    unsigned seed = 3;
+    for (uint32_t y = 0; y < rows; y++) {
+        for (int32_t x = 0; x < width; x++) {
+            for (int c = 0; c < channels; c++) {
+                seed = seed * 1103515245 + 12345;
+                bmp[data_offset + y * row_size + x * channels + c] = (x + 2 * y + 40 * c) % 200 + (seed >> 16) % 4;
+            }
+        }
+    }
+    return bmp;
+}
+
+// Mean absolute difference between the pixel arrays of two BMPs of the same size
+static double image_error(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    double sum = 0;
+    for (size_t i = BMP_HEADER_LEN; i < len; i++) {
+        sum += abs(a[i] - b[i]);
+    }
+    return sum / (len - BMP_HEADER_LEN);
+}
+
+// All of the stream gives back the BMP, whatever its size, depth and row order
+static int test_round_trip(int32_t width, int32_t height, int bit_depth)
+{
+    printf("[TEST] Round trip of a %dx%d %d bit image\n", width, height, bit_depth);
+    size_t len;
+    uint8_t *bmp = make_image(width, height, bit_depth, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    uint8_t *stream, *decoded;
+    size_t stream_len, decoded_len;
+    double complete;
+    TEST_ASSERT(progressive_encode(bmp, len, &stream, &stream_len) == 0);
+    TEST_ASSERT(progressive_decode(stream, stream_len, &decoded, &decoded_len, &complete) == 0);
+    int identical = decoded_len == len && memcmp(decoded, bmp, len) == 0;
+    free(stream);
+    free(decoded);
+    free(bmp);
+    TEST_ASSERT(identical);
+    TEST_ASSERT(complete == 1);
+    return 0;
+}
+
+// Any prefix is a whole frame, and the longer it is the closer the frame comes
+static int test_truncated(int bit_depth)
+{
+    printf("[TEST] Truncated %d bit stream\n", bit_depth);
+    size_t len;
+    uint8_t *bmp = make_image(301, 203, bit_depth, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    uint8_t *stream, *decoded;
+    size_t stream_len, decoded_len;
+    TEST_ASSERT(progressive_encode(bmp, len, &stream, &stream_len) == 0);
+    size_t pixels_start = stream_len - 301 * 203 * (bit_depth / 8);
+
+    // Nothing of the pixels yet is a black frame
+    uint8_t *black = calloc(len, 1);
+    TEST_ASSERT(black != NULL);
+    double black_error = image_error(black, bmp, len);
+    free(black);
+
+    double percents[] = { 2, 7, 13, 26, 51, 100 };
+    double last_error = black_error;
+    int whole = 1, closer = 1;
+    for (size_t i = 0; i < sizeof(percents) / sizeof(percents[0]); i++) {
+        size_t cut = pixels_start + (stream_len - pixels_start) * percents[i] / 100;
+        double complete;
+        TEST_ASSERT(progressive_decode(stream, cut, &decoded, &decoded_len, &complete) == 0);
+        double error = image_error(decoded, bmp, len);
+        printf("[TEST] %5.1f%% of the pixels, mean error %.2f\n", complete * 100, error);
+        whole &= decoded_len == len && memcmp(decoded, bmp, BMP_HEADER_LEN) == 0;
+        closer &= error < last_error;
+        last_error = error;
+        free(decoded);
+    }
+    TEST_ASSERT(whole);
+    TEST_ASSERT(closer);
+    TEST_ASSERT(last_error == 0);
+
+    // Up to the header, it can't be told from anything else
+    TEST_ASSERT(progressive_decode(stream, pixels_start - 1, &decoded, &decoded_len, NULL) == -1);
+    TEST_ASSERT(progressive_decode(stream, pixels_start, &decoded, &decoded_len, NULL) == 0);
+    free(decoded);
+    free(stream);
+    free(bmp);
+    return 0;
+}
+
+static int test_not_a_bmp(void)
+{
+    printf("[TEST] Not a BMP\n");
+    uint8_t junk[200] = { 'P', 'R', 'O', 'G', PROGRESSIVE_VERSION, 54 };
+    uint8_t *out;
+    size_t out_len;
+    TEST_ASSERT(progressive_encode(junk, sizeof(junk), &out, &out_len) == -1);
+    TEST_ASSERT(progressive_decode(junk, sizeof(junk), &out, &out_len, NULL) == -1);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting progressive image tests...\n");
+
+    int failed = 0;
+    failed |= test_round_trip(640, 480, 8);
+    failed |= test_round_trip(13, -7, 24);
+    failed |= test_round_trip(1, 1, 8);
+    failed |= test_round_trip(9, 10, 24);
+    failed |= test_truncated(8);
+    failed |= test_truncated(24);
+    failed |= test_not_a_bmp();
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
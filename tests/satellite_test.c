@@ -20,7 +20,8 @@ static int tests_passed = 0;
 
 // Forward declarations
 int tftp_send_file(int sfd, uint8_t *buf, size_t buf_len, const char *log_prefix);
-void serialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, size_t filename_len, size_t mode_len);
+int tftp_send_mapped_file(int sfd, const char *path, const char *log_prefix);
+size_t serialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, size_t filename_len, size_t mode_len);
 void deserialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_len);
 void serialize_ack_pkt(uint8_t *buf, struct tftp_ack *ack_pkt);
 
@@ -58,6 +59,10 @@ void run_mock_ground_station() {
     uint8_t serial_buf[serial_buf_len];
     serialize_rrq_pkt(serial_buf, &rrq, filename_len, mode_len);
     printf("[GROUND STATION] Sending read request...\n");
+    // The satellite may not have bound its socket yet
+    for (int wait_count = 0; access(SATELLITE_SOCKET_PATH, F_OK) == -1 && wait_count < 1000; wait_count++) {
+        usleep(1000);
+    }
     if (sendto(sfd, serial_buf, serial_buf_len, 0, (struct sockaddr *) &server_addr, sizeof(struct sockaddr_un)) == -1) {
         perror("Unable to send request packet");
         exit(1);
@@ -73,7 +78,8 @@ void run_mock_ground_station() {
             exit(1);
         }
         printf("[GROUND STATION] Received data packet of size %zd\n", recv_len);
-        struct tftp_data data_pkt;
+        uint8_t data_buf[DEFAULT_BLKSIZE];
+        struct tftp_data data_pkt = { .data = data_buf };
         size_t data_len = recv_len - sizeof(data_pkt.opcode) - sizeof(data_pkt.block);
         deserialize_data_pkt(recv_buf, &data_pkt, data_len);
         printf("[GROUND STATION] Received block %d with %zu bytes of data\n", data_pkt.block, data_len);
@@ -88,7 +94,7 @@ void run_mock_ground_station() {
             exit(1);
         }
         printf("[GROUND STATION] ACK sent successfully\n");
-        if (data_len < MAX_DATA_LEN) {
+        if (data_len < DEFAULT_BLKSIZE) {
             printf("[GROUND STATION] Received final packet, exiting...\n");
             break;
         }
@@ -180,6 +186,8 @@ int main() {
     TEST_ASSERT(buf != NULL);
     TEST_ASSERT(fread(buf, 1, file_size, fp) == file_size);
     fclose(fp);
+    printf("[TEST] Attempting mapped file transfer of a missing image...\n");
+    TEST_ASSERT(tftp_send_mapped_file(sfd, "images/does-not-exist.bmp", "[SATELLITE]") == -1);
     printf("[TEST] Attempting file transfer with no client (should timeout)...\n");
     int result = tftp_send_file(sfd, buf, file_size, "[SATELLITE]");
     printf("[TEST] File transfer result: %d (expected -1)\n", result);
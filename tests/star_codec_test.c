@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/image-processing.h"
+#include "../src/star-codec.h"
+#include "bmp_test_image.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define BACKGROUND 20
+#define STARS 60
+
+/*
+    A star field BMP: a dark background with a few levels of noise, and stars falling off from
+    a bright core. 8 bit images carry a grayscale palette. Returns the BMP, NULL on failure.
+*/
+static uint8_t *make_star_field(int32_t width, int32_t height, int bit_depth, size_t *len)
+{
+    int channels = bit_depth / 8;
+    uint32_t rows = height < 0 ? -height : height;
+    size_t row_size = test_bmp_row_size(width, bit_depth);
+    uint32_t data_offset = test_bmp_data_offset(bit_depth);
+    uint8_t *bmp = make_test_bmp(width, height, bit_depth, len);
+    if (bmp == NULL) {
+        return NULL;
+    }
+
+    unsigned seed = 7;
+    for (uint32_t y = 0; y < rows; y++) {
+        for (int32_t x = 0; x < width * channels; x++) {
+            seed = seed * 1103515245 + 12345;
+            bmp[data_offset + y * row_size + x] = BACKGROUND + (seed >> 16) % 5 - 2;
+        }
+    }
+    for (int star = 0; star < STARS; star++) {
+        seed = seed * 1103515245 + 12345;
+        int cx = 2 + (seed >> 8) % (width - 4), cy = 2 + (seed >> 20) % (rows - 4);
+        for (int y = -2; y <= 2; y++) {
+            for (int x = -2; x <= 2; x++) {
+                for (int c = 0; c < channels; c++) {
+                    bmp[data_offset + (cy + y) * row_size + (cx + x) * channels + c] = 255 / (1 + x * x + y * y);
+                }
+            }
+        }
+    }
+    return bmp;
+}
+
+static int test_parse_header(void)
+{
+    printf("[TEST] BMP header\n");
+    size_t len;
+    uint8_t *bmp = make_star_field(101, -37, 24, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    Bmp_Header header;
+    TEST_ASSERT(bmp_parse_header(bmp, len, &header) == 0);
+    TEST_ASSERT(header.width == 101 && header.heigth == -37 && header.bit_depth == 24);
+    TEST_ASSERT(header.data_offset == BMP_HEADER_LEN);
+    TEST_ASSERT(bmp_row_size(&header) == 304);
+    TEST_ASSERT(bmp_rows(&header) == 37);
+
+    TEST_ASSERT(bmp_parse_header(bmp, BMP_HEADER_LEN - 1, &header) == -1);
+    bmp[30] = 1; // RLE-8
+    TEST_ASSERT(bmp_parse_header(bmp, len, &header) == -1);
+    bmp[30] = 0;
+    bmp[0] = 'X';
+    TEST_ASSERT(bmp_parse_header(bmp, len, &header) == -1);
+    free(bmp);
+    return 0;
+}
+
+// Without the residual layer the stars come back exactly, the sky within its noise
+static int test_sparse(void)
+{
+    printf("[TEST] Sparse star field\n");
+    size_t len;
+    uint8_t *bmp = make_star_field(1021, 766, 8, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    uint8_t *encoded, *decoded;
+    size_t encoded_len, decoded_len, significant;
+    TEST_ASSERT(star_encode(bmp, len, NULL, &encoded, &encoded_len, &significant) == 0);
+    printf("[TEST] %zu bytes encoded into %zu, %zu pixels kept\n", len, encoded_len, significant);
+    TEST_ASSERT(encoded_len * 10 < len);
+    TEST_ASSERT(significant >= STARS && significant <= STARS * 25);
+
+    TEST_ASSERT(star_decode(encoded, encoded_len, &decoded, &decoded_len) == 0);
+    TEST_ASSERT(decoded_len == len);
+    TEST_ASSERT(memcmp(decoded, bmp, BMP_HEADER_LEN + 1024) == 0);
+
+    int stars_exact = 1, sky_close = 1;
+    for (size_t i = BMP_HEADER_LEN + 1024; i < len; i++) {
+        if (bmp[i] > BACKGROUND + 10) {
+            stars_exact &= decoded[i] == bmp[i];
+        } else {
+            sky_close &= abs(decoded[i] - bmp[i]) <= 2 || (bmp[i] == 0 && decoded[i] == 0);
+        }
+    }
+    free(encoded);
+    free(decoded);
+    free(bmp);
+    TEST_ASSERT(stars_exact);
+    TEST_ASSERT(sky_close);
+    return 0;
+}
+
+// With it every byte comes back, in color and with a tile that doesn't divide the frame
+static int test_lossless(int bit_depth)
+{
+    printf("[TEST] Lossless %d bit star field\n", bit_depth);
+    size_t len;
+    uint8_t *bmp = make_star_field(333, 250, bit_depth, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    Star_Codec_Options opts = { .tile = 24, .residual = 1 };
+    uint8_t *encoded, *decoded;
+    size_t encoded_len, decoded_len;
+    TEST_ASSERT(star_encode(bmp, len, &opts, &encoded, &encoded_len, NULL) == 0);
+    printf("[TEST] %zu bytes encoded into %zu\n", len, encoded_len);
+    TEST_ASSERT(encoded_len < len / 2);
+    TEST_ASSERT(star_decode(encoded, encoded_len, &decoded, &decoded_len) == 0);
+    int identical = decoded_len == len && memcmp(decoded, bmp, len) == 0;
+
+    // Cut short anywhere, it is never taken for a frame
+    int rejected = 1;
+    for (size_t cut = 0; cut < encoded_len; cut += encoded_len / 17 + 1) {
+        uint8_t *partial;
+        size_t partial_len;
+        if (star_decode(encoded, cut, &partial, &partial_len) == 0) {
+            rejected = 0;
+            free(partial);
+        }
+    }
+    free(encoded);
+    free(decoded);
+    free(bmp);
+    TEST_ASSERT(identical);
+    TEST_ASSERT(rejected);
+    return 0;
+}
+
+// The stars found on board come back as they were, and a cut list is refused
+static int test_star_list(void)
+{
+    printf("[TEST] Star list\n");
+    size_t len;
+    uint8_t *bmp = make_star_field(640, 480, 8, &len);
+    TEST_ASSERT(bmp != NULL);
+
+    Star *stars, *decoded;
+    size_t count, decoded_count;
+    TEST_ASSERT(detect_stars(bmp, len, NULL, &stars, &count) == 0);
+    free(bmp);
+    TEST_ASSERT(count > STARS / 2 && count <= STARS);
+
+    uint8_t *list;
+    size_t list_len;
+    uint32_t width, height;
+    TEST_ASSERT(star_list_encode(stars, count, 640, 480, &list, &list_len) == 0);
+    printf("[TEST] %zu stars in %zu bytes\n", count, list_len);
+    TEST_ASSERT(list_len == STAR_LIST_HEADER_LEN + count * STAR_LIST_ENTRY_LEN);
+    TEST_ASSERT(star_list_decode(list, list_len, &decoded, &decoded_count, &width, &height) == 0);
+    TEST_ASSERT(width == 640 && height == 480 && decoded_count == count);
+    int identical = 1;
+    for (size_t i = 0; i < count; i++) {
+        identical &= decoded[i].x == stars[i].x && decoded[i].y == stars[i].y && decoded[i].flux == stars[i].flux &&
+                     decoded[i].pixels == stars[i].pixels && decoded[i].peak == stars[i].peak;
+    }
+    free(decoded);
+    TEST_ASSERT(identical);
+
+    TEST_ASSERT(star_list_decode(list, list_len - 1, &decoded, &decoded_count, &width, &height) == -1);
+    list[0] = 'X';
+    TEST_ASSERT(star_list_decode(list, list_len, &decoded, &decoded_count, &width, &height) == -1);
+    free(list);
+    free(stars);
+    return 0;
+}
+
+static int test_not_a_bmp(void)
+{
+    printf("[TEST] Not a BMP\n");
+    uint8_t junk[200] = { 'B', 'M' };
+    uint8_t *encoded;
+    size_t encoded_len;
+    TEST_ASSERT(star_encode(junk, sizeof(junk), NULL, &encoded, &encoded_len, NULL) == -1);
+    TEST_ASSERT(star_decode(junk, sizeof(junk), &encoded, &encoded_len) == -1);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting star codec tests...\n");
+
+    int failed = 0;
+    failed |= test_parse_header();
+    failed |= test_sparse();
+    failed |= test_lossless(8);
+    failed |= test_lossless(24);
+    failed |= test_star_list();
+    failed |= test_not_a_bmp();
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
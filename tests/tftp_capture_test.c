@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "../src/tftp.h"
+#include "../src/tftp-io.h"
+#include "../src/link-emu.h"
+#include "../src/tftp-capture.h"
+#include "tftp_test_fixture.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define SATELLITE_SOCKET_PATH "temp/server-socket"
+#define GROUND_STATION_SOCKET_PATH "temp/client-socket"
+#define LINK_SOCKET_PATH "temp/link-socket"
+#define RELAY_SOCKET_PATH "temp/link-relay-socket"
+#define CAPTURE_PATH "temp/test.cap"
+
+#define FILE_LEN 50000
+
+static uint8_t file[FILE_LEN];
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_stop(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+// Datagrams come back as written, and a capture cut short keeps the ones before the cut
+static int test_capture_file(void)
+{
+    printf("[TEST] Capture file\n");
+    uint8_t rrq[] = { 0, TFTP_RRQ, 'f', 0, 'o', 'c', 't', 'e', 't', 0 };
+    uint8_t data[DATA_HDR_LEN + 100] = { 0, TFTP_DATA, 0, 1 };
+    uint8_t ack[] = { 0, TFTP_ACK, 0, 1 };
+    struct tftp_capture c;
+    struct tftp_capture_log log;
+
+    TEST_ASSERT(tftp_capture_open(&c, CAPTURE_PATH) == 0);
+    TEST_ASSERT(tftp_capture_write(&c, 1, rrq, sizeof(rrq)) == 0);
+    TEST_ASSERT(tftp_capture_write(&c, 0, data, sizeof(data)) == 0);
+    TEST_ASSERT(tftp_capture_write(&c, 1, ack, sizeof(ack)) == 0);
+    TEST_ASSERT(c.datagrams == 3);
+    TEST_ASSERT(tftp_capture_close(&c) == 0);
+
+    TEST_ASSERT(tftp_capture_load(&log, CAPTURE_PATH) == 0);
+    TEST_ASSERT(log.count == 3);
+    TEST_ASSERT(log.datagrams[0].uplink && log.datagrams[0].len == sizeof(rrq));
+    TEST_ASSERT(memcmp(log.datagrams[0].buf, rrq, sizeof(rrq)) == 0);
+    TEST_ASSERT(!log.datagrams[1].uplink && log.datagrams[1].len == sizeof(data));
+    TEST_ASSERT(memcmp(log.datagrams[1].buf, data, sizeof(data)) == 0);
+    TEST_ASSERT(log.datagrams[2].uplink && memcmp(log.datagrams[2].buf, ack, sizeof(ack)) == 0);
+    TEST_ASSERT(log.datagrams[0].time_ns <= log.datagrams[1].time_ns);
+    TEST_ASSERT(log.datagrams[1].time_ns <= log.datagrams[2].time_ns);
+    tftp_capture_free(&log);
+
+    struct stat st;
+    TEST_ASSERT(stat(CAPTURE_PATH, &st) == 0);
+    TEST_ASSERT(truncate(CAPTURE_PATH, st.st_size - 2) == 0);
+    TEST_ASSERT(tftp_capture_load(&log, CAPTURE_PATH) == 0);
+    TEST_ASSERT(log.count == 2);
+    tftp_capture_free(&log);
+
+    FILE *fp = fopen(CAPTURE_PATH, "wb");
+    TEST_ASSERT(fp != NULL);
+    fprintf(fp, "not a capture at all");
+    fclose(fp);
+    TEST_ASSERT(tftp_capture_load(&log, CAPTURE_PATH) == -1);
+    unlink(CAPTURE_PATH);
+    return 0;
+}
+
+/*
+    Sends the file from a satellite child process to this one through a lossy emulator in
+    another child, which captures every datagram it delivers.
+*/
+static int record_transfer(const struct link_profile *profile, const struct tftp_options *opts)
+{
+    printf("[TEST] Recording a transfer over a lossy link\n");
+
+    struct link_emulator emulator;
+    TEST_ASSERT(link_emulator_open(&emulator, LINK_SOCKET_PATH, RELAY_SOCKET_PATH, SATELLITE_SOCKET_PATH,
+                                   profile, profile, 4321) == 0);
+    int satellite_fd = open_socket(SATELLITE_SOCKET_PATH);
+    TEST_ASSERT(satellite_fd >= 0);
+
+    fflush(stdout);
+    pid_t satellite = fork();
+    TEST_ASSERT(satellite >= 0);
+    if (satellite == 0) {
+        int result = tftp_send_file(satellite_fd, file, FILE_LEN, "[SATELLITE]");
+        exit(result == 0 ? 0 : 1);
+    }
+    close(satellite_fd);
+
+    // The capture is only complete once closed, so the emulator stops on SIGTERM instead of dying
+    pid_t link = fork();
+    TEST_ASSERT(link >= 0);
+    if (link == 0) {
+        struct sigaction sa = { .sa_handler = handle_stop };
+        sigaction(SIGTERM, &sa, NULL);
+        struct tftp_capture capture;
+        if (tftp_capture_open(&capture, CAPTURE_PATH) == -1) {
+            exit(1);
+        }
+        emulator.capture = &capture;
+        int result = link_emulator_run(&emulator, &stop);
+        exit(tftp_capture_close(&capture) == 0 && result == 0 ? 0 : 1);
+    }
+    close(emulator.ground_fd);
+    close(emulator.satellite_fd);
+
+    uint8_t *out = malloc(FILE_LEN + 1);
+    TEST_ASSERT(out != NULL);
+    struct tftp_memory mem;
+    struct tftp_sink sink;
+    tftp_memory_sink(&sink, &mem, out, FILE_LEN + 1);
+
+    int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(sfd >= 0);
+    int result = tftp_retrieve_file(sfd, socket_addr(LINK_SOCKET_PATH), &sink, opts, "[GROUND STATION]");
+    close(sfd);
+
+    int status;
+    TEST_ASSERT(waitpid(satellite, &status, 0) == satellite);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    kill(link, SIGTERM);
+    TEST_ASSERT(waitpid(link, &status, 0) == link);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+    unlink(LINK_SOCKET_PATH);
+    unlink(RELAY_SOCKET_PATH);
+
+    int matches = memcmp(out, file, FILE_LEN) == 0;
+    free(out);
+    TEST_ASSERT(result == 0);
+    TEST_ASSERT(matches);
+    return 0;
+}
+
+// The live end of a replay
+struct sut {
+    int sfd;
+    const struct tftp_options *opts; // retrieve with these, NULL to send the file
+    uint8_t *out;
+    struct tftp_memory mem;
+    int result;
+};
+
+static void *run_sut(void *arg)
+{
+    struct sut *sut = arg;
+
+    if (sut->opts == NULL) {
+        sut->result = tftp_send_file(sut->sfd, file, FILE_LEN, "[SATELLITE]");
+        return NULL;
+    }
+    struct tftp_sink sink;
+    tftp_memory_sink(&sink, &sut->mem, sut->out, FILE_LEN + 1);
+    sut->result = tftp_retrieve_file(sut->sfd, socket_addr(LINK_SOCKET_PATH), &sink, sut->opts, "[GROUND STATION]");
+    return NULL;
+}
+
+/*
+    Plays one side of the capture to a live other end: it gets through the same losses without
+    a single datagram of the capture missing, and ends up with the same file.
+*/
+static int test_replay(const char *name, int uplink, const struct tftp_options *opts)
+{
+    printf("[TEST] Replay of the %s side\n", name);
+    struct tftp_capture_log log;
+    TEST_ASSERT(tftp_capture_load(&log, CAPTURE_PATH) == 0);
+    TEST_ASSERT(log.count > 0 && log.datagrams[0].uplink);
+    TEST_ASSERT(log.datagrams[0].len >= 2 && log.datagrams[0].buf[1] == TFTP_RRQ);
+
+    uint64_t side = 0;
+    for (size_t i = 0; i < log.count; i++) {
+        side += !log.datagrams[i].uplink == !uplink;
+    }
+
+    // The ground station retrieves from the capture's satellite, which answers from where it listens
+    uint8_t out[FILE_LEN + 1];
+    struct sut sut = { .opts = uplink ? NULL : opts, .out = out, .result = -1 };
+    const char *sut_path = uplink ? SATELLITE_SOCKET_PATH : GROUND_STATION_SOCKET_PATH;
+    sut.sfd = open_socket(sut_path);
+    int sfd = open_socket(LINK_SOCKET_PATH);
+    TEST_ASSERT(sut.sfd >= 0 && sfd >= 0);
+
+    pthread_t thread;
+    TEST_ASSERT(pthread_create(&thread, NULL, run_sut, &sut) == 0);
+    struct sockaddr_un peer_addr = socket_addr(sut_path);
+    socklen_t peer_len = uplink ? sizeof(struct sockaddr_un) : 0;
+    struct tftp_replay_config config = { .uplink = uplink };
+    struct tftp_replay_stats stats;
+    int result = tftp_replay_run(sfd, &peer_addr, &peer_len, &log, &config, &stats);
+    pthread_join(thread, NULL);
+    close(sut.sfd);
+    close(sfd);
+    unlink(sut_path);
+    unlink(LINK_SOCKET_PATH);
+    tftp_capture_free(&log);
+
+    printf("[TEST] %llu sent, %llu received in %.3f ms\n", (unsigned long long)stats.sent,
+           (unsigned long long)stats.received, stats.elapsed_ns / 1e6);
+    TEST_ASSERT(result == 0);
+    TEST_ASSERT(sut.result == 0);
+    TEST_ASSERT(stats.diverged == 0);
+    TEST_ASSERT(stats.sent == side && stats.received > 0);
+    if (!uplink) {
+        TEST_ASSERT(memcmp(out, file, FILE_LEN) == 0);
+    }
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting capture and replay tests...\n");
+
+    char scratch_dir[] = "/tmp/tftp-capture-test-XXXXXX";
+    if (enter_scratch_dir(scratch_dir, "temp", NULL) == -1) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < FILE_LEN; i++) {
+        file[i] = (i * 13 + i / 512) % 251;
+    }
+
+    struct tftp_options opts = { .windowsize = 8, .blksize = 1024, .tsize = 1 };
+    struct link_profile lossy = { .delay_ms = 2, .jitter_ms = 1, .loss = 0.05, .duplicate = 0.02, .reorder = 0.02 };
+
+    int failed = 0;
+    failed |= test_capture_file();
+    int recorded = record_transfer(&lossy, &opts) == 0;
+    failed |= !recorded;
+    if (recorded) {
+        failed |= test_replay("satellite's", 0, &opts);
+        failed |= test_replay("ground station's", 1, &opts);
+    }
+
+    unlink(CAPTURE_PATH);
+    leave_scratch_dir(scratch_dir, "temp", NULL);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
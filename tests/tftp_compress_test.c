@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "../src/tftp.h"
+#include "../src/tftp-io.h"
+#include "../src/tftp-compress.h"
+#include "../src/tftp-metrics.h"
+#include "tftp_test_fixture.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define SATELLITE_SOCKET_PATH "temp/server-socket"
+#define GROUND_STATION_SOCKET_PATH "temp/client-socket"
+#define IMAGE_FILE_PATH "temp/stars.raw"
+
+#define IMAGE_SIDE 512
+#define FILE_LEN (IMAGE_SIDE * IMAGE_SIDE)
+
+static uint8_t file[FILE_LEN];
+
+// A frame of the star tracker: dark sky with a little sensor noise, and a few stars
+static void make_star_field(void)
+{
+    unsigned seed = 1;
+    for (size_t i = 0; i < FILE_LEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        file[i] = (seed >> 16) % 4;
+    }
+    for (int star = 0; star < 40; star++) {
+        seed = seed * 1103515245 + 12345;
+        int cx = 3 + (seed >> 8) % (IMAGE_SIDE - 6), cy = 3 + (seed >> 20) % (IMAGE_SIDE - 6);
+        for (int y = -3; y <= 3; y++) {
+            for (int x = -3; x <= 3; x++) {
+                int brightness = 255 / (1 + x * x + y * y);
+                file[(cy + y) * IMAGE_SIDE + cx + x] = brightness;
+            }
+        }
+    }
+}
+
+// The option goes out in the RRQ and comes back in the OACK, out of range levels are ignored
+static int test_option(void)
+{
+    printf("[TEST] Compress option\n");
+    uint8_t buf[512];
+
+    struct tftp_request rrq = { .opcode = TFTP_RRQ, .filename = "image.bmp", .mode = "octet",
+                                .compress = TFTP_COMPRESS_BEST };
+    size_t len = serialize_rrq_pkt(buf, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+    struct tftp_request parsed;
+    deserialize_rrq_pkt(buf, &parsed, len);
+    TEST_ASSERT(parsed.compress == TFTP_COMPRESS_BEST);
+
+    struct tftp_oack oack = { .opcode = TFTP_OACK, .compress = TFTP_COMPRESS_FAST };
+    len = serialize_oack_pkt(buf, &oack);
+    struct tftp_oack parsed_oack;
+    deserialize_oack_pkt(buf, &parsed_oack, len);
+    TEST_ASSERT(parsed_oack.compress == TFTP_COMPRESS_FAST);
+
+    uint8_t bad[] = { 0, TFTP_OACK, 'c', 'o', 'm', 'p', 'r', 'e', 's', 's', 0, '1', '0', 0 };
+    deserialize_oack_pkt(bad, &parsed_oack, sizeof(bad));
+    TEST_ASSERT(parsed_oack.compress == 0);
+    return 0;
+}
+
+/*
+    Reads the deflated file block by block, the way a session does, and inflates it through a
+    decompressing sink. Returns the deflated length, 0 on failure.
+*/
+static size_t round_trip(int level, uint8_t *out)
+{
+    struct tftp_source plain;
+    tftp_memory_source(&plain, file, FILE_LEN);
+    struct tftp_compressor compressor;
+    const struct tftp_source *deflated = tftp_compress_source(&compressor, &plain, level);
+    if (deflated == NULL || deflated->size != TFTP_SIZE_UNKNOWN) {
+        return 0;
+    }
+
+    struct tftp_memory mem;
+    struct tftp_sink memory;
+    tftp_memory_sink(&memory, &mem, out, FILE_LEN + 1);
+    struct tftp_decompressor decompressor;
+    struct tftp_sink *sink = tftp_decompress_sink(&decompressor, &memory);
+    if (sink == NULL) {
+        tftp_compressor_end(&compressor);
+        return 0;
+    }
+    decompressor.level = level;
+
+    uint8_t block[DEFAULT_BLKSIZE];
+    uint64_t pos = 0;
+    ssize_t n;
+    int failed = 0;
+    do {
+        n = deflated->read(deflated->ctx, pos, block, sizeof(block));
+        struct iovec iov = { .iov_base = block, .iov_len = n > 0 ? n : 0 };
+        failed |= n < 0 || sink->write(sink->ctx, pos, &iov, 1) == -1;
+        pos += n > 0 ? n : 0;
+    } while (n == sizeof(block) && !failed);
+
+    failed |= sink->close(sink->ctx, 1) == -1 || mem.length != FILE_LEN;
+    tftp_compressor_end(&compressor);
+    tftp_decompressor_end(&decompressor);
+    return failed ? 0 : pos;
+}
+
+// Both levels inflate back to the file, and the mostly dark frame shrinks a lot
+static int test_round_trip(void)
+{
+    printf("[TEST] Deflate and inflate round trip\n");
+    uint8_t *out = malloc(FILE_LEN + 1);
+    TEST_ASSERT(out != NULL);
+
+    size_t fast = round_trip(TFTP_COMPRESS_FAST, out);
+    int fast_matches = memcmp(out, file, FILE_LEN) == 0;
+    size_t best = round_trip(TFTP_COMPRESS_BEST, out);
+    int best_matches = memcmp(out, file, FILE_LEN) == 0;
+    free(out);
+
+    printf("[TEST] %d bytes deflated into %zu at level %d, %zu at level %d\n", FILE_LEN, fast,
+           TFTP_COMPRESS_FAST, best, TFTP_COMPRESS_BEST);
+    TEST_ASSERT(fast > 0 && fast_matches);
+    TEST_ASSERT(best > 0 && best_matches);
+    TEST_ASSERT(fast < FILE_LEN / 2);
+    TEST_ASSERT(best <= fast);
+    return 0;
+}
+
+// A stream that isn't zlib, or ends early, never counts as a complete file
+static int test_corrupt_stream(void)
+{
+    printf("[TEST] Corrupt compressed stream\n");
+    uint8_t out[64];
+    struct tftp_memory mem;
+    struct tftp_sink memory;
+    struct tftp_decompressor decompressor;
+
+    tftp_memory_sink(&memory, &mem, out, sizeof(out));
+    struct tftp_sink *sink = tftp_decompress_sink(&decompressor, &memory);
+    TEST_ASSERT(sink != NULL);
+    decompressor.level = TFTP_COMPRESS_FAST;
+    uint8_t garbage[] = "not a zlib stream at all";
+    struct iovec iov = { .iov_base = garbage, .iov_len = sizeof(garbage) };
+    int written = sink->write(sink->ctx, 0, &iov, 1);
+    int closed = sink->close(sink->ctx, 1);
+    tftp_decompressor_end(&decompressor);
+    TEST_ASSERT(written == -1 || closed == -1);
+
+    // The first few bytes of a real stream, then nothing
+    uint8_t deflated[8192];
+    uLongf deflated_len = sizeof(deflated);
+    TEST_ASSERT(compress2(deflated, &deflated_len, file, 4096, TFTP_COMPRESS_FAST) == Z_OK);
+    tftp_memory_sink(&memory, &mem, out, sizeof(out));
+    sink = tftp_decompress_sink(&decompressor, &memory);
+    TEST_ASSERT(sink != NULL);
+    decompressor.level = TFTP_COMPRESS_FAST;
+    iov = (struct iovec) { .iov_base = deflated, .iov_len = 8 };
+    written = sink->write(sink->ctx, 0, &iov, 1);
+    closed = sink->close(sink->ctx, 1);
+    tftp_decompressor_end(&decompressor);
+    TEST_ASSERT(written == 0 && closed == -1);
+    return 0;
+}
+
+// The satellite of a transfer, on a thread of its own
+struct satellite {
+    int sfd;
+    int from_file; // read the file from IMAGE_FILE_PATH, otherwise send it from memory
+    int result;
+};
+
+static void *run_satellite(void *arg)
+{
+    struct satellite *sat = arg;
+
+    if (!sat->from_file) {
+        sat->result = tftp_send_file(sat->sfd, file, FILE_LEN, "[SATELLITE]");
+        return NULL;
+    }
+    struct tftp_source src;
+    int fd = open(IMAGE_FILE_PATH, O_RDONLY);
+    if (fd < 0 || tftp_file_source(&src, fd) == -1) {
+        sat->result = -1;
+    } else {
+        sat->result = tftp_send_source(sat->sfd, &src, "[SATELLITE]");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+    Retrieves the file with opts from a satellite sending it from a file or from memory.
+    Returns 0 on success, 1 on failure.
+*/
+static int transfer(int from_file, struct tftp_options *opts, uint8_t *out, struct tftp_metrics *metrics)
+{
+    struct satellite sat = { .from_file = from_file, .result = -1 };
+    sat.sfd = open_socket(SATELLITE_SOCKET_PATH);
+    int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(sat.sfd >= 0 && sfd >= 0);
+
+    pthread_t thread;
+    TEST_ASSERT(pthread_create(&thread, NULL, run_satellite, &sat) == 0);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, SATELLITE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    struct tftp_memory mem;
+    struct tftp_sink sink;
+    tftp_memory_sink(&sink, &mem, out, FILE_LEN + 1);
+    opts->metrics = metrics;
+    int result = tftp_retrieve_file(sfd, addr, &sink, opts, "[GROUND STATION]");
+
+    pthread_join(thread, NULL);
+    close(sat.sfd);
+    close(sfd);
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(result == 0);
+    TEST_ASSERT(sat.result == 0);
+    TEST_ASSERT(mem.length == FILE_LEN);
+    return 0;
+}
+
+// A file asked for deflated crosses the link in far fewer blocks, and arrives as it was
+static int test_compressed_transfer(void)
+{
+    printf("[TEST] Compressed transfer\n");
+    uint8_t *out = malloc(FILE_LEN + 1);
+    TEST_ASSERT(out != NULL);
+
+    FILE *fp = fopen(IMAGE_FILE_PATH, "wb");
+    TEST_ASSERT(fp != NULL);
+    TEST_ASSERT(fwrite(file, FILE_LEN, 1, fp) == 1);
+    fclose(fp);
+
+    int compressed = -1;
+    struct tftp_metrics plain, deflated;
+    struct tftp_options opts = { .windowsize = 8, .blksize = 1024 };
+    int failed = transfer(1, &opts, out, &plain);
+    opts.compress = TFTP_COMPRESS_BEST;
+    opts.compressed = &compressed;
+    failed |= transfer(1, &opts, out, &deflated);
+    int matches = memcmp(out, file, FILE_LEN) == 0;
+    free(out);
+    unlink(IMAGE_FILE_PATH);
+
+    printf("[TEST] %llu bytes as is, %llu deflated\n", (unsigned long long)plain.bytes,
+           (unsigned long long)deflated.bytes);
+    TEST_ASSERT(!failed);
+    TEST_ASSERT(compressed == TFTP_COMPRESS_BEST);
+    TEST_ASSERT(matches);
+    TEST_ASSERT(deflated.bytes < plain.bytes / 2);
+    return 0;
+}
+
+// Asked to resume, the satellite sends the rest of the file as is
+static int test_resume_uncompressed(void)
+{
+    printf("[TEST] Resumed transfer is not compressed\n");
+    uint8_t *out = malloc(FILE_LEN + 1);
+    TEST_ASSERT(out != NULL);
+    memcpy(out, file, FILE_LEN / 2);
+
+    int compressed = -1;
+    struct tftp_metrics metrics;
+    struct tftp_options opts = { .windowsize = 8, .blksize = 1024, .offset = FILE_LEN / 2,
+                                 .compress = TFTP_COMPRESS_FAST, .compressed = &compressed };
+    int failed = transfer(0, &opts, out, &metrics);
+    int matches = memcmp(out, file, FILE_LEN) == 0;
+    free(out);
+
+    TEST_ASSERT(!failed);
+    TEST_ASSERT(compressed == 0);
+    TEST_ASSERT(matches);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting compression tests...\n");
+
+    char scratch_dir[] = "/tmp/tftp-compress-test-XXXXXX";
+    if (enter_scratch_dir(scratch_dir, "temp", NULL) == -1) {
+        return 1;
+    }
+    make_star_field();
+
+    int failed = 0;
+    failed |= test_option();
+    failed |= test_round_trip();
+    failed |= test_corrupt_stream();
+    failed |= test_compressed_transfer();
+    failed |= test_resume_uncompressed();
+
+    leave_scratch_dir(scratch_dir, "temp", NULL);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
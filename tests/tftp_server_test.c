@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include "../src/tftp.h"
+#include "../src/tftp-server.h"
+#include "tftp_test_fixture.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define SATELLITE_SOCKET_PATH "temp/server-socket"
+#define IMAGE_LEN 65000
+#define CLIENT_COUNT 1000
+
+// One simulated ground station
+struct mock_client {
+    int sfd;
+    struct sockaddr_un peer_addr;
+    socklen_t peer_len;
+    uint16_t windowsize;
+    size_t blksize;
+    uint16_t expected_block;
+    uint16_t blocks_in_window;
+    size_t received;
+    int silent;      // never ACKs, so the satellite has to give up on it
+    int rrq_sent;
+    int ack_pending; // ack_block still has to be sent
+    uint16_t ack_block;
+    int done;        // last block received
+    int corrupt;
+};
+
+static uint8_t image[IMAGE_LEN];
+
+/*
+    Sends the RRQ, or the latest ACK, of a mock client. The satellite's queue holds only a few
+    datagrams, so when it is full the packet stays pending and is sent again on the next call.
+    Returns 0 on success, -1 on failure.
+*/
+static int mock_client_flush(struct mock_client *c)
+{
+    uint8_t pkt_buf[MAX_BUF_SIZE];
+    size_t pkt_len;
+
+    if (!c->rrq_sent) {
+        struct tftp_request rrq = {
+            .opcode = TFTP_RRQ,
+            .filename = "test.bmp",
+            .mode = "octet",
+            .windowsize = c->windowsize,
+            .blksize = c->blksize
+        };
+        pkt_len = serialize_rrq_pkt(pkt_buf, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+    } else if (c->ack_pending) {
+        struct tftp_ack ack_pkt = { .opcode = TFTP_ACK, .block = c->ack_block };
+        serialize_ack_pkt(pkt_buf, &ack_pkt);
+        pkt_len = DATA_HDR_LEN;
+    } else {
+        return 0;
+    }
+
+    if (sendto(c->sfd, pkt_buf, pkt_len, 0, (struct sockaddr *)&c->peer_addr, c->peer_len) == -1) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        perror("unable to send to satellite");
+        return -1;
+    }
+
+    if (!c->rrq_sent) {
+        // Until the OACK says otherwise the transfer uses the defaults
+        c->rrq_sent = 1;
+        c->windowsize = DEFAULT_WINDOWSIZE;
+        c->blksize = DEFAULT_BLKSIZE;
+    }
+    c->ack_pending = 0;
+    return 0;
+}
+
+static int mock_client_pending(struct mock_client *c)
+{
+    return !c->rrq_sent || c->ack_pending;
+}
+
+// Handles a packet from the satellite the way tftp_retrieve_file does, without writing a file
+static void mock_client_on_packet(struct mock_client *c, uint8_t *buf, size_t len,
+                                  struct sockaddr_un *src, socklen_t src_len)
+{
+    struct tftp_pkt_view pkt;
+
+    if (c->done || c->silent || tftp_parse_pkt(buf, len, &pkt) == -1) {
+        return;
+    }
+
+    // Follow the satellite to its transfer ID
+    c->peer_addr = *src;
+    c->peer_len = src_len;
+
+    if (pkt.opcode == TFTP_OACK) {
+        struct tftp_oack oack_pkt;
+        deserialize_oack_pkt(buf, &oack_pkt, len);
+        c->windowsize = oack_pkt.windowsize ? oack_pkt.windowsize : DEFAULT_WINDOWSIZE;
+        c->blksize = oack_pkt.blksize ? oack_pkt.blksize : DEFAULT_BLKSIZE;
+        c->ack_pending = 1;
+        c->ack_block = 0;
+        return;
+    }
+
+    if (pkt.opcode != TFTP_DATA || pkt.block != c->expected_block) {
+        return;
+    }
+
+    if (c->received + pkt.payload_len > IMAGE_LEN ||
+        memcmp(image + c->received, pkt.payload, pkt.payload_len) != 0) {
+        c->corrupt = 1;
+    }
+    c->received += pkt.payload_len;
+    c->expected_block++;
+    c->blocks_in_window++;
+
+    int last_block = pkt.payload_len < c->blksize;
+    if (last_block || c->blocks_in_window == c->windowsize) {
+        c->ack_pending = 1;
+        c->ack_block = pkt.block;
+        c->blocks_in_window = 0;
+    }
+    c->done = last_block;
+}
+
+// Opens the autobound socket of a mock client and sends its RRQ
+static int mock_client_start(struct mock_client *c, int epfd, uint16_t windowsize, uint16_t blksize)
+{
+    memset(c, 0, sizeof(struct mock_client));
+    c->windowsize = windowsize;
+    c->blksize = blksize;
+    c->expected_block = 1;
+
+    c->sfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (c->sfd < 0 || bind(c->sfd, (struct sockaddr *)&addr, sizeof(sa_family_t)) == -1) {
+        perror("unable to open client socket");
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->sfd, &ev) == -1) {
+        perror("unable to watch client socket");
+        return -1;
+    }
+
+    memset(&c->peer_addr, 0, sizeof(struct sockaddr_un));
+    c->peer_addr.sun_family = AF_UNIX;
+    strncpy(c->peer_addr.sun_path, SATELLITE_SOCKET_PATH, sizeof(c->peer_addr.sun_path) - 1);
+    c->peer_len = sizeof(struct sockaddr_un);
+    return mock_client_flush(c);
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+    Runs tftp_server_run in a child process and client_count mock ground stations at once in
+    this one. The last silent_count clients never ACK anything. Before them, unnamed_count
+    clients that never bound their socket send a RRQ each, which the satellite has to refuse.
+*/
+static int run_clients(int client_count, int silent_count, int ephemeral_tids, int unnamed_count)
+{
+    printf("[TEST] %d concurrent ground stations, %d silent, %d unnamed%s\n", client_count, silent_count,
+           unnamed_count, ephemeral_tids ? ", ephemeral TIDs" : "");
+    unlink(SATELLITE_SOCKET_PATH);
+
+    int server_sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    TEST_ASSERT(server_sfd >= 0);
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(struct sockaddr_un));
+    server_addr.sun_family = AF_UNIX;
+    strncpy(server_addr.sun_path, SATELLITE_SOCKET_PATH, sizeof(server_addr.sun_path) - 1);
+    TEST_ASSERT(bind(server_sfd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_un)) != -1);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    TEST_ASSERT(pid >= 0);
+    if (pid == 0) {
+        struct tftp_server_config config = {
+            .buf = image,
+            .buf_len = IMAGE_LEN,
+            .ephemeral_tids = ephemeral_tids,
+            .timeout_ms = silent_count ? 200 : 0, // don't wait long for the silent ones
+            .max_retries = silent_count ? 2 : 0,
+            .max_transfers = client_count,
+            .log_prefix = "[SATELLITE]"
+        };
+        struct tftp_server_stats stats;
+        int result = tftp_server_run(server_sfd, &config, &stats);
+        printf("[SATELLITE] %lu completed, %lu failed, %lu at once\n", stats.completed, stats.failed, stats.max_sessions);
+        exit(result == 0 && stats.completed == (unsigned long)(client_count - silent_count) &&
+             stats.failed == (unsigned long)silent_count && stats.refused == (unsigned long)unnamed_count ? 0 : 1);
+    }
+    close(server_sfd);
+
+    // Unbound sockets, so the satellite sees the same empty address for all of them
+    uint8_t rrq_buf[MAX_BUF_SIZE];
+    struct tftp_request rrq = { .opcode = TFTP_RRQ, .filename = "test.bmp", .mode = "octet" };
+    size_t rrq_len = serialize_rrq_pkt(rrq_buf, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+    int *unnamed = calloc(unnamed_count + 1, sizeof(int));
+    TEST_ASSERT(unnamed != NULL);
+    for (int i = 0; i < unnamed_count; i++) {
+        unnamed[i] = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        TEST_ASSERT(unnamed[i] >= 0);
+        TEST_ASSERT(sendto(unnamed[i], rrq_buf, rrq_len, 0, (struct sockaddr *)&server_addr,
+                           sizeof(struct sockaddr_un)) == (ssize_t)rrq_len);
+    }
+
+    int epfd = epoll_create1(0);
+    TEST_ASSERT(epfd >= 0);
+    struct mock_client *clients = calloc(client_count, sizeof(struct mock_client));
+    TEST_ASSERT(clients != NULL);
+
+    // Mix clients that use the defaults with windowed and large block transfers
+    for (int i = 0; i < client_count; i++) {
+        uint16_t windowsize = (i % 3 == 0) ? 0 : 4;
+        uint16_t blksize = (i % 3 == 2) ? 4096 : 0;
+        TEST_ASSERT(mock_client_start(&clients[i], epfd, windowsize, blksize) == 0);
+        clients[i].silent = i >= client_count - silent_count;
+    }
+
+    // A client counts as finished once the ACK of its last block went out
+    int remaining = client_count - silent_count;
+    uint64_t give_up = now_ms() + 60000;
+    uint8_t buf[DATA_HDR_LEN + 4096];
+    struct epoll_event events[64];
+
+    while (remaining > 0 && now_ms() < give_up) {
+        int pending = 0;
+        for (int i = 0; i < client_count; i++) {
+            struct mock_client *c = &clients[i];
+            if (mock_client_pending(c)) {
+                if (mock_client_flush(c) == -1) {
+                    give_up = 0;
+                }
+                remaining -= c->done && !mock_client_pending(c);
+                pending |= mock_client_pending(c);
+            }
+        }
+
+        int event_count = epoll_wait(epfd, events, 64, pending ? 1 : 100);
+        for (int i = 0; i < event_count; i++) {
+            struct mock_client *c = events[i].data.ptr;
+            struct sockaddr_un src;
+            socklen_t src_len = sizeof(src);
+            ssize_t len;
+
+            while ((len = recvfrom(c->sfd, buf, sizeof(buf), 0, (struct sockaddr *)&src, &src_len)) >= 0) {
+                mock_client_on_packet(c, buf, len, &src, src_len);
+                src_len = sizeof(src);
+            }
+        }
+    }
+
+    int status;
+    TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+
+    int answered = 0;
+    for (int i = 0; i < unnamed_count; i++) {
+        answered += recv(unnamed[i], buf, sizeof(buf), 0) >= 0;
+        close(unnamed[i]);
+    }
+    free(unnamed);
+
+    int corrupt = 0, incomplete = 0;
+    for (int i = 0; i < client_count; i++) {
+        corrupt += clients[i].corrupt;
+        incomplete += !clients[i].silent && (!clients[i].done || clients[i].received != IMAGE_LEN);
+        close(clients[i].sfd);
+    }
+    free(clients);
+    close(epfd);
+    unlink(SATELLITE_SOCKET_PATH);
+
+    TEST_ASSERT(remaining == 0);
+    TEST_ASSERT(corrupt == 0);
+    TEST_ASSERT(incomplete == 0);
+    TEST_ASSERT(answered == 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting satellite server tests...\n");
+
+    char scratch_dir[] = "/tmp/tftp-server-test-XXXXXX";
+    if (enter_scratch_dir(scratch_dir, "temp", NULL) == -1) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < IMAGE_LEN; i++) {
+        image[i] = (i * 13 + i / 1024) % 251;
+    }
+
+    int failed = 0;
+    failed |= run_clients(1, 0, 0, 0);
+    failed |= run_clients(CLIENT_COUNT, 0, 0, 0);
+    failed |= run_clients(CLIENT_COUNT, 0, 1, 0);
+    failed |= run_clients(10, 3, 0, 0);
+    failed |= run_clients(10, 3, 1, 0);
+    failed |= run_clients(1, 0, 0, 2);
+    failed |= run_clients(1, 0, 1, 2);
+
+    leave_scratch_dir(scratch_dir, "temp", NULL);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
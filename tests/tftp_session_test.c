@@ -0,0 +1,793 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "../src/tftp.h"
+#include "../src/tftp-session.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define QUEUE_LEN 128
+#define PKT_LEN (DATA_HDR_LEN + MAX_BLKSIZE)
+
+// Datagrams in flight in one direction
+struct link {
+    uint8_t (*pkts)[PKT_LEN];
+    size_t lens[QUEUE_LEN];
+    int count;
+    int loss_percent;
+    uint32_t seed; // drops are pseudo-random but the same on every run
+};
+
+static int link_init(struct link *l, int loss_percent, uint32_t seed)
+{
+    memset(l, 0, sizeof(struct link));
+    l->pkts = malloc(QUEUE_LEN * PKT_LEN);
+    l->loss_percent = loss_percent;
+    l->seed = seed;
+    return l->pkts != NULL ? 0 : -1;
+}
+
+static int link_drops(struct link *l)
+{
+    l->seed = l->seed * 1103515245 + 12345;
+    return (int)((l->seed >> 16) % 100) < l->loss_percent;
+}
+
+/*
+    Moves everything the session wants to send onto the link, a queue of room packets at most.
+    Returns the number of packets the session offered.
+*/
+static int pump_tx(struct tftp_session *s, struct link *l, uint64_t now, int room)
+{
+    struct tftp_tx txs[MAX_WINDOWSIZE];
+    int tx_count = tftp_session_poll_tx(s, now, txs, MAX_WINDOWSIZE);
+    int sent = 0;
+
+    if (tx_count <= 0) {
+        return tx_count;
+    }
+
+    for (; sent < tx_count && sent < room && l->count < QUEUE_LEN; sent++) {
+        if (link_drops(l)) {
+            continue;
+        }
+        memcpy(l->pkts[l->count], txs[sent].hdr, txs[sent].hdr_len);
+        memcpy(l->pkts[l->count] + txs[sent].hdr_len, txs[sent].payload, txs[sent].payload_len);
+        l->lens[l->count++] = txs[sent].hdr_len + txs[sent].payload_len;
+    }
+    tftp_session_tx_done(s, sent, now);
+    return tx_count;
+}
+
+/*
+    Delivers the link's datagrams to the session. Payloads handed back by a receiver are
+    stored at their offset in out (unless out is NULL), out_len is where the last one ended.
+    Returns 0 on success, -1 if the session failed.
+*/
+static int pump_rx(struct tftp_session *s, struct link *l, uint64_t now, uint8_t *out, size_t *out_len)
+{
+    for (int i = 0; i < l->count; i++) {
+        struct tftp_pkt_view data;
+        int status = tftp_session_on_datagram(s, l->pkts[i], l->lens[i], now, &data);
+        if (status == -1) {
+            l->count = 0;
+            return -1;
+        }
+        if (status == TFTP_SESSION_DATA) {
+            if (data.offset != *out_len) {
+                l->count = 0;
+                return -1;
+            }
+            if (out != NULL) {
+                memcpy(out + data.offset, data.payload, data.payload_len);
+            }
+            *out_len = data.offset + data.payload_len;
+        }
+    }
+    l->count = 0;
+    return 0;
+}
+
+static uint64_t min_deadline(struct tftp_session *a, struct tftp_session *b)
+{
+    uint64_t da = tftp_session_next_deadline(a);
+    uint64_t db = tftp_session_next_deadline(b);
+    return da < db ? da : db;
+}
+
+// How the sender of run_sessions gets the file
+enum sender_input {
+    FROM_BUF,          // DATA points into the buffer
+    FROM_SOURCE,       // read into a small window cache
+    FROM_SIZELESS      // read into the cache from a source that only knows its size once it ends
+};
+
+#define SOURCE_CACHE_TEST_LEN (8 * 1024)
+
+// A buffer read through a source, which has to be read front to back
+struct test_source {
+    const uint8_t *buf;
+    size_t len;
+    uint64_t pos;
+    int out_of_order;
+};
+
+static ssize_t test_source_read(void *ctx, uint64_t offset, uint8_t *buf, size_t len)
+{
+    struct test_source *src = ctx;
+
+    if (offset != src->pos) {
+        src->out_of_order = 1;
+        return -1;
+    }
+    len = src->len - offset < len ? src->len - offset : len;
+    memcpy(buf, src->buf + offset, len);
+    src->pos += len;
+    return len;
+}
+
+/*
+    Runs a sender and a receiver session against each other over two in-memory links, with
+    a simulated clock that jumps to the next deadline whenever both sides are idle.
+    Returns 0 on success, 1 on failure.
+*/
+static int run_sessions_from(uint8_t *buf, size_t buf_len, const struct tftp_options *opts, int loss_percent, int room,
+                             enum sender_input input)
+{
+    printf("[TEST] Session transfer of %zu bytes, windowsize %d, blksize %d, offset %llu, %d%% loss, room for %d packets%s\n",
+           buf_len, opts ? opts->windowsize : 0, opts ? opts->blksize : 0,
+           opts ? (unsigned long long)opts->offset : 0, loss_percent, room,
+           input == FROM_SOURCE ? ", from a source" : input == FROM_SIZELESS ? ", from a source without a size" : "");
+
+    struct tftp_session_config config = { .timeout_ms = 100, .max_retries = 50, .log_prefix = "[SESSION]" };
+    struct tftp_session sender, receiver;
+    struct link to_sender, to_receiver;
+    uint8_t *out = malloc(buf_len + MAX_BLKSIZE);
+    uint64_t now = 1;
+
+    // Resuming, the receiver already has everything before the offset the sender agrees to
+    size_t offset = opts && opts->offset < buf_len ? opts->offset : buf_len;
+    offset = opts && opts->offset && input != FROM_SIZELESS ? offset : 0;
+    size_t out_len = offset;
+
+    uint8_t cache[SOURCE_CACHE_TEST_LEN];
+    struct test_source test_src = { .buf = buf, .len = buf_len, .pos = offset };
+    struct tftp_source src = {
+        .read = test_source_read,
+        .size = input == FROM_SIZELESS ? TFTP_SIZE_UNKNOWN : buf_len,
+        .ctx = &test_src
+    };
+
+    TEST_ASSERT(out != NULL);
+    TEST_ASSERT(link_init(&to_sender, loss_percent, 1) == 0);
+    TEST_ASSERT(link_init(&to_receiver, loss_percent, 2) == 0);
+    if (input == FROM_BUF) {
+        tftp_session_init_sender(&sender, buf, buf_len, &config);
+    } else {
+        tftp_session_init_source(&sender, &src, cache, sizeof(cache), &config);
+    }
+    tftp_session_init_receiver(&receiver, "test.bmp", opts, &config);
+
+    int steps = 0;
+    while ((receiver.state != TFTP_SESSION_DONE || sender.state != TFTP_SESSION_DONE) && steps++ < 1000000) {
+        int offered = pump_tx(&receiver, &to_sender, now, room);
+        if (pump_rx(&sender, &to_sender, now, NULL, NULL) == -1) {
+            break;
+        }
+        offered += pump_tx(&sender, &to_receiver, now, room);
+        if (pump_rx(&receiver, &to_receiver, now, out, &out_len) == -1) {
+            break;
+        }
+
+        if (sender.state == TFTP_SESSION_FAILED || receiver.state == TFTP_SESSION_FAILED) {
+            break;
+        }
+
+        // Nothing moved, let time pass until the next retransmission
+        uint64_t deadline = min_deadline(&sender, &receiver);
+        if (offered == 0 && deadline != TFTP_SESSION_NO_DEADLINE && deadline > now) {
+            now = deadline;
+        }
+    }
+
+    // The receiver dallies until the sender heard the last ACK, lost or not
+    TEST_ASSERT(sender.state == TFTP_SESSION_DONE);
+    TEST_ASSERT(receiver.state == TFTP_SESSION_DONE);
+    TEST_ASSERT(receiver.offset == offset);
+    if (opts && opts->tsize && input != FROM_SIZELESS) {
+        TEST_ASSERT(receiver.tsize_known && receiver.tsize == buf_len);
+    }
+    TEST_ASSERT(out_len == buf_len);
+    TEST_ASSERT(memcmp(out + offset, buf + offset, buf_len - offset) == 0);
+
+    // Both sides counted every byte once, however often it went over the link
+    TEST_ASSERT(receiver.metrics.bytes == buf_len - offset);
+    TEST_ASSERT(receiver.metrics.blocks == (buf_len - offset) / receiver.blksize + 1);
+    TEST_ASSERT(sender.metrics.bytes == buf_len - offset);
+    if (!loss_percent && room == MAX_WINDOWSIZE) {
+        TEST_ASSERT(sender.metrics.retransmits == 0 && receiver.metrics.retransmits == 0);
+        TEST_ASSERT(sender.metrics.timeouts == 0 && receiver.metrics.timeouts == 0);
+    }
+
+    // Every block was read once, and all of the window fit in the cache
+    TEST_ASSERT(!test_src.out_of_order);
+    if (input != FROM_BUF && buf_len > 0) {
+        TEST_ASSERT(sender.windowsize * sender.blksize <= sizeof(cache));
+    }
+
+    free(out);
+    free(to_sender.pkts);
+    free(to_receiver.pkts);
+    return 0;
+}
+
+static int run_sessions(uint8_t *buf, size_t buf_len, const struct tftp_options *opts, int loss_percent, int room)
+{
+    return run_sessions_from(buf, buf_len, opts, loss_percent, room, FROM_BUF);
+}
+
+// A receiver whose RRQ is never answered sends it again, backing off, then gives up
+static int test_receiver_gives_up(void)
+{
+    printf("[TEST] Receiver retransmits its RRQ with backoff and gives up\n");
+
+    struct tftp_session_config config = { .timeout_ms = 100, .max_retries = 3 };
+    struct tftp_session s;
+    struct tftp_tx tx;
+    uint64_t now = 1;
+    int rrqs = 0;
+
+    tftp_session_init_receiver(&s, "test.bmp", NULL, &config);
+    TEST_ASSERT(tftp_session_next_deadline(&s) == 0);
+
+    int tx_count;
+    while ((tx_count = tftp_session_poll_tx(&s, now, &tx, 1)) >= 0) {
+        if (tx_count == 1) {
+            struct tftp_pkt_view pkt;
+            TEST_ASSERT(tftp_parse_pkt(tx.hdr, tx.hdr_len, &pkt) == 0);
+            TEST_ASSERT(pkt.opcode == TFTP_RRQ);
+            rrqs++;
+            tftp_session_tx_done(&s, 1, now);
+            TEST_ASSERT(tftp_session_next_deadline(&s) == now + (100 << (rrqs - 1)));
+        }
+        // Nothing is due before the deadline
+        TEST_ASSERT(tftp_session_poll_tx(&s, now + 50, &tx, 1) == 0);
+        now = tftp_session_next_deadline(&s);
+    }
+
+    TEST_ASSERT(rrqs == 4);
+    TEST_ASSERT(s.state == TFTP_SESSION_FAILED);
+    TEST_ASSERT(tftp_session_next_deadline(&s) == TFTP_SESSION_NO_DEADLINE);
+    return 0;
+}
+
+// Packets the peer had no room for are polled again, starting with the first unsent one
+static int test_partial_send(void)
+{
+    printf("[TEST] Sender resumes a partially sent window\n");
+
+    uint8_t buf[10 * 100];
+    uint8_t rrq_buf[MAX_BUF_SIZE];
+    struct tftp_request rrq = { .opcode = TFTP_RRQ, .filename = "test.bmp", .mode = "octet", .windowsize = 8, .blksize = 100 };
+    size_t rrq_len = serialize_rrq_pkt(rrq_buf, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+    uint8_t ack_buf[DATA_HDR_LEN];
+    struct tftp_ack ack_pkt = { .opcode = TFTP_ACK, .block = 0 };
+    struct tftp_session s;
+    struct tftp_tx txs[MAX_WINDOWSIZE];
+    struct tftp_pkt_view pkt;
+
+    tftp_session_init_sender(&s, buf, sizeof(buf), NULL);
+    TEST_ASSERT(tftp_session_next_deadline(&s) == TFTP_SESSION_NO_DEADLINE);
+    TEST_ASSERT(tftp_session_on_datagram(&s, rrq_buf, rrq_len, 1, NULL) == 0);
+
+    // The OACK comes first, DATA only follows ACK 0
+    TEST_ASSERT(tftp_session_poll_tx(&s, 1, txs, MAX_WINDOWSIZE) == 1);
+    TEST_ASSERT(tftp_parse_pkt(txs[0].hdr, txs[0].hdr_len, &pkt) == 0 && pkt.opcode == TFTP_OACK);
+    tftp_session_tx_done(&s, 1, 1);
+    TEST_ASSERT(tftp_session_poll_tx(&s, 2, txs, MAX_WINDOWSIZE) == 0);
+
+    serialize_ack_pkt(ack_buf, &ack_pkt);
+    TEST_ASSERT(tftp_session_on_datagram(&s, ack_buf, sizeof(ack_buf), 3, NULL) == 0);
+
+    TEST_ASSERT(tftp_session_poll_tx(&s, 3, txs, MAX_WINDOWSIZE) == 8);
+    TEST_ASSERT(txs[0].payload == buf && txs[0].payload_len == 100);
+    tftp_session_tx_done(&s, 3, 3);
+    TEST_ASSERT(tftp_session_next_deadline(&s) == 3 + SEND_RETRY_MS);
+
+    TEST_ASSERT(tftp_session_poll_tx(&s, 4, txs, MAX_WINDOWSIZE) == 5);
+    TEST_ASSERT(tftp_parse_pkt(txs[0].hdr, txs[0].hdr_len, &pkt) == 0 && pkt.block == 4);
+    TEST_ASSERT(txs[0].payload == buf + 300);
+    tftp_session_tx_done(&s, 5, 4);
+
+    // The OACK was answered within 2 ms, the timeout drops to its lower bound
+    TEST_ASSERT(s.rto_ms == MIN_RTO_MS);
+    TEST_ASSERT(tftp_session_next_deadline(&s) == 4 + MIN_RTO_MS);
+
+    // An ACK short of the window end resends the rest of it
+    ack_pkt.block = 6;
+    serialize_ack_pkt(ack_buf, &ack_pkt);
+    TEST_ASSERT(tftp_session_on_datagram(&s, ack_buf, sizeof(ack_buf), 5, NULL) == 0);
+    TEST_ASSERT(tftp_session_poll_tx(&s, 5, txs, MAX_WINDOWSIZE) == 5);
+    TEST_ASSERT(tftp_parse_pkt(txs[0].hdr, txs[0].hdr_len, &pkt) == 0 && pkt.block == 7);
+    TEST_ASSERT(txs[4].payload_len == 0);
+    return 0;
+}
+
+static void send_ack(struct tftp_session *s, uint16_t block, uint64_t now)
+{
+    uint8_t ack_buf[DATA_HDR_LEN];
+    struct tftp_ack ack_pkt = { .opcode = TFTP_ACK, .block = block };
+
+    serialize_ack_pkt(ack_buf, &ack_pkt);
+    tftp_session_on_datagram(s, ack_buf, sizeof(ack_buf), now, NULL);
+}
+
+// Starts a stop-and-wait sender over buf, with its RRQ received at now
+static void start_sender(struct tftp_session *s, uint8_t *buf, size_t buf_len, uint64_t now)
+{
+    uint8_t rrq_buf[MAX_BUF_SIZE];
+    struct tftp_request rrq = { .opcode = TFTP_RRQ, .filename = "test.bmp", .mode = "octet" };
+    size_t rrq_len = serialize_rrq_pkt(rrq_buf, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+
+    tftp_session_init_sender(s, buf, buf_len, NULL);
+    tftp_session_on_datagram(s, rrq_buf, rrq_len, now, NULL);
+}
+
+/*
+    The timeout follows the measured round trip, doubles on every timeout, and ACKs of
+    retransmitted blocks are not measured (Karn's algorithm).
+*/
+static int test_rtt_estimate(void)
+{
+    printf("[TEST] Round trip estimation and backoff\n");
+
+    uint8_t buf[100 * 512];
+    struct tftp_session s;
+    struct tftp_tx tx;
+    uint64_t now = 1;
+    uint16_t block;
+
+    start_sender(&s, buf, sizeof(buf), now);
+    TEST_ASSERT(s.rto_ms == DEFAULT_TIMEOUT_MS);
+
+    // Every block is ACKed 300 ms after it went out
+    for (block = 1; block <= 40; block++) {
+        TEST_ASSERT(tftp_session_poll_tx(&s, now, &tx, 1) == 1);
+        tftp_session_tx_done(&s, 1, now);
+        now += 300;
+        send_ack(&s, block, now);
+    }
+    TEST_ASSERT(s.rtt_samples == 40);
+    TEST_ASSERT(s.srtt8 >> 3 == 300);
+    TEST_ASSERT(s.metrics.rtt_ms.count == 40);
+    TEST_ASSERT(tftp_histogram_percentile(&s.metrics.rtt_ms, 50) == 300);
+    TEST_ASSERT(s.rto_ms > 300 && s.rto_ms < 320);
+    uint32_t rto = s.rto_ms;
+
+    // The next block is lost twice: the timeout doubles each time
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, &tx, 1) == 1);
+    tftp_session_tx_done(&s, 1, now);
+    now += rto;
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, &tx, 1) == 1);
+    TEST_ASSERT(s.rto_ms == 2 * rto);
+    tftp_session_tx_done(&s, 1, now);
+    TEST_ASSERT(tftp_session_next_deadline(&s) == now + 2 * rto);
+    now += 2 * rto;
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, &tx, 1) == 1);
+    TEST_ASSERT(s.rto_ms == 4 * rto);
+    tftp_session_tx_done(&s, 1, now);
+
+    // The ACK of the resent block is not measured, the backed off timeout stays
+    now += 5;
+    send_ack(&s, block, now);
+    TEST_ASSERT(s.rtt_samples == 40);
+    TEST_ASSERT(s.metrics.timeouts == 2 && s.metrics.retransmits == 2);
+    TEST_ASSERT(s.metrics.blocks == 41 && s.metrics.bytes == 41 * DEFAULT_BLKSIZE);
+    TEST_ASSERT(s.retries == 0);
+    TEST_ASSERT(s.rto_ms == 4 * rto);
+
+    // Until a block sent once is ACKed again
+    block++;
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, &tx, 1) == 1);
+    tftp_session_tx_done(&s, 1, now);
+    now += 300;
+    send_ack(&s, block, now);
+    TEST_ASSERT(s.rtt_samples == 41);
+    TEST_ASSERT(s.rto_ms == rto);
+    return 0;
+}
+
+// Only the first repeated ACK resends the window (no Sorcerer's Apprentice)
+static int test_duplicate_acks(void)
+{
+    printf("[TEST] Sender resends the window once for repeated ACKs\n");
+
+    uint8_t buf[10 * 512];
+    struct tftp_session s;
+    struct tftp_tx txs[MAX_WINDOWSIZE];
+    uint64_t now = 1;
+
+    start_sender(&s, buf, sizeof(buf), now);
+    s.windowsize = 4;
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, txs, MAX_WINDOWSIZE) == 4);
+    tftp_session_tx_done(&s, 4, now);
+    send_ack(&s, 4, ++now);
+
+    // Blocks 5 to 8 go out, block 5 goes missing and the receiver repeats ACK 4
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, txs, MAX_WINDOWSIZE) == 4);
+    tftp_session_tx_done(&s, 4, now);
+    send_ack(&s, 4, ++now);
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, txs, MAX_WINDOWSIZE) == 4);
+    tftp_session_tx_done(&s, 4, now);
+
+    // Further copies of it are ignored
+    for (int i = 0; i < 3; i++) {
+        send_ack(&s, 4, ++now);
+        TEST_ASSERT(tftp_session_poll_tx(&s, now, txs, MAX_WINDOWSIZE) == 0);
+    }
+
+    // As are the ones crossing a window resent on timeout
+    send_ack(&s, 8, ++now);
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, txs, MAX_WINDOWSIZE) == 3);
+    tftp_session_tx_done(&s, 3, now);
+    now = tftp_session_next_deadline(&s);
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, txs, MAX_WINDOWSIZE) == 3);
+    tftp_session_tx_done(&s, 3, now);
+    send_ack(&s, 8, ++now);
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, txs, MAX_WINDOWSIZE) == 0);
+
+    send_ack(&s, 11, ++now);
+    TEST_ASSERT(s.state == TFTP_SESSION_DONE);
+    return 0;
+}
+
+// Blocks that arrive twice are handed back once, and ACKed once
+static int test_duplicate_data(void)
+{
+    printf("[TEST] Receiver drops duplicate blocks\n");
+
+    uint8_t pkt_buf[DATA_HDR_LEN + DEFAULT_BLKSIZE] = { 0 };
+    struct tftp_data data_pkt = { .opcode = TFTP_DATA };
+    struct tftp_session s;
+    struct tftp_pkt_view data;
+    struct tftp_tx tx;
+    uint64_t now = 1;
+    int delivered = 0;
+
+    tftp_session_init_receiver(&s, "test.bmp", NULL, NULL);
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, &tx, 1) == 1);
+    tftp_session_tx_done(&s, 1, now);
+
+    // Blocks 1 to 3 arrive, then all of them once more after the sender missed ACK 3
+    uint16_t blocks[] = { 1, 2, 3, 1, 2, 3 };
+    for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        data_pkt.block = blocks[i];
+        serialize_data_hdr(pkt_buf, &data_pkt);
+        delivered += tftp_session_on_datagram(&s, pkt_buf, sizeof(pkt_buf), ++now, &data) == TFTP_SESSION_DATA;
+
+        int tx_count = tftp_session_poll_tx(&s, now, &tx, 1);
+        TEST_ASSERT(tx_count == (i < 3 || i == 3));
+        if (tx_count == 1) {
+            struct tftp_pkt_view ack;
+            TEST_ASSERT(tftp_parse_pkt(tx.hdr, tx.hdr_len, &ack) == 0);
+            TEST_ASSERT(ack.opcode == TFTP_ACK && ack.block == (i < 3 ? blocks[i] : 3));
+            tftp_session_tx_done(&s, 1, now);
+        }
+    }
+
+    TEST_ASSERT(delivered == 3);
+    TEST_ASSERT(s.metrics.duplicates == 3);
+    TEST_ASSERT(s.expected_block == 4);
+    return 0;
+}
+
+// After ACKing the last block the receiver dallies, and ACKs it again if it comes again
+static int test_dally(void)
+{
+    printf("[TEST] Receiver dallies after the last ACK\n");
+
+    uint8_t pkt_buf[DATA_HDR_LEN + DEFAULT_BLKSIZE] = { 0 };
+    struct tftp_data data_pkt = { .opcode = TFTP_DATA };
+    struct tftp_session_config config = { .timeout_ms = 100 };
+    struct tftp_session s;
+    struct tftp_pkt_view data, ack;
+    struct tftp_tx tx;
+    uint64_t now = 1;
+
+    tftp_session_init_receiver(&s, "test.bmp", NULL, &config);
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, &tx, 1) == 1);
+    tftp_session_tx_done(&s, 1, now);
+
+    // A full block, then the short last one
+    for (uint16_t block = 1; block <= 2; block++) {
+        data_pkt.block = block;
+        serialize_data_hdr(pkt_buf, &data_pkt);
+        size_t len = block == 1 ? sizeof(pkt_buf) : DATA_HDR_LEN + 10;
+        TEST_ASSERT(tftp_session_on_datagram(&s, pkt_buf, len, ++now, &data) == TFTP_SESSION_DATA);
+    }
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, &tx, 1) == 1);
+    tftp_session_tx_done(&s, 1, now);
+    TEST_ASSERT(s.state == TFTP_SESSION_DALLY);
+    TEST_ASSERT(tftp_session_next_deadline(&s) == now + DALLY_RTOS * s.rto_ms);
+
+    // The ACK went missing, the sender resends the last block and it is ACKed again, not delivered
+    uint32_t rto_ms = s.rto_ms;
+    now += rto_ms;
+    TEST_ASSERT(tftp_session_on_datagram(&s, pkt_buf, DATA_HDR_LEN + 10, now, &data) == 0);
+    TEST_ASSERT(tftp_session_poll_tx(&s, now, &tx, 1) == 1);
+    TEST_ASSERT(tftp_parse_pkt(tx.hdr, tx.hdr_len, &ack) == 0);
+    TEST_ASSERT(ack.opcode == TFTP_ACK && ack.block == 2);
+    tftp_session_tx_done(&s, 1, now);
+    TEST_ASSERT(s.metrics.duplicates == 1 && s.metrics.retransmits == 1);
+
+    // The dally starts over, and then the session is done
+    TEST_ASSERT(s.rto_ms == rto_ms);
+    TEST_ASSERT(s.state == TFTP_SESSION_DALLY);
+    TEST_ASSERT(tftp_session_poll_tx(&s, now + DALLY_RTOS * s.rto_ms - 1, &tx, 1) == 0);
+    TEST_ASSERT(s.state == TFTP_SESSION_DALLY);
+    TEST_ASSERT(tftp_session_poll_tx(&s, now + DALLY_RTOS * s.rto_ms, &tx, 1) == 0);
+    TEST_ASSERT(s.state == TFTP_SESSION_DONE);
+    TEST_ASSERT(s.metrics.timeouts == 0);
+    TEST_ASSERT(tftp_session_next_deadline(&s) == TFTP_SESSION_NO_DEADLINE);
+    return 0;
+}
+
+/*
+    A file of more than 4 GiB, and so of more than 65535 blocks of any size: the block number
+    on the wire rolls over while the file offsets keep counting. The sender's file is a mapping
+    of zero pages, the receiver only checks where every payload goes.
+*/
+static int test_large_file(void)
+{
+    size_t buf_len = (4ULL << 30) + 12345;
+    printf("[TEST] Session transfer of %zu bytes\n", buf_len);
+
+    uint8_t *buf = mmap(NULL, buf_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    TEST_ASSERT(buf != MAP_FAILED);
+
+    struct tftp_options opts = { .windowsize = MAX_WINDOWSIZE, .blksize = MAX_BLKSIZE, .tsize = 1 };
+    struct tftp_session sender, receiver;
+    struct link to_sender, to_receiver;
+    size_t out_len = 0;
+    uint64_t now = 1;
+
+    TEST_ASSERT(link_init(&to_sender, 0, 1) == 0);
+    TEST_ASSERT(link_init(&to_receiver, 0, 2) == 0);
+    tftp_session_init_sender(&sender, buf, buf_len, NULL);
+    tftp_session_init_receiver(&receiver, "test.bmp", &opts, NULL);
+
+    while (receiver.state != TFTP_SESSION_DONE && receiver.state != TFTP_SESSION_FAILED) {
+        pump_tx(&receiver, &to_sender, now, MAX_WINDOWSIZE);
+        if (pump_rx(&sender, &to_sender, now, NULL, NULL) == -1) {
+            break;
+        }
+        pump_tx(&sender, &to_receiver, now, MAX_WINDOWSIZE);
+        if (pump_rx(&receiver, &to_receiver, now, NULL, &out_len) == -1) {
+            break;
+        }
+        now++;
+    }
+    munmap(buf, buf_len);
+    free(to_sender.pkts);
+    free(to_receiver.pkts);
+
+    TEST_ASSERT(receiver.state == TFTP_SESSION_DONE);
+    TEST_ASSERT(sender.state == TFTP_SESSION_DONE);
+    TEST_ASSERT(receiver.tsize == buf_len);
+    TEST_ASSERT(out_len == buf_len);
+    TEST_ASSERT(sender.last_block == buf_len / MAX_BLKSIZE + 1);
+    TEST_ASSERT(receiver.expected_block == sender.last_block + 1);
+    TEST_ASSERT(receiver.metrics.duplicates == 0);
+    return 0;
+}
+
+// A sender announces the size of the whole file, the receiver checks it against what arrived
+static int test_tsize(void)
+{
+    printf("[TEST] Transfer size option\n");
+
+    uint8_t buf[3000] = {0};
+    uint8_t rrq_buf[MAX_BUF_SIZE];
+    struct tftp_request rrq = { .opcode = TFTP_RRQ, .filename = "test.bmp", .mode = "octet", .tsize = 1 };
+    size_t rrq_len = serialize_rrq_pkt(rrq_buf, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+    struct tftp_session s;
+    struct tftp_tx tx;
+    struct tftp_oack oack;
+
+    // Even a resumed transfer announces the size of the whole file
+    rrq.offset = 1000;
+    rrq_len = serialize_rrq_pkt(rrq_buf, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+    tftp_session_init_sender(&s, buf, sizeof(buf), NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, rrq_buf, rrq_len, 1, NULL) == 0);
+    TEST_ASSERT(tftp_session_poll_tx(&s, 1, &tx, 1) == 1);
+    deserialize_oack_pkt((uint8_t *)tx.hdr, &oack, tx.hdr_len);
+    TEST_ASSERT(oack.has_tsize && oack.tsize == sizeof(buf) && oack.offset == 1000);
+
+    // A file that ends short of the announced size failed
+    struct tftp_options opts = { .tsize = 1 };
+    struct tftp_pkt_view data;
+    uint8_t oack_buf[MAX_BUF_SIZE];
+    uint8_t data_buf[DATA_HDR_LEN + 100];
+    struct tftp_oack oack_pkt = { .opcode = TFTP_OACK, .has_tsize = 1, .tsize = 600 };
+    struct tftp_data data_pkt = { .opcode = TFTP_DATA, .block = 1, .data = buf };
+    size_t oack_len = serialize_oack_pkt(oack_buf, &oack_pkt);
+    serialize_data_pkt(data_buf, &data_pkt, 100);
+
+    tftp_session_init_receiver(&s, "test.bmp", &opts, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, oack_buf, oack_len, 1, &data) == 0);
+    TEST_ASSERT(s.tsize_known && s.tsize == 600);
+    TEST_ASSERT(tftp_session_on_datagram(&s, data_buf, sizeof(data_buf), 2, &data) == -1);
+
+    // So did one that goes on past it
+    oack_pkt.tsize = 50;
+    oack_len = serialize_oack_pkt(oack_buf, &oack_pkt);
+    tftp_session_init_receiver(&s, "test.bmp", &opts, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, oack_buf, oack_len, 1, &data) == 0);
+    TEST_ASSERT(tftp_session_on_datagram(&s, data_buf, sizeof(data_buf), 2, &data) == -1);
+
+    oack_pkt.tsize = 100;
+    oack_len = serialize_oack_pkt(oack_buf, &oack_pkt);
+    tftp_session_init_receiver(&s, "test.bmp", &opts, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, oack_buf, oack_len, 1, &data) == 0);
+    TEST_ASSERT(tftp_session_on_datagram(&s, data_buf, sizeof(data_buf), 2, &data) == TFTP_SESSION_DATA);
+    return 0;
+}
+
+// Protocol violations end the session
+static int test_protocol_errors(void)
+{
+    printf("[TEST] Protocol errors fail the session\n");
+
+    struct tftp_session s;
+    uint8_t ack_buf[DATA_HDR_LEN];
+    struct tftp_ack ack_pkt = { .opcode = TFTP_ACK, .block = 1 };
+    serialize_ack_pkt(ack_buf, &ack_pkt);
+
+    // A sender has to be started by a RRQ
+    tftp_session_init_sender(&s, NULL, 0, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, ack_buf, sizeof(ack_buf), 1, NULL) == -1);
+    TEST_ASSERT(s.state == TFTP_SESSION_FAILED);
+
+    // An ERROR packet aborts the transfer
+    uint8_t error_buf[] = { 0, TFTP_ERROR, 0, 1, 0 };
+    struct tftp_options opts = { .windowsize = 4, .blksize = 1024 };
+    struct tftp_pkt_view data;
+    tftp_session_init_receiver(&s, "test.bmp", &opts, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, error_buf, sizeof(error_buf), 1, &data) == -1);
+
+    // The sender may lower the requested options, never raise them
+    uint8_t oack_buf[MAX_BUF_SIZE];
+    struct tftp_oack oack_pkt = { .opcode = TFTP_OACK, .windowsize = 2, .blksize = 512 };
+    size_t oack_len = serialize_oack_pkt(oack_buf, &oack_pkt);
+    tftp_session_init_receiver(&s, "test.bmp", &opts, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, oack_buf, oack_len, 1, &data) == 0);
+    TEST_ASSERT(s.windowsize == 2 && s.blksize == 512);
+
+    oack_pkt.windowsize = 8;
+    oack_len = serialize_oack_pkt(oack_buf, &oack_pkt);
+    tftp_session_init_receiver(&s, "test.bmp", &opts, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, oack_buf, oack_len, 1, &data) == -1);
+
+    // Nor resume beyond the byte the receiver asked for
+    oack_pkt.windowsize = 2;
+    oack_pkt.offset = 4096;
+    oack_len = serialize_oack_pkt(oack_buf, &oack_pkt);
+    tftp_session_init_receiver(&s, "test.bmp", &opts, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, oack_buf, oack_len, 1, &data) == -1);
+    opts.offset = 8192;
+    tftp_session_init_receiver(&s, "test.bmp", &opts, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, oack_buf, oack_len, 1, &data) == 0);
+    TEST_ASSERT(s.offset == 4096);
+
+    // Short datagrams are dropped
+    tftp_session_init_receiver(&s, "test.bmp", &opts, NULL);
+    TEST_ASSERT(tftp_session_on_datagram(&s, error_buf, 1, 1, &data) == 0);
+    TEST_ASSERT(s.state == TFTP_SESSION_REQUEST);
+    return 0;
+}
+
+// Percentiles come back within the histogram's precision, and merging adds up
+static int test_histogram(void)
+{
+    printf("[TEST] Round trip histogram\n");
+
+    static struct tftp_histogram h, other;
+    uint64_t v;
+
+    TEST_ASSERT(tftp_histogram_percentile(&h, 50) == 0);
+
+    for (v = 1; v <= 10000; v++) {
+        tftp_histogram_record(&h, v);
+    }
+    TEST_ASSERT(h.count == 10000 && h.min == 1 && h.max == 10000);
+    TEST_ASSERT(h.sum == 10000 * 10001 / 2);
+
+    double percentiles[] = { 1, 50, 90, 99, 99.9 };
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        uint64_t exact = percentiles[i] * 100;
+        uint64_t value = tftp_histogram_percentile(&h, percentiles[i]);
+        TEST_ASSERT(value >= exact && value <= exact + exact / TFTP_HIST_SUB_COUNT);
+    }
+    TEST_ASSERT(tftp_histogram_percentile(&h, 100) == 10000);
+
+    // Small values are exact, huge ones saturate
+    tftp_histogram_record(&other, 0);
+    tftp_histogram_record(&other, 31);
+    tftp_histogram_record(&other, (uint64_t)1 << 40);
+    TEST_ASSERT(tftp_histogram_percentile(&other, 0) == 0);
+    TEST_ASSERT(tftp_histogram_percentile(&other, 50) == 31);
+    TEST_ASSERT(tftp_histogram_percentile(&other, 100) == UINT32_MAX);
+
+    tftp_histogram_merge(&h, &other);
+    TEST_ASSERT(h.count == 10003 && h.min == 0 && h.max == UINT32_MAX);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting TFTP session tests...\n");
+
+    // Past 65535 blocks of the smallest size, where the block number rolls over
+    size_t max_len = 65536 * MIN_BLKSIZE + 5000;
+    uint8_t *buf = malloc(max_len);
+    if (buf == NULL) {
+        perror("unable to allocate test data");
+        return 1;
+    }
+    for (size_t i = 0; i < max_len; i++) {
+        buf[i] = (i * 11 + i / 512) % 251;
+    }
+
+    size_t sizes[] = { 0, 100, DEFAULT_BLKSIZE, 5 * DEFAULT_BLKSIZE + 3, max_len };
+    struct tftp_options opts[] = {
+        { .windowsize = 0, .blksize = 0 },
+        { .windowsize = 1, .blksize = 0 },
+        { .windowsize = 8, .blksize = 0 },
+        { .windowsize = MAX_WINDOWSIZE, .blksize = 1428 },
+        { .windowsize = 16, .blksize = MIN_BLKSIZE },
+        { .windowsize = 4, .blksize = MAX_BLKSIZE },
+        { .windowsize = 8, .blksize = 1428, .offset = 3000 },
+        { .windowsize = 0, .blksize = 0, .offset = 5 * DEFAULT_BLKSIZE, .tsize = 1 }
+    };
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        failed |= run_sessions(buf, sizes[i], NULL, 0, MAX_WINDOWSIZE);
+        for (size_t j = 0; j < sizeof(opts) / sizeof(opts[0]); j++) {
+            // Lossless, a peer queue with room for only a few packets, and a lossy link
+            failed |= run_sessions(buf, sizes[i], &opts[j], 0, MAX_WINDOWSIZE);
+            failed |= run_sessions(buf, sizes[i], &opts[j], 0, 3);
+            failed |= run_sessions(buf, sizes[i], &opts[j], 10, MAX_WINDOWSIZE);
+
+            // Read block by block, the window shrinks to the cache
+            failed |= run_sessions_from(buf, sizes[i], &opts[j], 0, MAX_WINDOWSIZE, FROM_SOURCE);
+            failed |= run_sessions_from(buf, sizes[i], &opts[j], 10, MAX_WINDOWSIZE, FROM_SOURCE);
+            failed |= run_sessions_from(buf, sizes[i], &opts[j], 0, MAX_WINDOWSIZE, FROM_SIZELESS);
+            failed |= run_sessions_from(buf, sizes[i], &opts[j], 10, MAX_WINDOWSIZE, FROM_SIZELESS);
+        }
+    }
+
+    failed |= test_large_file();
+
+    failed |= test_receiver_gives_up();
+    failed |= test_partial_send();
+    failed |= test_rtt_estimate();
+    failed |= test_duplicate_acks();
+    failed |= test_duplicate_data();
+    failed |= test_dally();
+    failed |= test_tsize();
+    failed |= test_protocol_errors();
+    failed |= test_histogram();
+    free(buf);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
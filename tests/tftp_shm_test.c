@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include "../src/tftp.h"
+#include "../src/tftp-shm.h"
+#include "tftp_test_fixture.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define RECEIVED_FILE_PATH "received-images/test.bmp"
+
+static char link_name[64];
+
+// Records of every size around the alignment, many times around the (small) ACK ring
+static int test_ring_wraparound(void)
+{
+    printf("[TEST] Ring wraparound\n");
+    struct tftp_shm_link satellite, ground;
+    TEST_ASSERT(tftp_shm_create(&satellite, link_name) == 0);
+    TEST_ASSERT(tftp_shm_attach(&ground, link_name) == 0);
+
+    uint8_t pattern[4096];
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = i % 253;
+    }
+
+    int corrupt = 0, lost = 0, expected = 0;
+    size_t written = 0;
+    for (int i = 0; i < 20000; i++) {
+        size_t len = (i * 37) % 4000;
+        uint8_t *pkt = tftp_shm_reserve(&ground.ack, len, 0);
+        if (pkt == NULL) {
+            lost++;
+            break;
+        }
+        memcpy(pkt, pattern + i % 64, len);
+        tftp_shm_commit(&ground.ack);
+        written += len;
+
+        // Let a few records pile up before draining them
+        if (i % 7 == 0) {
+            const uint8_t *rec;
+            size_t rec_len;
+            while ((rec = tftp_shm_next(&satellite.ack, &rec_len)) != NULL) {
+                corrupt += rec_len != (size_t)(expected * 37) % 4000 ||
+                           memcmp(rec, pattern + expected % 64, rec_len) != 0;
+                expected++;
+            }
+            tftp_shm_release(&satellite.ack);
+        }
+    }
+
+    tftp_shm_close(&ground);
+    tftp_shm_close(&satellite);
+    TEST_ASSERT(written > 4 * SHM_ACK_RING_SIZE);
+    TEST_ASSERT(lost == 0);
+    TEST_ASSERT(corrupt == 0);
+    return 0;
+}
+
+// A full ring and an empty one time out instead of blocking
+static int test_ring_limits(void)
+{
+    printf("[TEST] Ring limits\n");
+    struct tftp_shm_link link;
+    TEST_ASSERT(tftp_shm_create(&link, link_name) == 0);
+
+    size_t len;
+    TEST_ASSERT(tftp_shm_wait(&link.ack, 10) == -1);
+    TEST_ASSERT(tftp_shm_next(&link.ack, &len) == NULL);
+
+    TEST_ASSERT(tftp_shm_reserve(&link.ack, SHM_ACK_RING_SIZE, 0) == NULL);
+    TEST_ASSERT(errno == EMSGSIZE);
+
+    int records = 0;
+    while (tftp_shm_reserve(&link.ack, 1000, 10) != NULL) {
+        tftp_shm_commit(&link.ack);
+        records++;
+    }
+    TEST_ASSERT(errno == ETIMEDOUT);
+    TEST_ASSERT(records == SHM_ACK_RING_SIZE / 1008);
+
+    TEST_ASSERT(tftp_shm_wait(&link.ack, 10) == 0);
+    TEST_ASSERT(tftp_shm_next(&link.ack, &len) != NULL);
+    TEST_ASSERT(len == 1000);
+
+    tftp_shm_close(&link);
+    return 0;
+}
+
+/*
+    Runs tftp_shm_send_file in this process and tftp_shm_retrieve_file in a child that
+    attaches to the link, then checks that the received file matches buf.
+*/
+static int run_transfer(uint8_t *buf, size_t buf_len, const struct tftp_options *opts)
+{
+    printf("[TEST] Shared memory transfer of %zu bytes, windowsize %d, blksize %d\n", buf_len,
+           opts ? opts->windowsize : 0, opts ? opts->blksize : 0);
+
+    struct tftp_shm_link link;
+    TEST_ASSERT(tftp_shm_create(&link, link_name) == 0);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    TEST_ASSERT(pid >= 0);
+    if (pid == 0) {
+        struct tftp_shm_link ground_link;
+        if (tftp_shm_attach(&ground_link, link_name) == -1) {
+            exit(1);
+        }
+        int result = tftp_shm_retrieve_file(&ground_link, NULL, opts, "[GROUND STATION]");
+        tftp_shm_close(&ground_link);
+        exit(result == 0 ? 0 : 1);
+    }
+
+    int result = tftp_shm_send_file(&link, buf, buf_len, "[SATELLITE]");
+    int status;
+    TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+    tftp_shm_close(&link);
+    TEST_ASSERT(result == 0);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    FILE *fp = fopen(RECEIVED_FILE_PATH, "rb");
+    TEST_ASSERT(fp != NULL);
+    uint8_t *received = malloc(buf_len + 1);
+    TEST_ASSERT(received != NULL);
+    size_t bytes_read = fread(received, 1, buf_len + 1, fp);
+    fclose(fp);
+
+    int matches = bytes_read == buf_len && memcmp(received, buf, buf_len) == 0;
+    free(received);
+    TEST_ASSERT(matches);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting shared memory link tests...\n");
+
+    char scratch_dir[] = "/tmp/tftp-shm-test-XXXXXX";
+    if (enter_scratch_dir(scratch_dir, "received-images", NULL) == -1) {
+        return 1;
+    }
+    snprintf(link_name, sizeof(link_name), "/tftp-shm-test-%d", (int)getpid());
+
+    // Larger than the DATA ring, so full windows of the largest blocks wrap around it
+    size_t max_len = 3 * SHM_DATA_RING_SIZE + 12345;
+    uint8_t *buf = malloc(max_len);
+    if (buf == NULL) {
+        perror("unable to allocate test data");
+        return 1;
+    }
+    for (size_t i = 0; i < max_len; i++) {
+        buf[i] = (i * 7 + i / 512) % 251;
+    }
+
+    int failed = 0;
+    failed |= test_ring_wraparound();
+    failed |= test_ring_limits();
+
+    size_t sizes[] = { 0, 100, DEFAULT_BLKSIZE, 5 * DEFAULT_BLKSIZE + 3, 200000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        struct tftp_options opts = { .windowsize = 16, .blksize = 1428 };
+        failed |= run_transfer(buf, sizes[i], NULL);
+        failed |= run_transfer(buf, sizes[i], &opts);
+    }
+
+    struct tftp_options large = { .windowsize = MAX_WINDOWSIZE, .blksize = MAX_BLKSIZE };
+    failed |= run_transfer(buf, max_len, &large);
+
+    free(buf);
+    unlink(RECEIVED_FILE_PATH);
+    leave_scratch_dir(scratch_dir, "received-images", NULL);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
@@ -101,11 +101,12 @@ void test_packet_serialization() {
         struct tftp_data data = {
             .opcode = TFTP_DATA,
             .block = 1234,
-            .data = "test data"
+            .data = (uint8_t *)"test data"
         };
         
         uint8_t serialized[256] = {0};
-        struct tftp_data deserialized = {0};
+        uint8_t deserialized_data[256] = {0};
+        struct tftp_data deserialized = { .data = deserialized_data };
         
         serialize_data_pkt(serialized, &data, strlen((char*)data.data));
         deserialize_data_pkt(serialized, &deserialized, strlen((char*)data.data));
@@ -160,11 +161,244 @@ void test_packet_serialization() {
     }
 }
 
+// Test option negotiation packets (RFC 2347 / RFC 7440)
+void test_option_negotiation() {
+    printf("Testing option negotiation...\n");
+
+    // Test Case 1: RRQ with windowsize option (Happy Path)
+    {
+        struct tftp_request rrq = {
+            .opcode = TFTP_RRQ,
+            .filename = "test.txt",
+            .mode = "octet",
+            .windowsize = 16
+        };
+
+        uint8_t serialized[256] = {0};
+        struct tftp_request deserialized = {0};
+        size_t len = serialize_rrq_pkt(serialized, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+        deserialize_rrq_pkt(serialized, &deserialized, len);
+
+        TEST_ASSERT(len == 2 + strlen("test.txt") + 1 + strlen("octet") + 1 + strlen("windowsize") + 1 + strlen("16") + 1);
+        TEST_ASSERT(deserialized.opcode == TFTP_RRQ);
+        TEST_ASSERT(strcmp(deserialized.filename, "test.txt") == 0);
+        TEST_ASSERT(strcmp(deserialized.mode, "octet") == 0);
+        TEST_ASSERT(deserialized.windowsize == 16);
+    }
+
+    // Test Case 2: RRQ without options (Edge Case)
+    {
+        struct tftp_request rrq = {
+            .opcode = TFTP_RRQ,
+            .filename = "test.txt",
+            .mode = "octet"
+        };
+
+        uint8_t serialized[256] = {0};
+        struct tftp_request deserialized = { .windowsize = 99 };
+        size_t len = serialize_rrq_pkt(serialized, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+        deserialize_rrq_pkt(serialized, &deserialized, len);
+
+        TEST_ASSERT(len == 2 + strlen("test.txt") + 1 + strlen("octet") + 1);
+        TEST_ASSERT(deserialized.windowsize == 0);
+    }
+
+    // Test Case 3: Unknown, malformed and truncated options are ignored (Error Case)
+    {
+        uint8_t rrq_pkt[] = "\0\1test.txt\0octet\0foo\0bar\0WindowSize\0abc\0windowsize\0" "8";
+        struct tftp_request deserialized = {0};
+
+        // Without the closing terminator the last option is truncated
+        deserialize_rrq_pkt(rrq_pkt, &deserialized, sizeof(rrq_pkt) - 1);
+        TEST_ASSERT(deserialized.windowsize == 0);
+
+        deserialize_rrq_pkt(rrq_pkt, &deserialized, sizeof(rrq_pkt));
+        TEST_ASSERT(deserialized.windowsize == 8);
+    }
+
+    // Test Case 4: OACK Packet (Happy Path)
+    {
+        struct tftp_oack oack = {
+            .opcode = TFTP_OACK,
+            .windowsize = 32,
+            .blksize = MAX_BLKSIZE
+        };
+
+        uint8_t serialized[256] = {0};
+        struct tftp_oack deserialized = {0};
+        size_t len = serialize_oack_pkt(serialized, &oack);
+        deserialize_oack_pkt(serialized, &deserialized, len);
+
+        TEST_ASSERT(deserialized.opcode == TFTP_OACK);
+        TEST_ASSERT(deserialized.windowsize == 32);
+        TEST_ASSERT(deserialized.blksize == MAX_BLKSIZE);
+    }
+
+    // Test Case 5: OACK with option values out of range (Error Case)
+    {
+        uint8_t oack_pkt[] = "\0\6windowsize\0" "65535\0blksize\0" "65535";
+        struct tftp_oack deserialized = {0};
+
+        deserialize_oack_pkt(oack_pkt, &deserialized, sizeof(oack_pkt));
+        TEST_ASSERT(deserialized.opcode == TFTP_OACK);
+        TEST_ASSERT(deserialized.windowsize == 0);
+        TEST_ASSERT(deserialized.blksize == 0);
+    }
+
+    // Test Case 6: RRQ with blksize option, too small values are ignored (Edge Case)
+    {
+        struct tftp_request rrq = {
+            .opcode = TFTP_RRQ,
+            .filename = "test.txt",
+            .mode = "octet",
+            .blksize = 1428
+        };
+
+        uint8_t serialized[256] = {0};
+        struct tftp_request deserialized = {0};
+        size_t len = serialize_rrq_pkt(serialized, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+        deserialize_rrq_pkt(serialized, &deserialized, len);
+
+        TEST_ASSERT(deserialized.windowsize == 0);
+        TEST_ASSERT(deserialized.blksize == 1428);
+
+        rrq.blksize = MIN_BLKSIZE - 1;
+        len = serialize_rrq_pkt(serialized, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+        deserialize_rrq_pkt(serialized, &deserialized, len);
+        TEST_ASSERT(deserialized.blksize == 0);
+    }
+
+    // Test Case 7: RRQ and OACK with an offset past 4 GiB (Edge Case)
+    {
+        struct tftp_request rrq = {
+            .opcode = TFTP_RRQ,
+            .filename = "test.txt",
+            .mode = "octet",
+            .offset = 5000000000ULL
+        };
+        struct tftp_oack oack = { .opcode = TFTP_OACK, .offset = 4096 };
+
+        uint8_t serialized[256] = {0};
+        struct tftp_request deserialized = {0};
+        struct tftp_oack deserialized_oack = {0};
+        size_t len = serialize_rrq_pkt(serialized, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+        deserialize_rrq_pkt(serialized, &deserialized, len);
+        TEST_ASSERT(deserialized.offset == 5000000000ULL);
+        TEST_ASSERT(deserialized.windowsize == 0 && deserialized.blksize == 0);
+
+        len = serialize_oack_pkt(serialized, &oack);
+        deserialize_oack_pkt(serialized, &deserialized_oack, len);
+        TEST_ASSERT(deserialized_oack.offset == 4096);
+
+        uint8_t bad_oack[] = "\0\6offset\0" "-";
+        deserialize_oack_pkt(bad_oack, &deserialized_oack, sizeof(bad_oack));
+        TEST_ASSERT(deserialized_oack.offset == 0);
+    }
+
+    // Test Case 8: tsize is requested as 0, and an empty file is acknowledged with 0 (Edge Case)
+    {
+        struct tftp_request rrq = {
+            .opcode = TFTP_RRQ,
+            .filename = "test.txt",
+            .mode = "octet",
+            .tsize = 1
+        };
+        struct tftp_oack oack = { .opcode = TFTP_OACK, .has_tsize = 1, .tsize = 0 };
+
+        uint8_t serialized[256] = {0};
+        struct tftp_request deserialized = {0};
+        struct tftp_oack deserialized_oack = {0};
+        size_t len = serialize_rrq_pkt(serialized, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+        TEST_ASSERT(memcmp(serialized + len - sizeof("tsize\0" "0"), "tsize\0" "0", sizeof("tsize\0" "0")) == 0);
+        deserialize_rrq_pkt(serialized, &deserialized, len);
+        TEST_ASSERT(deserialized.tsize == 1);
+
+        len = serialize_oack_pkt(serialized, &oack);
+        deserialize_oack_pkt(serialized, &deserialized_oack, len);
+        TEST_ASSERT(deserialized_oack.has_tsize == 1 && deserialized_oack.tsize == 0);
+
+        oack.tsize = 6000000000ULL;
+        len = serialize_oack_pkt(serialized, &oack);
+        deserialize_oack_pkt(serialized, &deserialized_oack, len);
+        TEST_ASSERT(deserialized_oack.has_tsize == 1 && deserialized_oack.tsize == 6000000000ULL);
+
+        uint8_t bad_oack[] = "\0\6tsize\0" "big";
+        deserialize_oack_pkt(bad_oack, &deserialized_oack, sizeof(bad_oack));
+        TEST_ASSERT(deserialized_oack.has_tsize == 0);
+    }
+}
+
+// Test decoding packets in place
+void test_packet_view() {
+    printf("Testing packet views...\n");
+
+    // Test Case 1: DATA packet payload stays in the receive buffer (Happy Path)
+    {
+        struct tftp_data data = {
+            .opcode = TFTP_DATA,
+            .block = 4321,
+            .data = (uint8_t *)"test data"
+        };
+
+        uint8_t serialized[256] = {0};
+        struct tftp_pkt_view pkt;
+        serialize_data_pkt(serialized, &data, strlen("test data"));
+
+        TEST_ASSERT(tftp_parse_pkt(serialized, DATA_HDR_LEN + strlen("test data"), &pkt) == 0);
+        TEST_ASSERT(pkt.opcode == TFTP_DATA);
+        TEST_ASSERT(pkt.block == 4321);
+        TEST_ASSERT(pkt.payload == serialized + DATA_HDR_LEN);
+        TEST_ASSERT(pkt.payload_len == strlen("test data"));
+    }
+
+    // Test Case 2: Empty final DATA packet and ACK packet (Edge Case)
+    {
+        uint8_t empty_data[] = {0x00, 0x03, 0xFF, 0xFF};
+        uint8_t ack[] = {0x00, 0x04, 0x00, 0x07};
+        struct tftp_pkt_view pkt;
+
+        TEST_ASSERT(tftp_parse_pkt(empty_data, sizeof(empty_data), &pkt) == 0);
+        TEST_ASSERT(pkt.block == 0xFFFF);
+        TEST_ASSERT(pkt.payload_len == 0);
+
+        TEST_ASSERT(tftp_parse_pkt(ack, sizeof(ack), &pkt) == 0);
+        TEST_ASSERT(pkt.opcode == TFTP_ACK);
+        TEST_ASSERT(pkt.block == 7);
+    }
+
+    // Test Case 3: OACK options follow the opcode (Happy Path)
+    {
+        struct tftp_oack oack = {
+            .opcode = TFTP_OACK,
+            .windowsize = 8
+        };
+        uint8_t serialized[256] = {0};
+        struct tftp_pkt_view pkt;
+        size_t len = serialize_oack_pkt(serialized, &oack);
+
+        TEST_ASSERT(tftp_parse_pkt(serialized, len, &pkt) == 0);
+        TEST_ASSERT(pkt.opcode == TFTP_OACK);
+        TEST_ASSERT(pkt.payload == serialized + 2);
+        TEST_ASSERT(pkt.payload_len == len - 2);
+    }
+
+    // Test Case 4: Truncated packets (Error Case)
+    {
+        uint8_t short_data[] = {0x00, 0x03, 0x00};
+        struct tftp_pkt_view pkt;
+
+        TEST_ASSERT(tftp_parse_pkt(short_data, sizeof(short_data), &pkt) == -1);
+        TEST_ASSERT(tftp_parse_pkt(short_data, 1, &pkt) == -1);
+    }
+}
+
 int main() {
     printf("Starting TFTP protocol tests...\n");
     
     test_string_packing();
     test_packet_serialization();
+    test_option_negotiation();
+    test_packet_view();
     
     if (tests_run == tests_passed) {
         printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
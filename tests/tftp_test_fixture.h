@@ -0,0 +1,86 @@
+#ifndef TFTP_TEST_FIXTURE_H
+#define TFTP_TEST_FIXTURE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// Sockets and scratch directories of the tests that run real transfers
+
+#ifndef TEST_SOCKET_TIMEOUT_S
+#define TEST_SOCKET_TIMEOUT_S 5 // receive timeout of open_socket(), so a stuck transfer fails the test
+#endif
+
+static inline struct sockaddr_un socket_addr(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+// Binds a datagram socket to path, with a receive timeout of TEST_SOCKET_TIMEOUT_S
+static inline int open_socket(const char *path)
+{
+    int sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sfd < 0) {
+        perror("unable to open socket");
+        return -1;
+    }
+
+    struct timeval tv = { .tv_sec = TEST_SOCKET_TIMEOUT_S, .tv_usec = 0 };
+    setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_un addr = socket_addr(path);
+    unlink(path);
+    if (bind(sfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1) {
+        perror("unable to bind socket");
+        close(sfd);
+        return -1;
+    }
+    return sfd;
+}
+
+/*
+    Creates a directory from the mkdtemp() template scratch_dir, moves into it and creates the
+    subdirectories named after it, a NULL ends the list. Returns 0 on success, -1 on failure.
+*/
+static inline int enter_scratch_dir(char *scratch_dir, ...)
+{
+    if (mkdtemp(scratch_dir) == NULL || chdir(scratch_dir) == -1) {
+        perror("unable to create scratch directory");
+        return -1;
+    }
+
+    va_list dirs;
+    va_start(dirs, scratch_dir);
+    for (const char *dir = va_arg(dirs, const char *); dir != NULL; dir = va_arg(dirs, const char *)) {
+        mkdir(dir, 0755);
+    }
+    va_end(dirs);
+    return 0;
+}
+
+// Removes the subdirectories named after scratch_dir, which the test emptied, and scratch_dir itself
+static inline void leave_scratch_dir(const char *scratch_dir, ...)
+{
+    va_list dirs;
+    va_start(dirs, scratch_dir);
+    for (const char *dir = va_arg(dirs, const char *); dir != NULL; dir = va_arg(dirs, const char *)) {
+        rmdir(dir);
+    }
+    va_end(dirs);
+
+    if (chdir("/") == 0) {
+        rmdir(scratch_dir);
+    }
+}
+
+#endif // TFTP_TEST_FIXTURE_H
@@ -9,12 +9,14 @@
 size_t pack_str(uint8_t *buf, const char *str, size_t str_len);
 size_t unpack_str(uint8_t *src_buf, char *dest_buf, size_t max_str_len);
 
-void serialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, size_t filename_len, size_t mode_len);
+size_t serialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, size_t filename_len, size_t mode_len);
 void serialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_len);
 void serialize_ack_pkt(uint8_t *buf, struct tftp_ack *ack_pkt);
+size_t serialize_oack_pkt(uint8_t *buf, struct tftp_oack *oack_pkt);
 
 void deserialize_rrq_pkt(uint8_t *buf, struct tftp_request *rrq_pkt, int buf_len);
 void deserialize_data_pkt(uint8_t *buf, struct tftp_data *data_pkt, size_t data_len);
 void deserialize_ack_pkt(uint8_t *buf, struct tftp_ack *ack_pkt);
+void deserialize_oack_pkt(uint8_t *buf, struct tftp_oack *oack_pkt, size_t buf_len);
 
 #endif // TFTP_TEST_INTERFACE_H 
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "../src/tftp.h"
+#include "../src/tftp-trace.h"
+#include "tftp_test_fixture.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define TRACE_PATH "test.trace"
+#define THREAD_EVENTS 5000
+
+// Reads the whole trace back, the records are malloc'ed. Returns the record count, -1 on failure.
+static long read_trace(struct tftp_trace_header *header, struct tftp_trace_record **records)
+{
+    FILE *fp = fopen(TRACE_PATH, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    long count = -1;
+    *records = NULL;
+    if (fread(header, sizeof(*header), 1, fp) == 1) {
+        *records = malloc((header->records + 1) * sizeof(**records));
+        if (*records != NULL) {
+            count = fread(*records, sizeof(**records), header->records + 1, fp);
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+static uint64_t elapsed_ns(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec;
+}
+
+static void *emit_blocks(void *arg)
+{
+    enum tftp_trace_event event = (enum tftp_trace_event)(long)arg;
+    for (uint32_t block = 0; block < THREAD_EVENTS; block++) {
+        tftp_trace(event, block, 512);
+    }
+    return NULL;
+}
+
+// Nothing is recorded, nor a ring attached, before tracing starts
+static int test_disabled(void)
+{
+    printf("[TEST] Tracing disabled\n");
+    tftp_trace(TFTP_TRACE_TIMEOUT, 1, 1);
+    TEST_ASSERT(tftp_trace_ring == NULL);
+    TEST_ASSERT(tftp_trace_stop() == 0);
+    return 0;
+}
+
+// Every thread's events come back in order, under the right thread
+static int test_threads(void)
+{
+    printf("[TEST] Events from several threads\n");
+    pthread_t threads[2];
+    struct tftp_trace_header header;
+    struct tftp_trace_record *records;
+
+    TEST_ASSERT(tftp_trace_start(TRACE_PATH) == 0);
+    TEST_ASSERT(tftp_trace_start(TRACE_PATH) == -1);
+    TEST_ASSERT(pthread_create(&threads[0], NULL, emit_blocks, (void *)(long)TFTP_TRACE_DATA_TX) == 0);
+    TEST_ASSERT(pthread_create(&threads[1], NULL, emit_blocks, (void *)(long)TFTP_TRACE_ACK_RX) == 0);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    // A packet is told apart by its opcode, and only DATA has a length
+    uint8_t data_hdr[] = { 0, TFTP_DATA, 0x12, 0x34 };
+    uint8_t ack_hdr[] = { 0, TFTP_ACK, 0xff, 0xfe };
+    uint8_t rrq[] = { 0, TFTP_RRQ, 't', 0, 'o', 'c', 't', 'e', 't', 0 };
+    tftp_trace_packet(data_hdr, sizeof(data_hdr), 100000, 1);
+    tftp_trace_packet(ack_hdr, sizeof(ack_hdr), 7, 0);
+    tftp_trace_packet(rrq, sizeof(rrq), 0, 0);
+    tftp_trace_packet(rrq, 1, 0, 1);
+    TEST_ASSERT(tftp_trace_stop() == 0);
+
+    long count = read_trace(&header, &records);
+    TEST_ASSERT(count == 2 * THREAD_EVENTS + 3);
+    TEST_ASSERT(memcmp(header.magic, TFTP_TRACE_MAGIC, sizeof(TFTP_TRACE_MAGIC)) == 0);
+    TEST_ASSERT(header.records == (uint64_t)count && header.dropped == 0);
+    TEST_ASSERT(header.end_ticks >= header.start_ticks && header.end_ns > header.start_ns);
+
+    uint32_t next[2] = { 0, 0 };
+    uint64_t last_ticks[2] = { 0, 0 };
+    uint8_t thread_of[2] = { 0, 0 };
+    for (long i = 0; i < count; i++) {
+        struct tftp_trace_record *rec = &records[i];
+        TEST_ASSERT(rec->ticks >= header.start_ticks && rec->ticks <= header.end_ticks);
+        if (rec->event == TFTP_TRACE_DATA_TX || rec->event == TFTP_TRACE_ACK_RX) {
+            int t = rec->event == TFTP_TRACE_ACK_RX;
+            if (next[t] == 0) {
+                thread_of[t] = rec->thread;
+            }
+            TEST_ASSERT(rec->block == next[t]++ && rec->len == 512);
+            TEST_ASSERT(rec->thread == thread_of[t] && rec->ticks >= last_ticks[t]);
+            last_ticks[t] = rec->ticks;
+        } else if (rec->event == TFTP_TRACE_DATA_RX) {
+            TEST_ASSERT(rec->block == 0x1234 && rec->len == UINT16_MAX);
+        } else if (rec->event == TFTP_TRACE_ACK_TX) {
+            TEST_ASSERT(rec->block == 0xfffe && rec->len == 0);
+        } else {
+            TEST_ASSERT(rec->event == TFTP_TRACE_RRQ_TX && rec->block == 0);
+        }
+    }
+    TEST_ASSERT(next[0] == THREAD_EVENTS && next[1] == THREAD_EVENTS);
+    TEST_ASSERT(thread_of[0] != thread_of[1]);
+    free(records);
+    return 0;
+}
+
+// A ring the flusher can't keep up with drops events instead of blocking, and counts them
+static int test_full_ring(void)
+{
+    printf("[TEST] Full ring drops events\n");
+    struct tftp_trace_header header;
+    struct tftp_trace_record *records;
+    uint32_t total = 4 * TFTP_TRACE_RING_RECORDS;
+
+    TEST_ASSERT(tftp_trace_start(TRACE_PATH) == 0);
+    for (uint32_t i = 0; i < total; i++) {
+        tftp_trace(TFTP_TRACE_RETRANSMIT, i, 0);
+    }
+    TEST_ASSERT(tftp_trace_stop() == 0);
+
+    long count = read_trace(&header, &records);
+    TEST_ASSERT(count > 0 && header.records == (uint64_t)count);
+    TEST_ASSERT(header.dropped > 0 && header.records + header.dropped == total);
+    for (long i = 1; i < count; i++) {
+        TEST_ASSERT(records[i].block > records[i - 1].block);
+    }
+    free(records);
+    return 0;
+}
+
+// What an event costs with tracing on, and with it off
+static int test_overhead(void)
+{
+    printf("[TEST] Overhead per event\n");
+    int events = TFTP_TRACE_RING_RECORDS / 2;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < events; i++) {
+        tftp_trace(TFTP_TRACE_DATA_TX, i, 512);
+    }
+    double off_ns = (double)elapsed_ns(&start) / events;
+
+    TEST_ASSERT(tftp_trace_start(TRACE_PATH) == 0);
+    tftp_trace(TFTP_TRACE_DATA_TX, 0, 512);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < events; i++) {
+        tftp_trace(TFTP_TRACE_DATA_TX, i, 512);
+    }
+    double on_ns = (double)elapsed_ns(&start) / events;
+    TEST_ASSERT(tftp_trace_stop() == 0);
+
+    printf("[TEST] %.1f ns per event traced, %.1f ns with tracing off\n", on_ns, off_ns);
+    TEST_ASSERT(on_ns < 1000);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting trace tests...\n");
+
+    char scratch_dir[] = "/tmp/tftp-trace-test-XXXXXX";
+    if (enter_scratch_dir(scratch_dir, NULL) == -1) {
+        return 1;
+    }
+
+    int failed = 0;
+    failed |= test_disabled();
+    failed |= test_full_ring();
+    failed |= test_threads();
+    failed |= test_overhead();
+
+    unlink(TRACE_PATH);
+    leave_scratch_dir(scratch_dir, NULL);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}
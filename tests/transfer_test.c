@@ -0,0 +1,889 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "../src/tftp.h"
+#include "../src/tftp-io.h"
+#include "../src/tftp-metrics.h"
+#include "tftp_test_fixture.h"
+
+static int tests_run = 0;
+static int tests_passed = 0;
+#define TEST_ASSERT(expr) do { tests_run++; if (expr) { tests_passed++; } else { \
+    printf("\033[0;31mTest failed: %s at %s:%d\033[0m\n", #expr, __FILE__, __LINE__); \
+    return 1; } } while(0)
+
+#define SATELLITE_SOCKET_PATH "temp/server-socket"
+#define GROUND_STATION_SOCKET_PATH "temp/client-socket"
+#define RECEIVED_FILE_PATH "received-images/test.bmp"
+#define SOURCE_FILE_PATH "images/source.bmp"
+
+/*
+    Runs tftp_send_file in a child process and tftp_retrieve_file in this one, then
+    checks that the received file matches buf. With mapped set the child sends buf from
+    a file through tftp_send_mapped_file instead.
+*/
+static int run_transfer(uint8_t *buf, size_t buf_len, const struct tftp_options *opts, int mapped)
+{
+    printf("[TEST] Transfer of %zu bytes, windowsize %d, blksize %d%s\n", buf_len,
+           opts ? opts->windowsize : 0, opts ? opts->blksize : 0, mapped ? ", mapped" : "");
+
+    if (mapped) {
+        FILE *fp = fopen(SOURCE_FILE_PATH, "wb");
+        TEST_ASSERT(fp != NULL);
+        TEST_ASSERT(fwrite(buf, 1, buf_len, fp) == buf_len);
+        fclose(fp);
+    }
+    unlink(SATELLITE_SOCKET_PATH);
+
+    pid_t pid = fork();
+    TEST_ASSERT(pid >= 0);
+    if (pid == 0) {
+        int sfd = open_socket(SATELLITE_SOCKET_PATH);
+        if (sfd < 0) {
+            exit(1);
+        }
+        int result = mapped ? tftp_send_mapped_file(sfd, SOURCE_FILE_PATH, "[SATELLITE]")
+                            : tftp_send_file(sfd, buf, buf_len, "[SATELLITE]");
+        close(sfd);
+        unlink(SATELLITE_SOCKET_PATH);
+        exit(result == 0 ? 0 : 1);
+    }
+
+    int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(sfd >= 0);
+
+    // Wait for server socket to exist
+    int wait_count = 0;
+    while (access(SATELLITE_SOCKET_PATH, F_OK) == -1 && wait_count < 1000) {
+        usleep(1000); // 1ms
+        wait_count++;
+    }
+
+    struct sockaddr_un satellite_addr;
+    memset(&satellite_addr, 0, sizeof(struct sockaddr_un));
+    satellite_addr.sun_family = AF_UNIX;
+    strncpy(satellite_addr.sun_path, SATELLITE_SOCKET_PATH, sizeof(satellite_addr.sun_path) - 1);
+
+    int result = tftp_retrieve_file(sfd, satellite_addr, NULL, opts, "[GROUND STATION]");
+    close(sfd);
+    unlink(GROUND_STATION_SOCKET_PATH);
+
+    int status;
+    TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    TEST_ASSERT(result == 0);
+
+    // Verify the received file matches what was sent
+    FILE *fp = fopen(RECEIVED_FILE_PATH, "rb");
+    TEST_ASSERT(fp != NULL);
+    uint8_t *received = malloc(buf_len + 1);
+    TEST_ASSERT(received != NULL);
+    size_t bytes_read = fread(received, 1, buf_len + 1, fp);
+    fclose(fp);
+
+    int matches = bytes_read == buf_len && memcmp(received, buf, buf_len) == 0;
+    free(received);
+    TEST_ASSERT(matches);
+    return 0;
+}
+
+/*
+    Receives one datagram and parses it. Returns 0 on success, -1 on timeout or a short packet.
+    A ring torn down by an earlier transfer can still interrupt the first blocking call.
+*/
+static int recv_pkt(int sfd, uint8_t *buf, size_t buf_len, struct tftp_pkt_view *pkt)
+{
+    ssize_t len;
+    while ((len = recv(sfd, buf, buf_len, 0)) < 0 && errno == EINTR) {
+    }
+    return len < 0 ? -1 : tftp_parse_pkt(buf, len, pkt);
+}
+
+static void send_ack(int sfd, struct sockaddr_un *addr, uint16_t block)
+{
+    uint8_t ack_buf[DATA_HDR_LEN];
+    struct tftp_ack ack_pkt = { .opcode = TFTP_ACK, .block = block };
+    serialize_ack_pkt(ack_buf, &ack_pkt);
+    sendto(sfd, ack_buf, sizeof(ack_buf), 0, (struct sockaddr *)addr, sizeof(struct sockaddr_un));
+}
+
+/*
+    A lost datagram is retransmitted once the timeout passes instead of ending the transfer:
+    this process plays a ground station that ignores the first DATA packet, then a satellite
+    that ignores the first RRQ.
+*/
+static int test_lost_datagrams(uint8_t *buf)
+{
+    printf("[TEST] Lost datagrams are retransmitted\n");
+
+    uint8_t pkt_buf[MAX_BUF_SIZE];
+    struct tftp_pkt_view pkt;
+    size_t buf_len = 2 * DEFAULT_BLKSIZE + 10;
+
+    unlink(SATELLITE_SOCKET_PATH);
+    pid_t pid = fork();
+    TEST_ASSERT(pid >= 0);
+    if (pid == 0) {
+        int sfd = open_socket(SATELLITE_SOCKET_PATH);
+        int result = sfd < 0 ? -1 : tftp_send_file(sfd, buf, buf_len, "[SATELLITE]");
+        close(sfd);
+        exit(result == 0 ? 0 : 1);
+    }
+
+    int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(sfd >= 0);
+    for (int wait_count = 0; access(SATELLITE_SOCKET_PATH, F_OK) == -1 && wait_count < 1000; wait_count++) {
+        usleep(1000);
+    }
+
+    struct sockaddr_un satellite_addr = socket_addr(SATELLITE_SOCKET_PATH);
+    struct tftp_request rrq = { .opcode = TFTP_RRQ, .filename = "test.bmp", .mode = "octet" };
+    size_t rrq_len = serialize_rrq_pkt(pkt_buf, &rrq, strlen(rrq.filename), strlen(rrq.mode));
+    sendto(sfd, pkt_buf, rrq_len, 0, (struct sockaddr *)&satellite_addr, sizeof(satellite_addr));
+
+    // Block 1 comes again after the satellite's timeout, then the rest follows in order
+    TEST_ASSERT(recv_pkt(sfd, pkt_buf, sizeof(pkt_buf), &pkt) == 0 && pkt.block == 1);
+    for (uint16_t block = 1; block <= 3; block++) {
+        TEST_ASSERT(recv_pkt(sfd, pkt_buf, sizeof(pkt_buf), &pkt) == 0);
+        TEST_ASSERT(pkt.opcode == TFTP_DATA && pkt.block == block);
+        send_ack(sfd, &satellite_addr, block);
+    }
+    TEST_ASSERT(pkt.payload_len == 10);
+
+    int status;
+    TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    close(sfd);
+
+    // The other way around, with the ground station resending its RRQ
+    sfd = open_socket(SATELLITE_SOCKET_PATH);
+    TEST_ASSERT(sfd >= 0);
+    unlink(GROUND_STATION_SOCKET_PATH);
+    pid = fork();
+    TEST_ASSERT(pid >= 0);
+    if (pid == 0) {
+        int gs_sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+        int result = gs_sfd < 0 ? -1 : tftp_retrieve_file(gs_sfd, satellite_addr, NULL, NULL, "[GROUND STATION]");
+        close(gs_sfd);
+        exit(result == 0 ? 0 : 1);
+    }
+
+    struct sockaddr_un ground_station_addr = socket_addr(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(recv_pkt(sfd, pkt_buf, sizeof(pkt_buf), &pkt) == 0 && pkt.opcode == TFTP_RRQ);
+    TEST_ASSERT(recv_pkt(sfd, pkt_buf, sizeof(pkt_buf), &pkt) == 0 && pkt.opcode == TFTP_RRQ);
+
+    struct tftp_data data_pkt = { .opcode = TFTP_DATA, .block = 1, .data = buf };
+    serialize_data_pkt(pkt_buf, &data_pkt, 100);
+    sendto(sfd, pkt_buf, DATA_HDR_LEN + 100, 0, (struct sockaddr *)&ground_station_addr, sizeof(ground_station_addr));
+    TEST_ASSERT(recv_pkt(sfd, pkt_buf, sizeof(pkt_buf), &pkt) == 0);
+    TEST_ASSERT(pkt.opcode == TFTP_ACK && pkt.block == 1);
+
+    TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    close(sfd);
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+    return 0;
+}
+
+// Blocks placed into a mapped image land at their offset in whatever order they come
+static int test_image_sink(uint8_t *buf)
+{
+    printf("[TEST] Mapped image sink\n");
+
+    size_t len = 10 * DEFAULT_BLKSIZE + 77;
+    struct tftp_options opts = { .sync = TFTP_SYNC_MSYNC };
+    struct tftp_image image;
+    unlink(RECEIVED_FILE_PATH CHECKPOINT_SUFFIX);
+    TEST_ASSERT(tftp_image_open(&image, RECEIVED_FILE_PATH, &opts, "[GROUND STATION]") == 0);
+    TEST_ASSERT(opts.offset == 0 && opts.tsize == 1);
+    TEST_ASSERT(tftp_image_map(&image, len, "[GROUND STATION]") == 0);
+    TEST_ASSERT(tftp_image_map(&image, len, "[GROUND STATION]") == 0);
+
+    struct stat st;
+    TEST_ASSERT(fstat(image.fd, &st) == 0 && (size_t)st.st_size == len);
+
+    for (size_t pos = len - len % DEFAULT_BLKSIZE;; pos -= DEFAULT_BLKSIZE) {
+        size_t block_len = len - pos < DEFAULT_BLKSIZE ? len - pos : DEFAULT_BLKSIZE;
+        tftp_place(image.map, pos, buf + pos, block_len);
+        if (pos == 0) {
+            break;
+        }
+    }
+    tftp_image_progress(&image, len);
+    TEST_ASSERT(tftp_image_close(&image, 1) == 0);
+    TEST_ASSERT(image.map == NULL);
+
+    FILE *fp = fopen(RECEIVED_FILE_PATH, "rb");
+    TEST_ASSERT(fp != NULL);
+    uint8_t *received = malloc(len + 1);
+    TEST_ASSERT(received != NULL);
+    size_t bytes_read = fread(received, 1, len + 1, fp);
+    fclose(fp);
+
+    int matches = bytes_read == len && memcmp(received, buf, len) == 0;
+    free(received);
+    TEST_ASSERT(matches);
+    return 0;
+}
+
+/*
+    A pass ends when the satellite drops below the horizon: the satellite is killed a few
+    milliseconds into every pass, and the ground station gives up once it hears nothing for
+    a while. Every pass resumes from the checkpoint the last one left, until the image is whole.
+*/
+static int test_resume_across_passes(uint8_t *buf, size_t buf_len)
+{
+    printf("[TEST] Transfer of %zu bytes resumed across short passes\n", buf_len);
+
+    struct tftp_options opts = { .windowsize = 1, .blksize = DEFAULT_BLKSIZE };
+    struct sockaddr_un satellite_addr = socket_addr(SATELLITE_SOCKET_PATH);
+    unsigned long long checkpoint = 0;
+    int result = -1;
+    int passes = 0;
+
+    unlink(RECEIVED_FILE_PATH);
+    unlink(RECEIVED_FILE_PATH CHECKPOINT_SUFFIX);
+    while (result != 0 && passes++ < 200) {
+        unlink(SATELLITE_SOCKET_PATH);
+        fflush(stdout);
+        pid_t pid = fork();
+        TEST_ASSERT(pid >= 0);
+        if (pid == 0) {
+            struct itimerval pass = { .it_value = { .tv_sec = 0, .tv_usec = 20000 } };
+            setitimer(ITIMER_REAL, &pass, NULL);
+            int sfd = open_socket(SATELLITE_SOCKET_PATH);
+            exit(sfd < 0 || tftp_send_file(sfd, buf, buf_len, "[SATELLITE]") == -1 ? 1 : 0);
+        }
+
+        int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+        TEST_ASSERT(sfd >= 0);
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 200000 };
+        setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        for (int wait_count = 0; access(SATELLITE_SOCKET_PATH, F_OK) == -1 && wait_count < 1000; wait_count++) {
+            usleep(1000);
+        }
+
+        result = tftp_retrieve_file(sfd, satellite_addr, NULL, &opts, "[GROUND STATION]");
+        close(sfd);
+        int status;
+        TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+
+        // An interrupted pass never loses what an earlier one saved
+        if (result != 0) {
+            FILE *fp = fopen(RECEIVED_FILE_PATH CHECKPOINT_SUFFIX, "r");
+            unsigned long long saved = 0;
+            if (fp != NULL) {
+                TEST_ASSERT(fscanf(fp, "%llu", &saved) == 1);
+                fclose(fp);
+            }
+            TEST_ASSERT(saved >= checkpoint && saved <= buf_len);
+            printf("[TEST] Pass %d ended at byte %llu\n", passes, saved);
+            checkpoint = saved;
+        }
+    }
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+
+    TEST_ASSERT(result == 0);
+    TEST_ASSERT(passes > 1);
+    TEST_ASSERT(access(RECEIVED_FILE_PATH CHECKPOINT_SUFFIX, F_OK) == -1);
+
+    FILE *fp = fopen(RECEIVED_FILE_PATH, "rb");
+    TEST_ASSERT(fp != NULL);
+    uint8_t *received = malloc(buf_len + 1);
+    TEST_ASSERT(received != NULL);
+    size_t bytes_read = fread(received, 1, buf_len + 1, fp);
+    fclose(fp);
+
+    int matches = bytes_read == buf_len && memcmp(received, buf, buf_len) == 0;
+    free(received);
+    TEST_ASSERT(matches);
+    return 0;
+}
+
+// Leaves an image holding len bytes of data along with a checkpoint of the given contents
+static int write_checkpoint(const uint8_t *data, size_t len, const char *checkpoint)
+{
+    FILE *fp = fopen(RECEIVED_FILE_PATH, "wb");
+    if (fp == NULL || fwrite(data, 1, len, fp) != len) {
+        return -1;
+    }
+    fclose(fp);
+    fp = fopen(RECEIVED_FILE_PATH CHECKPOINT_SUFFIX, "w");
+    if (fp == NULL || fputs(checkpoint, fp) == EOF) {
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+    A checkpoint only resumes the file it was saved of. A satellite announcing another size
+    fails the retrieval, which drops the checkpoint, and the next one starts over from byte 0.
+*/
+static int test_resume_changed_source(uint8_t *buf)
+{
+    printf("[TEST] Resuming after the satellite's file changed\n");
+
+    size_t buf_len = 10 * DEFAULT_BLKSIZE + 77, saved = 4 * DEFAULT_BLKSIZE;
+    uint8_t stale[4 * DEFAULT_BLKSIZE];
+    char checkpoint[64];
+    memset(stale, 0xAA, sizeof(stale));
+
+    // An earlier pass saved the start of a longer file
+    snprintf(checkpoint, sizeof(checkpoint), "%zu %zu\n", saved, buf_len + 1000);
+    TEST_ASSERT(write_checkpoint(stale, saved, checkpoint) == 0);
+
+    unlink(SATELLITE_SOCKET_PATH);
+    fflush(stdout);
+    pid_t pid = fork();
+    TEST_ASSERT(pid >= 0);
+    if (pid == 0) {
+        // Its OACK goes unanswered, the pass ends before it gives up
+        struct itimerval pass = { .it_value = { .tv_sec = 0, .tv_usec = 300000 } };
+        setitimer(ITIMER_REAL, &pass, NULL);
+        int sfd = open_socket(SATELLITE_SOCKET_PATH);
+        exit(sfd < 0 || tftp_send_file(sfd, buf, buf_len, "[SATELLITE]") == -1 ? 1 : 0);
+    }
+    int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(sfd >= 0);
+    for (int wait_count = 0; access(SATELLITE_SOCKET_PATH, F_OK) == -1 && wait_count < 1000; wait_count++) {
+        usleep(1000);
+    }
+    int result = tftp_retrieve_file(sfd, socket_addr(SATELLITE_SOCKET_PATH), NULL, NULL, "[GROUND STATION]");
+    close(sfd);
+    int status;
+    TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(result == -1);
+    TEST_ASSERT(access(RECEIVED_FILE_PATH CHECKPOINT_SUFFIX, F_OK) == -1);
+
+    // The next pass gets all of the file
+    struct tftp_metrics metrics;
+    struct tftp_options opts = { .metrics = &metrics };
+    if (run_transfer(buf, buf_len, &opts, 0)) {
+        return 1;
+    }
+    TEST_ASSERT(metrics.bytes == buf_len);
+
+    // A checkpoint without the size of its file starts over at once
+    snprintf(checkpoint, sizeof(checkpoint), "%zu\n", saved);
+    TEST_ASSERT(write_checkpoint(stale, saved, checkpoint) == 0);
+    if (run_transfer(buf, buf_len, &opts, 0)) {
+        return 1;
+    }
+    TEST_ASSERT(metrics.bytes == buf_len);
+
+    // The same file resumes where the checkpoint ended
+    snprintf(checkpoint, sizeof(checkpoint), "%zu %zu\n", saved, buf_len);
+    TEST_ASSERT(write_checkpoint(buf, saved, checkpoint) == 0);
+    if (run_transfer(buf, buf_len, &opts, 0)) {
+        return 1;
+    }
+    TEST_ASSERT(metrics.bytes == buf_len - saved);
+    return 0;
+}
+
+// XORs every byte, its own inverse
+static int xor_bytes(void *ctx, const uint8_t *in, size_t *in_len, uint8_t *out, size_t *out_len, int final)
+{
+    size_t n = *in_len < *out_len ? *in_len : *out_len;
+    int done = final && n == *in_len;
+    (void)ctx;
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = in[i] ^ 0x5a;
+    }
+    *in_len = n;
+    *out_len = n;
+    return done;
+}
+
+// Sends every byte twice, so the file on the wire is twice as long
+static int double_bytes(void *ctx, const uint8_t *in, size_t *in_len, uint8_t *out, size_t *out_len, int final)
+{
+    size_t n = *in_len < *out_len / 2 ? *in_len : *out_len / 2;
+    int done = final && n == *in_len;
+    (void)ctx;
+
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = in[i];
+        out[2 * i + 1] = in[i];
+    }
+    *in_len = n;
+    *out_len = 2 * n;
+    return done;
+}
+
+// Undoes double_bytes, a pair split across two payloads waits in ctx for its second half
+static int halve_bytes(void *ctx, const uint8_t *in, size_t *in_len, uint8_t *out, size_t *out_len, int final)
+{
+    int *pending = ctx;
+    size_t consumed = 0, produced = 0;
+
+    for (; consumed < *in_len; consumed++) {
+        if (*pending && produced == *out_len) {
+            break;
+        }
+        if (*pending) {
+            out[produced++] = in[consumed];
+        }
+        *pending = !*pending;
+    }
+    int done = final && consumed == *in_len;
+    *in_len = consumed;
+    *out_len = produced;
+    return done && *pending ? -1 : done;
+}
+
+static int send_file_source(int sfd, const uint8_t *buf, size_t buf_len)
+{
+    struct tftp_source src;
+    int fd = open(SOURCE_FILE_PATH, O_RDONLY);
+    (void)buf;
+    (void)buf_len;
+
+    int result = fd < 0 || tftp_file_source(&src, fd) == -1 ? -1 : tftp_send_source(sfd, &src, "[SATELLITE]");
+    close(fd);
+    return result;
+}
+
+static int send_doubled(int sfd, const uint8_t *buf, size_t buf_len)
+{
+    static struct tftp_transform_stage stage;
+    struct tftp_source src, doubled;
+
+    tftp_memory_source(&src, buf, buf_len);
+    tftp_transform_source(&doubled, &stage, double_bytes, NULL, &src);
+    return tftp_send_source(sfd, &doubled, "[SATELLITE]");
+}
+
+static int send_xored_file(int sfd, const uint8_t *buf, size_t buf_len)
+{
+    static struct tftp_transform_stage stage;
+    struct tftp_source src, xored;
+    int fd = open(SOURCE_FILE_PATH, O_RDONLY);
+    (void)buf;
+    (void)buf_len;
+
+    if (fd < 0 || tftp_file_source(&src, fd) == -1) {
+        return -1;
+    }
+    tftp_transform_source(&xored, &stage, xor_bytes, NULL, &src);
+    int result = tftp_send_source(sfd, &xored, "[SATELLITE]");
+    close(fd);
+    return result;
+}
+
+// Streams buf out of a pipe that a generator process writes to
+static int send_pipe(int sfd, const uint8_t *buf, size_t buf_len)
+{
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        for (size_t done = 0; done < buf_len;) {
+            size_t chunk = buf_len - done < 777 ? buf_len - done : 777;
+            ssize_t n = write(fds[1], buf + done, chunk);
+            if (n <= 0) {
+                exit(1);
+            }
+            done += n;
+        }
+        exit(0);
+    }
+    close(fds[1]);
+
+    struct tftp_source src;
+    int result = pid < 0 || tftp_file_source(&src, fds[0]) == -1 ? -1 : tftp_send_source(sfd, &src, "[SATELLITE]");
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return result;
+}
+
+/*
+    Runs send in a child process and tftp_retrieve_file into sink in this one.
+    Returns 0 on success, 1 on failure.
+*/
+static int run_pipeline(const char *name, int (*send)(int sfd, const uint8_t *buf, size_t buf_len),
+                        const uint8_t *buf, size_t buf_len, struct tftp_sink *sink, const struct tftp_options *opts)
+{
+    printf("[TEST] %s, %zu bytes, windowsize %d, blksize %d\n", name, buf_len,
+           opts ? opts->windowsize : 0, opts ? opts->blksize : 0);
+
+    unlink(SATELLITE_SOCKET_PATH);
+    fflush(stdout);
+    pid_t pid = fork();
+    TEST_ASSERT(pid >= 0);
+    if (pid == 0) {
+        int sfd = open_socket(SATELLITE_SOCKET_PATH);
+        int result = sfd < 0 ? -1 : send(sfd, buf, buf_len);
+        close(sfd);
+        exit(result == 0 ? 0 : 1);
+    }
+
+    int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(sfd >= 0);
+    for (int wait_count = 0; access(SATELLITE_SOCKET_PATH, F_OK) == -1 && wait_count < 1000; wait_count++) {
+        usleep(1000);
+    }
+
+    int result = tftp_retrieve_file(sfd, socket_addr(SATELLITE_SOCKET_PATH), sink, opts, "[GROUND STATION]");
+    close(sfd);
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+
+    int status;
+    TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    TEST_ASSERT(result == 0);
+    return 0;
+}
+
+// Files streamed from sources other than a buffer, into sinks other than the image file
+static int test_sources_and_sinks(uint8_t *buf, size_t buf_len)
+{
+    uint8_t *out = malloc(2 * buf_len);
+    TEST_ASSERT(out != NULL);
+
+    FILE *fp = fopen(SOURCE_FILE_PATH, "wb");
+    TEST_ASSERT(fp != NULL);
+    TEST_ASSERT(fwrite(buf, 1, buf_len, fp) == buf_len);
+    fclose(fp);
+
+    // A file read block by block, received straight into memory
+    struct tftp_options opts = { .windowsize = 16, .blksize = 1428 };
+    struct tftp_memory mem;
+    struct tftp_sink sink;
+    for (int i = 0; i < 2; i++) {
+        tftp_memory_sink(&sink, &mem, out, buf_len);
+        TEST_ASSERT(run_pipeline("File source into memory", send_file_source, buf, buf_len, &sink,
+                                 i == 0 ? &opts : NULL) == 0);
+        TEST_ASSERT(mem.length == buf_len && memcmp(out, buf, buf_len) == 0);
+    }
+
+    // A generator piping a file of unknown size, which cannot be mapped ahead
+    tftp_memory_sink(&sink, &mem, out, buf_len);
+    TEST_ASSERT(run_pipeline("Pipe source into memory", send_pipe, buf, buf_len, &sink, &opts) == 0);
+    TEST_ASSERT(mem.length == buf_len && memcmp(out, buf, buf_len) == 0);
+
+    // Transforms that change the length on the way out and back
+    struct tftp_transform_stage stage;
+    struct tftp_sink halved;
+    int pending = 0;
+    struct tftp_options odd_opts = { .windowsize = 8, .blksize = 1001 };
+    memset(out, 0, buf_len);
+    tftp_memory_sink(&sink, &mem, out, buf_len);
+    tftp_transform_sink(&halved, &stage, halve_bytes, &pending, &sink);
+    TEST_ASSERT(run_pipeline("Doubling source into halving sink", send_doubled, buf, buf_len, &halved, &odd_opts) == 0);
+    TEST_ASSERT(mem.length == buf_len && memcmp(out, buf, buf_len) == 0);
+    TEST_ASSERT(stage.in_pos == 2 * buf_len && stage.out_pos == buf_len);
+
+    // A chain of file, transform, transform and file
+    int fd = open(RECEIVED_FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    TEST_ASSERT(fd >= 0);
+    struct tftp_sink file_sink, unxored;
+    tftp_fd_sink(&file_sink, fd);
+    tftp_transform_sink(&unxored, &stage, xor_bytes, NULL, &file_sink);
+    TEST_ASSERT(run_pipeline("XORed file source into XOR sink", send_xored_file, buf, buf_len, &unxored, &opts) == 0);
+    ssize_t bytes_read = pread(fd, out, 2 * buf_len, 0);
+    close(fd);
+    TEST_ASSERT(bytes_read == (ssize_t)buf_len && memcmp(out, buf, buf_len) == 0);
+
+    unlink(SOURCE_FILE_PATH);
+    unlink(RECEIVED_FILE_PATH);
+    free(out);
+    return 0;
+}
+
+// Sinks refuse what they cannot hold, and transforms only ever move forward
+static int test_sink_limits(uint8_t *buf)
+{
+    printf("[TEST] Source and sink limits\n");
+
+    uint8_t out[100];
+    struct tftp_memory mem;
+    struct tftp_sink sink;
+    struct iovec iov = { .iov_base = buf, .iov_len = 60 };
+    tftp_memory_sink(&sink, &mem, out, sizeof(out));
+    TEST_ASSERT(sink.write(sink.ctx, 0, &iov, 1) == 0);
+    TEST_ASSERT(sink.write(sink.ctx, 60, &iov, 1) == -1);
+    TEST_ASSERT(sink.map(sink.ctx, sizeof(out)) == out);
+    TEST_ASSERT(sink.map(sink.ctx, sizeof(out) + 1) == NULL);
+
+    // A transform sink cannot resume in the middle of the file
+    struct tftp_transform_stage stage;
+    struct tftp_sink xored;
+    tftp_transform_sink(&xored, &stage, xor_bytes, NULL, &sink);
+    TEST_ASSERT(xored.write(xored.ctx, 10, &iov, 1) == -1);
+    TEST_ASSERT(xored.write(xored.ctx, 0, &iov, 1) == 0);
+    TEST_ASSERT(xored.close(xored.ctx, 1) == 0);
+    TEST_ASSERT(mem.length == 60 && out[59] == (buf[59] ^ 0x5a));
+
+    // Reads of a transform source follow on from each other
+    struct tftp_source src, xor_src;
+    uint8_t block[40];
+    tftp_memory_source(&src, buf, 50);
+    tftp_transform_source(&xor_src, &stage, xor_bytes, NULL, &src);
+    TEST_ASSERT(xor_src.size == TFTP_SIZE_UNKNOWN && xor_src.data == NULL);
+    TEST_ASSERT(xor_src.read(xor_src.ctx, 0, block, sizeof(block)) == sizeof(block));
+    TEST_ASSERT(block[39] == (buf[39] ^ 0x5a));
+    TEST_ASSERT(xor_src.read(xor_src.ctx, 0, block, sizeof(block)) == -1);
+    TEST_ASSERT(xor_src.read(xor_src.ctx, 40, block, sizeof(block)) == 10);
+    TEST_ASSERT(xor_src.read(xor_src.ctx, 50, block, sizeof(block)) == 0);
+    return 0;
+}
+
+// Written to by the satellite once the whole file was ACKed, see test_pipelined_retrieval
+static int sender_done_fd = -1;
+
+static int send_and_report(int sfd, const uint8_t *buf, size_t buf_len)
+{
+    int result = tftp_send_file(sfd, (uint8_t *)buf, buf_len, "[SATELLITE]");
+    if (result == 0 && write(sender_done_fd, "", 1) != 1) {
+        result = -1;
+    }
+    return result;
+}
+
+// A disk whose first write stalls until the satellite is done, or for 5 s
+struct stalled_sink {
+    struct tftp_sink inner;
+    int done_fd;
+    int stalled;
+    int sender_done; // the satellite was done before the first write returned
+};
+
+static int stalled_write(void *ctx, uint64_t offset, struct iovec *iovs, int iov_count)
+{
+    struct stalled_sink *s = ctx;
+
+    if (!s->stalled) {
+        struct pollfd pfd = { .fd = s->done_fd, .events = POLLIN };
+        s->stalled = 1;
+        s->sender_done = poll(&pfd, 1, 5000) == 1;
+    }
+    return s->inner.write(s->inner.ctx, offset, iovs, iov_count);
+}
+
+static void stalled_progress(void *ctx, uint64_t length)
+{
+    struct stalled_sink *s = ctx;
+    s->inner.progress(s->inner.ctx, length);
+}
+
+// The sink written on a thread of its own, behind the ACKs
+static int test_pipelined_retrieval(uint8_t *buf, size_t buf_len)
+{
+    size_t sizes[] = { 0, 100, DEFAULT_BLKSIZE, 5 * DEFAULT_BLKSIZE + 3, buf_len };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        struct tftp_options opts = { .windowsize = 8, .blksize = 1428, .pipelined = 1 };
+        TEST_ASSERT(run_transfer(buf, sizes[i], &opts, 0) == 0);
+    }
+
+    // Many more blocks than the ring has slots for, the ACKs have to wait for the writer
+    struct tftp_options small_opts = { .windowsize = MAX_WINDOWSIZE, .blksize = MIN_BLKSIZE, .pipelined = 1 };
+    TEST_ASSERT(run_transfer(buf, 20000, &small_opts, 0) == 0);
+    struct tftp_options default_opts = { .pipelined = 1 };
+    TEST_ASSERT(run_transfer(buf, buf_len, &default_opts, 0) == 0);
+
+    /*
+        A stalled disk doesn't hold the ACKs back while the ring has room: the whole file fits,
+        and the satellite is done before the first write returns.
+    */
+    uint8_t *out = malloc(buf_len);
+    int fds[2];
+    TEST_ASSERT(out != NULL);
+    TEST_ASSERT(pipe(fds) == 0);
+    sender_done_fd = fds[1];
+
+    struct tftp_memory mem;
+    struct stalled_sink stalled = { .done_fd = fds[0] };
+    tftp_memory_sink(&stalled.inner, &mem, out, buf_len);
+    struct tftp_sink sink = { .write = stalled_write, .progress = stalled_progress, .fd = -1, .ctx = &stalled };
+    struct tftp_options opts = { .windowsize = 16, .blksize = 1428, .pipelined = 1 };
+    TEST_ASSERT(run_pipeline("Pipelined retrieval behind a stalled disk", send_and_report, buf, buf_len, &sink,
+                             &opts) == 0);
+    TEST_ASSERT(stalled.sender_done);
+    TEST_ASSERT(mem.length == buf_len && memcmp(out, buf, buf_len) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    free(out);
+    return 0;
+}
+
+/*
+    A file of more than 4 GiB goes through end to end, rolling the block number over. The
+    source is a sparse file with a marker every 256 MiB, which are checked in the copy.
+*/
+static int test_large_file(void)
+{
+    off_t len = (4LL << 30) + 12345;
+    printf("[TEST] Transfer of %lld bytes, mapped\n", (long long)len);
+
+    int fd = open(SOURCE_FILE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    TEST_ASSERT(fd >= 0);
+    TEST_ASSERT(ftruncate(fd, len) == 0);
+    for (off_t pos = 0; pos < len; pos += 256LL << 20) {
+        TEST_ASSERT(pwrite(fd, &pos, sizeof(pos), pos) == sizeof(pos));
+    }
+    TEST_ASSERT(pwrite(fd, "end", 3, len - 3) == 3);
+    close(fd);
+
+    unlink(SATELLITE_SOCKET_PATH);
+    fflush(stdout);
+    pid_t pid = fork();
+    TEST_ASSERT(pid >= 0);
+    if (pid == 0) {
+        int sfd = open_socket(SATELLITE_SOCKET_PATH);
+        int result = sfd < 0 ? -1 : tftp_send_mapped_file(sfd, SOURCE_FILE_PATH, "[SATELLITE]");
+        close(sfd);
+        exit(result == 0 ? 0 : 1);
+    }
+
+    int sfd = open_socket(GROUND_STATION_SOCKET_PATH);
+    TEST_ASSERT(sfd >= 0);
+    for (int wait_count = 0; access(SATELLITE_SOCKET_PATH, F_OK) == -1 && wait_count < 1000; wait_count++) {
+        usleep(1000);
+    }
+
+    struct tftp_options opts = { .windowsize = MAX_WINDOWSIZE, .blksize = MAX_BLKSIZE, .tsize = 1 };
+    int result = tftp_retrieve_file(sfd, socket_addr(SATELLITE_SOCKET_PATH), NULL, &opts, "[GROUND STATION]");
+    close(sfd);
+    unlink(SATELLITE_SOCKET_PATH);
+    unlink(GROUND_STATION_SOCKET_PATH);
+    unlink(SOURCE_FILE_PATH);
+
+    int status;
+    TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    TEST_ASSERT(result == 0);
+
+    struct stat st;
+    fd = open(RECEIVED_FILE_PATH, O_RDONLY);
+    TEST_ASSERT(fd >= 0);
+    TEST_ASSERT(fstat(fd, &st) == 0 && st.st_size == len);
+
+    int markers = 1;
+    for (off_t pos = 0; pos < len; pos += 256LL << 20) {
+        off_t marker = -1;
+        markers &= pread(fd, &marker, sizeof(marker), pos) == sizeof(marker) && marker == pos;
+    }
+    char end[3] = {0};
+    markers &= pread(fd, end, 3, len - 3) == 3 && memcmp(end, "end", 3) == 0;
+    close(fd);
+    unlink(RECEIVED_FILE_PATH);
+    TEST_ASSERT(markers);
+    return 0;
+}
+
+int main() {
+    printf("[TEST] Starting end-to-end transfer tests...\n");
+
+    // Run in a scratch directory so the tracked received-images/ stay untouched
+    char scratch_dir[] = "/tmp/transfer-test-XXXXXX";
+    if (enter_scratch_dir(scratch_dir, "temp", "images", "received-images", NULL) == -1) {
+        return 1;
+    }
+
+    size_t max_len = 200000;
+    uint8_t *buf = malloc(max_len);
+    if (buf == NULL) {
+        perror("unable to allocate test data");
+        return 1;
+    }
+    for (size_t i = 0; i < max_len; i++) {
+        buf[i] = (i * 7 + i / 512) % 251;
+    }
+
+    size_t sizes[] = { 0, 100, DEFAULT_BLKSIZE, 5 * DEFAULT_BLKSIZE + 3, max_len };
+    uint16_t windowsizes[] = { 0, 1, 4, MAX_WINDOWSIZE };
+    uint16_t blksizes[] = { MIN_BLKSIZE, 1428, 8192, MAX_BLKSIZE };
+    int failed = 0;
+
+    // Default options, as sent by a client that does not know about them
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        failed |= run_transfer(buf, sizes[i], NULL, 0);
+    }
+
+    // Negotiated windowsize, including more blocks in flight than the socket queues
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(windowsizes) / sizeof(windowsizes[0]); j++) {
+            struct tftp_options opts = { .windowsize = windowsizes[j] };
+            failed |= run_transfer(buf, sizes[i], &opts, 0);
+        }
+    }
+
+    // Negotiated blksize, alone and together with a window
+    for (size_t i = 0; i < sizeof(blksizes) / sizeof(blksizes[0]); i++) {
+        struct tftp_options opts = { .blksize = blksizes[i] };
+        failed |= run_transfer(buf, 20000, &opts, 0);
+        failed |= run_transfer(buf, 3 * blksizes[i], &opts, 0);
+
+        opts.windowsize = 8;
+        failed |= run_transfer(buf, max_len, &opts, 0);
+    }
+
+    // Zero-copy send straight out of a file mapping
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        struct tftp_options opts = { .windowsize = 16, .blksize = 1428 };
+        failed |= run_transfer(buf, sizes[i], NULL, 1);
+        failed |= run_transfer(buf, sizes[i], &opts, 1);
+    }
+
+    // The mapped image flushed to disk either way before the transfer completes
+    struct tftp_options msync_opts = { .windowsize = 8, .blksize = 1428, .sync = TFTP_SYNC_MSYNC };
+    struct tftp_options fdatasync_opts = { .windowsize = 8, .blksize = 1428, .sync = TFTP_SYNC_FDATASYNC };
+    failed |= run_transfer(buf, max_len, &msync_opts, 0);
+    failed |= run_transfer(buf, max_len, &fdatasync_opts, 0);
+
+    failed |= test_image_sink(buf);
+    failed |= test_lost_datagrams(buf);
+    failed |= test_sources_and_sinks(buf, max_len);
+    failed |= test_sink_limits(buf);
+    failed |= test_pipelined_retrieval(buf, max_len);
+    free(buf);
+
+    // Many times what fits in a pass, a block at a time
+    size_t resume_len = 4 * 1024 * 1024 + 123;
+    buf = malloc(resume_len);
+    if (buf == NULL) {
+        perror("unable to allocate test data");
+        return 1;
+    }
+    for (size_t i = 0; i < resume_len; i++) {
+        buf[i] = (i * 13 + i / 4096) % 251;
+    }
+    failed |= test_resume_across_passes(buf, resume_len);
+    failed |= test_resume_changed_source(buf);
+    failed |= test_large_file();
+
+    free(buf);
+    unlink(RECEIVED_FILE_PATH);
+    unlink(RECEIVED_FILE_PATH CHECKPOINT_SUFFIX);
+    unlink(SOURCE_FILE_PATH);
+    leave_scratch_dir(scratch_dir, "images", "received-images", "temp", NULL);
+
+    if (tests_run == tests_passed && !failed) {
+        printf("\033[0;32m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    } else {
+        printf("\033[0;31m%d/%d tests passed\033[0m\n", tests_passed, tests_run);
+    }
+    return failed;
+}